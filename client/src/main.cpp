@@ -5,6 +5,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <chrono>
+#include <ctime>
 #include <filesystem>
 #include <fstream>
 #include <limits>
@@ -43,6 +44,7 @@
 #include "TextEditor.h"
 
 #include "rmi_client.h"
+#include "rmi_protocol.h"
 #include "stb_image.h"
 
 #if defined(RMI_ENABLE_LUA)
@@ -59,13 +61,24 @@ enum class DownloadAction {
   Preview
 };
 
+// Folders always come first; Date and Size put the newest and largest on top.
+enum class FileSort {
+  Name = 0,
+  Date,
+  Size
+};
+
 struct FileNode {
   std::string name;
   std::string path;
   bool is_dir = false;
   uint64_t size = 0;
+  // Modification time from LIST2; 0 when the server does not send it.
+  uint64_t mtime_ns = 0;
   bool expanded = false;
   bool loading = false;
+  // The folder's mtime moved since it was last listed.
+  bool relist = false;
   std::string error;
   uint64_t list_version = 0;
   std::vector<FileNode> children;
@@ -92,13 +105,15 @@ struct FileBrowserState {
   };
 
   FileNode root;
+  FileSort sort = FileSort::Name;
   bool visible = false;
   bool pending_select = false;
   std::deque<std::string> console_lines;
   size_t console_last_count = 0;
   struct PendingSave {
     std::string suggested_name;
-    std::vector<uint8_t> data;
+    // Downloaded body, spooled to disk until a destination is chosen.
+    std::string spool_path;
   };
   std::deque<PendingSave> save_queue;
   std::deque<PendingPreview> preview_queue;
@@ -108,6 +123,11 @@ struct FileBrowserState {
   bool save_popup_open = false;
   std::string save_path_input;
   std::string save_error;
+  // "Copy To..." / "Move To...": the remote path and where it should go.
+  bool copy_popup_open = false;
+  bool copy_move = false;
+  std::string copy_source;
+  std::string copy_dest_input;
 };
 
 struct ScreencapViewState {
@@ -127,6 +147,14 @@ struct ScreencapViewState {
   uint64_t next_capture_id = 1;
   int pending_select = -1;
   std::string last_error;
+
+  // SCREENSTREAM view: one texture patched in place as tiles arrive.
+  SDL_Texture* live_texture = nullptr;
+  int live_width = 0;
+  int live_height = 0;
+  uint64_t live_version = 0;
+  int live_fps = 10;
+  bool live_select = false;
 };
 
 struct AdbDevice {
@@ -163,6 +191,8 @@ struct ClientSlot {
   std::string upload_local_path;
   std::string upload_remote_path;
   std::string upload_error;
+  // Remote directory of the last "Upload Folder", whose summary is shown.
+  std::string tree_upload_remote;
   std::string update_error;
   std::string update_status;
   FileBrowserState file_browser;
@@ -1375,6 +1405,43 @@ int LuaPress(lua_State* L) {
   return 0;
 }
 
+lua_Integer LuaFieldInteger(lua_State* L, int table, const char* name, lua_Integer fallback) {
+  lua_getfield(L, table, name);
+  const lua_Integer value = lua_isnil(L, -1) ? fallback : luaL_checkinteger(L, -1);
+  lua_pop(L, 1);
+  return value;
+}
+
+// rmi.input_batch(client, { {type=, code=, value=, delay_us=, device=}, ... })
+int LuaInputBatch(lua_State* L) {
+  const int idx = static_cast<int>(luaL_checkinteger(L, 1));
+  luaL_checktype(L, 2, LUA_TTABLE);
+  std::vector<RmiClient::InputRecord> records;
+  for (int i = 1;; ++i) {
+    lua_rawgeti(L, 2, i);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      break;
+    }
+    luaL_checktype(L, -1, LUA_TTABLE);
+    const int entry = lua_gettop(L);
+    RmiClient::InputRecord record;
+    record.device = static_cast<uint8_t>(
+        LuaFieldInteger(L, entry, "device", RmiClient::InputRecord::kAutoDevice));
+    record.type = static_cast<uint16_t>(LuaFieldInteger(L, entry, "type", 0));
+    record.code = static_cast<uint16_t>(LuaFieldInteger(L, entry, "code", 0));
+    record.value = static_cast<int32_t>(LuaFieldInteger(L, entry, "value", 0));
+    record.delay_us = static_cast<uint32_t>(LuaFieldInteger(L, entry, "delay_us", 0));
+    records.push_back(record);
+    lua_pop(L, 1);
+  }
+  ClientSlot* slot = LuaGetSlot(L, idx);
+  if (slot) {
+    slot->client.sendInputBatch(records);
+  }
+  return 0;
+}
+
 int LuaUpload(lua_State* L) {
   const int idx = static_cast<int>(luaL_checkinteger(L, 1));
   const char* local_path = luaL_checkstring(L, 2);
@@ -1386,6 +1453,17 @@ int LuaUpload(lua_State* L) {
   return 0;
 }
 
+int LuaUploadTree(lua_State* L) {
+  const int idx = static_cast<int>(luaL_checkinteger(L, 1));
+  const char* local_dir = luaL_checkstring(L, 2);
+  const char* remote_dir = luaL_checkstring(L, 3);
+  ClientSlot* slot = LuaGetSlot(L, idx);
+  if (slot && local_dir && remote_dir) {
+    slot->client.sendUploadTree(local_dir, remote_dir);
+  }
+  return 0;
+}
+
 int LuaSendRaw(lua_State* L) {
   const int idx = static_cast<int>(luaL_checkinteger(L, 1));
   const char* command = luaL_checkstring(L, 2);
@@ -1478,8 +1556,12 @@ void RegisterLuaApi(lua_State* L) {
   lua_setfield(L, -2, "quit");
   lua_pushcfunction(L, LuaPress);
   lua_setfield(L, -2, "press");
+  lua_pushcfunction(L, LuaInputBatch);
+  lua_setfield(L, -2, "input_batch");
   lua_pushcfunction(L, LuaUpload);
   lua_setfield(L, -2, "upload");
+  lua_pushcfunction(L, LuaUploadTree);
+  lua_setfield(L, -2, "upload_tree");
   lua_pushcfunction(L, LuaSendRaw);
   lua_setfield(L, -2, "raw");
   lua_pushcfunction(L, LuaSleep);
@@ -1638,6 +1720,14 @@ bool LoadSettings(ClientConfig* config,
       config->username = value;
     } else if (key == "password") {
       config->password = value;
+    } else if (key == "download_connections") {
+      try {
+        config->download_connections =
+            std::clamp(std::stoi(value), 1, RmiClient::kMaxDownloadConnections);
+      } catch (...) {
+      }
+    } else if (key == "compress") {
+      config->compress = value != "0";
     } else if (key == "connect_tab") {
       try {
         int tab = std::stoi(value);
@@ -1677,6 +1767,8 @@ bool SaveSettings(const ClientConfig& config,
   file << "port=" << EscapeSetting(config.port) << "\n";
   file << "username=" << EscapeSetting(config.username) << "\n";
   file << "password=" << EscapeSetting(config.password) << "\n";
+  file << "download_connections=" << config.download_connections << "\n";
+  file << "compress=" << (config.compress ? 1 : 0) << "\n";
   file << "connect_tab=" << connect_tab << "\n";
   file << "ui_scale=" << ui_scale << "\n";
   if (!file.good()) {
@@ -1706,11 +1798,9 @@ static void UpdateScreencapTexture(SDL_Renderer* renderer,
   if (!client.getScreencapImage(&pixels, &width, &height, &version)) {
     return;
   }
+  // Raw captures carry no PNG; their tabs just cannot be saved.
   uint64_t png_version = 0;
-  if (!client.getScreencapPng(&png, &png_version)) {
-    return;
-  }
-  if (png_version != version) {
+  if (client.getScreencapPng(&png, &png_version) && png_version != version) {
     return;
   }
   if (version != latest_version) {
@@ -1748,6 +1838,58 @@ static void UpdateScreencapTexture(SDL_Renderer* renderer,
   view->last_error.clear();
 }
 
+static void UpdateScreenStreamTexture(SDL_Renderer* renderer,
+                                      RmiClient& client,
+                                      ScreencapViewState* view) {
+  client.patchScreenStream(
+      &view->live_version,
+      [renderer, view](const uint8_t* pixels,
+                       int width,
+                       int height,
+                       const std::vector<RmiClient::StreamRect>& dirty,
+                       bool full) {
+        bool upload_all = full;
+        if (!view->live_texture || view->live_width != width || view->live_height != height) {
+          if (view->live_texture) {
+            SDL_DestroyTexture(view->live_texture);
+          }
+          const Uint32 format = (SDL_BYTEORDER == SDL_LIL_ENDIAN) ? SDL_PIXELFORMAT_ABGR8888
+                                                                  : SDL_PIXELFORMAT_RGBA8888;
+          view->live_texture = SDL_CreateTexture(renderer,
+                                                 format,
+                                                 SDL_TEXTUREACCESS_STREAMING,
+                                                 width,
+                                                 height);
+          if (!view->live_texture) {
+            view->live_width = 0;
+            view->live_height = 0;
+            view->last_error = std::string("SDL_CreateTexture failed: ") + SDL_GetError();
+            return;
+          }
+          view->live_width = width;
+          view->live_height = height;
+          view->live_select = true;
+          upload_all = true;
+        }
+        const int pitch = width * 4;
+        if (upload_all) {
+          if (SDL_UpdateTexture(view->live_texture, nullptr, pixels, pitch) != 0) {
+            view->last_error = std::string("SDL_UpdateTexture failed: ") + SDL_GetError();
+          }
+          return;
+        }
+        for (const auto& rect : dirty) {
+          SDL_Rect area{rect.x, rect.y, rect.width, rect.height};
+          const uint8_t* origin =
+              pixels + (static_cast<size_t>(rect.y) * width + rect.x) * 4;
+          if (SDL_UpdateTexture(view->live_texture, &area, origin, pitch) != 0) {
+            view->last_error = std::string("SDL_UpdateTexture failed: ") + SDL_GetError();
+            return;
+          }
+        }
+      });
+}
+
 static bool SavePngToFile(const std::vector<uint8_t>& png,
                           uint64_t capture_id,
                           std::string* out_path,
@@ -1884,6 +2026,13 @@ static void UpdateFilePreviewTextures(SDL_Renderer* renderer, FileBrowserState&
   }
 }
 
+static void BeginServerCopy(FileBrowserState& state, const FileNode& node, bool move) {
+  state.copy_popup_open = true;
+  state.copy_move = move;
+  state.copy_source = node.path;
+  state.copy_dest_input = node.path;
+}
+
 static void RequestNodeList(RmiClient& client, FileNode& node, FileBrowserState* state) {
   node.loading = true;
   node.error.clear();
@@ -1893,9 +2042,53 @@ static void RequestNodeList(RmiClient& client, FileNode& node, FileBrowserState*
   client.requestFileList(node.path);
 }
 
+static bool FileNodeBefore(const FileNode& a, const FileNode& b, FileSort sort) {
+  if (a.is_dir != b.is_dir) {
+    return a.is_dir;
+  }
+  if (sort == FileSort::Date && a.mtime_ns != b.mtime_ns) {
+    return a.mtime_ns > b.mtime_ns;
+  }
+  if (sort == FileSort::Size && a.size != b.size) {
+    return a.size > b.size;
+  }
+  return a.name < b.name;
+}
+
+static void SortNodeChildren(FileNode& node, FileSort sort) {
+  std::sort(node.children.begin(), node.children.end(),
+            [sort](const FileNode& a, const FileNode& b) {
+              return FileNodeBefore(a, b, sort);
+            });
+}
+
+static void SortFileTree(FileNode& node, FileSort sort) {
+  SortNodeChildren(node, sort);
+  for (auto& child : node.children) {
+    if (!child.children.empty()) {
+      SortFileTree(child, sort);
+    }
+  }
+}
+
+static std::string FormatModifiedTime(uint64_t mtime_ns) {
+  const std::time_t seconds = static_cast<std::time_t>(mtime_ns / 1000000000ull);
+  const std::tm* local = std::localtime(&seconds);
+  char text[32];
+  if (local == nullptr || std::strftime(text, sizeof(text), "%Y-%m-%d %H:%M", local) == 0) {
+    return std::string();
+  }
+  return text;
+}
+
+// While a listing is still arriving, children it has not reached yet are
+// kept so their expanded subtrees survive the refresh. Once it is complete,
+// expanded folders are listed again, skipping those whose mtime shows
+// nothing was added, removed or renamed in them.
 static void RefreshNodeChildren(RmiClient& client,
                                 FileNode& node,
                                 const std::vector<RmiClient::FileEntry>& entries,
+                                bool complete,
                                 bool is_connected,
                                 FileBrowserState* state) {
   std::unordered_map<std::string, FileNode> existing;
@@ -1913,10 +2106,14 @@ static void RefreshNodeChildren(RmiClient& client,
     if (it != existing.end()) {
       child = std::move(it->second);
     }
+    if (entry.mtime_ns == 0 || child.mtime_ns != entry.mtime_ns) {
+      child.relist = true;
+    }
     child.name = entry.name;
     child.path = path;
     child.is_dir = entry.is_dir;
     child.size = entry.size;
+    child.mtime_ns = entry.mtime_ns;
     if (!child.is_dir) {
       child.children.clear();
       child.expanded = false;
@@ -1924,11 +2121,24 @@ static void RefreshNodeChildren(RmiClient& client,
       child.error.clear();
     }
     node.children.push_back(std::move(child));
+    if (it != existing.end()) {
+      existing.erase(it);
+    }
   }
 
+  if (!complete) {
+    for (auto& entry : existing) {
+      node.children.push_back(std::move(entry.second));
+    }
+  }
+  SortNodeChildren(node, state ? state->sort : FileSort::Name);
+  if (!complete) {
+    return;
+  }
   if (is_connected) {
     for (auto& child : node.children) {
-      if (child.is_dir && child.expanded) {
+      if (child.is_dir && child.expanded && child.relist) {
+        child.relist = false;
         RequestNodeList(client, child, state);
       }
     }
@@ -1942,24 +2152,25 @@ static void ApplyListResult(RmiClient& client,
   std::vector<RmiClient::FileEntry> entries;
   std::string error;
   uint64_t version = 0;
-  if (!client.getFileList(node.path, &entries, &error, &version)) {
+  bool complete = false;
+  if (!client.getFileList(node.path, &entries, &error, &version, &complete)) {
     return;
   }
   if (version <= node.list_version) {
     return;
   }
   node.list_version = version;
-  node.loading = false;
+  node.loading = !complete;
   node.error = error;
   if (!error.empty()) {
     node.children.clear();
     return;
   }
-  RefreshNodeChildren(client, node, entries, is_connected, state);
+  RefreshNodeChildren(client, node, entries, complete, is_connected, state);
 }
 
 static void ApplyDownloadResult(RmiClient& client, FileNode& node, FileBrowserState& state) {
-  if (node.is_dir) {
+  if (node.is_dir && !node.downloading) {
     return;
   }
   std::vector<uint8_t> data;
@@ -1973,8 +2184,15 @@ static void ApplyDownloadResult(RmiClient& client, FileNode& node, FileBrowserSt
   }
   node.download_version = version;
   node.downloading = false;
+  // A failed download leaves its `.part` behind; downloading again resumes it.
+  const std::string spool_path = std::move(node.download_path);
   node.download_path.clear();
   node.download_error = error;
+  if (node.is_dir) {
+    // The tree was unpacked into downloads/ as it arrived.
+    node.download_action = DownloadAction::None;
+    return;
+  }
   if (error.empty()) {
     if (node.download_action == DownloadAction::Preview) {
       std::string title = node.name.empty()
@@ -1984,7 +2202,7 @@ static void ApplyDownloadResult(RmiClient& client, FileNode& node, FileBrowserSt
     } else {
       FileBrowserState::PendingSave pending;
       pending.suggested_name = node.name;
-      pending.data = std::move(data);
+      pending.spool_path = spool_path;
       state.save_queue.push_back(std::move(pending));
     }
   }
@@ -2004,14 +2222,32 @@ static void DrawFileNode(RmiClient& client,
         ImGuiTreeNodeFlags_SpanAvailWidth;
     const bool opened = ImGui::TreeNodeEx("dir", flags, "%s", node.name.c_str());
     ImGui::OpenPopupOnItemClick("dir_ctx", ImGuiPopupFlags_MouseButtonRight);
+    if (node.mtime_ns != 0) {
+      ImGui::SameLine();
+      ImGui::TextDisabled("%s", FormatModifiedTime(node.mtime_ns).c_str());
+    }
     if (ImGui::BeginPopup("dir_ctx")) {
       ImGui::BeginDisabled(!is_connected);
       if (ImGui::MenuItem("Reload")) {
         RequestNodeList(client, node, &state);
       }
+      if (parent != nullptr && ImGui::MenuItem("Download", nullptr, false, !node.downloading)) {
+        node.downloading = true;
+        node.download_error.clear();
+        node.download_action = DownloadAction::Save;
+        AddFileBrowserLog(state, "DOWNLOAD_TREE " + node.path);
+        client.requestDownloadTree(node.path,
+                                   (std::filesystem::current_path() / "downloads").string());
+      }
       ImGui::EndDisabled();
       if (parent != nullptr) {
         ImGui::BeginDisabled(!is_connected);
+        if (ImGui::MenuItem("Copy To...")) {
+          BeginServerCopy(state, node, false);
+        }
+        if (ImGui::MenuItem("Move To...")) {
+          BeginServerCopy(state, node, true);
+        }
         if (ImGui::MenuItem("Delete")) {
           AddFileBrowserLog(state, "DELETE " + node.path);
           client.requestDelete(node.path);
@@ -2023,11 +2259,27 @@ static void DrawFileNode(RmiClient& client,
     }
     if (node.loading) {
       ImGui::SameLine();
-      ImGui::TextDisabled("Loading...");
+      if (node.children.empty()) {
+        ImGui::TextDisabled("Loading...");
+      } else {
+        ImGui::TextDisabled("Loading... (%zu)", node.children.size());
+      }
     }
     if (!node.error.empty()) {
       ImGui::TextWrapped("Error: %s", node.error.c_str());
     }
+    ApplyDownloadResult(client, node, state);
+    if (node.downloading) {
+      uint64_t received = 0;
+      uint64_t total = 0;
+      bool in_progress = false;
+      client.getDownloadProgress(node.path, &received, &total, &in_progress);
+      const std::string overlay = "Downloading... " + std::to_string(received) + " bytes";
+      ImGui::ProgressBar(0.0f, ImVec2(-1, 0), overlay.c_str());
+    }
+    if (!node.download_error.empty()) {
+      ImGui::TextWrapped("Download error: %s", node.download_error.c_str());
+    }
     if (opened) {
       if (!node.expanded) {
         node.expanded = true;
@@ -2054,16 +2306,25 @@ static void DrawFileNode(RmiClient& client,
     ImGui::TreeNodeEx("file", flags, "%s", node.name.c_str());
     ImGui::OpenPopupOnItemClick("file_ctx", ImGuiPopupFlags_MouseButtonRight);
     ImGui::SameLine();
-    ImGui::TextDisabled("%llu bytes", static_cast<unsigned long long>(node.size));
+    if (node.mtime_ns != 0) {
+      ImGui::TextDisabled("%llu bytes  %s", static_cast<unsigned long long>(node.size),
+                          FormatModifiedTime(node.mtime_ns).c_str());
+    } else {
+      ImGui::TextDisabled("%llu bytes", static_cast<unsigned long long>(node.size));
+    }
     if (ImGui::BeginPopup("file_ctx")) {
       ImGui::BeginDisabled(!is_connected);
       if (ImGui::MenuItem("Download")) {
+        std::error_code fs_error;
+        std::filesystem::path spool = std::filesystem::current_path() / "downloads";
+        std::filesystem::create_directories(spool, fs_error);
+        spool /= node.name;
         node.downloading = true;
         node.download_error.clear();
-        node.download_path.clear();
+        node.download_path = spool.string();
         node.download_action = DownloadAction::Save;
         AddFileBrowserLog(state, "DOWNLOAD " + node.path);
-        client.requestDownload(node.path);
+        client.requestDownload(node.path, node.download_path);
       }
       ImGui::EndDisabled();
       const bool preview_supported = IsPreviewSupported(node.name);
@@ -2084,6 +2345,12 @@ static void DrawFileNode(RmiClient& client,
         }
       }
       ImGui::BeginDisabled(!is_connected);
+      if (ImGui::MenuItem("Copy To...")) {
+        BeginServerCopy(state, node, false);
+      }
+      if (ImGui::MenuItem("Move To...")) {
+        BeginServerCopy(state, node, true);
+      }
       if (ImGui::MenuItem("Delete")) {
         AddFileBrowserLog(state, "DELETE " + node.path);
         client.requestDelete(node.path);
@@ -2105,6 +2372,15 @@ static void DrawFileNode(RmiClient& client,
         const std::string overlay = std::to_string(received) + " / " +
             std::to_string(total) + " bytes";
         ImGui::ProgressBar(progress, ImVec2(-1, 0), overlay.c_str());
+        std::vector<RmiClient::ConnectionStats> stats;
+        if (client.getDownloadStats(node.path, &stats)) {
+          for (size_t i = 0; i < stats.size(); ++i) {
+            const double mb = static_cast<double>(stats[i].bytes) / (1024.0 * 1024.0);
+            const double rate = stats[i].seconds > 0.0 ? mb / stats[i].seconds : 0.0;
+            ImGui::TextDisabled("#%zu %.1f MB, %.1f MB/s%s", i + 1, mb, rate,
+                                stats[i].active ? "" : " (done)");
+          }
+        }
       } else {
         ImGui::ProgressBar(0.0f, ImVec2(-1, 0), "Downloading...");
       }
@@ -2116,7 +2392,12 @@ static void DrawFileNode(RmiClient& client,
   ImGui::PopID();
 }
 
-static void DrawFileBrowser(RmiClient& client, FileBrowserState& state, bool is_connected) {
+// Returns true when a transfer setting in `config` was changed.
+static bool DrawFileBrowser(RmiClient& client,
+                            FileBrowserState& state,
+                            bool is_connected,
+                            ClientConfig* config) {
+  bool settings_changed = false;
   if (state.root.path.empty()) {
     state.root.name = "/";
     state.root.path = "/";
@@ -2129,6 +2410,28 @@ static void DrawFileBrowser(RmiClient& client, FileBrowserState& state, bool is_
     }
   }
 
+  ImGui::SetNextItemWidth(160.0f);
+  if (ImGui::SliderInt("Download connections", &config->download_connections, 1,
+                       RmiClient::kMaxDownloadConnections)) {
+    client.setDownloadConnections(config->download_connections);
+    settings_changed = true;
+  }
+  ImGui::SameLine();
+  if (ImGui::Checkbox("Compress", &config->compress)) {
+    client.setCompression(config->compress);
+    settings_changed = true;
+  }
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Compress listings and transfers when the server supports it.");
+  }
+  ImGui::SameLine();
+  ImGui::SetNextItemWidth(100.0f);
+  int sort = static_cast<int>(state.sort);
+  if (ImGui::Combo("Sort", &sort, "Name\0Date\0Size\0")) {
+    state.sort = static_cast<FileSort>(sort);
+    SortFileTree(state.root, state.sort);
+  }
+
   ImGui::Text("Command Log");
   ImGui::BeginChild("file_browser_console", ImVec2(0, 80), true);
   const bool auto_scroll = state.console_lines.size() != state.console_last_count;
@@ -2178,31 +2481,36 @@ static void DrawFileBrowser(RmiClient& client, FileBrowserState& state, bool is_
         state.save_error = "Save path is empty.";
       } else {
         std::filesystem::create_directories(dest.parent_path(), fs_error);
+        if (!fs_error) {
+          std::filesystem::rename(pending.spool_path, dest, fs_error);
+          if (fs_error) {
+            // The spool may sit on another file system.
+            fs_error.clear();
+            std::filesystem::copy_file(pending.spool_path, dest,
+                                       std::filesystem::copy_options::overwrite_existing,
+                                       fs_error);
+            if (!fs_error) {
+              std::filesystem::remove(pending.spool_path, fs_error);
+              fs_error.clear();
+            }
+          }
+        }
         if (fs_error) {
           state.save_error = fs_error.message();
         } else {
-          std::ofstream out(dest, std::ios::binary);
-          if (!out) {
-            state.save_error = "Failed to open file for writing.";
-          } else {
-            out.write(reinterpret_cast<const char*>(pending.data.data()),
-                      static_cast<std::streamsize>(pending.data.size()));
-            if (!out.good()) {
-              state.save_error = "Failed to write file.";
-            } else {
-              AddFileBrowserLog(state, "SAVED " + pending.suggested_name + " -> " + dest.string());
-              state.save_queue.pop_front();
-              state.save_popup_open = false;
-              state.save_error.clear();
-              ImGui::CloseCurrentPopup();
-            }
-          }
+          AddFileBrowserLog(state, "SAVED " + pending.suggested_name + " -> " + dest.string());
+          state.save_queue.pop_front();
+          state.save_popup_open = false;
+          state.save_error.clear();
+          ImGui::CloseCurrentPopup();
         }
       }
     }
     ImGui::SameLine();
     if (ImGui::Button("Cancel", ImVec2(120, 0))) {
       if (!state.save_queue.empty()) {
+        std::error_code fs_error;
+        std::filesystem::remove(state.save_queue.front().spool_path, fs_error);
         state.save_queue.pop_front();
       }
       state.save_popup_open = false;
@@ -2211,6 +2519,38 @@ static void DrawFileBrowser(RmiClient& client, FileBrowserState& state, bool is_
     }
     ImGui::EndPopup();
   }
+
+  if (state.copy_popup_open) {
+    ImGui::OpenPopup("Copy / Move");
+    state.copy_popup_open = false;
+  }
+  if (ImGui::BeginPopupModal("Copy / Move", nullptr, ImGuiWindowFlags_AlwaysAutoResize)) {
+    ImGui::TextWrapped("%s %s on the device to:", state.copy_move ? "Move" : "Copy",
+                       state.copy_source.c_str());
+    ImGui::InputText("Destination", &state.copy_dest_input);
+    const bool valid = !state.copy_dest_input.empty() &&
+        state.copy_dest_input != state.copy_source;
+    ImGui::BeginDisabled(!is_connected || !valid);
+    if (ImGui::Button(state.copy_move ? "Move" : "Copy", ImVec2(120, 0))) {
+      if (state.copy_move) {
+        AddFileBrowserLog(state, "MOVE " + state.copy_source + " -> " + state.copy_dest_input);
+        client.requestMove(state.copy_source, state.copy_dest_input);
+      } else {
+        AddFileBrowserLog(state, "COPY " + state.copy_source + " -> " + state.copy_dest_input);
+        client.requestCopy(state.copy_source, state.copy_dest_input);
+      }
+      // Folders whose contents changed relist as their new mtimes come in.
+      RequestNodeList(client, state.root, &state);
+      ImGui::CloseCurrentPopup();
+    }
+    ImGui::EndDisabled();
+    ImGui::SameLine();
+    if (ImGui::Button("Cancel", ImVec2(120, 0))) {
+      ImGui::CloseCurrentPopup();
+    }
+    ImGui::EndPopup();
+  }
+  return settings_changed;
 }
 
 static void DrawLuaPanel(LuaState& state,
@@ -2338,7 +2678,7 @@ static void DrawLuaPanel(LuaState& state,
 #if !defined(RMI_ENABLE_LUA)
   ImGui::TextDisabled("Lua support not available. Install Lua and rebuild.");
 #endif
-  ImGui::TextDisabled("Lua API: rmi.client_count(), rmi.screencap(i), rmi.press(i, key), rmi.upload(i, local, remote), rmi.raw(i, cmd, timeout_ms), rmi.sleep(seconds).");
+  ImGui::TextDisabled("Lua API: rmi.client_count(), rmi.screencap(i), rmi.press(i, key), rmi.upload(i, local, remote), rmi.upload_tree(i, local_dir, remote_dir), rmi.raw(i, cmd, timeout_ms), rmi.sleep(seconds).");
   if (state.selected >= 0 && state.selected < static_cast<int>(state.scripts.size())) {
     LuaScript& script = state.scripts[static_cast<size_t>(state.selected)];
     ImGui::Text("Editing: %s", script.name.c_str());
@@ -2383,6 +2723,7 @@ static void DrawLuaPanel(LuaState& state,
 static bool DrawClientPanel(int index,
                             ClientSlot& slot,
                             const SettingsState& settings) {
+  bool settings_changed = false;
   ImGui::PushID(index);
   ImGui::BeginChild("client_panel", ImVec2(0, 0), true);
 
@@ -2406,6 +2747,23 @@ static bool DrawClientPanel(int index,
   if (ImGui::Button("Screencap", ImVec2(-1, 0))) {
     slot.client.sendScreencap();
   }
+  if (ImGui::Button("Screencap (Fast)", ImVec2(-1, 0))) {
+    slot.client.sendScreencapRaw();
+  }
+  if (slot.client.screenStreamActive()) {
+    if (ImGui::Button("Stop Live View", ImVec2(-1, 0))) {
+      slot.client.stopScreenStream();
+    }
+  } else {
+    if (ImGui::Button("Live View", ImVec2(-1, 0))) {
+      slot.client.startScreenStream(slot.screencap_view.live_fps);
+    }
+  }
+  ImGui::SetNextItemWidth(-1);
+  ImGui::SliderInt("##live_fps", &slot.screencap_view.live_fps, 1, RMI_STREAM_MAX_FPS, "%d fps");
+  if (ImGui::IsItemDeactivatedAfterEdit() && slot.client.screenStreamActive()) {
+    slot.client.startScreenStream(slot.screencap_view.live_fps);
+  }
   if (ImGui::Button("Get Version", ImVec2(-1, 0))) {
     slot.client.sendVersion();
   }
@@ -2483,10 +2841,33 @@ static bool DrawClientPanel(int index,
       slot.upload_error.clear();
     }
   }
+  if (ImGui::Button("Upload Folder", ImVec2(-1, 0))) {
+    slot.tree_upload_remote = TrimCopy(slot.upload_remote_path);
+    slot.client.sendUploadTree(TrimCopy(slot.upload_local_path), slot.tree_upload_remote);
+    slot.upload_error.clear();
+  }
   ImGui::EndDisabled();
   if (!slot.upload_error.empty()) {
     ImGui::TextWrapped("Upload error: %s", slot.upload_error.c_str());
   }
+  RmiClient::TreeUploadResult tree_upload;
+  if (!slot.tree_upload_remote.empty() &&
+      slot.client.getUploadTreeResult(slot.tree_upload_remote, &tree_upload)) {
+    if (tree_upload.in_progress) {
+      ImGui::TextDisabled("Uploading folder... %llu bytes",
+                          static_cast<unsigned long long>(tree_upload.sent));
+    } else if (!tree_upload.error.empty()) {
+      ImGui::TextWrapped("Folder upload error: %s", tree_upload.error.c_str());
+    } else {
+      ImGui::TextDisabled("Folder: %u written, %u failed, %u skipped",
+                          tree_upload.written, tree_upload.failed, tree_upload.skipped);
+      for (const std::string& line : tree_upload.entries) {
+        if (line.compare(0, 3, "ok ") != 0) {
+          ImGui::TextWrapped("%s", line.c_str());
+        }
+      }
+    }
+  }
 
   ImGui::Separator();
   ImGui::BeginDisabled(status == ClientStatus::Disconnected);
@@ -2535,7 +2916,8 @@ static bool DrawClientPanel(int index,
         flags = ImGuiTabItemFlags_SetSelected;
       }
       if (ImGui::BeginTabItem("Files", &slot.file_browser.visible, flags)) {
-        DrawFileBrowser(slot.client, slot.file_browser, is_connected);
+        settings_changed |= DrawFileBrowser(slot.client, slot.file_browser, is_connected,
+                                            &slot.config);
         ImGui::EndTabItem();
       }
       if (!slot.file_browser.visible) {
@@ -2546,6 +2928,26 @@ static bool DrawClientPanel(int index,
       }
     }
 
+    ScreencapViewState& view = slot.screencap_view;
+    if (view.live_texture && view.live_width > 0 && view.live_height > 0) {
+      const ImGuiTabItemFlags flags = view.live_select ? ImGuiTabItemFlags_SetSelected : 0;
+      view.live_select = false;
+      if (ImGui::BeginTabItem("Live", nullptr, flags)) {
+        ImGui::Text("%dx%d%s", view.live_width, view.live_height,
+                    slot.client.screenStreamActive() ? "" : " (stopped)");
+        ImVec2 avail = ImGui::GetContentRegionAvail();
+        const float scale_x = avail.x / static_cast<float>(view.live_width);
+        const float scale_y = avail.y / static_cast<float>(view.live_height);
+        float scale = std::min(scale_x, scale_y);
+        if (scale <= 0.0f) {
+          scale = 1.0f;
+        }
+        ImVec2 size(view.live_width * scale, view.live_height * scale);
+        ImGui::Image(reinterpret_cast<ImTextureID>(view.live_texture), size);
+        ImGui::EndTabItem();
+      }
+    }
+
     int preview_select = slot.file_browser.preview_pending_select;
     for (size_t i = 0; i < slot.file_browser.preview_tabs.size();) {
       auto& tab = slot.file_browser.preview_tabs[i];
@@ -2664,7 +3066,7 @@ static bool DrawClientPanel(int index,
 
   ImGui::EndChild();
   ImGui::PopID();
-  return false;
+  return settings_changed;
 }
 
 static bool DrawConnectPopup(ClientSlot& slot, int slot_index, bool* open_popup) {
@@ -3011,6 +3413,7 @@ int main(int argc, char** argv) {
     for (size_t i = 0; i < slots.size(); ++i) {
       ClientSlot& slot = *slots[i];
       UpdateScreencapTexture(renderer, slot.client, &slot.screencap_view);
+      UpdateScreenStreamTexture(renderer, slot.client, &slot.screencap_view);
       UpdateFilePreviewTextures(renderer, slot.file_browser);
       if (slot.reconnect_pending && SDL_GetTicks64() >= slot.reconnect_at_ticks) {
         const ClientStatus reconnect_status = slot.client.status();
@@ -3184,6 +3587,10 @@ int main(int argc, char** argv) {
         tab.texture = nullptr;
       }
     }
+    if (slot.screencap_view.live_texture) {
+      SDL_DestroyTexture(slot.screencap_view.live_texture);
+      slot.screencap_view.live_texture = nullptr;
+    }
     for (auto& tab : slot.file_browser.preview_tabs) {
       if (tab.texture) {
         SDL_DestroyTexture(tab.texture);
@@ -2,18 +2,36 @@
 
 #include "net.h"
 #include "rmi_protocol.h"
+#include "rmi_lz.h"
+#include "rmi_delta.h"
+#include "rmi_qoi.h"
+#include "rmi_tar.h"
 #include "stb_image.h"
 
 #include <algorithm>
 #include <cctype>
+#include <cerrno>
 #include <chrono>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <limits>
+#include <random>
 #include <sstream>
 #include <utility>
 
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <share.h>
+#include <sys/stat.h>
+#include <sys/utime.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace {
 
 constexpr uint8_t kPngSignature[8] = {0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a};
@@ -23,9 +41,24 @@ constexpr size_t kMaxUploadBytes = std::numeric_limits<uint32_t>::max();
 constexpr int kAuthTimeoutMs = 5000;
 constexpr int kVersionTimeoutMs = 3000;
 constexpr int kScreencapTimeoutMs = 15000;
+// DELETE, COPY and MOVE of a large tree run for as long as the storage takes.
+constexpr int kFileJobTimeoutMs = 30 * 60 * 1000;
 constexpr int kReadStepTimeoutMs = 1000;
 constexpr int kHeartbeatIntervalMs = 5000;
 constexpr int kHeartbeatTimeoutMs = 2000;
+constexpr int kStreamPollMs = 15;
+constexpr int kStreamPollFrames = 8;
+constexpr size_t kMaxStreamDirtyRects = 256;
+constexpr size_t kMaxRequestsInFlight = 64;
+constexpr size_t kV2ReadChunkBytes = 64 * 1024;
+constexpr uint64_t kParallelRangeBytes = 4 * 1024 * 1024;
+constexpr size_t kParallelWriteBytes = 256 * 1024;
+constexpr uint64_t kListPageEntries = 1000;
+// Smaller uploads go out whole; the BLOCKSUMS round trip would not pay off.
+constexpr uint64_t kMinDeltaBytes = 64 * 1024;
+// The local file is diffed through a window of about a block plus these.
+constexpr uint64_t kDeltaReadBytes = 1024 * 1024;
+constexpr uint64_t kDeltaLiteralBytes = 1024 * 1024;
 
 uint32_t ReadBe32(const uint8_t* data) {
   return rmi_read_be32(data);
@@ -39,6 +72,23 @@ bool PayloadStartsWith(const std::vector<uint8_t>& payload, const char* text) {
   return rmi_payload_starts_with(payload.data(), payload.size(), text) != 0;
 }
 
+bool IsStreamFrame(const std::vector<uint8_t>& payload) {
+  return payload.size() >= RMI_STREAM_HEADER_SIZE &&
+         PayloadStartsWith(payload, RMI_STREAM_MAGIC);
+}
+
+std::string Be32Arg(uint32_t value) {
+  std::string arg(4, '\0');
+  rmi_write_be32(reinterpret_cast<uint8_t*>(&arg[0]), value);
+  return arg;
+}
+
+std::string Be64Arg(uint64_t value) {
+  std::string arg(8, '\0');
+  rmi_write_be64(reinterpret_cast<uint8_t*>(&arg[0]), value);
+  return arg;
+}
+
 std::string PayloadToString(const std::vector<uint8_t>& payload) {
   return std::string(payload.begin(), payload.end());
 }
@@ -76,9 +126,429 @@ std::string NormalizeOpenTarget(const std::string& target) {
   return trimmed;
 }
 
+// A local file written at explicit offsets from several threads at once.
+class PositionalFile {
+ public:
+  ~PositionalFile() { close(); }
+
+  bool open(const std::string& path) {
+#ifdef _WIN32
+    return _sopen_s(&fd_, path.c_str(), _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY,
+                    _SH_DENYWR, _S_IREAD | _S_IWRITE) == 0;
+#else
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return fd_ != -1;
+#endif
+  }
+
+  // Sets the final size up front so ranges can land in any order.
+  bool resize(uint64_t size) {
+#ifdef _WIN32
+    return _chsize_s(fd_, static_cast<__int64>(size)) == 0;
+#else
+    return ::ftruncate(fd_, static_cast<off_t>(size)) == 0;
+#endif
+  }
+
+  bool writeAt(uint64_t offset, const uint8_t* data, size_t size) {
+#ifdef _WIN32
+    // No pwrite here; seek and write under a lock instead.
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (_lseeki64(fd_, static_cast<__int64>(offset), SEEK_SET) == -1) {
+      return false;
+    }
+    while (size > 0) {
+      const int n = _write(fd_, data, static_cast<unsigned int>(std::min<size_t>(size, 1u << 30)));
+      if (n <= 0) {
+        return false;
+      }
+      data += n;
+      size -= static_cast<size_t>(n);
+    }
+    return true;
+#else
+    while (size > 0) {
+      const ssize_t n = ::pwrite(fd_, data, size, static_cast<off_t>(offset));
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      data += n;
+      size -= static_cast<size_t>(n);
+      offset += static_cast<uint64_t>(n);
+    }
+    return true;
+#endif
+  }
+
+  bool close() {
+    if (fd_ == -1) {
+      return true;
+    }
+#ifdef _WIN32
+    const bool ok = _close(fd_) == 0;
+#else
+    const bool ok = ::close(fd_) == 0;
+#endif
+    fd_ = -1;
+    return ok;
+  }
+
+ private:
+  int fd_ = -1;
+#ifdef _WIN32
+  std::mutex mutex_;
+#endif
+};
+
+// The part of the local file the delta search still needs: from the start
+// of the pending literal to just past the block under test. Everything read
+// also goes into the whole-file hash.
+class DeltaWindow {
+ public:
+  DeltaWindow(std::istream& in, uint64_t size) : in_(in), size_(size) {
+    rmi_delta_hash_init(&hash_);
+  }
+
+  // Makes the bytes up to `end` available; false on a read error.
+  bool fill(uint64_t end) {
+    end = std::min(end, size_);
+    const uint64_t have = start_ + buf_.size();
+    if (have >= end) {
+      return true;
+    }
+    const size_t take = static_cast<size_t>(
+        std::min<uint64_t>(size_ - have, std::max<uint64_t>(end - have, kDeltaReadBytes)));
+    const size_t old = buf_.size();
+    buf_.resize(old + take);
+    if (!in_.read(reinterpret_cast<char*>(buf_.data() + old), static_cast<std::streamsize>(take))) {
+      return false;
+    }
+    rmi_delta_hash_update(&hash_, buf_.data() + old, take);
+    return true;
+  }
+
+  const uint8_t* at(uint64_t offset) const {
+    return buf_.data() + static_cast<size_t>(offset - start_);
+  }
+
+  // The bytes before `offset` are no longer needed.
+  void release(uint64_t offset) {
+    if (offset - start_ < kDeltaReadBytes) {
+      return;
+    }
+    buf_.erase(buf_.begin(), buf_.begin() + static_cast<ptrdiff_t>(offset - start_));
+    start_ = offset;
+  }
+
+  uint64_t hash() const { return rmi_delta_hash_final(&hash_); }
+
+ private:
+  std::istream& in_;
+  uint64_t size_;
+  uint64_t start_ = 0;
+  std::vector<uint8_t> buf_;
+  rmi_delta_hash hash_;
+};
+
+// Writes DELTA_UPLOAD ops rebuilding the `size`-byte file in `window` from
+// the remote blocks whose checksums are in `sums` (the BLOCKSUMS entries),
+// rsync style: the weak checksum rolls through the file a byte at a time
+// and a hit is confirmed with the strong hash before it becomes a COPY.
+// Adjacent blocks merge into one COPY; everything else goes out as LITERAL
+// runs of at most kDeltaLiteralBytes. Gives up on a read or write error,
+// once `cancel` is set, or once the ops reach `limit` bytes.
+bool WriteDeltaOps(DeltaWindow* window,
+                   uint64_t size,
+                   uint32_t block,
+                   uint64_t remote_size,
+                   const uint8_t* sums,
+                   uint32_t count,
+                   uint64_t limit,
+                   const std::atomic<bool>& cancel,
+                   std::ostream& out) {
+  std::unordered_multimap<uint32_t, uint32_t> blocks;
+  const uint32_t full_blocks = static_cast<uint32_t>(remote_size / block);
+  blocks.reserve(full_blocks);
+  for (uint32_t i = 0; i < full_blocks; ++i) {
+    blocks.emplace(ReadBe32(sums + static_cast<size_t>(i) * RMI_BLOCKSUMS_ENTRY_SIZE), i);
+  }
+  auto strong_of = [sums](uint32_t index) {
+    return rmi_read_be64(sums + static_cast<size_t>(index) * RMI_BLOCKSUMS_ENTRY_SIZE + 4);
+  };
+
+  uint64_t written = 0;
+  bool ok = true;
+  auto emit = [&](const uint8_t* data, size_t length) {
+    out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(length));
+    written += length;
+    ok = ok && out.good() && written < limit;
+  };
+  uint32_t copy_first = 0;
+  uint32_t copy_count = 0;
+  auto flush_copy = [&]() {
+    if (copy_count == 0) {
+      return;
+    }
+    uint8_t op[RMI_DELTA_COPY_SIZE];
+    op[0] = RMI_DELTA_OP_COPY;
+    rmi_write_be32(op + 1, copy_first);
+    rmi_write_be32(op + 5, copy_count);
+    emit(op, sizeof(op));
+    copy_count = 0;
+  };
+  auto add_copy = [&](uint32_t index) {
+    if (copy_count > 0 && index == copy_first + copy_count) {
+      ++copy_count;
+      return;
+    }
+    flush_copy();
+    copy_first = index;
+    copy_count = 1;
+  };
+  auto add_literal = [&](uint64_t from, uint64_t to) {
+    flush_copy();
+    while (ok && from < to) {
+      const uint64_t end = std::min(to, from + kDeltaLiteralBytes);
+      if (!window->fill(end)) {
+        ok = false;
+        return;
+      }
+      uint8_t op[RMI_DELTA_LITERAL_SIZE];
+      op[0] = RMI_DELTA_OP_LITERAL;
+      rmi_write_be32(op + 1, static_cast<uint32_t>(end - from));
+      emit(op, sizeof(op));
+      emit(window->at(from), static_cast<size_t>(end - from));
+      from = end;
+      window->release(from);
+    }
+  };
+
+  uint64_t literal = 0;
+  uint64_t pos = 0;
+  uint32_t weak = 0;
+  bool weak_valid = false;
+  while (ok && !blocks.empty() && pos + block <= size) {
+    // One past the block, for the byte the checksum rolls in next.
+    if (cancel.load() || !window->fill(pos + block + 1)) {
+      return false;
+    }
+    const uint8_t* data = window->at(pos);
+    if (!weak_valid) {
+      weak = rmi_delta_weak(data, block);
+      weak_valid = true;
+    }
+    const auto range = blocks.equal_range(weak);
+    bool found = false;
+    uint32_t match = 0;
+    if (range.first != range.second) {
+      const uint64_t strong = rmi_delta_strong(data, block);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (strong_of(it->second) != strong) {
+          continue;
+        }
+        // Prefer the block that extends the current COPY.
+        if (!found || it->second == copy_first + copy_count) {
+          match = it->second;
+          found = true;
+        }
+      }
+    }
+    if (found) {
+      add_literal(literal, pos);
+      add_copy(match);
+      pos += block;
+      literal = pos;
+      window->release(literal);
+      weak_valid = false;
+      continue;
+    }
+    if (pos + block < size) {
+      weak = rmi_delta_roll(weak, block, data[0], data[block]);
+    }
+    ++pos;
+    if (pos - literal >= kDeltaLiteralBytes) {
+      add_literal(literal, pos);
+      literal = pos;
+    }
+  }
+  // A short last remote block can only match the end of the file.
+  const uint64_t tail = remote_size % block;
+  if (ok && tail > 0 && count > 0 && size >= tail && size - tail >= literal) {
+    add_literal(literal, size - tail);
+    literal = size - tail;
+    if (ok && window->fill(size) &&
+        rmi_delta_weak(window->at(literal), static_cast<size_t>(tail)) ==
+            ReadBe32(sums + static_cast<size_t>(count - 1) * RMI_BLOCKSUMS_ENTRY_SIZE) &&
+        rmi_delta_strong(window->at(literal), static_cast<size_t>(tail)) == strong_of(count - 1)) {
+      add_copy(count - 1);
+      literal = size;
+    }
+  }
+  add_literal(literal, size);
+  flush_copy();
+  return ok && window->fill(size);
+}
+
+// Maps an archive name onto a path under `root`. Names that climb out with
+// `..`, and names that lead through a symlink, are refused.
+bool TreeEntryPath(const std::filesystem::path& root,
+                   const std::string& name,
+                   std::filesystem::path* out) {
+  std::filesystem::path path = root;
+  std::error_code fs_error;
+  bool any = false;
+  size_t start = 0;
+  while (start <= name.size()) {
+    size_t end = name.find('/', start);
+    if (end == std::string::npos) {
+      end = name.size();
+    }
+    const std::string part = name.substr(start, end - start);
+    start = end + 1;
+    if (part.empty() || part == ".") {
+      continue;
+    }
+#ifdef _WIN32
+    if (part.find_first_of("\\:") != std::string::npos) {
+      return false;
+    }
+#endif
+    if (part == ".." ||
+        (any && std::filesystem::is_symlink(std::filesystem::symlink_status(path, fs_error)))) {
+      return false;
+    }
+    path /= part;
+    any = true;
+  }
+  if (!any) {
+    return false;
+  }
+  *out = path;
+  return true;
+}
+
+void SetFileMtime(const std::filesystem::path& path, int64_t mtime) {
+#ifdef _WIN32
+  struct _utimbuf times;
+  times.actime = static_cast<time_t>(mtime);
+  times.modtime = static_cast<time_t>(mtime);
+  _wutime(path.c_str(), &times);
+#else
+  struct timespec times[2];
+  times[0].tv_sec = static_cast<time_t>(mtime);
+  times[0].tv_nsec = 0;
+  times[1] = times[0];
+  utimensat(AT_FDCWD, path.c_str(), times, 0);
+#endif
+}
+
+// Permission bits and modification time (seconds) for an archive header.
+void ArchiveEntryStat(const std::filesystem::path& path,
+                      bool is_dir,
+                      uint32_t* mode,
+                      int64_t* mtime) {
+#ifdef _WIN32
+  struct _stat64 st;
+  *mode = is_dir ? 0755 : 0644;
+  *mtime = _wstat64(path.c_str(), &st) == 0 ? static_cast<int64_t>(st.st_mtime) : 0;
+#else
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    *mode = st.st_mode & 07777;
+    *mtime = static_cast<int64_t>(st.st_mtime);
+  } else {
+    *mode = is_dir ? 0755 : 0644;
+    *mtime = 0;
+  }
+#endif
+}
+
 }  // namespace
 
-RmiClient::RmiClient() : status_(ClientStatus::Disconnected), stop_(false) {
+// Shared state of one parallel download. Ranges still to fetch sit in
+// `ranges`; a connection that fails puts its range back for the others.
+struct RmiClient::ParallelDownload {
+  std::string path;
+  PositionalFile file;
+  std::mutex mutex;
+  std::deque<uint64_t> ranges;
+  bool identified = false;
+  uint64_t size = 0;
+  uint64_t mtime = 0;
+  uint64_t received = 0;
+  // Set when retrying cannot help: the file changed or a local write failed.
+  bool failed = false;
+  std::string error;
+  std::vector<ConnectionStats> stats;
+  std::chrono::steady_clock::time_point start;
+};
+
+// A DOWNLOAD_TREE being unpacked under `root`. The file being written goes
+// to `<out_path>.part` and is renamed into place once its body is in.
+struct RmiClient::TreeDownload {
+  std::filesystem::path root;
+  rmi_tar_reader reader;
+  std::ofstream out;
+  std::filesystem::path out_path;
+  uint64_t out_left = 0;
+  int64_t out_mtime = 0;
+  uint32_t out_mode = 0;
+  uint64_t received = 0;
+  uint64_t files = 0;
+  // Directory mtimes, set once the archive ends; writing into a directory
+  // moves its own.
+  std::vector<std::pair<std::filesystem::path, int64_t>> dir_mtimes;
+  bool ended = false;
+  // Set once unpacking failed; the rest of the archive is only counted.
+  std::string error;
+};
+
+// An UPLOAD_TREE archive built from `root` as it is sent. The walk only
+// moves on once `pending` (a header or padding) and the open file's body
+// are out, so nothing is staged. Names are relative to `base`, the
+// directory holding `root`.
+struct RmiClient::TreeUpload {
+  std::filesystem::path base;
+  std::filesystem::path root;
+  std::filesystem::recursive_directory_iterator walk;
+  bool started = false;
+  rmi_tar_entry entry;
+  std::vector<uint8_t> pending;
+  size_t pending_off = 0;
+  std::ifstream in;
+  uint64_t body_left = 0;
+  size_t pad = 0;
+  // The end-of-archive blocks are queued in `pending`.
+  bool done = false;
+  uint64_t sent = 0;
+
+  bool finished() const { return done && pending_off == pending.size(); }
+};
+
+// An UPLOAD delta spooled to a temporary file of `size` bytes, removed
+// along with the last message that refers to it.
+struct RmiClient::UploadDelta {
+  std::filesystem::path path;
+  uint64_t size = 0;
+
+  ~UploadDelta() {
+    std::error_code fs_error;
+    std::filesystem::remove(path, fs_error);
+  }
+};
+
+RmiClient::RmiClient()
+    : stream_active_(false),
+      status_(ClientStatus::Disconnected),
+      stop_(false),
+      v2_active_(false),
+      compress_(true),
+      compress_active_(false),
+      download_connections_(1),
+      transfer_running_(false) {
   static std::atomic<uint32_t> next_id{1};
   client_id_ = next_id.fetch_add(1);
 }
@@ -96,6 +566,9 @@ bool RmiClient::connect(const ClientConfig& config) {
   joinWorker();
   clearError();
   stop_ = false;
+  config_ = config;
+  setDownloadConnections(config.download_connections);
+  compress_ = config.compress;
   setStatus(ClientStatus::Connecting);
   worker_ = std::thread(&RmiClient::workerLoop, this, config);
   return true;
@@ -105,6 +578,8 @@ void RmiClient::disconnect() {
   stop_ = true;
   outbox_cv_.notify_all();
   joinWorker();
+  joinTransfer();
+  joinDelta();
   if (status_.load() != ClientStatus::Error) {
     setStatus(ClientStatus::Disconnected);
   }
@@ -116,16 +591,56 @@ void RmiClient::sendScreencap() {
   }
   OutboundMessage message;
   message.message = RMI_CMD_SCREENCAP;
+  message.op = RMI_OP_SCREENCAP;
   message.response = ResponseType::Screencap;
   queueMessage(message);
 }
 
+void RmiClient::sendScreencapRaw() {
+  if (status_.load() != ClientStatus::Connected) {
+    return;
+  }
+  OutboundMessage message;
+  message.message = RMI_CMD_SCREENCAP_RAW;
+  message.op = RMI_OP_SCREENCAP_RAW;
+  message.response = ResponseType::ScreencapRaw;
+  queueMessage(message);
+}
+
+void RmiClient::startScreenStream(int fps) {
+  if (status_.load() != ClientStatus::Connected) {
+    return;
+  }
+  OutboundMessage message;
+  message.stream_fps = std::clamp(fps, 1, RMI_STREAM_MAX_FPS);
+  message.message = std::string(RMI_CMD_SCREENSTREAM) + " " +
+                    std::to_string(message.stream_fps);
+  message.op = RMI_OP_SCREENSTREAM;
+  message.args.push_back(Be32Arg(static_cast<uint32_t>(message.stream_fps)));
+  message.response = ResponseType::Ok;
+  queueMessage(message);
+}
+
+void RmiClient::stopScreenStream() {
+  if (status_.load() != ClientStatus::Connected) {
+    return;
+  }
+  OutboundMessage message;
+  message.stream_fps = 0;
+  message.message = std::string(RMI_CMD_SCREENSTREAM) + " 0";
+  message.op = RMI_OP_SCREENSTREAM;
+  message.args.push_back(Be32Arg(0));
+  message.response = ResponseType::Ok;
+  queueMessage(message);
+}
+
 void RmiClient::sendQuit() {
   if (status_.load() != ClientStatus::Connected) {
     return;
   }
   OutboundMessage message;
   message.message = RMI_CMD_QUIT;
+  message.op = RMI_OP_QUIT;
   message.response = ResponseType::Ok;
   message.disconnect_after_ok = true;
   queueMessage(message);
@@ -137,6 +652,7 @@ void RmiClient::sendRestart() {
   }
   OutboundMessage message;
   message.message = RMI_CMD_RESTART;
+  message.op = RMI_OP_RESTART;
   message.response = ResponseType::Ok;
   message.disconnect_after_ok = true;
   queueMessage(message);
@@ -148,6 +664,8 @@ void RmiClient::sendPress(int keycode) {
   }
   OutboundMessage message;
   message.message = std::string(RMI_CMD_PRESS) + " " + std::to_string(keycode);
+  message.op = RMI_OP_PRESS;
+  message.args.push_back(Be32Arg(static_cast<uint32_t>(keycode)));
   message.response = ResponseType::Ok;
   queueMessage(message);
 }
@@ -158,7 +676,42 @@ void RmiClient::sendPressInput(int keycode) {
   }
   OutboundMessage message;
   message.message = std::string(RMI_CMD_PRESS_INPUT) + " " + std::to_string(keycode);
+  message.op = RMI_OP_PRESS_INPUT;
+  message.args.push_back(Be32Arg(static_cast<uint32_t>(keycode)));
+  message.response = ResponseType::Ok;
+  queueMessage(message);
+}
+
+void RmiClient::sendInputBatch(const std::vector<InputRecord>& records) {
+  if (status_.load() != ClientStatus::Connected) {
+    return;
+  }
+  if (records.empty() || records.size() > RMI_INPUT_BATCH_MAX) {
+    setError("Input batch must hold 1 to " + std::to_string(RMI_INPUT_BATCH_MAX) + " records.");
+    return;
+  }
+  OutboundMessage message;
+  message.message = std::string(RMI_CMD_INPUT_BATCH) + " " + std::to_string(records.size());
+  message.op = RMI_OP_INPUT_BATCH;
   message.response = ResponseType::Ok;
+  message.body.assign(records.size() * RMI_INPUT_RECORD_SIZE, 0);
+  uint64_t total_us = 0;
+  uint8_t* out = message.body.data();
+  for (const InputRecord& record : records) {
+    out[0] = record.device;
+    rmi_write_be16(out + 2, record.type);
+    rmi_write_be16(out + 4, record.code);
+    rmi_write_be32(out + 8, static_cast<uint32_t>(record.value));
+    rmi_write_be32(out + 12, record.delay_us);
+    total_us += record.delay_us;
+    out += RMI_INPUT_RECORD_SIZE;
+  }
+  if (total_us > RMI_INPUT_BATCH_MAX_US) {
+    setError("Input batch delays exceed the server limit.");
+    return;
+  }
+  // The reply only comes once the whole batch has been played.
+  message.response_timeout_ms = static_cast<int>(total_us / 1000) + kAuthTimeoutMs;
   queueMessage(message);
 }
 
@@ -173,6 +726,8 @@ void RmiClient::sendOpen(const std::string& target) {
   }
   OutboundMessage message;
   message.message = std::string(RMI_CMD_OPEN) + " " + normalized;
+  message.op = RMI_OP_OPEN;
+  message.args.push_back(normalized);
   message.response = ResponseType::Ok;
   queueMessage(message);
 }
@@ -185,6 +740,7 @@ void RmiClient::sendUpload(const std::string& local_path, const std::string& rem
   message.is_upload = true;
   message.upload_local_path = local_path;
   message.upload_remote_path = remote_path;
+  message.compress = compress_.load();
   queueMessage(message);
 }
 
@@ -197,9 +753,57 @@ void RmiClient::sendUploadAndRestart(const std::string& local_path, const std::s
   message.restart_after_upload = true;
   message.upload_local_path = local_path;
   message.upload_remote_path = remote_path;
+  message.compress = compress_.load();
+  queueMessage(message);
+}
+
+void RmiClient::sendUploadTree(const std::string& local_dir, const std::string& remote_dir) {
+  if (status_.load() != ClientStatus::Connected) {
+    return;
+  }
+  if (local_dir.empty() || remote_dir.empty()) {
+    setError("Upload tree needs a local and a remote directory.");
+    return;
+  }
+  if (!v2_active_ && ContainsWhitespace(remote_dir)) {
+    setError("Upload remote path must not contain whitespace.");
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(file_mutex_);
+    TreeUploadResult& result = tree_uploads_[remote_dir];
+    result.sent = 0;
+    result.in_progress = true;
+    result.written = 0;
+    result.failed = 0;
+    result.skipped = 0;
+    result.entries.clear();
+    result.error.clear();
+  }
+  OutboundMessage message;
+  message.message = std::string(RMI_CMD_UPLOAD_TREE) + " " + remote_dir;
+  message.op = RMI_OP_UPLOAD_TREE;
+  message.args.assign(1, remote_dir);
+  message.compress = compress_.load();
+  message.response = ResponseType::UploadTree;
+  message.upload_local_path = local_dir;
+  message.upload_remote_path = remote_dir;
   queueMessage(message);
 }
 
+bool RmiClient::getUploadTreeResult(const std::string& remote_dir,
+                                    TreeUploadResult* result) const {
+  std::lock_guard<std::mutex> lock(file_mutex_);
+  auto it = tree_uploads_.find(remote_dir);
+  if (it == tree_uploads_.end()) {
+    return false;
+  }
+  if (result) {
+    *result = it->second;
+  }
+  return true;
+}
+
 bool RmiClient::sendRawCommand(const std::string& command,
                                std::string* response,
                                std::string* error,
@@ -223,6 +827,8 @@ bool RmiClient::sendRawCommand(const std::string& command,
   auto raw = std::make_shared<RawResponse>();
   OutboundMessage message;
   message.message = command;
+  message.op = RMI_OP_COMMAND;
+  message.args.push_back(command);
   message.response = ResponseType::Raw;
   message.raw_response = raw;
   message.raw_timeout_ms = timeout_ms;
@@ -255,6 +861,7 @@ void RmiClient::sendVersion() {
   }
   OutboundMessage message;
   message.message = RMI_CMD_VERSION;
+  message.op = RMI_OP_VERSION;
   message.response = ResponseType::Version;
   queueMessage(message);
 }
@@ -267,21 +874,48 @@ void RmiClient::requestFileList(const std::string& path) {
     setError("File list path is empty.");
     return;
   }
-  if (ContainsWhitespace(path)) {
+  if (!v2_active_ && ContainsWhitespace(path)) {
     setError("File list path must not contain whitespace.");
     return;
   }
   OutboundMessage message;
-  message.message = std::string(RMI_CMD_LIST) + " " + path;
   message.response = ResponseType::List;
   message.list_path = path;
+  // Every server with LIST2 speaks v2, and v1 servers would take it for LIST.
+  message.list_binary = v2_active_;
+  message.compress = compress_.load();
+  {
+    std::lock_guard<std::mutex> lock(file_mutex_);
+    FileListResult& result = file_lists_[path];
+    message.list_request = ++result.request;
+    result.complete = false;
+  }
+  setListCursor(&message, 0);
   queueMessage(message);
 }
 
+// v1 asks for kListPageEntries at a time and follows the cursor at the end
+// of each page; v2 streams everything from `offset` in one reply.
+void RmiClient::setListCursor(OutboundMessage* message, uint64_t offset) {
+  const std::string& path = message->list_path;
+  message->list_offset = offset;
+  message->op = message->list_binary ? RMI_OP_LIST2 : RMI_OP_LIST;
+  message->message = std::string(message->list_binary ? RMI_CMD_LIST2 : RMI_CMD_LIST) +
+                     " " + path;
+  message->args.assign(1, path);
+  if (message->list_legacy) {
+    return;
+  }
+  message->message += " " + std::to_string(offset) + " " + std::to_string(kListPageEntries);
+  message->args.push_back(Be64Arg(offset));
+  message->args.push_back(Be64Arg(0));
+}
+
 bool RmiClient::getFileList(const std::string& path,
                             std::vector<FileEntry>* entries,
                             std::string* error,
-                            uint64_t* version) const {
+                            uint64_t* version,
+                            bool* complete) const {
   std::lock_guard<std::mutex> lock(file_mutex_);
   auto it = file_lists_.find(path);
   if (it == file_lists_.end()) {
@@ -296,10 +930,53 @@ bool RmiClient::getFileList(const std::string& path,
   if (version) {
     *version = it->second.version;
   }
+  if (complete) {
+    *complete = it->second.complete;
+  }
   return true;
 }
 
-void RmiClient::requestDownload(const std::string& path) {
+void RmiClient::requestDownload(const std::string& path, const std::string& local_path) {
+  if (status_.load() != ClientStatus::Connected) {
+    return;
+  }
+  if (path.empty()) {
+    setError("Download path is empty.");
+    return;
+  }
+  if (!v2_active_ && ContainsWhitespace(path)) {
+    setError("Download path must not contain whitespace.");
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(file_mutex_);
+    DownloadResult& result = downloads_[path];
+    result.data.clear();
+    result.error.clear();
+    result.total = 0;
+    result.received = 0;
+    result.in_progress = true;
+    result.connections.clear();
+  }
+  const int connections = download_connections_.load();
+  // Side connections speak v1, whose commands cannot carry whitespace.
+  if (!local_path.empty() && connections > 1 && !ContainsWhitespace(path) &&
+      !transfer_running_.load()) {
+    joinTransfer();
+    transfer_running_ = true;
+    transfer_ = std::thread(&RmiClient::parallelDownloadLoop, this, config_, path, local_path,
+                            connections);
+    return;
+  }
+  OutboundMessage message;
+  message.response = ResponseType::Download;
+  message.download_path = path;
+  message.download_local_path = local_path;
+  applyDownloadRange(&message);
+  queueMessage(message);
+}
+
+void RmiClient::requestDownloadRange(const std::string& path, uint64_t offset, uint64_t length) {
   if (status_.load() != ClientStatus::Connected) {
     return;
   }
@@ -307,7 +984,7 @@ void RmiClient::requestDownload(const std::string& path) {
     setError("Download path is empty.");
     return;
   }
-  if (ContainsWhitespace(path)) {
+  if (!v2_active_ && ContainsWhitespace(path)) {
     setError("Download path must not contain whitespace.");
     return;
   }
@@ -321,9 +998,45 @@ void RmiClient::requestDownload(const std::string& path) {
     result.in_progress = true;
   }
   OutboundMessage message;
-  message.message = std::string(RMI_CMD_DOWNLOAD) + " " + path;
   message.response = ResponseType::Download;
   message.download_path = path;
+  message.download_ranged = true;
+  message.download_offset = offset;
+  message.download_length = length;
+  applyDownloadRange(&message);
+  queueMessage(message);
+}
+
+void RmiClient::requestDownloadTree(const std::string& path, const std::string& local_dir) {
+  if (status_.load() != ClientStatus::Connected) {
+    return;
+  }
+  if (path.empty() || local_dir.empty()) {
+    setError("Download tree needs a remote and a local directory.");
+    return;
+  }
+  if (!v2_active_ && ContainsWhitespace(path)) {
+    setError("Download path must not contain whitespace.");
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(file_mutex_);
+    DownloadResult& result = downloads_[path];
+    result.data.clear();
+    result.error.clear();
+    result.total = 0;
+    result.received = 0;
+    result.in_progress = true;
+    result.connections.clear();
+  }
+  OutboundMessage message;
+  message.message = std::string(RMI_CMD_DOWNLOAD_TREE) + " " + path;
+  message.op = RMI_OP_DOWNLOAD_TREE;
+  message.args.assign(1, path);
+  message.compress = compress_.load();
+  message.response = ResponseType::DownloadTree;
+  message.download_path = path;
+  message.download_local_path = local_dir;
   queueMessage(message);
 }
 
@@ -349,6 +1062,33 @@ bool RmiClient::getDownloadResult(const std::string& path,
   return true;
 }
 
+void RmiClient::setCompression(bool enabled) {
+  compress_ = enabled;
+}
+
+bool RmiClient::compressionActive() const {
+  return compress_ && compress_active_;
+}
+
+void RmiClient::setDownloadConnections(int count) {
+  download_connections_ = std::clamp(count, 1, kMaxDownloadConnections);
+}
+
+int RmiClient::downloadConnections() const {
+  return download_connections_.load();
+}
+
+bool RmiClient::getDownloadStats(const std::string& path,
+                                 std::vector<ConnectionStats>* stats) const {
+  std::lock_guard<std::mutex> lock(file_mutex_);
+  auto it = downloads_.find(path);
+  if (it == downloads_.end() || it->second.connections.empty()) {
+    return false;
+  }
+  *stats = it->second.connections;
+  return true;
+}
+
 bool RmiClient::getDownloadProgress(const std::string& path,
                                     uint64_t* received,
                                     uint64_t* total,
@@ -480,6 +1220,22 @@ bool RmiClient::getScreencapImage(std::vector<uint8_t>* pixels,
   return true;
 }
 
+bool RmiClient::screenStreamActive() const {
+  return stream_active_.load();
+}
+
+bool RmiClient::patchScreenStream(uint64_t* version, const StreamPatchFn& apply) {
+  std::lock_guard<std::mutex> lock(stream_mutex_);
+  if (stream_version_ == 0 || stream_version_ == *version || stream_pixels_.empty()) {
+    return false;
+  }
+  apply(stream_pixels_.data(), stream_width_, stream_height_, stream_dirty_, stream_full_);
+  stream_dirty_.clear();
+  stream_full_ = false;
+  *version = stream_version_;
+  return true;
+}
+
 bool RmiClient::getScreencapPng(std::vector<uint8_t>* png, uint64_t* version) const {
   std::lock_guard<std::mutex> lock(screencap_mutex_);
   if (last_screencap_png_.empty()) {
@@ -519,54 +1275,118 @@ void RmiClient::requestDelete(const std::string& path) {
     setError("Delete path is empty.");
     return;
   }
-  if (ContainsWhitespace(path)) {
+  if (!v2_active_ && ContainsWhitespace(path)) {
     setError("Delete path must not contain whitespace.");
     return;
   }
   OutboundMessage message;
   message.message = std::string(RMI_CMD_DELETE) + " " + path;
+  message.op = RMI_OP_DELETE;
+  message.args.push_back(path);
   message.response = ResponseType::Ok;
+  message.response_timeout_ms = kFileJobTimeoutMs;
   queueMessage(message);
 }
 
-void RmiClient::workerLoop(ClientConfig config) {
-  net::TcpConnection connection;
-  std::string error;
+void RmiClient::requestCopy(const std::string& source, const std::string& destination) {
+  queuePathPair(RMI_CMD_COPY, RMI_OP_COPY, "Copy", source, destination);
+}
 
-  if (!connection.connectTo(config.host, config.port, &error)) {
-    setError(error);
-    setStatus(ClientStatus::Error);
+void RmiClient::requestMove(const std::string& source, const std::string& destination) {
+  queuePathPair(RMI_CMD_MOVE, RMI_OP_MOVE, "Move", source, destination);
+}
+
+void RmiClient::queuePathPair(const char* command,
+                              uint8_t op,
+                              const std::string& label,
+                              const std::string& source,
+                              const std::string& destination) {
+  if (status_.load() != ClientStatus::Connected) {
     return;
   }
-
-  const std::string login_message =
-      std::string(RMI_CMD_AUTH) + " " + config.username + " " + config.password;
-  if (!sendFrame(connection, login_message, &error)) {
-    setError(error);
-    setStatus(ClientStatus::Error);
+  if (source.empty() || destination.empty()) {
+    setError(label + " source and destination must not be empty.");
     return;
   }
-  std::vector<uint8_t> auth_response;
-  if (!receiveFrameSkippingHeartbeats(connection,
-                                      &auth_response,
+  if (!v2_active_ && (ContainsWhitespace(source) || ContainsWhitespace(destination))) {
+    setError(label + " paths must not contain whitespace.");
+    return;
+  }
+  OutboundMessage message;
+  message.message = std::string(command) + " " + source + " " + destination;
+  message.op = op;
+  message.args.push_back(source);
+  message.args.push_back(destination);
+  message.response = ResponseType::Ok;
+  message.response_timeout_ms = kFileJobTimeoutMs;
+  queueMessage(message);
+}
+
+// Connects and authenticates; the connection is left in protocol v1.
+bool RmiClient::openConnection(net::TcpConnection& connection,
+                               const ClientConfig& config,
+                               std::string* error) {
+  if (!connection.connectTo(config.host, config.port, error)) {
+    return false;
+  }
+  const std::string login_message =
+      std::string(RMI_CMD_AUTH) + " " + config.username + " " + config.password;
+  if (!sendFrame(connection, login_message, error)) {
+    return false;
+  }
+  std::vector<uint8_t> auth_response;
+  if (!receiveFrameSkippingHeartbeats(connection,
+                                      &auth_response,
                                       kAuthTimeoutMs,
                                       256,
-                                      &error)) {
+                                      error)) {
+    return false;
+  }
+  if (!PayloadEquals(auth_response, RMI_RESP_OK)) {
+    if (error) {
+      *error = PayloadStartsWith(auth_response, RMI_RESP_ERR_PREFIX)
+          ? PayloadToString(auth_response)
+          : "Unexpected auth response: " + PayloadToString(auth_response);
+    }
+    return false;
+  }
+  return true;
+}
+
+void RmiClient::workerLoop(ClientConfig config) {
+  net::TcpConnection connection;
+  std::string error;
+
+  if (!openConnection(connection, config, &error)) {
     setError(error);
     setStatus(ClientStatus::Error);
     return;
   }
-  if (!PayloadEquals(auth_response, RMI_RESP_OK)) {
-    if (PayloadStartsWith(auth_response, RMI_RESP_ERR_PREFIX)) {
-      setError(PayloadToString(auth_response));
-    } else {
-      setError("Unexpected auth response: " + PayloadToString(auth_response));
-    }
+
+  bool v2 = false;
+  if (!negotiateProtocol(connection, &v2, &error)) {
+    setError(error);
     setStatus(ClientStatus::Error);
     return;
   }
 
+  stream_active_ = false;
+  v2_active_ = v2;
+  compress_active_ = false;
+  if (v2 && !negotiateCompression(connection, &error)) {
+    setError(error);
+    setStatus(ClientStatus::Error);
+    return;
+  }
   setStatus(ClientStatus::Connected);
+  if (v2) {
+    workerLoopV2(connection);
+    connection.close();
+    if (status_.load() != ClientStatus::Error) {
+      setStatus(ClientStatus::Disconnected);
+    }
+    return;
+  }
 
   auto last_heartbeat = std::chrono::steady_clock::now();
 
@@ -575,7 +1395,8 @@ void RmiClient::workerLoop(ClientConfig config) {
     bool has_message = false;
     {
       std::unique_lock<std::mutex> lock(outbox_mutex_);
-      outbox_cv_.wait_for(lock, std::chrono::milliseconds(100), [this]() {
+      const int wait_ms = stream_active_ ? 0 : 100;
+      outbox_cv_.wait_for(lock, std::chrono::milliseconds(wait_ms), [this]() {
         return stop_.load() || !outbox_.empty();
       });
       if (stop_) {
@@ -588,6 +1409,30 @@ void RmiClient::workerLoop(ClientConfig config) {
       }
     }
 
+    DownloadFile download_file;
+    if (has_message && message.response == ResponseType::Download &&
+        !message.download_local_path.empty() &&
+        !beginDownloadFile(&message, &download_file, &error)) {
+      storeDownloadResult(message.download_path, {}, error);
+      continue;
+    }
+    std::shared_ptr<TreeDownload> tree;
+    if (has_message && message.response == ResponseType::DownloadTree) {
+      tree = std::make_shared<TreeDownload>();
+      if (!beginTreeDownload(message, tree.get(), &error)) {
+        storeDownloadResult(message.download_path, {}, error);
+        continue;
+      }
+    }
+    std::shared_ptr<TreeUpload> tree_upload;
+    if (has_message && message.response == ResponseType::UploadTree) {
+      tree_upload = std::make_shared<TreeUpload>();
+      if (!beginTreeUpload(message, tree_upload.get(), &error)) {
+        storeTreeUploadResult(message.upload_remote_path, {}, error);
+        continue;
+      }
+    }
+
     if (has_message && !message.message.empty()) {
       auto finish_raw = [&message](bool ok,
                                    const std::string& payload,
@@ -603,7 +1448,13 @@ void RmiClient::workerLoop(ClientConfig config) {
         message.raw_response->cv.notify_one();
       };
 
-      if (!sendFrame(connection, message.message, &error)) {
+      if (message.stream_fps > 0) {
+        // Frames may follow the OK in the same read.
+        stream_active_ = true;
+      }
+      if (!sendFrame(connection, message.message, &error) ||
+          (!message.body.empty() &&
+           !sendFrameBytes(connection, message.body.data(), message.body.size(), &error))) {
         if (message.response == ResponseType::Raw) {
           finish_raw(false, std::string(), error);
         }
@@ -617,17 +1468,29 @@ void RmiClient::workerLoop(ClientConfig config) {
           setStatus(ClientStatus::Error);
           return;
         }
+      } else if (message.response == ResponseType::ScreencapRaw) {
+        if (!receiveScreencapRaw(connection)) {
+          setStatus(ClientStatus::Error);
+          return;
+        }
       } else if (message.response == ResponseType::Ok) {
         std::vector<uint8_t> response;
+        const int timeout = (message.response_timeout_ms > 0)
+            ? message.response_timeout_ms
+            : kAuthTimeoutMs;
         if (!receiveFrameSkippingHeartbeats(connection,
                                             &response,
-                                            kAuthTimeoutMs,
+                                            timeout,
                                             256,
                                             &error)) {
           setError(error);
           setStatus(ClientStatus::Error);
           return;
         }
+        if (message.stream_fps == 0 ||
+            (message.stream_fps > 0 && !PayloadEquals(response, RMI_RESP_OK))) {
+          stream_active_ = false;
+        }
         if (PayloadEquals(response, RMI_RESP_OK)) {
           if (message.disconnect_after_ok) {
             setStatus(ClientStatus::Disconnected);
@@ -667,20 +1530,12 @@ void RmiClient::workerLoop(ClientConfig config) {
           setStatus(ClientStatus::Error);
           return;
         }
-        std::vector<FileEntry> entries;
-        std::string list_error;
-        if (!parseFileListPayload(response, &entries, &list_error)) {
-          std::lock_guard<std::mutex> lock(file_mutex_);
-          FileListResult& result = file_lists_[message.list_path];
-          result.entries.clear();
-          result.error = list_error.empty() ? "Failed to parse file list." : list_error;
-          ++result.version;
-        } else {
-          std::lock_guard<std::mutex> lock(file_mutex_);
-          FileListResult& result = file_lists_[message.list_path];
-          result.entries = std::move(entries);
-          result.error.clear();
-          ++result.version;
+        uint64_t next = 0;
+        storeFileList(message, response, message.list_offset == 0, true, &next);
+        if (next > message.list_offset) {
+          OutboundMessage page = message;
+          setListCursor(&page, next);
+          queueMessage(page);
         }
       } else if (message.response == ResponseType::Download) {
         std::vector<uint8_t> response;
@@ -693,45 +1548,112 @@ void RmiClient::workerLoop(ClientConfig config) {
           setStatus(ClientStatus::Error);
           return;
         }
-        if (PayloadEquals(response, RMI_RESP_OK)) {
+        const bool to_file = !message.download_local_path.empty();
+        const bool ranged_ok = PayloadStartsWith(response, RMI_RESP_OK " ");
+        if (PayloadEquals(response, RMI_RESP_OK) || ranged_ok) {
           std::vector<uint8_t> file_data;
+          std::string file_error;
+          if (to_file && ranged_ok &&
+              !acceptDownloadReply(message, &download_file, PayloadToString(response))) {
+            // The body still has to be drained to keep the stream in sync.
+            file_error = "Unexpected response: " + PayloadToString(response);
+            download_file.out.close();
+          } else if (to_file && !ranged_ok && download_file.offset > 0) {
+            // Servers without ranged DOWNLOAD send the whole file.
+            download_file.out.close();
+            download_file.out.open(message.download_local_path + ".part",
+                                   std::ios::binary | std::ios::trunc);
+            download_file.offset = 0;
+          }
           if (!receiveFrameSkippingHeartbeatsWithProgress(connection,
                                                           &file_data,
                                                           kScreencapTimeoutMs,
                                                           kMaxFrameBytes,
                                                           message.download_path,
+                                                          to_file ? &download_file.out : nullptr,
                                                           &error)) {
             setError(error);
             setStatus(ClientStatus::Error);
             return;
           }
-          std::lock_guard<std::mutex> lock(file_mutex_);
-          DownloadResult& result = downloads_[message.download_path];
-          result.data = std::move(file_data);
-          result.error.clear();
-          result.total = result.data.size();
-          result.received = result.total;
-          result.in_progress = false;
-          ++result.version;
+          if (!to_file && message.download_ranged && !ranged_ok) {
+            // The server ignored the range; cut it out of the whole file.
+            const uint64_t begin = std::min<uint64_t>(message.download_offset, file_data.size());
+            uint64_t end = file_data.size();
+            if (message.download_length > 0 && message.download_length < end - begin) {
+              end = begin + message.download_length;
+            }
+            file_data = std::vector<uint8_t>(file_data.begin() + static_cast<ptrdiff_t>(begin),
+                                             file_data.begin() + static_cast<ptrdiff_t>(end));
+          }
+          if (to_file) {
+            file_data.clear();
+            const std::string finish_error =
+                finishDownloadFile(message, &download_file, file_error.empty());
+            if (file_error.empty()) {
+              file_error = finish_error;
+            }
+          }
+          if (download_file.discard) {
+            // The remote file changed under the `.part`; fetch it again in full.
+            queueMessage(message);
+          } else {
+            storeDownloadResult(message.download_path, std::move(file_data), file_error);
+          }
         } else if (PayloadStartsWith(response, RMI_RESP_ERR_PREFIX)) {
-          std::lock_guard<std::mutex> lock(file_mutex_);
-          DownloadResult& result = downloads_[message.download_path];
-          result.data.clear();
-          result.error = PayloadToString(response);
-          result.total = 0;
-          result.received = 0;
-          result.in_progress = false;
-          ++result.version;
+          if (to_file) {
+            // A resume offset past the end means the file shrank; start over.
+            download_file.discard = download_file.offset > 0;
+            finishDownloadFile(message, &download_file, false);
+          }
+          if (download_file.discard) {
+            queueMessage(message);
+          } else {
+            storeDownloadResult(message.download_path, {}, PayloadToString(response));
+          }
+        } else {
+          storeDownloadResult(message.download_path, {},
+                              "Unexpected response: " + PayloadToString(response));
+        }
+      } else if (message.response == ResponseType::DownloadTree) {
+        std::vector<uint8_t> response;
+        if (!receiveFrameSkippingHeartbeats(connection,
+                                            &response,
+                                            kAuthTimeoutMs,
+                                            256,
+                                            &error)) {
+          setError(error);
+          setStatus(ClientStatus::Error);
+          return;
+        }
+        if (!PayloadEquals(response, RMI_RESP_OK)) {
+          finishTreeDownload(tree.get(), false);
+          storeDownloadResult(message.download_path, {},
+                              PayloadStartsWith(response, RMI_RESP_ERR_PREFIX)
+                                  ? PayloadToString(response)
+                                  : "Unexpected response: " + PayloadToString(response));
+        } else if (!receiveTreeArchive(connection, tree.get(), message.download_path, &error)) {
+          finishTreeDownload(tree.get(), false);
+          storeDownloadResult(message.download_path, {}, error);
+          setError(error);
+          setStatus(ClientStatus::Error);
+          return;
         } else {
-          std::lock_guard<std::mutex> lock(file_mutex_);
-          DownloadResult& result = downloads_[message.download_path];
-          result.data.clear();
-          result.error = "Unexpected response: " + PayloadToString(response);
-          result.total = 0;
-          result.received = 0;
-          result.in_progress = false;
-          ++result.version;
+          storeDownloadResult(message.download_path, {}, finishTreeDownload(tree.get(), true));
+        }
+      } else if (message.response == ResponseType::UploadTree) {
+        std::vector<uint8_t> response;
+        if (!sendTreeArchive(connection, tree_upload.get(), message.upload_remote_path,
+                             &response, &error)) {
+          storeTreeUploadResult(message.upload_remote_path, {}, error);
+          setError(error);
+          setStatus(ClientStatus::Error);
+          return;
         }
+        storeTreeUploadResult(message.upload_remote_path, response,
+                              PayloadStartsWith(response, RMI_RESP_ERR_PREFIX)
+                                  ? PayloadToString(response)
+                                  : std::string());
       } else if (message.response == ResponseType::Raw) {
         std::vector<uint8_t> response;
         const int timeout = (message.raw_timeout_ms > 0)
@@ -765,42 +1687,56 @@ void RmiClient::workerLoop(ClientConfig config) {
         setError("Upload remote path must not contain whitespace.");
         continue;
       }
-      std::vector<uint8_t> file_data;
-      uint32_t size = 0;
-      if (!loadUploadFile(message.upload_local_path, &file_data, &size, &error)) {
+      std::ifstream file;
+      uint64_t size = 0;
+      if (!openUploadFile(message.upload_local_path, &file, &size, &error)) {
         setError(error);
         continue;
       }
-      const std::string command = std::string(RMI_CMD_UPLOAD) + " " +
-                                  message.upload_remote_path + " " +
-                                  std::to_string(size);
-      if (!sendFrame(connection, command, &error)) {
-        setError(error);
-        setStatus(ClientStatus::Error);
-        return;
-      }
-      if (!sendFrameBytes(connection, file_data.data(), file_data.size(), &error)) {
-        setError(error);
-        setStatus(ClientStatus::Error);
-        return;
+      if (size > kMaxUploadBytes) {
+        setError("Upload file too large for protocol v1.");
+        continue;
       }
-      std::vector<uint8_t> response;
-      if (!receiveFrameSkippingHeartbeats(connection,
-                                          &response,
-                                          kAuthTimeoutMs,
-                                          256,
-                                          &error)) {
+      // Servers without BLOCKSUMS, or a delta they refuse, get the whole file.
+      bool uploaded = false;
+      if (!message.upload_full && size >= kMinDeltaBytes &&
+          !sendDeltaUploadV1(connection, message, &uploaded, &error)) {
         setError(error);
         setStatus(ClientStatus::Error);
         return;
       }
-      if (!PayloadEquals(response, RMI_RESP_OK)) {
-        if (PayloadStartsWith(response, RMI_RESP_ERR_PREFIX)) {
-          setError(PayloadToString(response));
-        } else {
-          setError("Unexpected response: " + PayloadToString(response));
+      if (!uploaded) {
+        const std::string command = std::string(RMI_CMD_UPLOAD) + " " +
+                                    message.upload_remote_path + " " +
+                                    std::to_string(size);
+        if (!sendFrame(connection, command, &error)) {
+          setError(error);
+          setStatus(ClientStatus::Error);
+          return;
+        }
+        if (!sendFileFrame(connection, file, size, &error)) {
+          setError(error);
+          setStatus(ClientStatus::Error);
+          return;
+        }
+        std::vector<uint8_t> response;
+        if (!receiveFrameSkippingHeartbeats(connection,
+                                            &response,
+                                            kAuthTimeoutMs,
+                                            256,
+                                            &error)) {
+          setError(error);
+          setStatus(ClientStatus::Error);
+          return;
+        }
+        if (!PayloadEquals(response, RMI_RESP_OK)) {
+          if (PayloadStartsWith(response, RMI_RESP_ERR_PREFIX)) {
+            setError(PayloadToString(response));
+          } else {
+            setError("Unexpected response: " + PayloadToString(response));
+          }
+          continue;
         }
-        continue;
       }
       if (message.restart_after_upload) {
         if (!sendFrame(connection, RMI_CMD_RESTART, &error)) {
@@ -833,6 +1769,14 @@ void RmiClient::workerLoop(ClientConfig config) {
       last_heartbeat = std::chrono::steady_clock::now();
     }
 
+    if (!has_message && stream_active_) {
+      if (!pollStreamFrames(connection, kStreamPollMs, &error)) {
+        setError(error);
+        setStatus(ClientStatus::Error);
+        return;
+      }
+    }
+
     if (!has_message) {
       const auto now = std::chrono::steady_clock::now();
       const auto elapsed_ms =
@@ -854,115 +1798,984 @@ void RmiClient::workerLoop(ClientConfig config) {
   }
 }
 
-void RmiClient::queueMessage(const OutboundMessage& message) {
-  {
-    std::lock_guard<std::mutex> lock(outbox_mutex_);
-    outbox_.push(message);
+// Servers that predate protocol v2 answer `PROTOCOL 2` with an error and
+// the connection stays on v1.
+bool RmiClient::negotiateProtocol(net::TcpConnection& connection,
+                                  bool* v2,
+                                  std::string* error) {
+  *v2 = false;
+  if (!sendFrame(connection, std::string(RMI_CMD_PROTOCOL) + " 2", error)) {
+    return false;
   }
-  outbox_cv_.notify_one();
-}
-
-void RmiClient::setStatus(ClientStatus status) {
-  status_.store(status);
-}
-
-void RmiClient::setError(const std::string& error) {
-  std::lock_guard<std::mutex> lock(error_mutex_);
-  last_error_ = error;
-}
-
-void RmiClient::clearError() {
-  std::lock_guard<std::mutex> lock(error_mutex_);
-  last_error_.clear();
-}
-
-void RmiClient::setLastScreencapPath(const std::string& path) {
-  std::lock_guard<std::mutex> lock(screencap_mutex_);
-  last_screencap_path_ = path;
-}
-
-void RmiClient::setScreencapData(std::vector<uint8_t> png,
-                                 std::vector<uint8_t> pixels,
-                                 int width,
-                                 int height) {
-  std::lock_guard<std::mutex> lock(screencap_mutex_);
-  last_screencap_png_ = std::move(png);
-  last_screencap_pixels_ = std::move(pixels);
-  last_screencap_width_ = width;
-  last_screencap_height_ = height;
-  last_screencap_path_.clear();
-  ++last_screencap_version_;
-}
-
-void RmiClient::setVersionInfo(int64_t version) {
-  std::lock_guard<std::mutex> lock(version_mutex_);
-  last_version_ = version;
-  has_version_ = true;
-}
-
-void RmiClient::setVersionStatus(const std::string& status) {
-  std::lock_guard<std::mutex> lock(version_mutex_);
-  version_status_ = status;
+  std::vector<uint8_t> response;
+  if (!receiveFrameSkippingHeartbeats(connection, &response, kAuthTimeoutMs, 256, error)) {
+    return false;
+  }
+  *v2 = PayloadEquals(response, RMI_RESP_PROTOCOL_PREFIX "2");
+  return true;
 }
 
-void RmiClient::setDownloadProgress(const std::string& path,
-                                    uint64_t received,
-                                    uint64_t total,
-                                    bool in_progress) {
-  if (path.empty()) {
-    return;
+// Offers the LZ codec on a v2 connection before any other request is in
+// flight. Servers without compression answer with an error and everything
+// stays unpacked.
+bool RmiClient::negotiateCompression(net::TcpConnection& connection, std::string* error) {
+  if (!sendV2Frame(connection, 1, RMI_OP_COMPRESS, 0, {RMI_LZ_CODEC}, nullptr, 0, error)) {
+    return false;
   }
-  std::lock_guard<std::mutex> lock(file_mutex_);
-  DownloadResult& result = downloads_[path];
-  result.received = received;
-  result.total = total;
-  result.in_progress = in_progress;
+  std::vector<uint8_t> response;
+  do {
+    // Id 0 frames are server heartbeats.
+    if (!receiveFrame(connection, &response, kAuthTimeoutMs, 256, error)) {
+      return false;
+    }
+  } while (response.size() < RMI_V2_HEADER_SIZE || ReadBe32(response.data()) != 1);
+  const std::vector<uint8_t> reply(response.begin() + RMI_V2_HEADER_SIZE, response.end());
+  compress_active_ = PayloadEquals(reply, RMI_RESP_OK " " RMI_LZ_CODEC);
+  return true;
 }
 
-bool RmiClient::parseVersionPayload(const std::vector<uint8_t>& payload,
-                                    int64_t* version,
-                                    std::string* error) const {
-  if (PayloadStartsWith(payload, RMI_RESP_ERR_PREFIX)) {
-    if (error) {
-      *error = PayloadToString(payload);
-    }
-    return false;
+bool RmiClient::sendV2Frame(net::TcpConnection& connection,
+                            uint32_t id,
+                            uint8_t op,
+                            uint8_t flags,
+                            const std::vector<std::string>& args,
+                            const uint8_t* data,
+                            size_t size,
+                            std::string* error) {
+  size_t length = RMI_V2_HEADER_SIZE + size;
+  for (const std::string& arg : args) {
+    length += 4 + arg.size();
   }
-  const std::string text = PayloadToString(payload);
-  const std::string prefix = RMI_RESP_VERSION_PREFIX;
-  if (text.size() <= prefix.size() || text.compare(0, prefix.size(), prefix) != 0) {
+  if (length > std::numeric_limits<uint32_t>::max()) {
     if (error) {
-      *error = "Unexpected VERSION response: " + text;
+      *error = "Payload too large to send.";
     }
     return false;
   }
-  const std::string number_text = text.substr(prefix.size());
-  try {
-    size_t idx = 0;
-    long long parsed = std::stoll(number_text, &idx, 10);
-    if (idx != number_text.size() || parsed < 0) {
-      if (error) {
-        *error = "Invalid version number: " + number_text;
+  std::string framed(RMI_FRAME_HEADER_SIZE + RMI_V2_HEADER_SIZE, '\0');
+  uint8_t* header = reinterpret_cast<uint8_t*>(&framed[0]);
+  rmi_write_be32(header, static_cast<uint32_t>(length));
+  rmi_v2_write_header(header + RMI_FRAME_HEADER_SIZE, id, op, flags);
+  for (const std::string& arg : args) {
+    framed += Be32Arg(static_cast<uint32_t>(arg.size()));
+    framed += arg;
+  }
+  if (size > 0) {
+    framed.append(reinterpret_cast<const char*>(data), size);
+  }
+  return connection.sendAll(framed, error);
+}
+
+// Sends one queued message as a v2 request. Returns false only when the
+// connection is no longer usable; a request that cannot be built sets the
+// error and leaves the response type at None.
+bool RmiClient::sendRequest(net::TcpConnection& connection,
+                            uint32_t id,
+                            PendingRequest* request,
+                            std::string* error) {
+  OutboundMessage* message = &request->message;
+  if (message->is_upload) {
+    message->response = ResponseType::None;
+    if (message->upload_local_path.empty() || message->upload_remote_path.empty()) {
+      setError("Upload requires local and remote paths.");
+      return true;
+    }
+    if (message->upload_delta) {
+      // The delta is read from its spool file like a whole upload.
+      std::string open_error;
+      if (!openUploadFile(message->upload_delta->path.string(), &request->upload_file,
+                          &request->upload_size, &open_error)) {
+        setError(open_error);
+        return true;
       }
+      const std::vector<std::string> args = {message->upload_remote_path,
+                                             Be64Arg(message->upload_delta_size),
+                                             Be64Arg(request->upload_size)};
+      if (!sendV2Frame(connection, id, RMI_OP_DELTA_UPLOAD, 0, args, nullptr, 0, error)) {
+        return false;
+      }
+      request->upload_pending = true;
+      request->upload_credit = RMI_V2_STREAM_WINDOW;
+      request->upload_compress = message->compress && compress_active_;
+      message->response = ResponseType::Ok;
+      return true;
+    }
+    std::string open_error;
+    if (!openUploadFile(message->upload_local_path, &request->upload_file,
+                        &request->upload_size, &open_error)) {
+      setError(open_error);
+      return true;
+    }
+    if (!message->upload_full && request->upload_size >= kMinDeltaBytes) {
+      // The reply decides between a delta and the whole file.
+      request->upload_file.close();
+      const std::vector<std::string> args = {
+          message->upload_remote_path, Be32Arg(rmi_delta_block_size(request->upload_size))};
+      if (!sendV2Frame(connection, id, RMI_OP_BLOCKSUMS, 0, args, nullptr, 0, error)) {
+        return false;
+      }
+      message->response = ResponseType::BlockSums;
+      return true;
+    }
+    const std::vector<std::string> args = {message->upload_remote_path,
+                                           Be64Arg(request->upload_size)};
+    if (!sendV2Frame(connection, id, RMI_OP_UPLOAD, 0, args, nullptr, 0, error)) {
       return false;
     }
-    if (version) {
-      *version = parsed;
+    request->upload_pending = true;
+    request->upload_credit = RMI_V2_STREAM_WINDOW;
+    request->upload_compress = message->compress && compress_active_;
+    message->response = ResponseType::Ok;
+    return true;
+  }
+  if (message->response == ResponseType::UploadTree) {
+    request->tree_upload = std::make_shared<TreeUpload>();
+    std::string open_error;
+    if (!beginTreeUpload(*message, request->tree_upload.get(), &open_error)) {
+      storeTreeUploadResult(message->upload_remote_path, {}, open_error);
+      message->response = ResponseType::None;
+      return true;
+    }
+    if (!sendV2Frame(connection, id, RMI_OP_UPLOAD_TREE, 0, message->args, nullptr, 0, error)) {
+      return false;
     }
+    request->upload_pending = true;
+    request->upload_credit = RMI_V2_STREAM_WINDOW;
+    request->upload_compress = message->compress && compress_active_;
     return true;
-  } catch (const std::exception&) {
-    if (error) {
-      *error = "Invalid version number: " + number_text;
+  }
+  if (message->op == RMI_OP_INPUT_BATCH) {
+    message->args.assign(1, std::string(message->body.begin(), message->body.end()));
+  }
+  if (message->response == ResponseType::DownloadTree) {
+    request->tree = std::make_shared<TreeDownload>();
+    std::string open_error;
+    if (!beginTreeDownload(*message, request->tree.get(), &open_error)) {
+      storeDownloadResult(message->download_path, {}, open_error);
+      message->response = ResponseType::None;
+      return true;
+    }
+  } else if (!message->download_local_path.empty()) {
+    std::string open_error;
+    if (!beginDownloadFile(message, &request->download_file, &open_error)) {
+      storeDownloadResult(message->download_path, {}, open_error);
+      message->response = ResponseType::None;
+      return true;
     }
-    return false;
   }
+  if (message->stream_fps > 0) {
+    // Frames may follow the OK in the same read.
+    stream_active_ = true;
+  }
+  const uint8_t flags = message->compress && compress_active_ ? RMI_V2_FLAG_COMPRESSED : 0;
+  return sendV2Frame(connection, id, message->op, flags, message->args, nullptr, 0, error);
 }
 
-bool RmiClient::parseFileListPayload(const std::vector<uint8_t>& payload,
-                                     std::vector<FileEntry>* entries,
-                                     std::string* error) const {
-  if (PayloadStartsWith(payload, RMI_RESP_ERR_PREFIX)) {
-    if (error) {
+// Reads and sends the next DATA chunk of an upload that still has credit;
+// the last chunk carries the END flag. A local read error ends the stream
+// early, which the server answers with `ERR upload`. An UPLOAD_TREE has no
+// size up front; its stream ends with the archive.
+bool RmiClient::sendUploadChunk(net::TcpConnection& connection,
+                                uint32_t id,
+                                PendingRequest* request,
+                                std::string* error) {
+  TreeUpload* tree = request->tree_upload.get();
+  const uint64_t left = tree ? RMI_V2_CHUNK_MAX : request->upload_size - request->upload_sent;
+  size_t size = static_cast<size_t>(
+      std::min<uint64_t>({left, RMI_V2_CHUNK_MAX, request->upload_credit}));
+  bool last = size == left;
+  uint8_t chunk[RMI_V2_CHUNK_MAX];
+  if (tree) {
+    size = readTreeArchive(tree, chunk, size);
+    last = tree->finished();
+    setTreeUploadProgress(request->message.upload_remote_path, tree->sent);
+  } else if (size > 0) {
+    request->upload_file.read(reinterpret_cast<char*>(chunk), static_cast<std::streamsize>(size));
+    if (!request->upload_file.good()) {
+      setError("Failed to read upload file.");
+      size = 0;
+      last = true;
+    }
+  }
+  if (request->upload_sent == 0 && rmi_lz_precompressed(chunk, size)) {
+    request->upload_compress = false;
+  }
+  uint8_t flags = last ? RMI_V2_FLAG_END : 0;
+  const uint8_t* wire = chunk;
+  size_t wire_size = size;
+  uint8_t packed[RMI_LZ_HEADER_SIZE + RMI_V2_CHUNK_MAX + RMI_V2_CHUNK_MAX / 255 + 16];
+  if (request->upload_compress) {
+    const size_t packed_size = rmi_lz_pack(chunk, size, packed, sizeof(packed));
+    if (packed_size > 0) {
+      wire = packed;
+      wire_size = packed_size;
+      flags |= RMI_V2_FLAG_COMPRESSED;
+    }
+  }
+  if (!sendV2Frame(connection, id, RMI_OP_DATA, flags, {}, wire, wire_size, error)) {
+    return false;
+  }
+  request->upload_sent += size;
+  // Credit counts the bytes on the wire.
+  request->upload_credit -= static_cast<uint32_t>(wire_size);
+  if (last) {
+    request->upload_pending = false;
+    request->upload_file.close();
+  }
+  return true;
+}
+
+bool RmiClient::handleDownloadChunk(net::TcpConnection& connection,
+                                    uint32_t id,
+                                    PendingRequest* request,
+                                    uint8_t flags,
+                                    const uint8_t* data,
+                                    size_t size,
+                                    bool* done,
+                                    std::string* error) {
+  const OutboundMessage& message = request->message;
+  const std::string& path = message.download_path;
+  DownloadFile& file = request->download_file;
+  const bool to_file = !message.download_local_path.empty();
+  const size_t wire_size = size;
+  uint8_t raw[RMI_V2_CHUNK_MAX];
+  if (flags & RMI_V2_FLAG_COMPRESSED) {
+    size_t raw_size = 0;
+    if (rmi_lz_unpack(data, size, raw, sizeof(raw), &raw_size) != 0) {
+      flags |= RMI_V2_FLAG_ERROR;
+    }
+    data = raw;
+    size = raw_size;
+  }
+  *done = true;
+  if (flags & RMI_V2_FLAG_ERROR) {
+    if (to_file) {
+      finishDownloadFile(message, &file, false);
+    }
+    storeDownloadResult(path, {}, "ERR download");
+    return true;
+  }
+  if (file.out.is_open()) {
+    file.out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+  } else if (!to_file) {
+    request->body.insert(request->body.end(), data, data + size);
+  }
+  request->body_received += size;
+  request->deadline = std::chrono::steady_clock::now() +
+                      std::chrono::milliseconds(kScreencapTimeoutMs);
+  if (flags & RMI_V2_FLAG_END) {
+    if (!to_file) {
+      storeDownloadResult(path, std::move(request->body), std::string());
+      return true;
+    }
+    const std::string file_error = finishDownloadFile(message, &file, true);
+    if (file.discard) {
+      // The remote file changed under the `.part`; fetch it again in full.
+      queueMessage(message);
+      return true;
+    }
+    storeDownloadResult(path, {}, file_error);
+    return true;
+  }
+  *done = false;
+  setDownloadProgress(path, file.offset + request->body_received,
+                      file.offset + request->body_size, true);
+  // The chunk is consumed, so the server may send that much more.
+  const std::string credit = Be32Arg(static_cast<uint32_t>(wire_size));
+  return sendV2Frame(connection, id, RMI_OP_WINDOW, 0, {},
+                     reinterpret_cast<const uint8_t*>(credit.data()), credit.size(), error);
+}
+
+// DOWNLOAD_TREE DATA chunks are unpacked as they land.
+bool RmiClient::handleTreeChunk(net::TcpConnection& connection,
+                                uint32_t id,
+                                PendingRequest* request,
+                                uint8_t flags,
+                                const uint8_t* data,
+                                size_t size,
+                                bool* done,
+                                std::string* error) {
+  const std::string& path = request->message.download_path;
+  TreeDownload* tree = request->tree.get();
+  const size_t wire_size = size;
+  uint8_t raw[RMI_V2_CHUNK_MAX];
+  if (flags & RMI_V2_FLAG_COMPRESSED) {
+    size_t raw_size = 0;
+    if (rmi_lz_unpack(data, size, raw, sizeof(raw), &raw_size) != 0) {
+      flags |= RMI_V2_FLAG_ERROR;
+    }
+    data = raw;
+    size = raw_size;
+  }
+  *done = true;
+  if (flags & RMI_V2_FLAG_ERROR) {
+    finishTreeDownload(tree, false);
+    storeDownloadResult(path, {}, "ERR download_tree");
+    return true;
+  }
+  unpackTreeChunk(tree, data, size);
+  request->deadline = std::chrono::steady_clock::now() +
+                      std::chrono::milliseconds(kScreencapTimeoutMs);
+  if (flags & RMI_V2_FLAG_END) {
+    storeDownloadResult(path, {}, finishTreeDownload(tree, true));
+    return true;
+  }
+  *done = false;
+  setDownloadProgress(path, tree->received, 0, true);
+  const std::string credit = Be32Arg(static_cast<uint32_t>(wire_size));
+  return sendV2Frame(connection, id, RMI_OP_WINDOW, 0, {},
+                     reinterpret_cast<const uint8_t*>(credit.data()), credit.size(), error);
+}
+
+// LIST DATA chunks carry whole lines, so each one is stored as it lands.
+bool RmiClient::handleListChunk(net::TcpConnection& connection,
+                                uint32_t id,
+                                PendingRequest* request,
+                                uint8_t flags,
+                                const uint8_t* data,
+                                size_t size,
+                                bool* done,
+                                std::string* error) {
+  std::vector<uint8_t> text(data, data + size);
+  if (flags & RMI_V2_FLAG_COMPRESSED) {
+    text.assign(RMI_V2_CHUNK_MAX, 0);
+    size_t raw_size = 0;
+    if (rmi_lz_unpack(data, size, text.data(), text.size(), &raw_size) != 0) {
+      flags |= RMI_V2_FLAG_ERROR;
+    }
+    text.resize(raw_size);
+  }
+  *done = (flags & (RMI_V2_FLAG_END | RMI_V2_FLAG_ERROR)) != 0;
+  if (flags & RMI_V2_FLAG_ERROR) {
+    const std::string failed = "ERR list";
+    text.assign(failed.begin(), failed.end());
+  }
+  storeFileList(request->message, text, request->body_received == 0, *done, nullptr);
+  request->body_received += size;
+  request->deadline = std::chrono::steady_clock::now() +
+                      std::chrono::milliseconds(kScreencapTimeoutMs);
+  if (*done) {
+    return true;
+  }
+  const std::string credit = Be32Arg(static_cast<uint32_t>(size));
+  return sendV2Frame(connection, id, RMI_OP_WINDOW, 0, {},
+                     reinterpret_cast<const uint8_t*>(credit.data()), credit.size(), error);
+}
+
+void RmiClient::failRequest(PendingRequest* request, const std::string& error) {
+  const OutboundMessage& message = request->message;
+  if (message.response == ResponseType::List) {
+    std::lock_guard<std::mutex> lock(file_mutex_);
+    FileListResult& result = file_lists_[message.list_path];
+    if (result.request == message.list_request) {
+      result.error = error;
+      result.complete = true;
+      ++result.version;
+    }
+  } else if (message.response == ResponseType::Download) {
+    if (!message.download_local_path.empty()) {
+      // Keeps the `.part` so the next request resumes it.
+      finishDownloadFile(message, &request->download_file, false);
+    }
+    storeDownloadResult(message.download_path, {}, error);
+  } else if (message.response == ResponseType::DownloadTree) {
+    finishTreeDownload(request->tree.get(), false);
+    storeDownloadResult(message.download_path, {}, error);
+  } else if (message.response == ResponseType::UploadTree) {
+    storeTreeUploadResult(message.upload_remote_path, {}, error);
+  } else if (message.response == ResponseType::Raw && message.raw_response) {
+    std::lock_guard<std::mutex> lock(message.raw_response->mutex);
+    message.raw_response->error = error;
+    message.raw_response->ok = false;
+    message.raw_response->done = true;
+    message.raw_response->cv.notify_one();
+  }
+}
+
+bool RmiClient::handleReply(PendingRequest* request,
+                            std::vector<uint8_t> payload,
+                            bool* disconnect) {
+  OutboundMessage& message = request->message;
+  const bool is_error = PayloadStartsWith(payload, RMI_RESP_ERR_PREFIX);
+  switch (message.response) {
+    case ResponseType::Screencap:
+      handleScreencapPayload(std::move(payload));
+      return false;
+    case ResponseType::ScreencapRaw:
+      handleScreencapRawPayload(payload);
+      return false;
+    case ResponseType::Version: {
+      int64_t version = -1;
+      std::string parse_error;
+      if (!parseVersionPayload(payload, &version, &parse_error)) {
+        setError(parse_error);
+      } else {
+        setVersionInfo(version);
+      }
+      return false;
+    }
+    case ResponseType::List:
+      if (!message.list_legacy && PayloadEquals(payload, RMI_RESP_OK)) {
+        // The entries follow as DATA chunks with the same id.
+        request->awaiting_body = true;
+        request->deadline = std::chrono::steady_clock::now() +
+                            std::chrono::milliseconds(kScreencapTimeoutMs);
+        return true;
+      }
+      if (message.list_binary && PayloadEquals(payload, "ERR unknown command")) {
+        // Servers before LIST2 still list names and sizes.
+        message.list_binary = false;
+        setListCursor(&message, 0);
+        queueMessage(message);
+        return false;
+      }
+      if (!message.list_legacy && is_error) {
+        // Servers before paging only take the bare path.
+        message.list_legacy = true;
+        setListCursor(&message, 0);
+        queueMessage(message);
+        return false;
+      }
+      storeFileList(message, payload, true, true, nullptr);
+      return false;
+    case ResponseType::Download: {
+      const bool to_file = !message.download_local_path.empty();
+      DownloadFile& file = request->download_file;
+      if (PayloadStartsWith(payload, RMI_RESP_OK " ") &&
+          (!to_file || acceptDownloadReply(message, &file, PayloadToString(payload)))) {
+        // `OK <length> ...`; the range follows as DATA chunks with the same id.
+        const std::string size_text =
+            PayloadToString(payload).substr(std::strlen(RMI_RESP_OK " "));
+        request->awaiting_body = true;
+        request->body_size = std::strtoull(size_text.c_str(), nullptr, 10);
+        if (!to_file && request->body_size <= std::numeric_limits<size_t>::max()) {
+          request->body.reserve(static_cast<size_t>(request->body_size));
+        }
+        request->deadline = std::chrono::steady_clock::now() +
+                            std::chrono::milliseconds(kScreencapTimeoutMs);
+        setDownloadProgress(message.download_path, file.offset,
+                            file.offset + request->body_size, true);
+        return true;
+      }
+      if (to_file) {
+        // A resume offset past the end means the file shrank; start over.
+        file.discard = is_error && file.offset > 0;
+        finishDownloadFile(message, &file, false);
+        if (file.discard) {
+          queueMessage(message);
+          return false;
+        }
+      }
+      storeDownloadResult(message.download_path, {},
+                          is_error ? PayloadToString(payload)
+                                   : "Unexpected response: " + PayloadToString(payload));
+      return false;
+    }
+    case ResponseType::DownloadTree:
+      if (PayloadEquals(payload, RMI_RESP_OK)) {
+        // The archive follows as DATA chunks with the same id.
+        request->awaiting_body = true;
+        request->deadline = std::chrono::steady_clock::now() +
+                            std::chrono::milliseconds(kScreencapTimeoutMs);
+        setDownloadProgress(message.download_path, 0, 0, true);
+        return true;
+      }
+      finishTreeDownload(request->tree.get(), false);
+      storeDownloadResult(message.download_path, {},
+                          is_error ? PayloadToString(payload)
+                                   : "Unexpected response: " + PayloadToString(payload));
+      return false;
+    case ResponseType::UploadTree:
+      // Also ends the archive stream when the server refused it early.
+      storeTreeUploadResult(message.upload_remote_path, payload,
+                            is_error ? PayloadToString(payload) : std::string());
+      return false;
+    case ResponseType::BlockSums:
+      if (is_error) {
+        OutboundMessage upload = message;
+        upload.response = ResponseType::None;
+        upload.upload_full = true;
+        queueMessage(upload);
+      } else {
+        // Diffing reads the whole local file; the network thread moves on.
+        queueUploadDelta(message, std::move(payload));
+      }
+      return false;
+    case ResponseType::Raw: {
+      const std::string text = PayloadToString(payload);
+      if (is_error) {
+        setError(text);
+      }
+      if (message.raw_response) {
+        std::lock_guard<std::mutex> lock(message.raw_response->mutex);
+        message.raw_response->payload = text;
+        message.raw_response->error = is_error ? text : std::string();
+        message.raw_response->ok = !is_error;
+        message.raw_response->done = true;
+        message.raw_response->cv.notify_one();
+      }
+      return false;
+    }
+    case ResponseType::Ok:
+    case ResponseType::None:
+      break;
+  }
+  if (message.upload_delta && is_error) {
+    // The file changed since BLOCKSUMS, or the delta did not check out.
+    OutboundMessage upload = message;
+    upload.upload_delta.reset();
+    upload.upload_full = true;
+    queueMessage(upload);
+    return false;
+  }
+  if (message.stream_fps == 0 ||
+      (message.stream_fps > 0 && !PayloadEquals(payload, RMI_RESP_OK))) {
+    stream_active_ = false;
+  }
+  if (PayloadEquals(payload, RMI_RESP_OK)) {
+    if (message.disconnect_after_ok) {
+      *disconnect = true;
+    } else if (message.is_upload && message.restart_after_upload) {
+      OutboundMessage restart;
+      restart.message = RMI_CMD_RESTART;
+      restart.op = RMI_OP_RESTART;
+      restart.response = ResponseType::Ok;
+      restart.disconnect_after_ok = true;
+      queueMessage(restart);
+    }
+  } else if (is_error) {
+    setError(PayloadToString(payload));
+  } else {
+    setError("Unexpected response: " + PayloadToString(payload));
+  }
+  return false;
+}
+
+// Protocol v2 keeps up to kMaxRequestsInFlight requests outstanding and
+// matches replies to them by id, so a slow screencap or download no longer
+// holds up key presses queued behind it.
+void RmiClient::workerLoopV2(net::TcpConnection& connection) {
+  std::unordered_map<uint32_t, PendingRequest> pending;
+  std::vector<uint8_t> rx;
+  std::vector<uint8_t> chunk(kV2ReadChunkBytes);
+  uint32_t next_id = 1;
+  std::string error;
+  auto last_send = std::chrono::steady_clock::now();
+  auto last_receive = last_send;
+
+  auto fail_all = [&](const std::string& reason) {
+    for (auto& entry : pending) {
+      failRequest(&entry.second, reason);
+    }
+    pending.clear();
+    setError(reason);
+    setStatus(ClientStatus::Error);
+  };
+
+  while (!stop_) {
+    std::vector<OutboundMessage> batch;
+    {
+      std::unique_lock<std::mutex> lock(outbox_mutex_);
+      const bool idle = pending.empty() && !stream_active_;
+      outbox_cv_.wait_for(lock, std::chrono::milliseconds(idle ? 100 : 0), [this]() {
+        return stop_.load() || !outbox_.empty();
+      });
+      if (stop_) {
+        break;
+      }
+      while (!outbox_.empty() && pending.size() + batch.size() < kMaxRequestsInFlight) {
+        batch.push_back(std::move(outbox_.front()));
+        outbox_.pop();
+      }
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (batch.empty() && pending.empty() &&
+        now - last_send >= std::chrono::milliseconds(kHeartbeatIntervalMs)) {
+      OutboundMessage heartbeat;
+      heartbeat.op = RMI_OP_HEARTBEAT;
+      heartbeat.response = ResponseType::Ok;
+      heartbeat.response_timeout_ms = kHeartbeatTimeoutMs;
+      batch.push_back(std::move(heartbeat));
+    }
+    for (OutboundMessage& message : batch) {
+      const uint32_t id = next_id++;
+      if (next_id == 0) {
+        next_id = 1;
+      }
+      PendingRequest request;
+      request.message = std::move(message);
+      if (!sendRequest(connection, id, &request, &error)) {
+        failRequest(&request, error);
+        fail_all(error);
+        return;
+      }
+      last_send = std::chrono::steady_clock::now();
+      if (request.message.response == ResponseType::None) {
+        continue;
+      }
+      const OutboundMessage& sent = request.message;
+      int timeout = kAuthTimeoutMs;
+      if (sent.response_timeout_ms > 0) {
+        timeout = sent.response_timeout_ms;
+      } else if (sent.response == ResponseType::Raw && sent.raw_timeout_ms > 0) {
+        timeout = sent.raw_timeout_ms;
+      } else if (sent.response == ResponseType::Screencap ||
+                 sent.response == ResponseType::ScreencapRaw ||
+                 sent.response == ResponseType::BlockSums) {
+        timeout = kScreencapTimeoutMs;
+      }
+      request.deadline = last_send + std::chrono::milliseconds(timeout);
+      pending.emplace(id, std::move(request));
+    }
+
+    // Bulk goes out one chunk per stream per pass, after anything newly
+    // queued, so interactive requests never wait behind an upload.
+    bool bulk_ready = false;
+    for (auto& entry : pending) {
+      PendingRequest& request = entry.second;
+      if (!request.upload_pending || request.upload_credit == 0) {
+        continue;
+      }
+      if (!sendUploadChunk(connection, entry.first, &request, &error)) {
+        fail_all(error);
+        return;
+      }
+      last_send = std::chrono::steady_clock::now();
+      request.deadline = last_send + std::chrono::milliseconds(kScreencapTimeoutMs);
+      bulk_ready = bulk_ready || (request.upload_pending && request.upload_credit > 0);
+    }
+
+    const bool waiting = !pending.empty() || stream_active_;
+    size_t received = 0;
+    const auto status = connection.receive(chunk.data(), chunk.size(), &received,
+                                           waiting && !bulk_ready ? kStreamPollMs : 0,
+                                           &error);
+    if (status == net::TcpConnection::ReceiveStatus::Closed) {
+      fail_all("Connection closed by server.");
+      return;
+    }
+    if (status == net::TcpConnection::ReceiveStatus::Error) {
+      fail_all(error);
+      return;
+    }
+    if (received > 0) {
+      rx.insert(rx.end(), chunk.begin(), chunk.begin() + received);
+      last_receive = std::chrono::steady_clock::now();
+    }
+
+    size_t offset = 0;
+    bool disconnect = false;
+    while (rx.size() - offset >= RMI_FRAME_HEADER_SIZE + RMI_V2_HEADER_SIZE) {
+      const uint8_t* frame = rx.data() + offset;
+      const uint32_t length = ReadBe32(frame);
+      if (length < RMI_V2_HEADER_SIZE) {
+        fail_all("Malformed frame from server.");
+        return;
+      }
+      if (rx.size() - offset - RMI_FRAME_HEADER_SIZE < length) {
+        rx.reserve(offset + RMI_FRAME_HEADER_SIZE + length);
+        break;
+      }
+      const uint32_t id = ReadBe32(frame + RMI_FRAME_HEADER_SIZE);
+      const uint8_t op = frame[RMI_FRAME_HEADER_SIZE + 4];
+      const uint8_t flags = frame[RMI_FRAME_HEADER_SIZE + 5];
+      const uint8_t* body = frame + RMI_FRAME_HEADER_SIZE + RMI_V2_HEADER_SIZE;
+      const size_t body_size = length - RMI_V2_HEADER_SIZE;
+      offset += RMI_FRAME_HEADER_SIZE + length;
+      auto it = pending.find(id);
+      if (op == RMI_OP_WINDOW) {
+        if (it != pending.end() && it->second.upload_pending && body_size == 4) {
+          const uint32_t add = ReadBe32(body);
+          uint32_t& credit = it->second.upload_credit;
+          credit = add > std::numeric_limits<uint32_t>::max() - credit
+              ? std::numeric_limits<uint32_t>::max()
+              : credit + add;
+        }
+        continue;
+      }
+      if (op == RMI_OP_DATA) {
+        if (it == pending.end() || !it->second.awaiting_body) {
+          continue;
+        }
+        bool done = false;
+        const ResponseType response = it->second.message.response;
+        const bool ok = response == ResponseType::List
+            ? handleListChunk(connection, id, &it->second, flags, body, body_size,
+                              &done, &error)
+            : response == ResponseType::DownloadTree
+            ? handleTreeChunk(connection, id, &it->second, flags, body, body_size,
+                              &done, &error)
+            : handleDownloadChunk(connection, id, &it->second, flags, body, body_size,
+                                  &done, &error);
+        if (!ok) {
+          fail_all(error);
+          return;
+        }
+        if (done) {
+          pending.erase(it);
+        }
+        continue;
+      }
+      std::vector<uint8_t> payload(body, body + body_size);
+      if (flags & RMI_V2_FLAG_COMPRESSED) {
+        // A block cannot expand more than 255-fold; anything larger is corrupt.
+        const size_t unpacked_size = rmi_lz_unpacked_size(body, body_size);
+        payload.assign(unpacked_size / 255 <= body_size ? unpacked_size : 0, 0);
+        size_t unpacked = 0;
+        if (rmi_lz_unpack(body, body_size, payload.data(), payload.size(), &unpacked) != 0) {
+          const std::string bad = "ERR compressed reply";
+          payload.assign(bad.begin(), bad.end());
+        }
+      }
+      if (id == 0) {
+        // Unsolicited: heartbeats and SCREENSTREAM frames.
+        if (stream_active_ && IsStreamFrame(payload)) {
+          applyStreamFrame(payload);
+        }
+        continue;
+      }
+      if (it == pending.end()) {
+        continue;
+      }
+      if (!handleReply(&it->second, std::move(payload), &disconnect)) {
+        pending.erase(it);
+      }
+      if (disconnect) {
+        break;
+      }
+    }
+    rx.erase(rx.begin(), rx.begin() + offset);
+    if (disconnect) {
+      for (auto& entry : pending) {
+        failRequest(&entry.second, "Disconnected.");
+      }
+      setStatus(ClientStatus::Disconnected);
+      stop_ = true;
+      break;
+    }
+
+    // Replies queue behind a body still being received, so a request only
+    // times out once the connection has gone quiet as well.
+    const auto checked = std::chrono::steady_clock::now();
+    if (checked - last_receive < std::chrono::milliseconds(kReadStepTimeoutMs)) {
+      continue;
+    }
+    for (auto& entry : pending) {
+      if (checked >= entry.second.deadline) {
+        fail_all("Timed out waiting for server response.");
+        return;
+      }
+    }
+  }
+
+  for (auto& entry : pending) {
+    failRequest(&entry.second, "Operation cancelled.");
+  }
+}
+
+void RmiClient::queueMessage(const OutboundMessage& message) {
+  {
+    std::lock_guard<std::mutex> lock(outbox_mutex_);
+    outbox_.push(message);
+  }
+  outbox_cv_.notify_one();
+}
+
+void RmiClient::setStatus(ClientStatus status) {
+  status_.store(status);
+}
+
+void RmiClient::setError(const std::string& error) {
+  std::lock_guard<std::mutex> lock(error_mutex_);
+  last_error_ = error;
+}
+
+void RmiClient::clearError() {
+  std::lock_guard<std::mutex> lock(error_mutex_);
+  last_error_.clear();
+}
+
+void RmiClient::setLastScreencapPath(const std::string& path) {
+  std::lock_guard<std::mutex> lock(screencap_mutex_);
+  last_screencap_path_ = path;
+}
+
+void RmiClient::setScreencapData(std::vector<uint8_t> png,
+                                 std::vector<uint8_t> pixels,
+                                 int width,
+                                 int height) {
+  std::lock_guard<std::mutex> lock(screencap_mutex_);
+  last_screencap_png_ = std::move(png);
+  last_screencap_pixels_ = std::move(pixels);
+  last_screencap_width_ = width;
+  last_screencap_height_ = height;
+  last_screencap_path_.clear();
+  ++last_screencap_version_;
+}
+
+void RmiClient::setVersionInfo(int64_t version) {
+  std::lock_guard<std::mutex> lock(version_mutex_);
+  last_version_ = version;
+  has_version_ = true;
+}
+
+void RmiClient::setVersionStatus(const std::string& status) {
+  std::lock_guard<std::mutex> lock(version_mutex_);
+  version_status_ = status;
+}
+
+void RmiClient::storeFileList(const OutboundMessage& message,
+                              const std::vector<uint8_t>& payload,
+                              bool first,
+                              bool complete,
+                              uint64_t* next) {
+  std::vector<FileEntry> entries;
+  std::string list_error;
+  uint64_t cursor = 0;
+  const bool ok = message.list_binary
+      ? parseFileList2Payload(payload, &entries, &cursor, &list_error)
+      : parseFileListPayload(payload, &entries, &cursor, &list_error);
+  std::lock_guard<std::mutex> lock(file_mutex_);
+  FileListResult& result = file_lists_[message.list_path];
+  if (result.request != message.list_request) {
+    // A newer LIST for this path is under way.
+    return;
+  }
+  if (!ok) {
+    result.entries.clear();
+    result.error = list_error.empty() ? "Failed to parse file list." : list_error;
+    cursor = 0;
+  } else if (first) {
+    result.entries = std::move(entries);
+    result.error.clear();
+  } else {
+    result.entries.insert(result.entries.end(),
+                          std::make_move_iterator(entries.begin()),
+                          std::make_move_iterator(entries.end()));
+  }
+  result.complete = complete && cursor == 0;
+  ++result.version;
+  if (next) {
+    *next = cursor;
+  }
+}
+
+// An empty `error` means `data` holds the whole file.
+void RmiClient::storeDownloadResult(const std::string& path,
+                                    std::vector<uint8_t> data,
+                                    const std::string& error) {
+  std::lock_guard<std::mutex> lock(file_mutex_);
+  DownloadResult& result = downloads_[path];
+  result.data = std::move(data);
+  result.error = error;
+  if (!error.empty()) {
+    result.data.clear();
+  }
+  result.total = result.data.size();
+  result.received = result.total;
+  result.in_progress = false;
+  ++result.version;
+}
+
+void RmiClient::setTreeUploadProgress(const std::string& remote_dir, uint64_t sent) {
+  std::lock_guard<std::mutex> lock(file_mutex_);
+  tree_uploads_[remote_dir].sent = sent;
+}
+
+// Keeps the server's summary: "OK <written> <failed> <skipped>", then one
+// line per entry.
+void RmiClient::storeTreeUploadResult(const std::string& remote_dir,
+                                      const std::vector<uint8_t>& reply,
+                                      const std::string& error) {
+  std::lock_guard<std::mutex> lock(file_mutex_);
+  TreeUploadResult& result = tree_uploads_[remote_dir];
+  result.in_progress = false;
+  result.written = 0;
+  result.failed = 0;
+  result.skipped = 0;
+  result.entries.clear();
+  result.error = error;
+  ++result.version;
+  if (!error.empty()) {
+    return;
+  }
+  std::istringstream in(PayloadToString(reply));
+  std::string line;
+  std::getline(in, line);
+  std::istringstream head(line);
+  std::string status;
+  head >> status >> result.written >> result.failed >> result.skipped;
+  if (status != RMI_RESP_OK || head.fail()) {
+    result.error = "Unexpected response: " + line;
+    return;
+  }
+  while (std::getline(in, line)) {
+    if (!line.empty()) {
+      result.entries.push_back(line);
+    }
+  }
+}
+
+void RmiClient::setDownloadProgress(const std::string& path,
+                                    uint64_t received,
+                                    uint64_t total,
+                                    bool in_progress) {
+  if (path.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(file_mutex_);
+  DownloadResult& result = downloads_[path];
+  result.received = received;
+  result.total = total;
+  result.in_progress = in_progress;
+}
+
+bool RmiClient::parseVersionPayload(const std::vector<uint8_t>& payload,
+                                    int64_t* version,
+                                    std::string* error) const {
+  if (PayloadStartsWith(payload, RMI_RESP_ERR_PREFIX)) {
+    if (error) {
+      *error = PayloadToString(payload);
+    }
+    return false;
+  }
+  const std::string text = PayloadToString(payload);
+  const std::string prefix = RMI_RESP_VERSION_PREFIX;
+  if (text.size() <= prefix.size() || text.compare(0, prefix.size(), prefix) != 0) {
+    if (error) {
+      *error = "Unexpected VERSION response: " + text;
+    }
+    return false;
+  }
+  const std::string number_text = text.substr(prefix.size());
+  try {
+    size_t idx = 0;
+    long long parsed = std::stoll(number_text, &idx, 10);
+    if (idx != number_text.size() || parsed < 0) {
+      if (error) {
+        *error = "Invalid version number: " + number_text;
+      }
+      return false;
+    }
+    if (version) {
+      *version = parsed;
+    }
+    return true;
+  } catch (const std::exception&) {
+    if (error) {
+      *error = "Invalid version number: " + number_text;
+    }
+    return false;
+  }
+}
+
+bool RmiClient::parseFileListPayload(const std::vector<uint8_t>& payload,
+                                     std::vector<FileEntry>* entries,
+                                     uint64_t* next,
+                                     std::string* error) const {
+  if (PayloadStartsWith(payload, RMI_RESP_ERR_PREFIX)) {
+    if (error) {
       *error = PayloadToString(payload);
     }
     return false;
@@ -971,6 +2784,9 @@ bool RmiClient::parseFileListPayload(const std::vector<uint8_t>& payload,
     return false;
   }
   entries->clear();
+  if (next) {
+    *next = 0;
+  }
   const std::string text = PayloadToString(payload);
   std::istringstream stream(text);
   std::string line;
@@ -984,6 +2800,13 @@ bool RmiClient::parseFileListPayload(const std::vector<uint8_t>& payload,
       }
       return false;
     }
+    if (line[0] == 'N') {
+      // `N\t<offset>` ends a page that has more entries after it.
+      if (next) {
+        *next = std::strtoull(line.c_str() + 2, nullptr, 10);
+      }
+      continue;
+    }
     FileEntry entry;
     if (line[0] == 'D') {
       entry.is_dir = true;
@@ -1008,119 +2831,919 @@ bool RmiClient::parseFileListPayload(const std::vector<uint8_t>& payload,
         return false;
       }
     } else {
-      if (error) {
-        *error = "Unknown list entry type.";
+      if (error) {
+        *error = "Unknown list entry type.";
+      }
+      return false;
+    }
+    if (entry.name.empty()) {
+      continue;
+    }
+    entries->push_back(std::move(entry));
+  }
+  return true;
+}
+
+bool RmiClient::parseFileList2Payload(const std::vector<uint8_t>& payload,
+                                      std::vector<FileEntry>* entries,
+                                      uint64_t* next,
+                                      std::string* error) const {
+  if (PayloadStartsWith(payload, RMI_RESP_ERR_PREFIX)) {
+    if (error) {
+      *error = PayloadToString(payload);
+    }
+    return false;
+  }
+  if (!entries) {
+    return false;
+  }
+  entries->clear();
+  if (next) {
+    *next = 0;
+  }
+  size_t offset = 0;
+  while (offset < payload.size()) {
+    const uint8_t* record = payload.data() + offset;
+    const size_t available = payload.size() - offset;
+    const size_t length = available >= RMI_LIST2_RECORD_HEADER_SIZE
+        ? rmi_read_be16(record)
+        : 0;
+    if (length < RMI_LIST2_RECORD_HEADER_SIZE || length > available) {
+      if (error) {
+        *error = "Malformed list record.";
+      }
+      return false;
+    }
+    offset += length;
+    const uint8_t type = record[2];
+    if (type == RMI_LIST2_TYPE_NEXT) {
+      if (next) {
+        *next = rmi_read_be64(record + 8);
+      }
+      continue;
+    }
+    FileEntry entry;
+    entry.name.assign(reinterpret_cast<const char*>(record) + RMI_LIST2_RECORD_HEADER_SIZE,
+                      length - RMI_LIST2_RECORD_HEADER_SIZE);
+    if (entry.name.empty()) {
+      continue;
+    }
+    entry.is_dir = type == RMI_LIST2_TYPE_DIR;
+    entry.mode = rmi_read_be32(record + 4);
+    entry.size = entry.is_dir ? 0 : rmi_read_be64(record + 8);
+    entry.mtime_ns = rmi_read_be64(record + 16);
+    entry.inode = rmi_read_be64(record + 24);
+    entries->push_back(std::move(entry));
+  }
+  return true;
+}
+
+bool RmiClient::sendFrame(net::TcpConnection& connection,
+                          const std::string& payload,
+                          std::string* error) {
+  if (payload.size() > std::numeric_limits<uint32_t>::max()) {
+    if (error) {
+      *error = "Payload too large to send.";
+    }
+    return false;
+  }
+  const uint32_t length = static_cast<uint32_t>(payload.size());
+  std::string framed;
+  framed.resize(RMI_FRAME_HEADER_SIZE);
+  rmi_write_be32(reinterpret_cast<uint8_t*>(&framed[0]), length);
+  framed += payload;
+  return connection.sendAll(framed, error);
+}
+
+bool RmiClient::sendFrameBytes(net::TcpConnection& connection,
+                               const uint8_t* data,
+                               size_t size,
+                               std::string* error) {
+  if (size > std::numeric_limits<uint32_t>::max()) {
+    if (error) {
+      *error = "Payload too large to send.";
+    }
+    return false;
+  }
+  std::string header;
+  header.resize(RMI_FRAME_HEADER_SIZE);
+  const uint32_t length = static_cast<uint32_t>(size);
+  rmi_write_be32(reinterpret_cast<uint8_t*>(&header[0]), length);
+  if (!connection.sendAll(header, error)) {
+    return false;
+  }
+  if (size == 0) {
+    return true;
+  }
+  std::string payload(reinterpret_cast<const char*>(data), size);
+  return connection.sendAll(payload, error);
+}
+
+// Sends `size` bytes of `in` as one v1 frame, a buffer at a time.
+bool RmiClient::sendFileFrame(net::TcpConnection& connection,
+                              std::ifstream& in,
+                              uint64_t size,
+                              std::string* error) {
+  if (size > std::numeric_limits<uint32_t>::max()) {
+    if (error) {
+      *error = "Payload too large to send.";
+    }
+    return false;
+  }
+  std::string chunk;
+  chunk.resize(RMI_FRAME_HEADER_SIZE);
+  rmi_write_be32(reinterpret_cast<uint8_t*>(&chunk[0]), static_cast<uint32_t>(size));
+  if (!connection.sendAll(chunk, error)) {
+    return false;
+  }
+  uint64_t sent = 0;
+  while (sent < size) {
+    chunk.resize(static_cast<size_t>(std::min<uint64_t>(size - sent, kV2ReadChunkBytes)));
+    in.read(&chunk[0], static_cast<std::streamsize>(chunk.size()));
+    if (!in.good()) {
+      // The frame length is already on the wire, so the connection is lost.
+      if (error) {
+        *error = "Failed to read upload file.";
+      }
+      return false;
+    }
+    if (!connection.sendAll(chunk, error)) {
+      return false;
+    }
+    sent += chunk.size();
+  }
+  return true;
+}
+
+bool RmiClient::openUploadFile(const std::string& path,
+                               std::ifstream* in,
+                               uint64_t* size,
+                               std::string* error) const {
+  std::error_code fs_error;
+  const std::filesystem::path file_path(path);
+  if (!std::filesystem::exists(file_path, fs_error)) {
+    if (error) {
+      *error = "Upload file not found.";
+    }
+    return false;
+  }
+  const auto file_size = std::filesystem::file_size(file_path, fs_error);
+  if (fs_error) {
+    if (error) {
+      *error = "Unable to determine upload file size.";
+    }
+    return false;
+  }
+  in->open(file_path, std::ios::binary);
+  if (!*in) {
+    if (error) {
+      *error = "Unable to open upload file.";
+    }
+    return false;
+  }
+  *size = static_cast<uint64_t>(file_size);
+  return true;
+}
+
+bool RmiClient::buildUploadDelta(const std::string& local_path,
+                                 const std::vector<uint8_t>& sums,
+                                 std::shared_ptr<const UploadDelta>* delta,
+                                 uint64_t* size) const {
+  if (sums.size() < RMI_BLOCKSUMS_HEADER_SIZE) {
+    return false;
+  }
+  const uint32_t block = ReadBe32(sums.data());
+  const uint32_t count = ReadBe32(sums.data() + 4);
+  const uint64_t remote_size = rmi_read_be64(sums.data() + 8);
+  const uint64_t remote_mtime = rmi_read_be64(sums.data() + 16);
+  if (block < RMI_DELTA_BLOCK_MIN || block > RMI_DELTA_BLOCK_MAX ||
+      count != (remote_size + block - 1) / block ||
+      sums.size() != RMI_BLOCKSUMS_HEADER_SIZE +
+                         static_cast<size_t>(count) * RMI_BLOCKSUMS_ENTRY_SIZE) {
+    return false;
+  }
+  std::ifstream in;
+  uint64_t file_size = 0;
+  if (!openUploadFile(local_path, &in, &file_size, nullptr) ||
+      file_size <= RMI_DELTA_HEADER_SIZE) {
+    return false;
+  }
+  std::error_code fs_error;
+  const std::filesystem::path dir = std::filesystem::temp_directory_path(fs_error);
+  if (fs_error) {
+    return false;
+  }
+  std::random_device random;
+  auto spool = std::make_shared<UploadDelta>();
+  spool->path = dir / ("rmi-delta-" + std::to_string(random()) + "-" +
+                       std::to_string(random()) + ".tmp");
+  std::ofstream out(spool->path, std::ios::binary | std::ios::trunc);
+  uint8_t header[RMI_DELTA_HEADER_SIZE] = {};
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  DeltaWindow window(in, file_size);
+  if (!out ||
+      !WriteDeltaOps(&window, file_size, block, remote_size,
+                     sums.data() + RMI_BLOCKSUMS_HEADER_SIZE, count,
+                     file_size - RMI_DELTA_HEADER_SIZE, stop_, out)) {
+    return false;
+  }
+  spool->size = static_cast<uint64_t>(out.tellp());
+  // The whole-file hash is only known once the ops are written.
+  rmi_write_be32(header, block);
+  rmi_write_be64(header + 4, remote_size);
+  rmi_write_be64(header + 12, remote_mtime);
+  rmi_write_be64(header + 20, window.hash());
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  out.close();
+  if (!out) {
+    return false;
+  }
+  *delta = std::move(spool);
+  *size = file_size;
+  return true;
+}
+
+void RmiClient::queueUploadDelta(const OutboundMessage& message, std::vector<uint8_t> sums) {
+  std::lock_guard<std::mutex> lock(delta_mutex_);
+  delta_jobs_.emplace(message, std::move(sums));
+  if (!delta_running_) {
+    // A previous run has already left its loop.
+    joinDelta();
+    delta_running_ = true;
+    delta_ = std::thread(&RmiClient::deltaLoop, this);
+  }
+}
+
+void RmiClient::deltaLoop() {
+  while (true) {
+    std::pair<OutboundMessage, std::vector<uint8_t>> job;
+    {
+      std::lock_guard<std::mutex> lock(delta_mutex_);
+      if (delta_jobs_.empty() || stop_) {
+        delta_jobs_ = {};
+        delta_running_ = false;
+        return;
+      }
+      job = std::move(delta_jobs_.front());
+      delta_jobs_.pop();
+    }
+    // Sent again as a DELTA_UPLOAD, or whole if no delta can be had.
+    OutboundMessage& upload = job.first;
+    upload.response = ResponseType::None;
+    std::shared_ptr<const UploadDelta> delta;
+    if (buildUploadDelta(upload.upload_local_path, job.second, &delta,
+                         &upload.upload_delta_size)) {
+      upload.upload_delta = std::move(delta);
+    } else {
+      upload.upload_full = true;
+    }
+    if (!stop_) {
+      queueMessage(upload);
+    }
+  }
+}
+
+bool RmiClient::sendDeltaUploadV1(net::TcpConnection& connection,
+                                  const OutboundMessage& message,
+                                  bool* uploaded,
+                                  std::string* error) {
+  *uploaded = false;
+  std::ifstream in;
+  uint64_t local_size = 0;
+  if (!openUploadFile(message.upload_local_path, &in, &local_size, nullptr)) {
+    return true;
+  }
+  const std::string request = std::string(RMI_CMD_BLOCKSUMS) + " " +
+                              message.upload_remote_path + " " +
+                              std::to_string(rmi_delta_block_size(local_size));
+  std::vector<uint8_t> sums;
+  if (!sendFrame(connection, request, error) ||
+      !receiveFrameSkippingHeartbeats(connection, &sums, kScreencapTimeoutMs,
+                                      kMaxFrameBytes, error)) {
+    return false;
+  }
+  std::shared_ptr<const UploadDelta> delta;
+  uint64_t size = 0;
+  std::ifstream delta_in;
+  uint64_t delta_size = 0;
+  if (PayloadStartsWith(sums, RMI_RESP_ERR_PREFIX) ||
+      !buildUploadDelta(message.upload_local_path, sums, &delta, &size) ||
+      delta->size > kMaxUploadBytes ||
+      !openUploadFile(delta->path.string(), &delta_in, &delta_size, nullptr)) {
+    return true;
+  }
+  const std::string command = std::string(RMI_CMD_DELTA_UPLOAD) + " " +
+                              message.upload_remote_path + " " +
+                              std::to_string(size) + " " + std::to_string(delta_size);
+  std::vector<uint8_t> response;
+  if (!sendFrame(connection, command, error) ||
+      !sendFileFrame(connection, delta_in, delta_size, error) ||
+      !receiveFrameSkippingHeartbeats(connection, &response, kAuthTimeoutMs, 256, error)) {
+    return false;
+  }
+  *uploaded = PayloadEquals(response, RMI_RESP_OK);
+  return true;
+}
+
+// Builds the v1 command and v2 arguments for a DOWNLOAD request.
+void RmiClient::applyDownloadRange(OutboundMessage* message) const {
+  message->message = std::string(RMI_CMD_DOWNLOAD) + " " + message->download_path;
+  message->op = RMI_OP_DOWNLOAD;
+  message->compress = compress_.load();
+  message->args.assign(1, message->download_path);
+  if (message->download_ranged) {
+    message->message += " " + std::to_string(message->download_offset) + " " +
+                        std::to_string(message->download_length);
+    message->args.push_back(Be64Arg(message->download_offset));
+    message->args.push_back(Be64Arg(message->download_length));
+  }
+}
+
+// Opens `<local>.part` for a DOWNLOAD. When `<local>.part.meta` records the
+// remote size and mtime the part was fetched from, the request is turned
+// into a ranged one that continues where the part ends; otherwise the part
+// starts over. Ranged requests also make v1 servers report the identity.
+bool RmiClient::beginDownloadFile(OutboundMessage* message,
+                                  DownloadFile* file,
+                                  std::string* error) const {
+  const std::filesystem::path part(message->download_local_path + ".part");
+  const std::filesystem::path meta(message->download_local_path + ".part.meta");
+  std::error_code fs_error;
+  const uint64_t part_size = std::filesystem::file_size(part, fs_error);
+  std::ifstream meta_in(meta);
+  if (!fs_error && meta_in >> file->size >> file->mtime && part_size <= file->size) {
+    file->offset = part_size;
+    file->out.open(part, std::ios::binary | std::ios::app);
+  } else {
+    file->offset = 0;
+    file->size = 0;
+    file->mtime = 0;
+    std::filesystem::remove(meta, fs_error);
+    file->out.open(part, std::ios::binary | std::ios::trunc);
+  }
+  if (!file->out) {
+    if (error) {
+      *error = "Unable to open download file.";
+    }
+    return false;
+  }
+  file->discard = false;
+  message->download_ranged = true;
+  message->download_offset = file->offset;
+  message->download_length = 0;
+  applyDownloadRange(message);
+  return true;
+}
+
+// Checks `OK <length> <size> <mtime>` against the part being resumed and
+// records the identity for the next attempt. A mismatch marks the body for
+// discarding. Returns false when the reply cannot be parsed.
+bool RmiClient::acceptDownloadReply(const OutboundMessage& message,
+                                    DownloadFile* file,
+                                    const std::string& reply) const {
+  std::istringstream in(reply);
+  std::string ok;
+  uint64_t length = 0;
+  uint64_t size = 0;
+  uint64_t mtime = 0;
+  if (!(in >> ok >> length >> size >> mtime) || ok != RMI_RESP_OK) {
+    return false;
+  }
+  if (file->offset > 0 && (size != file->size || mtime != file->mtime)) {
+    file->discard = true;
+    file->out.close();
+    return true;
+  }
+  file->size = size;
+  file->mtime = mtime;
+  std::ofstream meta(message.download_local_path + ".part.meta", std::ios::trunc);
+  meta << size << " " << mtime << "\n";
+  return true;
+}
+
+// Closes the part file; a complete, matching body is moved to the local
+// path. Returns an error message or an empty string. A discarded part is
+// removed so the retry starts from scratch.
+std::string RmiClient::finishDownloadFile(const OutboundMessage& message,
+                                          DownloadFile* file,
+                                          bool complete) const {
+  const std::string part = message.download_local_path + ".part";
+  const std::string meta = part + ".meta";
+  std::error_code fs_error;
+  if (file->out.is_open()) {
+    file->out.close();
+    if (file->out.fail()) {
+      return "Failed to write download file.";
+    }
+  }
+  if (file->discard) {
+    std::filesystem::remove(part, fs_error);
+    std::filesystem::remove(meta, fs_error);
+    return std::string();
+  }
+  if (!complete) {
+    return std::string();
+  }
+  std::filesystem::rename(part, message.download_local_path, fs_error);
+  if (fs_error) {
+    return fs_error.message();
+  }
+  std::filesystem::remove(meta, fs_error);
+  return std::string();
+}
+
+bool RmiClient::beginTreeDownload(const OutboundMessage& message,
+                                  TreeDownload* tree,
+                                  std::string* error) const {
+  std::error_code fs_error;
+  tree->root = std::filesystem::path(message.download_local_path);
+  std::filesystem::create_directories(tree->root, fs_error);
+  if (!std::filesystem::is_directory(tree->root, fs_error)) {
+    if (error) {
+      *error = "Unable to create download directory.";
+    }
+    return false;
+  }
+  rmi_tar_reader_init(&tree->reader);
+  return true;
+}
+
+// Directories and files are created as their headers arrive and each body
+// is written straight through. Symlinks are recreated where the platform
+// allows; other entry types are skipped.
+bool RmiClient::unpackTreeChunk(TreeDownload* tree, const uint8_t* data, size_t size) const {
+  auto finish_file = [tree]() {
+    std::filesystem::path part = tree->out_path;
+    part += ".part";
+    std::error_code fs_error;
+    tree->out.close();
+    if (tree->out.fail()) {
+      tree->error = "Failed to write " + tree->out_path.string() + ".";
+      return;
+    }
+    std::filesystem::rename(part, tree->out_path, fs_error);
+    if (fs_error) {
+      tree->error = fs_error.message();
+      return;
+    }
+    std::filesystem::permissions(tree->out_path,
+                                 static_cast<std::filesystem::perms>(tree->out_mode & 0777),
+                                 fs_error);
+    SetFileMtime(tree->out_path, tree->out_mtime);
+    ++tree->files;
+  };
+
+  tree->received += size;
+  while (size > 0 && tree->error.empty() && !tree->ended) {
+    size_t used = 0;
+    const uint8_t* body = nullptr;
+    size_t body_size = 0;
+    const rmi_tar_event event =
+        rmi_tar_read(&tree->reader, data, size, &used, &body, &body_size);
+    data += used;
+    size -= used;
+    if (event == RMI_TAR_ERROR) {
+      tree->error = "Malformed archive from server.";
+    } else if (event == RMI_TAR_END) {
+      tree->ended = true;
+      // A directory comes before its entries, so backwards sets each one
+      // after everything inside it.
+      for (auto it = tree->dir_mtimes.rbegin(); it != tree->dir_mtimes.rend(); ++it) {
+        std::error_code fs_error;
+        if (std::filesystem::is_directory(std::filesystem::symlink_status(it->first, fs_error))) {
+          SetFileMtime(it->first, it->second);
+        }
+      }
+    } else if (event == RMI_TAR_DATA && tree->out.is_open()) {
+      tree->out.write(reinterpret_cast<const char*>(body), static_cast<std::streamsize>(body_size));
+      tree->out_left -= body_size;
+      if (tree->out_left == 0) {
+        finish_file();
+      }
+    } else if (event == RMI_TAR_ENTRY) {
+      const rmi_tar_entry& entry = tree->reader.entry;
+      std::filesystem::path path;
+      std::error_code fs_error;
+      if (!TreeEntryPath(tree->root, entry.path, &path)) {
+        tree->error = std::string("Unsafe path in archive: ") + entry.path;
+      } else if (entry.type == RMI_TAR_TYPE_DIR) {
+        std::filesystem::create_directories(path, fs_error);
+        if (fs_error) {
+          tree->error = "Unable to create " + path.string() + ".";
+        } else {
+          tree->dir_mtimes.emplace_back(path, entry.mtime);
+        }
+      } else if (entry.type == RMI_TAR_TYPE_SYMLINK) {
+        std::filesystem::remove(path, fs_error);
+        std::filesystem::create_symlink(entry.link, path, fs_error);
+      } else if (entry.type == RMI_TAR_TYPE_FILE) {
+        std::filesystem::path part = path;
+        part += ".part";
+        std::filesystem::create_directories(path.parent_path(), fs_error);
+        tree->out.open(part, std::ios::binary | std::ios::trunc);
+        tree->out_path = path;
+        tree->out_left = entry.size;
+        tree->out_mtime = entry.mtime;
+        tree->out_mode = entry.mode;
+        if (!tree->out) {
+          tree->error = "Unable to open " + path.string() + ".";
+        } else if (entry.size == 0) {
+          finish_file();
+        }
+      }
+    }
+  }
+  return tree->error.empty();
+}
+
+// Drops a file cut off mid-body. Returns an error message or an empty
+// string; an archive that stopped before its end marker counts as an error
+// only when `complete` says it should have been whole.
+std::string RmiClient::finishTreeDownload(TreeDownload* tree, bool complete) const {
+  if (tree->out.is_open()) {
+    std::filesystem::path part = tree->out_path;
+    part += ".part";
+    std::error_code fs_error;
+    tree->out.close();
+    std::filesystem::remove(part, fs_error);
+  }
+  if (!tree->error.empty()) {
+    return tree->error;
+  }
+  if (complete && !tree->ended) {
+    return "Archive ended early.";
+  }
+  return std::string();
+}
+
+bool RmiClient::beginTreeUpload(const OutboundMessage& message,
+                                TreeUpload* tree,
+                                std::string* error) const {
+  std::error_code fs_error;
+  tree->root = std::filesystem::absolute(message.upload_local_path, fs_error).lexically_normal();
+  if (!tree->root.has_filename()) {
+    tree->root = tree->root.parent_path();
+  }
+  if (fs_error || !tree->root.has_filename() ||
+      !std::filesystem::is_directory(tree->root, fs_error)) {
+    if (error) {
+      *error = "Upload tree source is not a directory.";
+    }
+    return false;
+  }
+  tree->base = tree->root.parent_path();
+  tree->walk = std::filesystem::recursive_directory_iterator(
+      tree->root, std::filesystem::directory_options::skip_permission_denied, fs_error);
+  if (fs_error) {
+    if (error) {
+      *error = "Unable to read " + tree->root.string() + ".";
+    }
+    return false;
+  }
+  return true;
+}
+
+// Regular files, directories and symlinks go into the archive, symlinks
+// as links. Anything that cannot be read when its turn comes is left out.
+bool RmiClient::queueTreeEntry(TreeUpload* tree) const {
+  for (;;) {
+    std::error_code fs_error;
+    std::filesystem::path path;
+    std::filesystem::file_status status;
+    if (!tree->started) {
+      tree->started = true;
+      path = tree->root;
+      status = std::filesystem::status(path, fs_error);
+    } else if (tree->walk == std::filesystem::recursive_directory_iterator()) {
+      return false;
+    } else {
+      path = tree->walk->path();
+      status = std::filesystem::symlink_status(path, fs_error);
+      std::error_code walk_error;
+      tree->walk.increment(walk_error);
+      if (walk_error) {
+        tree->walk = std::filesystem::recursive_directory_iterator();
+      }
+    }
+    if (fs_error) {
+      continue;
+    }
+    rmi_tar_entry& entry = tree->entry;
+    std::memset(&entry, 0, sizeof(entry));
+    std::string name = path.lexically_relative(tree->base).generic_string();
+    std::string link;
+    if (std::filesystem::is_symlink(status)) {
+      entry.type = RMI_TAR_TYPE_SYMLINK;
+      link = std::filesystem::read_symlink(path, fs_error).generic_string();
+    } else if (std::filesystem::is_directory(status)) {
+      entry.type = RMI_TAR_TYPE_DIR;
+      name += '/';
+    } else if (std::filesystem::is_regular_file(status)) {
+      entry.type = RMI_TAR_TYPE_FILE;
+      entry.size = std::filesystem::file_size(path, fs_error);
+    } else {
+      continue;
+    }
+    if (fs_error || name.size() >= sizeof(entry.path) || link.size() >= sizeof(entry.link)) {
+      continue;
+    }
+    if (entry.type == RMI_TAR_TYPE_FILE) {
+      tree->in.open(path, std::ios::binary);
+      if (!tree->in.is_open()) {
+        continue;
       }
-      return false;
     }
-    if (entry.name.empty()) {
+    std::memcpy(entry.path, name.data(), name.size());
+    std::memcpy(entry.link, link.data(), link.size());
+    ArchiveEntryStat(path, entry.type == RMI_TAR_TYPE_DIR, &entry.mode, &entry.mtime);
+    tree->pending.resize(RMI_TAR_HEADER_MAX);
+    const size_t header = rmi_tar_write_header(&entry, tree->pending.data(), tree->pending.size());
+    if (header == 0) {
+      tree->in.close();
       continue;
     }
-    entries->push_back(std::move(entry));
+    tree->pending.resize(header);
+    tree->pending_off = 0;
+    tree->body_left = entry.type == RMI_TAR_TYPE_FILE ? entry.size : 0;
+    tree->pad = entry.type == RMI_TAR_TYPE_FILE ? rmi_tar_padding(entry.size) : 0;
+    if (tree->body_left == 0) {
+      tree->in.close();
+    }
+    return true;
   }
-  return true;
 }
 
-bool RmiClient::sendFrame(net::TcpConnection& connection,
-                          const std::string& payload,
-                          std::string* error) {
-  if (payload.size() > std::numeric_limits<uint32_t>::max()) {
-    if (error) {
-      *error = "Payload too large to send.";
+size_t RmiClient::readTreeArchive(TreeUpload* tree, uint8_t* out, size_t cap) const {
+  size_t used = 0;
+  while (used < cap) {
+    if (tree->pending_off < tree->pending.size()) {
+      const size_t step = std::min(cap - used, tree->pending.size() - tree->pending_off);
+      std::memcpy(out + used, tree->pending.data() + tree->pending_off, step);
+      tree->pending_off += step;
+      used += step;
+      continue;
+    }
+    if (tree->body_left > 0) {
+      const size_t step = static_cast<size_t>(std::min<uint64_t>(cap - used, tree->body_left));
+      size_t got = 0;
+      if (tree->in.is_open()) {
+        tree->in.read(reinterpret_cast<char*>(out + used), static_cast<std::streamsize>(step));
+        got = static_cast<size_t>(tree->in.gcount());
+      }
+      if (got < step) {
+        // The file shrank or stopped reading; its header already set the size.
+        std::memset(out + used + got, 0, step - got);
+        tree->in.close();
+      }
+      used += step;
+      tree->body_left -= step;
+      if (tree->body_left == 0) {
+        tree->in.close();
+        tree->pending.assign(tree->pad, 0);
+        tree->pending_off = 0;
+      }
+      continue;
+    }
+    if (tree->done) {
+      break;
+    }
+    if (!queueTreeEntry(tree)) {
+      tree->pending.assign(2 * RMI_TAR_BLOCK, 0);
+      tree->pending_off = 0;
+      tree->done = true;
     }
-    return false;
   }
-  const uint32_t length = static_cast<uint32_t>(payload.size());
-  std::string framed;
-  framed.resize(RMI_FRAME_HEADER_SIZE);
-  rmi_write_be32(reinterpret_cast<uint8_t*>(&framed[0]), length);
-  framed += payload;
-  return connection.sendAll(framed, error);
+  tree->sent += used;
+  return used;
 }
 
-bool RmiClient::sendFrameBytes(net::TcpConnection& connection,
-                               const uint8_t* data,
-                               size_t size,
-                               std::string* error) {
-  if (size > std::numeric_limits<uint32_t>::max()) {
-    if (error) {
-      *error = "Payload too large to send.";
+// Runs one download to `local_path` over `connections` authenticated
+// connections of its own. The first range identifies the file and sizes
+// the `.part`; the rest are handed out to whichever connection is free and
+// written in place, so they may complete in any order.
+void RmiClient::parallelDownloadLoop(ClientConfig config,
+                                     std::string path,
+                                     std::string local_path,
+                                     int connections) {
+  const std::string part = local_path + ".part";
+  std::error_code fs_error;
+  std::filesystem::remove(part + ".meta", fs_error);
+
+  ParallelDownload job;
+  job.path = path;
+  job.stats.resize(1);
+  job.start = std::chrono::steady_clock::now();
+  std::string error;
+  net::TcpConnection connection;
+  if (!job.file.open(part)) {
+    error = "Unable to open download file.";
+  } else if (openConnection(connection, config, &error) &&
+             fetchRange(connection, &job, 0, 0, &error)) {
+    // An old server answers the first range with the whole file.
+    for (uint64_t offset = job.received; offset < job.size; offset += kParallelRangeBytes) {
+      job.ranges.push_back(offset);
+    }
+    const size_t extra = std::min(static_cast<size_t>(connections - 1), job.ranges.size());
+    {
+      std::lock_guard<std::mutex> lock(job.mutex);
+      job.stats.resize(extra + 1);
+    }
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < extra; ++i) {
+      workers.emplace_back(&RmiClient::parallelDownloadWorker, this, std::cref(config), &job,
+                           static_cast<int>(i + 1), nullptr);
+    }
+    parallelDownloadWorker(config, &job, 0, &connection);
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+    if (job.failed || !job.ranges.empty() || job.received != job.size) {
+      error = job.error.empty() ? "Download incomplete." : job.error;
     }
-    return false;
   }
-  std::string header;
-  header.resize(RMI_FRAME_HEADER_SIZE);
-  const uint32_t length = static_cast<uint32_t>(size);
-  rmi_write_be32(reinterpret_cast<uint8_t*>(&header[0]), length);
-  if (!connection.sendAll(header, error)) {
-    return false;
+  connection.close();
+
+  if (!job.file.close() && error.empty()) {
+    error = "Failed to write download file.";
   }
-  if (size == 0) {
-    return true;
+  if (error.empty()) {
+    std::filesystem::rename(part, local_path, fs_error);
+    if (fs_error) {
+      error = fs_error.message();
+    }
   }
-  std::string payload(reinterpret_cast<const char*>(data), size);
-  return connection.sendAll(payload, error);
+  if (!error.empty()) {
+    std::filesystem::remove(part, fs_error);
+  }
+  {
+    std::lock_guard<std::mutex> lock(file_mutex_);
+    downloads_[path].connections = job.stats;
+  }
+  storeDownloadResult(path, {}, error);
+  transfer_running_ = false;
 }
 
-bool RmiClient::loadUploadFile(const std::string& path,
-                               std::vector<uint8_t>* data,
-                               uint32_t* size,
-                               std::string* error) const {
-  if (!data) {
-    if (error) {
-      *error = "Upload buffer missing.";
+// Fetches ranges until none are left. Connection 0 is handed in already
+// open; the others connect first. A range that fails is put back so a
+// healthy connection can pick it up.
+void RmiClient::parallelDownloadWorker(const ClientConfig& config,
+                                       ParallelDownload* job,
+                                       int index,
+                                       net::TcpConnection* connection) {
+  net::TcpConnection own;
+  std::string error;
+  if (connection == nullptr) {
+    connection = &own;
+    if (!openConnection(own, config, &error)) {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      if (job->error.empty()) {
+        job->error = error;
+      }
+      return;
     }
-    return false;
   }
-  std::error_code fs_error;
-  const std::filesystem::path file_path(path);
-  if (!std::filesystem::exists(file_path, fs_error)) {
-    if (error) {
-      *error = "Upload file not found.";
+  while (!stop_) {
+    uint64_t offset = 0;
+    {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      if (job->failed || job->ranges.empty()) {
+        break;
+      }
+      offset = job->ranges.front();
+      job->ranges.pop_front();
+    }
+    if (!fetchRange(*connection, job, index, offset, &error)) {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      job->ranges.push_front(offset);
+      if (job->error.empty()) {
+        job->error = error;
+      }
+      break;
     }
-    return false;
   }
-  const auto file_size = std::filesystem::file_size(file_path, fs_error);
-  if (fs_error) {
+  {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    job->stats[static_cast<size_t>(index)].active = false;
+    setConnectionStats(job->path, index, job->stats[static_cast<size_t>(index)]);
+  }
+  own.close();
+}
+
+// Downloads one range with a v1 ranged DOWNLOAD and writes it at its
+// offset. Returns false when the connection is no longer usable or the
+// download cannot continue; the latter also sets `job->failed`.
+bool RmiClient::fetchRange(net::TcpConnection& connection,
+                           ParallelDownload* job,
+                           int index,
+                           uint64_t offset,
+                           std::string* error) {
+  auto fail = [&](const std::string& message) {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    job->failed = true;
+    job->error = message;
     if (error) {
-      *error = "Unable to determine upload file size.";
+      *error = message;
     }
     return false;
+  };
+
+  const std::string command = std::string(RMI_CMD_DOWNLOAD) + " " + job->path + " " +
+                              std::to_string(offset) + " " +
+                              std::to_string(kParallelRangeBytes);
+  std::vector<uint8_t> response;
+  if (!sendFrame(connection, command, error) ||
+      !receiveFrameSkippingHeartbeats(connection, &response, kScreencapTimeoutMs, 256, error)) {
+    return false;
   }
-  if (file_size > kMaxUploadBytes) {
-    if (error) {
-      *error = "Upload file exceeds size limit.";
-    }
+  if (PayloadStartsWith(response, RMI_RESP_ERR_PREFIX)) {
+    return fail(PayloadToString(response));
+  }
+  std::istringstream in(PayloadToString(response));
+  std::string ok;
+  uint64_t reply_length = 0;
+  uint64_t size = 0;
+  uint64_t mtime = 0;
+  // Servers without ranged DOWNLOAD answer a plain OK with the whole file.
+  const bool whole_file = !(in >> ok >> reply_length >> size >> mtime);
+  if (ok != RMI_RESP_OK || (whole_file && offset != 0)) {
+    return fail("Unexpected response: " + PayloadToString(response));
+  }
+  uint8_t length_bytes[RMI_FRAME_HEADER_SIZE];
+  if (!readExact(connection, length_bytes, sizeof(length_bytes), kScreencapTimeoutMs, error)) {
     return false;
   }
-  if (file_size > std::numeric_limits<uint32_t>::max()) {
-    if (error) {
-      *error = "Upload file too large.";
+  const uint64_t length = rmi_read_be32(length_bytes);
+  if (whole_file) {
+    size = length;
+  } else if (reply_length != length) {
+    return fail("Unexpected response: " + PayloadToString(response));
+  }
+  bool write_ok = false;
+  {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (!job->identified) {
+      job->identified = true;
+      job->size = size;
+      job->mtime = mtime;
+      if (!job->file.resize(size)) {
+        job->failed = true;
+        job->error = "Unable to allocate download file.";
+      }
+    } else if (size != job->size || mtime != job->mtime) {
+      job->failed = true;
+      job->error = "Remote file changed during download.";
     }
-    return false;
+    write_ok = !job->failed;
   }
-  std::ifstream in(file_path, std::ios::binary);
-  if (!in) {
-    if (error) {
-      *error = "Unable to open upload file.";
+
+  std::vector<uint8_t> buffer(static_cast<size_t>(std::min<uint64_t>(length, kParallelWriteBytes)));
+  uint64_t done = 0;
+  while (done < length) {
+    const size_t step = static_cast<size_t>(std::min<uint64_t>(length - done, buffer.size()));
+    if (!readExact(connection, buffer.data(), step, kScreencapTimeoutMs, error)) {
+      return false;
     }
-    return false;
+    // A failed job still drains the body to keep the connection in sync.
+    write_ok = write_ok && job->file.writeAt(offset + done, buffer.data(), step);
+    done += step;
+
+    std::lock_guard<std::mutex> lock(job->mutex);
+    ConnectionStats& stats = job->stats[static_cast<size_t>(index)];
+    stats.bytes += step;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - job->start)
+                        .count();
+    stats.active = true;
+    job->received += step;
+    setConnectionStats(job->path, index, stats);
+    setDownloadProgress(job->path, job->received, job->size, true);
   }
-  data->resize(static_cast<size_t>(file_size));
-  if (file_size > 0) {
-    in.read(reinterpret_cast<char*>(data->data()), static_cast<std::streamsize>(file_size));
-    if (!in.good()) {
+  {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (job->failed) {
       if (error) {
-        *error = "Failed to read upload file.";
+        *error = job->error;
       }
       return false;
     }
   }
-  if (size) {
-    *size = static_cast<uint32_t>(file_size);
+  if (!write_ok) {
+    return fail("Failed to write download file.");
   }
   return true;
 }
+
+void RmiClient::setConnectionStats(const std::string& path,
+                                   int index,
+                                   const ConnectionStats& stats) {
+  std::lock_guard<std::mutex> lock(file_mutex_);
+  std::vector<ConnectionStats>& connections = downloads_[path].connections;
+  if (connections.size() <= static_cast<size_t>(index)) {
+    connections.resize(static_cast<size_t>(index) + 1);
+  }
+  connections[static_cast<size_t>(index)] = stats;
+}
+
 bool RmiClient::readExact(net::TcpConnection& connection,
                           uint8_t* buffer,
                           size_t size,
@@ -1275,12 +3898,25 @@ bool RmiClient::receiveFrameSkippingHeartbeats(net::TcpConnection& connection,
     const auto remaining_ms =
         std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
     const int remaining_timeout = static_cast<int>(remaining_ms);
-    if (!receiveFrame(connection, payload, remaining_timeout, max_bytes, error)) {
+    // Stream frames interleave with replies and exceed small reply limits.
+    const bool streaming = stream_active_.load();
+    if (!receiveFrame(connection, payload, remaining_timeout,
+                      streaming ? kMaxFrameBytes : max_bytes, error)) {
       return false;
     }
     if (PayloadEquals(*payload, RMI_CMD_HEARTBEAT)) {
       continue;
     }
+    if (streaming && IsStreamFrame(*payload)) {
+      applyStreamFrame(*payload);
+      continue;
+    }
+    if (max_bytes > 0 && payload->size() > max_bytes) {
+      if (error) {
+        *error = "Frame size exceeds limit.";
+      }
+      return false;
+    }
     return true;
   }
   if (error) {
@@ -1294,6 +3930,7 @@ bool RmiClient::receiveFrameSkippingHeartbeatsWithProgress(net::TcpConnection& c
                                                            int timeout_ms,
                                                            size_t max_bytes,
                                                            const std::string& download_path,
+                                                           std::ofstream* sink,
                                                            std::string* error) {
   const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
   const size_t heartbeat_len = std::strlen(RMI_CMD_HEARTBEAT);
@@ -1321,7 +3958,7 @@ bool RmiClient::receiveFrameSkippingHeartbeatsWithProgress(net::TcpConnection& c
       setDownloadProgress(download_path, 0, 0, false);
       return false;
     }
-    payload->assign(length, 0);
+    payload->assign(sink != nullptr && length > heartbeat_len ? 0 : length, 0);
     if (length == 0) {
       setDownloadProgress(download_path, 0, 0, false);
       return true;
@@ -1349,6 +3986,27 @@ bool RmiClient::receiveFrameSkippingHeartbeatsWithProgress(net::TcpConnection& c
     }
     size_t received_total = 0;
     setDownloadProgress(download_path, 0, length, true);
+    if (sink != nullptr) {
+      // Write the body through a bounded buffer instead of holding it all;
+      // a closed sink drops it.
+      std::vector<uint8_t> buffer(kV2ReadChunkBytes);
+      uint64_t written = 0;
+      while (written < length) {
+        const size_t step = static_cast<size_t>(std::min<uint64_t>(length - written, buffer.size()));
+        if (!readExact(connection, buffer.data(), step, payload_timeout, error)) {
+          setDownloadProgress(download_path, written, length, false);
+          return false;
+        }
+        if (sink->is_open()) {
+          sink->write(reinterpret_cast<const char*>(buffer.data()),
+                      static_cast<std::streamsize>(step));
+        }
+        written += step;
+        setDownloadProgress(download_path, written, length, true);
+      }
+      setDownloadProgress(download_path, length, length, false);
+      return true;
+    }
     if (!readExactWithProgress(connection,
                                payload->data(),
                                payload->size(),
@@ -1368,6 +4026,54 @@ bool RmiClient::receiveFrameSkippingHeartbeatsWithProgress(net::TcpConnection& c
   return false;
 }
 
+// v1 DOWNLOAD_TREE: the archive follows the OK as frames of any size and
+// ends with an empty one. Frames are unpacked through a bounded buffer as
+// they are read; after a local failure the rest is still read to keep the
+// connection in step.
+bool RmiClient::receiveTreeArchive(net::TcpConnection& connection,
+                                   TreeDownload* tree,
+                                   const std::string& path,
+                                   std::string* error) {
+  std::vector<uint8_t> buffer(kV2ReadChunkBytes);
+  for (;;) {
+    uint8_t length_bytes[4] = {};
+    if (!readExact(connection, length_bytes, sizeof(length_bytes), kScreencapTimeoutMs, error)) {
+      return false;
+    }
+    uint64_t left = ReadBe32(length_bytes);
+    if (left == 0) {
+      return true;
+    }
+    while (left > 0) {
+      const size_t step = static_cast<size_t>(std::min<uint64_t>(left, buffer.size()));
+      if (!readExact(connection, buffer.data(), step, kScreencapTimeoutMs, error)) {
+        return false;
+      }
+      left -= step;
+      unpackTreeChunk(tree, buffer.data(), step);
+      setDownloadProgress(path, tree->received, 0, true);
+    }
+  }
+}
+
+bool RmiClient::sendTreeArchive(net::TcpConnection& connection,
+                                TreeUpload* tree,
+                                const std::string& remote_dir,
+                                std::vector<uint8_t>* reply,
+                                std::string* error) {
+  std::vector<uint8_t> buffer(kV2ReadChunkBytes);
+  size_t size = 0;
+  do {
+    size = readTreeArchive(tree, buffer.data(), buffer.size());
+    if (!sendFrameBytes(connection, buffer.data(), size, error)) {
+      return false;
+    }
+    setTreeUploadProgress(remote_dir, tree->sent);
+  } while (size > 0);
+  return receiveFrameSkippingHeartbeats(connection, reply, kScreencapTimeoutMs,
+                                        kMaxFrameBytes, error);
+}
+
 bool RmiClient::sendHeartbeat(net::TcpConnection& connection, std::string* error) {
   if (!sendFrame(connection, RMI_CMD_HEARTBEAT, error)) {
     return false;
@@ -1406,15 +4112,19 @@ bool RmiClient::receiveScreencap(net::TcpConnection& connection) {
     setError(error);
     return false;
   }
+  handleScreencapPayload(std::move(data));
+  return true;
+}
 
+void RmiClient::handleScreencapPayload(std::vector<uint8_t> data) {
   if (PayloadStartsWith(data, RMI_RESP_ERR_PREFIX)) {
     setError(PayloadToString(data));
-    return true;
+    return;
   }
   if (data.size() < sizeof(kPngSignature) ||
       std::memcmp(data.data(), kPngSignature, sizeof(kPngSignature)) != 0) {
     setError("Unexpected screencap payload (not a PNG).");
-    return true;
+    return;
   }
 
   int width = 0;
@@ -1427,16 +4137,16 @@ bool RmiClient::receiveScreencap(net::TcpConnection& connection) {
                              &channels)) {
     const char* reason = stbi_failure_reason();
     setError(reason ? reason : "Failed to parse PNG header.");
-    return true;
+    return;
   }
   if (width <= 0 || height <= 0) {
     setError("Invalid PNG dimensions.");
-    return true;
+    return;
   }
   const uint64_t pixel_count = static_cast<uint64_t>(width) * static_cast<uint64_t>(height);
   if (pixel_count > kMaxScreencapPixels) {
     setError("PNG dimensions exceed limit.");
-    return true;
+    return;
   }
   stbi_uc* decoded = stbi_load_from_memory(data.data(),
                                            static_cast<int>(data.size()),
@@ -1447,17 +4157,213 @@ bool RmiClient::receiveScreencap(net::TcpConnection& connection) {
   if (!decoded) {
     const char* reason = stbi_failure_reason();
     setError(reason ? reason : "Failed to decode PNG screencap.");
-    return true;
+    return;
   }
   std::vector<uint8_t> pixels(decoded, decoded + (width * height * 4));
   stbi_image_free(decoded);
 
   setScreencapData(std::move(data), std::move(pixels), width, height);
+}
+
+// SCREENCAP_RAW decodes straight into the RGBA buffer that
+// UpdateScreencapTexture() hands to SDL; there is no PNG to keep.
+bool RmiClient::receiveScreencapRaw(net::TcpConnection& connection) {
+  std::vector<uint8_t> data;
+  std::string error;
+  if (!receiveFrameSkippingHeartbeats(connection,
+                                      &data,
+                                      kScreencapTimeoutMs,
+                                      kMaxFrameBytes,
+                                      &error)) {
+    setError(error);
+    return false;
+  }
+  handleScreencapRawPayload(data);
+  return true;
+}
+
+void RmiClient::handleScreencapRawPayload(const std::vector<uint8_t>& data) {
+  if (PayloadStartsWith(data, RMI_RESP_ERR_PREFIX)) {
+    setError(PayloadToString(data));
+    return;
+  }
+  if (data.size() < RMI_RAW_HEADER_SIZE) {
+    setError("Raw screencap payload too short.");
+    return;
+  }
+  const uint32_t width = ReadBe32(data.data());
+  const uint32_t height = ReadBe32(data.data() + 4);
+  const uint8_t format = data[12];
+  const uint8_t codec = data[13];
+  if (width == 0 || height == 0 ||
+      static_cast<uint64_t>(width) * height > kMaxScreencapPixels) {
+    setError("Invalid raw screencap dimensions.");
+    return;
+  }
+  if (format != RMI_RAW_FORMAT_RGB888 || codec != RMI_RAW_CODEC_QOI) {
+    setError("Unsupported raw screencap encoding.");
+    return;
+  }
+
+  std::vector<uint8_t> pixels(static_cast<size_t>(width) * height * 4);
+  if (rmi_qoi_decode(data.data() + RMI_RAW_HEADER_SIZE,
+                     data.size() - RMI_RAW_HEADER_SIZE,
+                     width,
+                     height,
+                     pixels.data(),
+                     static_cast<size_t>(width) * 4) != 0) {
+    setError("Failed to decode raw screencap.");
+    return;
+  }
+
+  setScreencapData(std::vector<uint8_t>(),
+                   std::move(pixels),
+                   static_cast<int>(width),
+                   static_cast<int>(height));
+}
+
+// Drains stream frames that arrived while no command is in flight.
+bool RmiClient::pollStreamFrames(net::TcpConnection& connection,
+                                 int timeout_ms,
+                                 std::string* error) {
+  for (int i = 0; i < kStreamPollFrames && stream_active_; ++i) {
+    uint8_t length_bytes[4] = {};
+    size_t received = 0;
+    const auto status = connection.receive(length_bytes,
+                                           sizeof(length_bytes),
+                                           &received,
+                                           i == 0 ? timeout_ms : 0,
+                                           error);
+    if (status == net::TcpConnection::ReceiveStatus::Timeout) {
+      return true;
+    }
+    if (status == net::TcpConnection::ReceiveStatus::Closed) {
+      if (error) {
+        *error = "Connection closed by server.";
+      }
+      return false;
+    }
+    if (status == net::TcpConnection::ReceiveStatus::Error) {
+      return false;
+    }
+    if (received < sizeof(length_bytes) &&
+        !readExact(connection,
+                   length_bytes + received,
+                   sizeof(length_bytes) - received,
+                   kAuthTimeoutMs,
+                   error)) {
+      return false;
+    }
+    std::vector<uint8_t> payload(ReadBe32(length_bytes));
+    if (!payload.empty() &&
+        !readExact(connection, payload.data(), payload.size(), kScreencapTimeoutMs, error)) {
+      return false;
+    }
+    if (PayloadEquals(payload, RMI_CMD_HEARTBEAT)) {
+      continue;
+    }
+    if (!IsStreamFrame(payload)) {
+      setError("Unexpected frame while streaming: " + PayloadToString(payload));
+      continue;
+    }
+    applyStreamFrame(payload);
+  }
   return true;
 }
 
+void RmiClient::applyStreamFrame(const std::vector<uint8_t>& payload) {
+  const uint8_t* data = payload.data();
+  const uint8_t flags = data[18];
+  if (flags & RMI_STREAM_FLAG_END) {
+    stream_active_ = false;
+    setError("Screen stream stopped by server.");
+    return;
+  }
+  const uint32_t width = ReadBe32(data + 8);
+  const uint32_t height = ReadBe32(data + 12);
+  const uint32_t tiles = ReadBe32(data + 20);
+  if (data[19] != RMI_RAW_FORMAT_RGB888 || width == 0 || height == 0 ||
+      static_cast<uint64_t>(width) * height > kMaxScreencapPixels) {
+    setError("Unsupported screen stream frame.");
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(stream_mutex_);
+  if (flags & RMI_STREAM_FLAG_KEYFRAME) {
+    if (stream_width_ != static_cast<int>(width) ||
+        stream_height_ != static_cast<int>(height)) {
+      stream_pixels_.assign(static_cast<size_t>(width) * height * 4, 0);
+      stream_width_ = static_cast<int>(width);
+      stream_height_ = static_cast<int>(height);
+    }
+    stream_keyed_ = true;
+    stream_full_ = true;
+    stream_dirty_.clear();
+  } else if (!stream_keyed_ ||
+             stream_width_ != static_cast<int>(width) ||
+             stream_height_ != static_cast<int>(height)) {
+    // Deltas are only meaningful on top of the keyframe they follow.
+    return;
+  }
+
+  size_t offset = RMI_STREAM_HEADER_SIZE;
+  for (uint32_t i = 0; i < tiles; ++i) {
+    if (payload.size() - offset < RMI_STREAM_TILE_HEADER_SIZE) {
+      setError("Screen stream frame truncated.");
+      break;
+    }
+    const uint32_t x = rmi_read_be16(data + offset);
+    const uint32_t y = rmi_read_be16(data + offset + 2);
+    const uint32_t tile_width = rmi_read_be16(data + offset + 4);
+    const uint32_t tile_height = rmi_read_be16(data + offset + 6);
+    const uint32_t length = ReadBe32(data + offset + 8);
+    offset += RMI_STREAM_TILE_HEADER_SIZE;
+    if (length > payload.size() - offset || tile_width == 0 || tile_height == 0 ||
+        x + tile_width > width || y + tile_height > height) {
+      setError("Screen stream frame truncated.");
+      break;
+    }
+    uint8_t* dst = stream_pixels_.data() + (static_cast<size_t>(y) * width + x) * 4;
+    if (rmi_qoi_decode(data + offset, length, tile_width, tile_height, dst,
+                       static_cast<size_t>(width) * 4) != 0) {
+      setError("Failed to decode screen stream tile.");
+      break;
+    }
+    offset += length;
+    if (stream_full_) {
+      continue;
+    }
+    if (stream_dirty_.size() >= kMaxStreamDirtyRects) {
+      stream_full_ = true;
+      stream_dirty_.clear();
+      continue;
+    }
+    StreamRect rect;
+    rect.x = static_cast<int>(x);
+    rect.y = static_cast<int>(y);
+    rect.width = static_cast<int>(tile_width);
+    rect.height = static_cast<int>(tile_height);
+    stream_dirty_.push_back(rect);
+  }
+  if (tiles > 0) {
+    ++stream_version_;
+  }
+}
+
 void RmiClient::joinWorker() {
   if (worker_.joinable()) {
     worker_.join();
   }
 }
+
+void RmiClient::joinTransfer() {
+  if (transfer_.joinable()) {
+    transfer_.join();
+  }
+}
+
+void RmiClient::joinDelta() {
+  if (delta_.joinable()) {
+    delta_.join();
+  }
+}
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <condition_variable>
+#include <fstream>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <cstdint>
@@ -10,6 +13,7 @@
 #include <string>
 #include <unordered_map>
 #include <thread>
+#include <utility>
 #include <vector>
 
 struct ClientConfig {
@@ -17,6 +21,11 @@ struct ClientConfig {
   std::string port;
   std::string username;
   std::string password;
+  // Connections a download to a local file may spread its byte ranges over.
+  int download_connections = 1;
+  // Ask for packed LIST and DOWNLOAD replies, and pack UPLOAD chunks, when
+  // the server supports compression.
+  bool compress = true;
 };
 
 namespace net {
@@ -32,26 +41,83 @@ enum class ClientStatus {
 
 class RmiClient {
  public:
+  static constexpr int kMaxDownloadConnections = 6;
+
+  // Per-connection counters of a parallel download.
+  struct ConnectionStats {
+    uint64_t bytes = 0;
+    double seconds = 0.0;
+    bool active = false;
+  };
+
   struct FileEntry {
     std::string name;
     bool is_dir = false;
     uint64_t size = 0;
+    // From LIST2; zero when the server only answers LIST.
+    uint64_t mtime_ns = 0;
+    uint32_t mode = 0;
+    uint64_t inode = 0;
+  };
+
+  // Progress and outcome of an UPLOAD_TREE. `entries` are the server's
+  // "<status> <path>" lines, status being ok, failed or skipped.
+  struct TreeUploadResult {
+    uint64_t sent = 0;
+    bool in_progress = false;
+    uint32_t written = 0;
+    uint32_t failed = 0;
+    uint32_t skipped = 0;
+    std::vector<std::string> entries;
+    std::string error;
+    uint64_t version = 0;
+  };
+
+  // One INPUT_BATCH record; `device` is an event node number or kAutoDevice.
+  struct InputRecord {
+    static constexpr uint8_t kAutoDevice = 0xff;
+    uint8_t device = kAutoDevice;
+    uint16_t type = 0;
+    uint16_t code = 0;
+    int32_t value = 0;
+    uint32_t delay_us = 0;
   };
 
+  struct StreamRect {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+  };
+  using StreamPatchFn = std::function<void(const uint8_t* pixels,
+                                           int width,
+                                           int height,
+                                           const std::vector<StreamRect>& dirty,
+                                           bool full)>;
+
   RmiClient();
   ~RmiClient();
 
   bool connect(const ClientConfig& config);
   void disconnect();
   void sendScreencap();
+  void sendScreencapRaw();
+  void startScreenStream(int fps);
+  void stopScreenStream();
   void sendQuit();
   void sendRestart();
   void sendPress(int keycode);
   void sendVersion();
   void sendPressInput(int keycode);
+  void sendInputBatch(const std::vector<InputRecord>& records);
   void sendOpen(const std::string& target);
   void sendUpload(const std::string& local_path, const std::string& remote_path);
   void sendUploadAndRestart(const std::string& local_path, const std::string& remote_path);
+  // Sends `local_dir` as one UPLOAD_TREE archive, built while it is sent,
+  // which the server unpacks as `<remote_dir>/<name>`. The result is kept
+  // under `remote_dir`.
+  void sendUploadTree(const std::string& local_dir, const std::string& remote_dir);
+  bool getUploadTreeResult(const std::string& remote_dir, TreeUploadResult* result) const;
   bool sendRawCommand(const std::string& command,
                       std::string* response,
                       std::string* error,
@@ -67,14 +133,42 @@ class RmiClient {
                          int* height,
                          uint64_t* version) const;
   bool getScreencapPng(std::vector<uint8_t>* png, uint64_t* version) const;
+  bool screenStreamActive() const;
+  // Hands the live frame (RGBA) and the regions changed since the previous
+  // call to `apply` when it is newer than `*version`. `full` means the
+  // whole frame must be re-uploaded.
+  bool patchScreenStream(uint64_t* version, const StreamPatchFn& apply);
   bool saveLastScreencap(std::string* out_path);
   bool getVersionInfo(int64_t* version, std::string* status) const;
   void requestFileList(const std::string& path);
+  // Large directories arrive in pieces; each piece bumps `*version` and
+  // `*complete` stays false until the last one is in.
   bool getFileList(const std::string& path,
                    std::vector<FileEntry>* entries,
                    std::string* error,
-                   uint64_t* version) const;
-  void requestDownload(const std::string& path);
+                   uint64_t* version,
+                   bool* complete = nullptr) const;
+  // With a `local_path` the body is written to `<local_path>.part` as it
+  // arrives and renamed into place when complete; the result then carries
+  // no data. A `.part` left by an interrupted download is resumed when the
+  // remote file's size and mtime still match. Without a local path the
+  // body is kept in memory.
+  void requestDownload(const std::string& path,
+                       const std::string& local_path = std::string());
+  // Fetches `length` bytes at `offset` into memory, e.g. a file header.
+  // Shares its result slot with requestDownload() for the same path.
+  void requestDownloadRange(const std::string& path, uint64_t offset, uint64_t length);
+  // With more than one connection, a download to a local path opens that
+  // many side connections and fetches disjoint ranges of the file in
+  // parallel. One such download runs at a time; others use the main
+  // connection.
+  void setDownloadConnections(int count);
+  int downloadConnections() const;
+  bool getDownloadStats(const std::string& path,
+                        std::vector<ConnectionStats>* stats) const;
+  // Applies to LIST, DOWNLOAD and UPLOAD requests queued afterwards.
+  void setCompression(bool enabled);
+  bool compressionActive() const;
   bool getDownloadResult(const std::string& path,
                          std::vector<uint8_t>* data,
                          std::string* error,
@@ -83,20 +177,36 @@ class RmiClient {
                            uint64_t* received,
                            uint64_t* total,
                            bool* in_progress) const;
+  // Fetches a remote directory as one DOWNLOAD_TREE archive and unpacks it
+  // under `local_dir` as it arrives, so `<local_dir>/<name>` mirrors it.
+  // Progress and the result are reported under `path` as for a download;
+  // the total stays zero since the archive size is not known up front.
+  void requestDownloadTree(const std::string& path, const std::string& local_dir);
   void requestDelete(const std::string& path);
+  // Copies or moves a remote path on the server itself, directories with
+  // everything under them; no file data crosses the connection.
+  void requestCopy(const std::string& source, const std::string& destination);
+  void requestMove(const std::string& source, const std::string& destination);
 
  private:
   enum class ResponseType {
     None,
     Ok,
     Screencap,
+    ScreencapRaw,
     Version,
     List,
     Download,
+    DownloadTree,
+    UploadTree,
+    BlockSums,
     Raw
   };
 
   struct RawResponse;
+  struct TreeDownload;
+  struct TreeUpload;
+  struct UploadDelta;
 
   struct OutboundMessage {
     std::string message;
@@ -106,10 +216,71 @@ class RmiClient {
     bool restart_after_upload = false;
     std::string upload_local_path;
     std::string upload_remote_path;
+    // UPLOAD first fetches BLOCKSUMS of the remote file and sends only a
+    // DELTA_UPLOAD of what changed. `upload_delta` is that delta once built,
+    // spooled to a temporary file, rebuilding a file of `upload_delta_size`
+    // bytes. Any failure along the way retries with `upload_full` set.
+    bool upload_full = false;
+    std::shared_ptr<const UploadDelta> upload_delta;
+    uint64_t upload_delta_size = 0;
     std::string list_path;
+    // LIST: v1 asks for a page of entries from `list_offset`, v2 streams
+    // them all. `list_binary` asks for LIST2 records, `list_legacy` for the
+    // bare-path form servers without paging take. `list_request` tells a
+    // stale reply from the current one.
+    uint64_t list_offset = 0;
+    bool list_binary = false;
+    bool list_legacy = false;
+    uint64_t list_request = 0;
     std::string download_path;
+    std::string download_local_path;
+    // DOWNLOAD <path> <offset> <length>; a zero length reads to the end.
+    bool download_ranged = false;
+    uint64_t download_offset = 0;
+    uint64_t download_length = 0;
     std::shared_ptr<RawResponse> raw_response;
     int raw_timeout_ms = 0;
+    int stream_fps = -1;
+    std::vector<uint8_t> body;
+    int response_timeout_ms = 0;
+    // Protocol v2 form of `message`: opcode and binary arguments.
+    uint8_t op = 0;
+    std::vector<std::string> args;
+    // Request packed data for this command if the connection allows it.
+    bool compress = false;
+  };
+
+  // Local `.part` file a DOWNLOAD is written to, with the identity of the
+  // remote file it belongs to.
+  struct DownloadFile {
+    std::ofstream out;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint64_t mtime = 0;
+    // The remote file changed since the `.part` was started; the body is
+    // dropped and the download restarts from scratch.
+    bool discard = false;
+  };
+
+  struct PendingRequest {
+    OutboundMessage message;
+    std::chrono::steady_clock::time_point deadline;
+    // DOWNLOAD: the body arrives as DATA chunks after the OK.
+    bool awaiting_body = false;
+    uint64_t body_size = 0;
+    uint64_t body_received = 0;
+    std::vector<uint8_t> body;
+    DownloadFile download_file;
+    std::shared_ptr<TreeDownload> tree;
+    // UPLOAD: the body is read from the file (or the delta) as DATA chunks
+    // within the server's credit. UPLOAD_TREE reads it from `tree_upload`.
+    std::shared_ptr<TreeUpload> tree_upload;
+    std::ifstream upload_file;
+    uint64_t upload_size = 0;
+    uint64_t upload_sent = 0;
+    uint32_t upload_credit = 0;
+    bool upload_pending = false;
+    bool upload_compress = false;
   };
 
   struct RawResponse {
@@ -122,7 +293,63 @@ class RmiClient {
   };
 
   void workerLoop(ClientConfig config);
+  bool negotiateCompression(class net::TcpConnection& connection, std::string* error);
+  bool negotiateProtocol(class net::TcpConnection& connection,
+                         bool* v2,
+                         std::string* error);
+  void workerLoopV2(class net::TcpConnection& connection);
+  bool sendRequest(class net::TcpConnection& connection,
+                   uint32_t id,
+                   PendingRequest* request,
+                   std::string* error);
+  bool sendV2Frame(class net::TcpConnection& connection,
+                   uint32_t id,
+                   uint8_t op,
+                   uint8_t flags,
+                   const std::vector<std::string>& args,
+                   const uint8_t* data,
+                   size_t size,
+                   std::string* error);
+  bool sendUploadChunk(class net::TcpConnection& connection,
+                       uint32_t id,
+                       PendingRequest* request,
+                       std::string* error);
+  // Returns false when the connection failed; `*done` once the body is in.
+  bool handleDownloadChunk(class net::TcpConnection& connection,
+                           uint32_t id,
+                           PendingRequest* request,
+                           uint8_t flags,
+                           const uint8_t* data,
+                           size_t size,
+                           bool* done,
+                           std::string* error);
+  bool handleTreeChunk(class net::TcpConnection& connection,
+                       uint32_t id,
+                       PendingRequest* request,
+                       uint8_t flags,
+                       const uint8_t* data,
+                       size_t size,
+                       bool* done,
+                       std::string* error);
+  bool handleListChunk(class net::TcpConnection& connection,
+                       uint32_t id,
+                       PendingRequest* request,
+                       uint8_t flags,
+                       const uint8_t* data,
+                       size_t size,
+                       bool* done,
+                       std::string* error);
+  // Returns false once the request is answered in full.
+  bool handleReply(PendingRequest* request,
+                   std::vector<uint8_t> payload,
+                   bool* disconnect);
+  void failRequest(PendingRequest* request, const std::string& error);
   void queueMessage(const OutboundMessage& message);
+  void queuePathPair(const char* command,
+                     uint8_t op,
+                     const std::string& label,
+                     const std::string& source,
+                     const std::string& destination);
   void setStatus(ClientStatus status);
   void setError(const std::string& error);
   void clearError();
@@ -142,10 +369,71 @@ class RmiClient {
                       size_t size,
                       std::string* error);
   bool sendHeartbeat(class net::TcpConnection& connection, std::string* error);
-  bool loadUploadFile(const std::string& path,
-                      std::vector<uint8_t>* data,
-                      uint32_t* size,
+  bool sendFileFrame(class net::TcpConnection& connection,
+                     std::ifstream& in,
+                     uint64_t size,
+                     std::string* error);
+  bool openUploadFile(const std::string& path,
+                      std::ifstream* in,
+                      uint64_t* size,
                       std::string* error) const;
+  // Diffs the local file against a BLOCKSUMS reply. Returns false when the
+  // reply is unusable, the delta would not beat sending the whole file, or
+  // the client is stopping.
+  bool buildUploadDelta(const std::string& local_path,
+                        const std::vector<uint8_t>& sums,
+                        std::shared_ptr<const UploadDelta>* delta,
+                        uint64_t* size) const;
+  // v2: hands a BLOCKSUMS reply to the delta thread, which queues the
+  // upload again once the delta is built.
+  void queueUploadDelta(const OutboundMessage& message, std::vector<uint8_t> sums);
+  void deltaLoop();
+  // v1: BLOCKSUMS, then DELTA_UPLOAD. Returns false when the connection
+  // failed; `*uploaded` once the server took the delta.
+  bool sendDeltaUploadV1(class net::TcpConnection& connection,
+                         const OutboundMessage& message,
+                         bool* uploaded,
+                         std::string* error);
+  void applyDownloadRange(OutboundMessage* message) const;
+  bool beginDownloadFile(OutboundMessage* message,
+                         DownloadFile* file,
+                         std::string* error) const;
+  bool acceptDownloadReply(const OutboundMessage& message,
+                           DownloadFile* file,
+                           const std::string& reply) const;
+  std::string finishDownloadFile(const OutboundMessage& message,
+                                 DownloadFile* file,
+                                 bool complete) const;
+  bool beginTreeDownload(const OutboundMessage& message,
+                         TreeDownload* tree,
+                         std::string* error) const;
+  // Unpacks the next piece of the archive. Returns false once it has failed;
+  // later pieces are then only counted.
+  bool unpackTreeChunk(TreeDownload* tree, const uint8_t* data, size_t size) const;
+  // Returns an error message or an empty string.
+  std::string finishTreeDownload(TreeDownload* tree, bool complete) const;
+  bool beginTreeUpload(const OutboundMessage& message,
+                       TreeUpload* tree,
+                       std::string* error) const;
+  // Fills `out` with the next bytes of the archive; fewer than `cap` only
+  // once it is complete.
+  size_t readTreeArchive(TreeUpload* tree, uint8_t* out, size_t cap) const;
+  // Writes the next entry's header to `pending`; false when the walk is over.
+  bool queueTreeEntry(TreeUpload* tree) const;
+  // v1: the archive as frames up to an empty one, then the summary.
+  bool sendTreeArchive(class net::TcpConnection& connection,
+                       TreeUpload* tree,
+                       const std::string& remote_dir,
+                       std::vector<uint8_t>* reply,
+                       std::string* error);
+  void setTreeUploadProgress(const std::string& remote_dir, uint64_t sent);
+  void storeTreeUploadResult(const std::string& remote_dir,
+                             const std::vector<uint8_t>& reply,
+                             const std::string& error);
+  bool receiveTreeArchive(class net::TcpConnection& connection,
+                          TreeDownload* tree,
+                          const std::string& path,
+                          std::string* error);
   bool readExact(class net::TcpConnection& connection,
                  uint8_t* buffer,
                  size_t size,
@@ -173,16 +461,62 @@ class RmiClient {
                                                   int timeout_ms,
                                                   size_t max_bytes,
                                                   const std::string& download_path,
+                                                  std::ofstream* sink,
                                                   std::string* error);
   bool receiveScreencap(class net::TcpConnection& connection);
+  bool receiveScreencapRaw(class net::TcpConnection& connection);
+  void handleScreencapPayload(std::vector<uint8_t> data);
+  void handleScreencapRawPayload(const std::vector<uint8_t>& data);
+  static void setListCursor(OutboundMessage* message, uint64_t offset);
+  // Stores one piece of a listing: `first` replaces what is there, later
+  // pieces append. Sets `*next` when a v1 page ends with a cursor.
+  void storeFileList(const OutboundMessage& message,
+                     const std::vector<uint8_t>& payload,
+                     bool first,
+                     bool complete,
+                     uint64_t* next);
+  void storeDownloadResult(const std::string& path,
+                           std::vector<uint8_t> data,
+                           const std::string& error);
+  bool pollStreamFrames(class net::TcpConnection& connection,
+                        int timeout_ms,
+                        std::string* error);
+  void applyStreamFrame(const std::vector<uint8_t>& payload);
   bool parseFileListPayload(const std::vector<uint8_t>& payload,
                             std::vector<FileEntry>* entries,
+                            uint64_t* next,
                             std::string* error) const;
+  bool parseFileList2Payload(const std::vector<uint8_t>& payload,
+                             std::vector<FileEntry>* entries,
+                             uint64_t* next,
+                             std::string* error) const;
   void setDownloadProgress(const std::string& path,
                            uint64_t received,
                            uint64_t total,
                            bool in_progress);
   void joinWorker();
+  void joinTransfer();
+  void joinDelta();
+  struct ParallelDownload;
+  void parallelDownloadLoop(ClientConfig config,
+                            std::string path,
+                            std::string local_path,
+                            int connections);
+  void parallelDownloadWorker(const ClientConfig& config,
+                              ParallelDownload* job,
+                              int index,
+                              class net::TcpConnection* connection);
+  bool openConnection(class net::TcpConnection& connection,
+                      const ClientConfig& config,
+                      std::string* error);
+  bool fetchRange(class net::TcpConnection& connection,
+                  ParallelDownload* job,
+                  int index,
+                  uint64_t offset,
+                  std::string* error);
+  void setConnectionStats(const std::string& path,
+                          int index,
+                          const ConnectionStats& stats);
 
   mutable std::mutex error_mutex_;
   std::string last_error_;
@@ -201,6 +535,16 @@ class RmiClient {
   uint64_t screencap_counter_ = 0;
   uint32_t client_id_ = 0;
 
+  std::atomic<bool> stream_active_;
+  mutable std::mutex stream_mutex_;
+  std::vector<uint8_t> stream_pixels_;
+  int stream_width_ = 0;
+  int stream_height_ = 0;
+  bool stream_keyed_ = false;
+  bool stream_full_ = false;
+  std::vector<StreamRect> stream_dirty_;
+  uint64_t stream_version_ = 0;
+
   mutable std::mutex version_mutex_;
   int64_t last_version_ = -1;
   bool has_version_ = false;
@@ -208,13 +552,33 @@ class RmiClient {
 
   std::atomic<ClientStatus> status_;
   std::atomic<bool> stop_;
+  // Set once the server accepted protocol v2 for this connection.
+  std::atomic<bool> v2_active_;
+  // `compress_` is the user's choice; `compress_active_` is set once the
+  // server accepted COMPRESS on this connection.
+  std::atomic<bool> compress_;
+  std::atomic<bool> compress_active_;
   std::thread worker_;
+  // Parallel download: the connection settings it reuses, the requested
+  // connection count, and the thread running it.
+  ClientConfig config_;
+  std::atomic<int> download_connections_;
+  std::atomic<bool> transfer_running_;
+  std::thread transfer_;
+  // UPLOAD deltas are built one at a time on `delta_`, off the v2 network
+  // thread; it runs while `delta_jobs_` has work.
+  std::mutex delta_mutex_;
+  std::queue<std::pair<OutboundMessage, std::vector<uint8_t>>> delta_jobs_;
+  bool delta_running_ = false;
+  std::thread delta_;
 
   mutable std::mutex file_mutex_;
   struct FileListResult {
     std::vector<FileEntry> entries;
     std::string error;
     uint64_t version = 0;
+    uint64_t request = 0;
+    bool complete = false;
   };
   struct DownloadResult {
     std::vector<uint8_t> data;
@@ -223,7 +587,9 @@ class RmiClient {
     uint64_t total = 0;
     uint64_t received = 0;
     bool in_progress = false;
+    std::vector<ConnectionStats> connections;
   };
   std::unordered_map<std::string, FileListResult> file_lists_;
   std::unordered_map<std::string, DownloadResult> downloads_;
+  std::unordered_map<std::string, TreeUploadResult> tree_uploads_;
 };
@@ -0,0 +1,133 @@
+#include "rmi_delta.h"
+
+#include <string.h>
+
+#define DELTA_SEED 0x9e3779b97f4a7c15ull
+#define DELTA_C1 0x87c37b91114253d5ull
+#define DELTA_C2 0x4cf5ad432745937full
+#define DELTA_BLOCK_FLOOR 2048u
+#define DELTA_BLOCK_TARGET_MAX (64u * 1024u)
+
+static uint64_t delta_rotl(uint64_t v, unsigned int r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+/* Words are read little-endian whatever the host, so both ends agree. */
+static uint64_t delta_read64(const uint8_t *p, size_t length) {
+    uint64_t v;
+    size_t i;
+
+    v = 0;
+    for (i = 0; i < length; i++) {
+        v |= (uint64_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+static uint64_t delta_scramble(uint64_t k) {
+    k *= DELTA_C1;
+    k = delta_rotl(k, 31);
+    return k * DELTA_C2;
+}
+
+static uint64_t delta_mix(uint64_t state, uint64_t k) {
+    state ^= delta_scramble(k);
+    return delta_rotl(state, 27) * 5 + 0x52dce729u;
+}
+
+void rmi_delta_hash_init(struct rmi_delta_hash *hash) {
+    hash->state = DELTA_SEED;
+    hash->length = 0;
+    hash->tail_len = 0;
+}
+
+void rmi_delta_hash_update(struct rmi_delta_hash *hash, const uint8_t *data, size_t length) {
+    hash->length += length;
+    if (hash->tail_len > 0) {
+        size_t take;
+
+        take = sizeof(hash->tail) - hash->tail_len;
+        if (take > length) {
+            take = length;
+        }
+        memcpy(hash->tail + hash->tail_len, data, take);
+        hash->tail_len += take;
+        data += take;
+        length -= take;
+        if (hash->tail_len < sizeof(hash->tail)) {
+            return;
+        }
+        hash->state = delta_mix(hash->state, delta_read64(hash->tail, 8));
+        hash->tail_len = 0;
+    }
+    while (length >= 8) {
+        hash->state = delta_mix(hash->state, delta_read64(data, 8));
+        data += 8;
+        length -= 8;
+    }
+    memcpy(hash->tail, data, length);
+    hash->tail_len = length;
+}
+
+uint64_t rmi_delta_hash_final(const struct rmi_delta_hash *hash) {
+    uint64_t h;
+
+    h = hash->state;
+    if (hash->tail_len > 0) {
+        h ^= delta_scramble(delta_read64(hash->tail, hash->tail_len));
+    }
+    h ^= hash->length;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t rmi_delta_strong(const uint8_t *data, size_t length) {
+    struct rmi_delta_hash hash;
+
+    rmi_delta_hash_init(&hash);
+    rmi_delta_hash_update(&hash, data, length);
+    return rmi_delta_hash_final(&hash);
+}
+
+uint32_t rmi_delta_weak(const uint8_t *data, size_t length) {
+    uint32_t a;
+    uint32_t b;
+    size_t i;
+
+    a = 0;
+    b = 0;
+    for (i = 0; i < length; i++) {
+        a += data[i];
+        b += (uint32_t)(length - i) * data[i];
+    }
+    return (a & 0xffffu) | (b << 16);
+}
+
+uint32_t rmi_delta_roll(uint32_t weak, size_t length, uint8_t out, uint8_t in) {
+    uint32_t a;
+    uint32_t b;
+
+    a = weak & 0xffffu;
+    b = weak >> 16;
+    a = (a - out + in) & 0xffffu;
+    b = (b - (uint32_t)length * out + a) & 0xffffu;
+    return a | (b << 16);
+}
+
+uint32_t rmi_delta_block_size(uint64_t size) {
+    uint32_t block;
+
+    block = DELTA_BLOCK_FLOOR;
+    while (block < DELTA_BLOCK_TARGET_MAX && (uint64_t)block * block < size) {
+        block <<= 1;
+    }
+    while (block < RMI_DELTA_BLOCK_MAX &&
+           (size + block - 1) / block > RMI_DELTA_MAX_BLOCKS) {
+        block <<= 1;
+    }
+    return block;
+}
@@ -0,0 +1,57 @@
+#ifndef RMI_DELTA_H
+#define RMI_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Block checksums for BLOCKSUMS and DELTA_UPLOAD. The weak checksum is the
+ * rsync rolling sum, so a sender can slide it one byte at a time looking
+ * for blocks the receiver already has; the 64-bit strong hash confirms a
+ * candidate and, over the whole file, checks the rebuilt result. Neither is
+ * meant to stand up to a deliberate collision.
+ */
+#define RMI_DELTA_BLOCK_MIN 512u
+#define RMI_DELTA_BLOCK_MAX (1024u * 1024u)
+#define RMI_DELTA_MAX_BLOCKS (1u << 20)
+
+/* Incremental strong hash; the result only depends on the bytes fed. */
+struct rmi_delta_hash {
+    uint64_t state;
+    uint64_t length;
+    uint8_t tail[8];
+    size_t tail_len;
+};
+
+void rmi_delta_hash_init(struct rmi_delta_hash *hash);
+void rmi_delta_hash_update(struct rmi_delta_hash *hash, const uint8_t *data, size_t length);
+uint64_t rmi_delta_hash_final(const struct rmi_delta_hash *hash);
+
+/* One-shot strong hash of `length` bytes. */
+uint64_t rmi_delta_strong(const uint8_t *data, size_t length);
+
+/* Weak checksum of one block. */
+uint32_t rmi_delta_weak(const uint8_t *data, size_t length);
+
+/*
+ * Slides the weak checksum of a `length`-byte window one byte on: `out`
+ * leaves at the front, `in` enters at the back.
+ */
+uint32_t rmi_delta_roll(uint32_t weak, size_t length, uint8_t out, uint8_t in);
+
+/*
+ * Block size for a file of `size` bytes: about its square root, a power
+ * of two no smaller than 2 KiB, and large enough to stay within
+ * RMI_DELTA_MAX_BLOCKS.
+ */
+uint32_t rmi_delta_block_size(uint64_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,264 @@
+#include "rmi_lz.h"
+
+#include "rmi_protocol.h"
+
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_OFFSET 65535u
+#define LZ_HASH_BITS 12
+#define LZ_RUN_MASK 15u
+
+/* Packing inputs shorter than this never pays for the header. */
+#define LZ_MIN_PACK 64u
+
+static uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_write_length(uint8_t *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+static uint8_t *lz_write_literals(uint8_t *op, const uint8_t *literals, size_t count,
+                                  uint8_t **token) {
+    *token = op++;
+    if (count >= LZ_RUN_MASK) {
+        **token = (uint8_t)(LZ_RUN_MASK << 4);
+        op = lz_write_length(op, count - LZ_RUN_MASK);
+    } else {
+        **token = (uint8_t)(count << 4);
+    }
+    memcpy(op, literals, count);
+    return op + count;
+}
+
+size_t rmi_lz_max_size(size_t length) {
+    return length + length / 255u + 16u;
+}
+
+size_t rmi_lz_compress(const uint8_t *data, size_t length, uint8_t *out, size_t out_cap) {
+    uint32_t table[1u << LZ_HASH_BITS];
+    const uint8_t *ip;
+    const uint8_t *anchor;
+    const uint8_t *end;
+    uint8_t *op;
+    uint8_t *token;
+
+    if ((data == NULL && length > 0) || out == NULL || length > UINT32_MAX ||
+        out_cap < rmi_lz_max_size(length)) {
+        return 0;
+    }
+    ip = data;
+    anchor = data;
+    end = data + length;
+    op = out;
+
+    if (length > LZ_MATCH_LIMIT) {
+        const uint8_t *match_start_limit = end - LZ_MATCH_LIMIT;
+        const uint8_t *match_end_limit = end - LZ_LAST_LITERALS;
+
+        memset(table, 0, sizeof(table));
+        while (ip < match_start_limit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t *ref = data + table[h];
+            const uint8_t *mp;
+            const uint8_t *mr;
+            size_t offset;
+            size_t match_len;
+
+            table[h] = (uint32_t)(ip - data);
+            if (ref >= ip || (size_t)(ip - ref) > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+                /* Step faster through data that keeps missing. */
+                ip += 1 + ((size_t)(ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > data && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            mp = ip + LZ_MIN_MATCH;
+            mr = ref + LZ_MIN_MATCH;
+            while (mp < match_end_limit && *mp == *mr) {
+                mp++;
+                mr++;
+            }
+            op = lz_write_literals(op, anchor, (size_t)(ip - anchor), &token);
+            offset = (size_t)(ip - ref);
+            *op++ = (uint8_t)(offset & 0xff);
+            *op++ = (uint8_t)(offset >> 8);
+            match_len = (size_t)(mp - ip) - LZ_MIN_MATCH;
+            if (match_len >= LZ_RUN_MASK) {
+                *token |= (uint8_t)LZ_RUN_MASK;
+                op = lz_write_length(op, match_len - LZ_RUN_MASK);
+            } else {
+                *token |= (uint8_t)match_len;
+            }
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    op = lz_write_literals(op, anchor, (size_t)(end - anchor), &token);
+    return (size_t)(op - out);
+}
+
+int rmi_lz_decompress(const uint8_t *data,
+                      size_t length,
+                      uint8_t *out,
+                      size_t out_cap,
+                      size_t *out_len) {
+    const uint8_t *ip;
+    const uint8_t *iend;
+    uint8_t *op;
+    uint8_t *oend;
+
+    if ((data == NULL && length > 0) || (out == NULL && out_cap > 0) || out_len == NULL) {
+        return -1;
+    }
+    ip = data;
+    iend = data + length;
+    op = out;
+    oend = out + out_cap;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        size_t match_len;
+        size_t offset;
+        uint8_t b;
+
+        if (literals == LZ_RUN_MASK) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < literals || (size_t)(oend - op) < literals) {
+            return -1;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out)) {
+            return -1;
+        }
+        match_len = token & LZ_RUN_MASK;
+        if (match_len == LZ_RUN_MASK) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < match_len) {
+            return -1;
+        }
+        if (offset >= match_len) {
+            memcpy(op, op - offset, match_len);
+            op += match_len;
+        } else {
+            const uint8_t *ref = op - offset;
+
+            while (match_len-- > 0) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    *out_len = (size_t)(op - out);
+    return 0;
+}
+
+size_t rmi_lz_pack_bound(size_t length) {
+    return RMI_LZ_HEADER_SIZE + rmi_lz_max_size(length);
+}
+
+size_t rmi_lz_pack(const uint8_t *data, size_t length, uint8_t *out, size_t out_cap) {
+    size_t packed;
+
+    if (length < LZ_MIN_PACK || length > UINT32_MAX || out_cap < rmi_lz_pack_bound(length)) {
+        return 0;
+    }
+    packed = rmi_lz_compress(data, length, out + RMI_LZ_HEADER_SIZE,
+                             out_cap - RMI_LZ_HEADER_SIZE);
+    if (packed == 0) {
+        return 0;
+    }
+    packed += RMI_LZ_HEADER_SIZE;
+    if (packed > length - length / 8) {
+        return 0;
+    }
+    rmi_write_be32(out, (uint32_t)length);
+    return packed;
+}
+
+size_t rmi_lz_unpacked_size(const uint8_t *data, size_t length) {
+    if (data == NULL || length < RMI_LZ_HEADER_SIZE) {
+        return 0;
+    }
+    return rmi_read_be32(data);
+}
+
+int rmi_lz_unpack(const uint8_t *data,
+                  size_t length,
+                  uint8_t *out,
+                  size_t out_cap,
+                  size_t *out_len) {
+    size_t expected;
+    size_t decoded;
+
+    expected = rmi_lz_unpacked_size(data, length);
+    if (expected == 0 || expected > out_cap) {
+        return -1;
+    }
+    if (rmi_lz_decompress(data + RMI_LZ_HEADER_SIZE, length - RMI_LZ_HEADER_SIZE,
+                          out, expected, &decoded) != 0 || decoded != expected) {
+        return -1;
+    }
+    *out_len = decoded;
+    return 0;
+}
+
+int rmi_lz_precompressed(const uint8_t *data, size_t length) {
+    static const uint8_t png[] = {0x89, 'P', 'N', 'G'};
+    static const uint8_t jpeg[] = {0xff, 0xd8, 0xff};
+    static const uint8_t tiff_le[] = {'I', 'I', 42, 0};
+    static const uint8_t tiff_be[] = {'M', 'M', 0, 42};
+
+    if (data == NULL || length < 4) {
+        return 0;
+    }
+    return memcmp(data, png, sizeof(png)) == 0 ||
+           memcmp(data, jpeg, sizeof(jpeg)) == 0 ||
+           memcmp(data, tiff_le, sizeof(tiff_le)) == 0 ||
+           memcmp(data, tiff_be, sizeof(tiff_be)) == 0;
+}
@@ -0,0 +1,71 @@
+#ifndef RMI_LZ_H
+#define RMI_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * LZ compression for protocol v2 payloads, using the LZ4 block format
+ * (greedy single-probe matcher, 64 KiB window). A packed payload is a be32
+ * uncompressed length followed by one block.
+ */
+#define RMI_LZ_CODEC "lz4"
+#define RMI_LZ_HEADER_SIZE 4
+
+/* Worst-case block size for `length` input bytes. */
+size_t rmi_lz_max_size(size_t length);
+
+/*
+ * Compresses `length` bytes into one block. Returns the block length, or 0
+ * if `out_cap` is below rmi_lz_max_size(length).
+ */
+size_t rmi_lz_compress(const uint8_t *data, size_t length, uint8_t *out, size_t out_cap);
+
+/*
+ * Decodes one block into at most `out_cap` bytes. Returns 0 and the decoded
+ * length in `*out_len`, or -1 on malformed input or overflow.
+ */
+int rmi_lz_decompress(const uint8_t *data,
+                      size_t length,
+                      uint8_t *out,
+                      size_t out_cap,
+                      size_t *out_len);
+
+/* Output space rmi_lz_pack() needs for `length` bytes. */
+size_t rmi_lz_pack_bound(size_t length);
+
+/*
+ * Packs `length` bytes. Returns the packed length, or 0 when compressing
+ * would save less than an eighth, in which case the data should go out
+ * as it is.
+ */
+size_t rmi_lz_pack(const uint8_t *data, size_t length, uint8_t *out, size_t out_cap);
+
+/* Uncompressed length of a packed payload, or 0 if it is too short. */
+size_t rmi_lz_unpacked_size(const uint8_t *data, size_t length);
+
+/*
+ * Unpacks into `out`, which must hold rmi_lz_unpacked_size() bytes.
+ * Returns 0 and the length in `*out_len`, or -1 on malformed input.
+ */
+int rmi_lz_unpack(const uint8_t *data,
+                  size_t length,
+                  uint8_t *out,
+                  size_t out_cap,
+                  size_t *out_len);
+
+/*
+ * Non-zero when `data` starts like a file that is compressed already
+ * (PNG, JPEG, or a TIFF-based DNG), so packing it would only cost time.
+ */
+int rmi_lz_precompressed(const uint8_t *data, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
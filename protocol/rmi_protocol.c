@@ -16,6 +16,60 @@ void rmi_write_be32(uint8_t *out, uint32_t value) {
     out[3] = (uint8_t)(value & 0xff);
 }
 
+uint16_t rmi_read_be16(const uint8_t *data) {
+    return (uint16_t)(((uint16_t)data[0] << 8) | (uint16_t)data[1]);
+}
+
+void rmi_write_be16(uint8_t *out, uint16_t value) {
+    out[0] = (uint8_t)((value >> 8) & 0xff);
+    out[1] = (uint8_t)(value & 0xff);
+}
+
+uint64_t rmi_read_be64(const uint8_t *data) {
+    return ((uint64_t)rmi_read_be32(data) << 32) | (uint64_t)rmi_read_be32(data + 4);
+}
+
+void rmi_write_be64(uint8_t *out, uint64_t value) {
+    rmi_write_be32(out, (uint32_t)(value >> 32));
+    rmi_write_be32(out + 4, (uint32_t)(value & 0xffffffffu));
+}
+
+void rmi_v2_write_header(uint8_t *out, uint32_t id, uint8_t opcode, uint8_t flags) {
+    rmi_write_be32(out, id);
+    out[4] = opcode;
+    out[5] = flags;
+    out[6] = 0;
+    out[7] = 0;
+}
+
+/* Splits a v2 request body into its arguments; -1 if it is malformed. */
+int rmi_v2_parse_args(const uint8_t *payload, size_t length,
+                      struct rmi_v2_arg *args, size_t max_args, size_t *count) {
+    size_t offset;
+    size_t n;
+
+    offset = 0;
+    n = 0;
+    while (offset < length) {
+        uint32_t arg_len;
+
+        if (n == max_args || length - offset < 4) {
+            return -1;
+        }
+        arg_len = rmi_read_be32(payload + offset);
+        offset += 4;
+        if (arg_len > length - offset) {
+            return -1;
+        }
+        args[n].data = payload + offset;
+        args[n].len = arg_len;
+        offset += arg_len;
+        n++;
+    }
+    *count = n;
+    return 0;
+}
+
 int rmi_payload_equals(const uint8_t *payload, size_t length, const char *text) {
     size_t text_len;
 
@@ -14,22 +14,190 @@ extern "C" {
 #define RMI_CMD_QUIT "QUIT"
 #define RMI_CMD_RESTART "RESTART"
 #define RMI_CMD_VERSION "VERSION"
+#define RMI_CMD_RUNTIME_INFO "RUNTIME_INFO"
 #define RMI_CMD_PRESS "PRESS"
 #define RMI_CMD_PRESS_INPUT "PRESS_INPUT"
+#define RMI_CMD_INPUT_BATCH "INPUT_BATCH"
 #define RMI_CMD_OPEN "OPEN"
 #define RMI_CMD_UPLOAD "UPLOAD"
 #define RMI_CMD_LIST "LIST"
+#define RMI_CMD_LIST2 "LIST2"
 #define RMI_CMD_DOWNLOAD "DOWNLOAD"
+#define RMI_CMD_BLOCKSUMS "BLOCKSUMS"
+#define RMI_CMD_DELTA_UPLOAD "DELTA_UPLOAD"
+#define RMI_CMD_DOWNLOAD_TREE "DOWNLOAD_TREE"
+#define RMI_CMD_UPLOAD_TREE "UPLOAD_TREE"
 #define RMI_CMD_DELETE "DELETE"
+#define RMI_CMD_COPY "COPY"
+#define RMI_CMD_MOVE "MOVE"
 #define RMI_CMD_SCREENCAP "SCREENCAP"
+#define RMI_CMD_SCREENCAP_STREAM "SCREENCAP_STREAM"
+#define RMI_CMD_SCREENCAP_RAW "SCREENCAP_RAW"
+#define RMI_CMD_SCREENSTREAM "SCREENSTREAM"
 #define RMI_CMD_HEARTBEAT "HEARTBEAT"
+#define RMI_CMD_JOB_START "JOB_START"
+#define RMI_CMD_JOB_STATUS "JOB_STATUS"
+#define RMI_CMD_JOB_WAIT "JOB_WAIT"
+#define RMI_CMD_JOB_CANCEL "JOB_CANCEL"
+#define RMI_CMD_PROTOCOL "PROTOCOL"
 
 #define RMI_RESP_OK "OK"
 #define RMI_RESP_ERR_PREFIX "ERR"
 #define RMI_RESP_VERSION_PREFIX "VERSION "
+#define RMI_RESP_JOB_PREFIX "JOB "
+#define RMI_RESP_PROTOCOL_PREFIX "PROTOCOL "
+
+/*
+ * SCREENCAP_RAW header: be32 width, be32 height, be32 stride (bytes per
+ * decoded row), u8 format, u8 codec, 2 reserved bytes. Pixels follow.
+ */
+#define RMI_RAW_HEADER_SIZE 16
+#define RMI_RAW_FORMAT_RGB888 1
+#define RMI_RAW_FORMAT_RGBA8888 2
+#define RMI_RAW_CODEC_NONE 0
+#define RMI_RAW_CODEC_QOI 1
+
+/*
+ * SCREENSTREAM frame: "SFRM", be32 sequence, be32 width, be32 height,
+ * be16 tile size, u8 flags, u8 format, be32 tile count. Each tile is
+ * be16 x, y, width, height, be32 length, then a QOI op stream of that
+ * length covering the tile.
+ */
+#define RMI_STREAM_MAGIC "SFRM"
+#define RMI_STREAM_HEADER_SIZE 24
+#define RMI_STREAM_TILE_HEADER_SIZE 12
+#define RMI_STREAM_FLAG_KEYFRAME 0x01
+#define RMI_STREAM_FLAG_END 0x02
+#define RMI_STREAM_MAX_FPS 30
+
+/*
+ * INPUT_BATCH record: u8 device (event node number, or RMI_INPUT_DEVICE_AUTO),
+ * u8 reserved, be16 type, be16 code, be16 reserved, be32 value, be32 delay in
+ * microseconds before the record is played.
+ */
+#define RMI_INPUT_RECORD_SIZE 16
+#define RMI_INPUT_DEVICE_AUTO 0xff
+#define RMI_INPUT_BATCH_MAX 2048
+#define RMI_INPUT_BATCH_MAX_US 60000000u
+
+/*
+ * LIST2 record: be16 record length (header and name), u8 type, u8 fields
+ * present, be32 mode, be64 size, be64 mtime in nanoseconds since the epoch,
+ * be64 inode, then the name without a terminator. Fields the client did
+ * not ask for are zero and their bit is clear. A page with more entries
+ * after it ends with a NEXT record whose size is the offset to ask for next.
+ */
+#define RMI_LIST2_RECORD_HEADER_SIZE 32
+#define RMI_LIST2_TYPE_OTHER 0
+#define RMI_LIST2_TYPE_FILE 1
+#define RMI_LIST2_TYPE_DIR 2
+#define RMI_LIST2_TYPE_LINK 3
+#define RMI_LIST2_TYPE_NEXT 0xff
+#define RMI_LIST2_FIELD_MODE 0x01
+#define RMI_LIST2_FIELD_SIZE 0x02
+#define RMI_LIST2_FIELD_MTIME 0x04
+#define RMI_LIST2_FIELD_INODE 0x08
+#define RMI_LIST2_FIELDS_ALL 0x0f
+
+/*
+ * BLOCKSUMS reply: be32 block size, be32 block count, be64 file size, be64
+ * mtime in nanoseconds, then per block a be32 weak and a be64 strong
+ * checksum (rmi_delta.h). The last block may be short.
+ *
+ * DELTA_UPLOAD body: be32 block size, be64 size and be64 mtime of the file
+ * it applies to (as BLOCKSUMS reported them), be64 strong hash of the whole
+ * new file, then ops until the end of the body. COPY (u8, be32 first
+ * block, be32 block count) repeats blocks of the current file; LITERAL
+ * (u8, be32 length, bytes) carries new data.
+ */
+#define RMI_BLOCKSUMS_HEADER_SIZE 24
+#define RMI_BLOCKSUMS_ENTRY_SIZE 12
+#define RMI_DELTA_HEADER_SIZE 28
+#define RMI_DELTA_OP_COPY 0x01
+#define RMI_DELTA_OP_LITERAL 0x02
+#define RMI_DELTA_COPY_SIZE 9
+#define RMI_DELTA_LITERAL_SIZE 5
+
+/*
+ * Protocol v2, switched on by `PROTOCOL 2` after AUTH. Frames keep the
+ * 4-byte length prefix and start with an 8-byte header: be32 request id,
+ * u8 opcode, u8 flags, be16 reserved. Request arguments follow as be32
+ * length + bytes each. Replies echo the id and opcode and carry what the v1
+ * reply would (`OK`, `ERR ...`, PNG data, ...). Id 0 marks unsolicited
+ * frames such as heartbeats and SCREENSTREAM frames.
+ */
+#define RMI_PROTOCOL_V1 1
+#define RMI_PROTOCOL_V2 2
+#define RMI_V2_HEADER_SIZE 8
+#define RMI_V2_MAX_ARGS 4
+
+#define RMI_V2_FLAG_REPLY 0x01
+#define RMI_V2_FLAG_ERROR 0x02
+#define RMI_V2_FLAG_DETACH 0x04
+#define RMI_V2_FLAG_END 0x08
+/*
+ * On a request: the client takes a packed reply (LIST, DOWNLOAD chunks)
+ * if the connection negotiated COMPRESS. On a reply or DATA frame: the
+ * body is packed as described in rmi_lz.h.
+ */
+#define RMI_V2_FLAG_COMPRESSED 0x10
+
+/*
+ * Bulk bodies (DOWNLOAD, UPLOAD) travel as DATA chunks on the request id,
+ * the last one flagged END. The receiver hands back credit with WINDOW
+ * frames; a sender never has more than its credit outstanding, starting
+ * from RMI_V2_STREAM_WINDOW. DATA and WINDOW carry raw bytes (WINDOW: a
+ * be32 byte count) instead of an argument list.
+ */
+#define RMI_V2_CHUNK_MAX (32u * 1024u)
+#define RMI_V2_STREAM_WINDOW (256u * 1024u)
+
+#define RMI_OP_HEARTBEAT 0x01
+#define RMI_OP_QUIT 0x02
+#define RMI_OP_RESTART 0x03
+#define RMI_OP_VERSION 0x04
+#define RMI_OP_RUNTIME_INFO 0x05
+#define RMI_OP_COMMAND 0x06
+#define RMI_OP_COMPRESS 0x07
+#define RMI_OP_PRESS 0x10
+#define RMI_OP_PRESS_INPUT 0x11
+#define RMI_OP_INPUT_BATCH 0x12
+#define RMI_OP_OPEN 0x13
+#define RMI_OP_UPLOAD 0x20
+#define RMI_OP_LIST 0x21
+#define RMI_OP_DOWNLOAD 0x22
+#define RMI_OP_DELETE 0x23
+#define RMI_OP_LIST2 0x24
+#define RMI_OP_BLOCKSUMS 0x25
+#define RMI_OP_DELTA_UPLOAD 0x26
+#define RMI_OP_DOWNLOAD_TREE 0x27
+#define RMI_OP_UPLOAD_TREE 0x28
+#define RMI_OP_COPY 0x29
+#define RMI_OP_MOVE 0x2a
+#define RMI_OP_SCREENCAP 0x30
+#define RMI_OP_SCREENCAP_RAW 0x31
+#define RMI_OP_SCREENCAP_STREAM 0x32
+#define RMI_OP_SCREENSTREAM 0x33
+#define RMI_OP_JOB_STATUS 0x40
+#define RMI_OP_JOB_WAIT 0x41
+#define RMI_OP_JOB_CANCEL 0x42
+#define RMI_OP_DATA 0x50
+#define RMI_OP_WINDOW 0x51
+
+struct rmi_v2_arg {
+    const uint8_t *data;
+    uint32_t len;
+};
 
 uint32_t rmi_read_be32(const uint8_t *data);
 void rmi_write_be32(uint8_t *out, uint32_t value);
+uint16_t rmi_read_be16(const uint8_t *data);
+void rmi_write_be16(uint8_t *out, uint16_t value);
+uint64_t rmi_read_be64(const uint8_t *data);
+void rmi_write_be64(uint8_t *out, uint64_t value);
+void rmi_v2_write_header(uint8_t *out, uint32_t id, uint8_t opcode, uint8_t flags);
+int rmi_v2_parse_args(const uint8_t *payload, size_t length,
+                      struct rmi_v2_arg *args, size_t max_args, size_t *count);
 int rmi_payload_equals(const uint8_t *payload, size_t length, const char *text);
 int rmi_payload_starts_with(const uint8_t *payload, size_t length, const char *text);
 
@@ -0,0 +1,210 @@
+#include "rmi_qoi.h"
+
+#include <string.h>
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+
+#define QOI_HASH(r, g, b, a) (((r) * 3 + (g) * 5 + (b) * 7 + (a) * 11) & 63)
+
+size_t rmi_qoi_max_size(uint32_t width, uint32_t height) {
+    return (size_t)width * height * 5u;
+}
+
+size_t rmi_qoi_encode(const uint8_t *pixels,
+                      uint32_t width,
+                      uint32_t height,
+                      uint32_t stride,
+                      uint32_t channels,
+                      uint8_t *out,
+                      size_t out_cap) {
+    uint8_t index[64][4];
+    uint8_t pr, pg, pb, pa;
+    size_t pos;
+    uint32_t run;
+    uint32_t x, y;
+
+    if (pixels == NULL || out == NULL || (channels != 3 && channels != 4) ||
+        out_cap < rmi_qoi_max_size(width, height)) {
+        return 0;
+    }
+    memset(index, 0, sizeof(index));
+    pr = 0;
+    pg = 0;
+    pb = 0;
+    pa = 255;
+    pos = 0;
+    run = 0;
+
+    for (y = 0; y < height; y++) {
+        const uint8_t *row = pixels + (size_t)y * stride;
+
+        for (x = 0; x < width; x++) {
+            const uint8_t *px = row + (size_t)x * channels;
+            uint8_t r = px[0];
+            uint8_t g = px[1];
+            uint8_t b = px[2];
+            uint8_t a = channels == 4 ? px[3] : 255;
+            int h;
+
+            if (r == pr && g == pg && b == pb && a == pa) {
+                run++;
+                if (run == 62) {
+                    out[pos++] = (uint8_t)(QOI_OP_RUN | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                out[pos++] = (uint8_t)(QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+
+            h = QOI_HASH(r, g, b, a);
+            if (index[h][0] == r && index[h][1] == g &&
+                index[h][2] == b && index[h][3] == a) {
+                out[pos++] = (uint8_t)(QOI_OP_INDEX | h);
+            } else {
+                index[h][0] = r;
+                index[h][1] = g;
+                index[h][2] = b;
+                index[h][3] = a;
+                if (a == pa) {
+                    int8_t vr = (int8_t)(r - pr);
+                    int8_t vg = (int8_t)(g - pg);
+                    int8_t vb = (int8_t)(b - pb);
+                    int8_t vg_r = (int8_t)(vr - vg);
+                    int8_t vg_b = (int8_t)(vb - vg);
+
+                    if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                        out[pos++] = (uint8_t)(QOI_OP_DIFF | ((vr + 2) << 4) |
+                                               ((vg + 2) << 2) | (vb + 2));
+                    } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                               vg_b > -9 && vg_b < 8) {
+                        out[pos++] = (uint8_t)(QOI_OP_LUMA | (vg + 32));
+                        out[pos++] = (uint8_t)(((vg_r + 8) << 4) | (vg_b + 8));
+                    } else {
+                        out[pos++] = QOI_OP_RGB;
+                        out[pos++] = r;
+                        out[pos++] = g;
+                        out[pos++] = b;
+                    }
+                } else {
+                    out[pos++] = QOI_OP_RGBA;
+                    out[pos++] = r;
+                    out[pos++] = g;
+                    out[pos++] = b;
+                    out[pos++] = a;
+                }
+            }
+            pr = r;
+            pg = g;
+            pb = b;
+            pa = a;
+        }
+    }
+    if (run > 0) {
+        out[pos++] = (uint8_t)(QOI_OP_RUN | (run - 1));
+    }
+    return pos;
+}
+
+int rmi_qoi_decode(const uint8_t *data,
+                   size_t length,
+                   uint32_t width,
+                   uint32_t height,
+                   uint8_t *out,
+                   size_t out_stride) {
+    uint8_t index[64][4];
+    uint8_t r, g, b, a;
+    size_t pos;
+    uint32_t run;
+    uint32_t x, y;
+
+    if ((data == NULL && length > 0) || out == NULL) {
+        return -1;
+    }
+    memset(index, 0, sizeof(index));
+    r = 0;
+    g = 0;
+    b = 0;
+    a = 255;
+    pos = 0;
+    run = 0;
+
+    for (y = 0; y < height; y++) {
+        uint8_t *row = out + (size_t)y * out_stride;
+
+        for (x = 0; x < width; x++) {
+            uint8_t *px = row + (size_t)x * 4u;
+
+            if (run > 0) {
+                run--;
+            } else {
+                uint8_t op;
+                int h;
+
+                if (pos >= length) {
+                    return -1;
+                }
+                op = data[pos++];
+                if (op == QOI_OP_RGB) {
+                    if (length - pos < 3) {
+                        return -1;
+                    }
+                    r = data[pos];
+                    g = data[pos + 1];
+                    b = data[pos + 2];
+                    pos += 3;
+                } else if (op == QOI_OP_RGBA) {
+                    if (length - pos < 4) {
+                        return -1;
+                    }
+                    r = data[pos];
+                    g = data[pos + 1];
+                    b = data[pos + 2];
+                    a = data[pos + 3];
+                    pos += 4;
+                } else if ((op & QOI_MASK_2) == QOI_OP_INDEX) {
+                    r = index[op][0];
+                    g = index[op][1];
+                    b = index[op][2];
+                    a = index[op][3];
+                } else if ((op & QOI_MASK_2) == QOI_OP_DIFF) {
+                    r = (uint8_t)(r + ((op >> 4) & 0x03) - 2);
+                    g = (uint8_t)(g + ((op >> 2) & 0x03) - 2);
+                    b = (uint8_t)(b + (op & 0x03) - 2);
+                } else if ((op & QOI_MASK_2) == QOI_OP_LUMA) {
+                    int vg;
+                    uint8_t next;
+
+                    if (pos >= length) {
+                        return -1;
+                    }
+                    next = data[pos++];
+                    vg = (op & 0x3f) - 32;
+                    r = (uint8_t)(r + vg - 8 + ((next >> 4) & 0x0f));
+                    g = (uint8_t)(g + vg);
+                    b = (uint8_t)(b + vg - 8 + (next & 0x0f));
+                } else {
+                    run = (uint32_t)(op & 0x3f);
+                }
+                h = QOI_HASH(r, g, b, a);
+                index[h][0] = r;
+                index[h][1] = g;
+                index[h][2] = b;
+                index[h][3] = a;
+            }
+            px[0] = r;
+            px[1] = g;
+            px[2] = b;
+            px[3] = a;
+        }
+    }
+    return 0;
+}
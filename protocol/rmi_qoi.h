@@ -0,0 +1,48 @@
+#ifndef RMI_QOI_H
+#define RMI_QOI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * QOI ("Quite OK Image") op stream used for SCREENCAP_RAW pixels. Only the
+ * chunk stream is encoded: no QOI file header or end marker, since the RMI
+ * raw header already carries the geometry.
+ */
+
+/* Worst-case encoded size for width x height pixels. */
+size_t rmi_qoi_max_size(uint32_t width, uint32_t height);
+
+/*
+ * Encodes packed RGB888 (`channels` 3) or RGBA8888 (`channels` 4) rows that
+ * are `stride` bytes apart. Returns the encoded length, or 0 if `out_cap`
+ * is too small.
+ */
+size_t rmi_qoi_encode(const uint8_t *pixels,
+                      uint32_t width,
+                      uint32_t height,
+                      uint32_t stride,
+                      uint32_t channels,
+                      uint8_t *out,
+                      size_t out_cap);
+
+/*
+ * Decodes a stream produced by rmi_qoi_encode() into RGBA8888 rows that are
+ * `out_stride` bytes apart. Returns 0 on success, -1 on truncated input.
+ */
+int rmi_qoi_decode(const uint8_t *data,
+                   size_t length,
+                   uint32_t width,
+                   uint32_t height,
+                   uint8_t *out,
+                   size_t out_stride);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
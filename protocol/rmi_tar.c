@@ -0,0 +1,448 @@
+#include "rmi_tar.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAR_NAME_LEN 100u
+#define TAR_PREFIX_LEN 155u
+#define TAR_OFF_NAME 0
+#define TAR_OFF_MODE 100
+#define TAR_OFF_UID 108
+#define TAR_OFF_GID 116
+#define TAR_OFF_SIZE 124
+#define TAR_OFF_MTIME 136
+#define TAR_OFF_CHKSUM 148
+#define TAR_OFF_TYPE 156
+#define TAR_OFF_LINK 157
+#define TAR_OFF_MAGIC 257
+#define TAR_OFF_VERSION 263
+#define TAR_OFF_PREFIX 345
+#define TAR_OCTAL_SIZE_MAX 077777777777ull
+
+enum {
+    TAR_STATE_HEADER,
+    TAR_STATE_EXT,
+    TAR_STATE_BODY,
+    TAR_STATE_PAD,
+    TAR_STATE_DONE
+};
+
+size_t rmi_tar_padding(uint64_t size) {
+    return (size_t)((RMI_TAR_BLOCK - size % RMI_TAR_BLOCK) % RMI_TAR_BLOCK);
+}
+
+static void tar_put_octal(uint8_t *field, size_t width, uint64_t value) {
+    char text[24];
+
+    snprintf(text, sizeof(text), "%0*llo", (int)(width - 1), (unsigned long long)value);
+    memcpy(field, text, width - 1);
+    field[width - 1] = '\0';
+}
+
+/* 12-byte numeric field: octal while it fits, else GNU base-256. */
+static void tar_put_number(uint8_t *field, uint64_t value) {
+    size_t i;
+
+    if (value <= TAR_OCTAL_SIZE_MAX) {
+        tar_put_octal(field, 12, value);
+        return;
+    }
+    field[0] = 0x80;
+    for (i = 0; i < 11; i++) {
+        field[11 - i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static void tar_finish_block(uint8_t *block, char type) {
+    unsigned int sum;
+    size_t i;
+
+    block[TAR_OFF_TYPE] = (uint8_t)type;
+    memcpy(block + TAR_OFF_MAGIC, "ustar", 6);
+    memcpy(block + TAR_OFF_VERSION, "00", 2);
+    memset(block + TAR_OFF_CHKSUM, ' ', 8);
+    sum = 0;
+    for (i = 0; i < RMI_TAR_BLOCK; i++) {
+        sum += block[i];
+    }
+    tar_put_octal(block + TAR_OFF_CHKSUM, 7, sum);
+    block[TAR_OFF_CHKSUM + 7] = ' ';
+}
+
+/* Appends `<len> key=value\n`, where <len> counts the whole record. */
+static size_t tar_put_record(uint8_t *out, size_t cap, const char *key, const char *value) {
+    size_t body;
+    size_t total;
+    size_t digits;
+    char text[24];
+
+    body = 1 + strlen(key) + 1 + strlen(value) + 1;
+    digits = 1;
+    for (;;) {
+        total = body + digits;
+        snprintf(text, sizeof(text), "%zu", total);
+        if (strlen(text) == digits) {
+            break;
+        }
+        digits = strlen(text);
+    }
+    if (total > cap) {
+        return 0;
+    }
+    snprintf((char *)out, cap, "%zu %s=%s\n", total, key, value);
+    return total;
+}
+
+/* Finds where a long path splits into the ustar prefix and name fields. */
+static size_t tar_split_path(const char *path, size_t len) {
+    size_t i;
+
+    for (i = 1; i < len && i <= TAR_PREFIX_LEN; i++) {
+        if (path[i] == '/' && len - i - 1 <= TAR_NAME_LEN && len - i - 1 > 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+size_t rmi_tar_write_header(const struct rmi_tar_entry *entry, uint8_t *out, size_t cap) {
+    uint8_t *block;
+    size_t path_len;
+    size_t link_len;
+    size_t split;
+    size_t used;
+
+    path_len = strlen(entry->path);
+    link_len = strlen(entry->link);
+    if (path_len == 0 || cap < RMI_TAR_BLOCK) {
+        return 0;
+    }
+    split = path_len > TAR_NAME_LEN ? tar_split_path(entry->path, path_len) : 0;
+    used = 0;
+    if ((path_len > TAR_NAME_LEN && split == 0) || link_len > TAR_NAME_LEN) {
+        uint8_t records[RMI_TAR_HEADER_MAX - 2 * RMI_TAR_BLOCK];
+        size_t records_len;
+        size_t n;
+
+        records_len = 0;
+        if (path_len > TAR_NAME_LEN && split == 0) {
+            n = tar_put_record(records, sizeof(records), "path", entry->path);
+            if (n == 0) {
+                return 0;
+            }
+            records_len += n;
+        }
+        if (link_len > TAR_NAME_LEN) {
+            n = tar_put_record(records + records_len, sizeof(records) - records_len,
+                               "linkpath", entry->link);
+            if (n == 0) {
+                return 0;
+            }
+            records_len += n;
+        }
+        if (cap < 2 * RMI_TAR_BLOCK + records_len + rmi_tar_padding(records_len)) {
+            return 0;
+        }
+        block = out;
+        memset(block, 0, RMI_TAR_BLOCK);
+        memcpy(block + TAR_OFF_NAME, "././@PaxHeader", 14);
+        tar_put_octal(block + TAR_OFF_MODE, 8, 0644);
+        tar_put_octal(block + TAR_OFF_UID, 8, 0);
+        tar_put_octal(block + TAR_OFF_GID, 8, 0);
+        tar_put_number(block + TAR_OFF_SIZE, records_len);
+        tar_put_octal(block + TAR_OFF_MTIME, 12, entry->mtime > 0 ? (uint64_t)entry->mtime : 0);
+        tar_finish_block(block, 'x');
+        memcpy(out + RMI_TAR_BLOCK, records, records_len);
+        memset(out + RMI_TAR_BLOCK + records_len, 0, rmi_tar_padding(records_len));
+        used = RMI_TAR_BLOCK + records_len + rmi_tar_padding(records_len);
+    }
+    if (cap - used < RMI_TAR_BLOCK) {
+        return 0;
+    }
+    block = out + used;
+    memset(block, 0, RMI_TAR_BLOCK);
+    if (path_len <= TAR_NAME_LEN) {
+        memcpy(block + TAR_OFF_NAME, entry->path, path_len);
+    } else if (split > 0) {
+        memcpy(block + TAR_OFF_PREFIX, entry->path, split);
+        memcpy(block + TAR_OFF_NAME, entry->path + split + 1, path_len - split - 1);
+    } else {
+        /* The pax path wins; this is only for readers without pax. */
+        memcpy(block + TAR_OFF_NAME, entry->path + path_len - TAR_NAME_LEN, TAR_NAME_LEN);
+    }
+    memcpy(block + TAR_OFF_LINK, entry->link, link_len < TAR_NAME_LEN ? link_len : TAR_NAME_LEN);
+    tar_put_octal(block + TAR_OFF_MODE, 8, entry->mode & 07777);
+    tar_put_octal(block + TAR_OFF_UID, 8, 0);
+    tar_put_octal(block + TAR_OFF_GID, 8, 0);
+    tar_put_number(block + TAR_OFF_SIZE, entry->type == RMI_TAR_TYPE_FILE ? entry->size : 0);
+    tar_put_octal(block + TAR_OFF_MTIME, 12, entry->mtime > 0 ? (uint64_t)entry->mtime : 0);
+    tar_finish_block(block, entry->type);
+    return used + RMI_TAR_BLOCK;
+}
+
+void rmi_tar_reader_init(struct rmi_tar_reader *reader) {
+    memset(reader, 0, sizeof(*reader));
+    reader->state = TAR_STATE_HEADER;
+}
+
+static uint64_t tar_get_number(const uint8_t *field, size_t width) {
+    uint64_t value;
+    size_t i;
+
+    value = 0;
+    if (field[0] & 0x80) {
+        for (i = 1; i < width; i++) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+    for (i = 0; i < width && field[i] == ' '; i++) {
+    }
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = (value << 3) | (uint64_t)(field[i] - '0');
+    }
+    return value;
+}
+
+static int tar_block_is_zero(const uint8_t *block) {
+    size_t i;
+
+    for (i = 0; i < RMI_TAR_BLOCK; i++) {
+        if (block[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int tar_checksum_ok(const uint8_t *block) {
+    unsigned int sum;
+    size_t i;
+
+    sum = 0;
+    for (i = 0; i < RMI_TAR_BLOCK; i++) {
+        sum += (i >= TAR_OFF_CHKSUM && i < TAR_OFF_CHKSUM + 8) ? ' ' : block[i];
+    }
+    return sum == tar_get_number(block + TAR_OFF_CHKSUM, 8);
+}
+
+static void tar_copy_field(char *dst, size_t dst_len, const uint8_t *src, size_t src_len) {
+    size_t n;
+
+    n = 0;
+    while (n < src_len && src[n] != '\0' && n + 1 < dst_len) {
+        n++;
+    }
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+
+/* Applies the `path`, `linkpath` and `size` records of a pax header. */
+static int tar_apply_pax(struct rmi_tar_reader *reader) {
+    size_t off;
+
+    off = 0;
+    while (off < reader->ext_len) {
+        const char *record;
+        const char *key;
+        const char *value;
+        const char *eq;
+        size_t len;
+        size_t value_len;
+        char *end;
+
+        record = (const char *)reader->ext + off;
+        len = (size_t)strtoul(record, &end, 10);
+        if (end == record || *end != ' ' || len < 4 || len > reader->ext_len - off ||
+            record[len - 1] != '\n') {
+            return -1;
+        }
+        key = end + 1;
+        eq = (const char *)memchr(key, '=', (size_t)(record + len - key));
+        if (eq == NULL) {
+            return -1;
+        }
+        value = eq + 1;
+        value_len = (size_t)(record + len - 1 - value);
+        if ((size_t)(eq - key) == 4 && memcmp(key, "path", 4) == 0 &&
+            value_len < sizeof(reader->next_path)) {
+            memcpy(reader->next_path, value, value_len);
+            reader->next_path[value_len] = '\0';
+        } else if ((size_t)(eq - key) == 8 && memcmp(key, "linkpath", 8) == 0 &&
+                   value_len < sizeof(reader->next_link)) {
+            memcpy(reader->next_link, value, value_len);
+            reader->next_link[value_len] = '\0';
+        } else if ((size_t)(eq - key) == 4 && memcmp(key, "size", 4) == 0) {
+            reader->next_size = strtoull(value, NULL, 10);
+            reader->has_next_size = 1;
+        }
+        off += len;
+    }
+    return 0;
+}
+
+static void tar_apply_ext(struct rmi_tar_reader *reader) {
+    size_t len;
+
+    len = reader->ext_len;
+    while (len > 0 && reader->ext[len - 1] == '\0') {
+        len--;
+    }
+    if (len >= RMI_TAR_PATH_MAX) {
+        len = RMI_TAR_PATH_MAX - 1;
+    }
+    if (reader->ext_type == 'L') {
+        memcpy(reader->next_path, reader->ext, len);
+        reader->next_path[len] = '\0';
+    } else {
+        memcpy(reader->next_link, reader->ext, len);
+        reader->next_link[len] = '\0';
+    }
+}
+
+/* Parses the header block just collected. */
+static enum rmi_tar_event tar_parse_header(struct rmi_tar_reader *reader) {
+    const uint8_t *block;
+    struct rmi_tar_entry *entry;
+    uint64_t size;
+    char type;
+
+    block = reader->block;
+    if (tar_block_is_zero(block)) {
+        reader->state = TAR_STATE_DONE;
+        return RMI_TAR_END;
+    }
+    if (!tar_checksum_ok(block)) {
+        return RMI_TAR_ERROR;
+    }
+    type = (char)block[TAR_OFF_TYPE];
+    size = tar_get_number(block + TAR_OFF_SIZE, 12);
+    if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+        if (size > sizeof(reader->ext)) {
+            return RMI_TAR_ERROR;
+        }
+        reader->ext_type = type;
+        reader->ext_len = 0;
+        reader->remaining = size;
+        reader->pad = rmi_tar_padding(size);
+        reader->state = TAR_STATE_EXT;
+        return RMI_TAR_MORE;
+    }
+    entry = &reader->entry;
+    entry->type = type == '\0' ? RMI_TAR_TYPE_FILE : type;
+    if (reader->next_path[0] != '\0') {
+        memcpy(entry->path, reader->next_path, sizeof(entry->path));
+    } else if (block[TAR_OFF_PREFIX] != '\0') {
+        char prefix[TAR_PREFIX_LEN + 1];
+        char name[TAR_NAME_LEN + 1];
+
+        tar_copy_field(prefix, sizeof(prefix), block + TAR_OFF_PREFIX, TAR_PREFIX_LEN);
+        tar_copy_field(name, sizeof(name), block + TAR_OFF_NAME, TAR_NAME_LEN);
+        snprintf(entry->path, sizeof(entry->path), "%s/%s", prefix, name);
+    } else {
+        tar_copy_field(entry->path, sizeof(entry->path), block + TAR_OFF_NAME, TAR_NAME_LEN);
+    }
+    if (reader->next_link[0] != '\0') {
+        memcpy(entry->link, reader->next_link, sizeof(entry->link));
+    } else {
+        tar_copy_field(entry->link, sizeof(entry->link), block + TAR_OFF_LINK, TAR_NAME_LEN);
+    }
+    entry->mode = (uint32_t)tar_get_number(block + TAR_OFF_MODE, 8) & 07777;
+    entry->mtime = (int64_t)tar_get_number(block + TAR_OFF_MTIME, 12);
+    entry->size = reader->has_next_size ? reader->next_size : size;
+    /* Only these types carry a body; a size on the others is ignored. */
+    if (entry->type == RMI_TAR_TYPE_DIR || entry->type == RMI_TAR_TYPE_SYMLINK ||
+        entry->type == RMI_TAR_TYPE_HARDLINK) {
+        entry->size = 0;
+    }
+    reader->next_path[0] = '\0';
+    reader->next_link[0] = '\0';
+    reader->has_next_size = 0;
+    reader->remaining = entry->size;
+    reader->pad = rmi_tar_padding(entry->size);
+    reader->state = TAR_STATE_BODY;
+    return RMI_TAR_ENTRY;
+}
+
+enum rmi_tar_event rmi_tar_read(struct rmi_tar_reader *reader, const uint8_t *data, size_t len,
+                                size_t *used, const uint8_t **body, size_t *body_len) {
+    size_t off;
+
+    off = 0;
+    *body = NULL;
+    *body_len = 0;
+    while (off < len) {
+        size_t take;
+
+        switch (reader->state) {
+        case TAR_STATE_HEADER:
+            take = RMI_TAR_BLOCK - reader->block_len;
+            if (take > len - off) {
+                take = len - off;
+            }
+            memcpy(reader->block + reader->block_len, data + off, take);
+            reader->block_len += take;
+            off += take;
+            if (reader->block_len == RMI_TAR_BLOCK) {
+                enum rmi_tar_event event;
+
+                reader->block_len = 0;
+                event = tar_parse_header(reader);
+                if (event != RMI_TAR_MORE) {
+                    *used = off;
+                    return event;
+                }
+            }
+            break;
+        case TAR_STATE_EXT:
+            take = reader->remaining < len - off ? (size_t)reader->remaining : len - off;
+            memcpy(reader->ext + reader->ext_len, data + off, take);
+            reader->ext_len += take;
+            reader->remaining -= take;
+            off += take;
+            if (reader->remaining == 0) {
+                if (reader->ext_type == 'x' && tar_apply_pax(reader) == -1) {
+                    *used = off;
+                    return RMI_TAR_ERROR;
+                }
+                if (reader->ext_type == 'L' || reader->ext_type == 'K') {
+                    tar_apply_ext(reader);
+                }
+                reader->state = TAR_STATE_PAD;
+            }
+            break;
+        case TAR_STATE_BODY:
+            if (reader->remaining == 0) {
+                reader->state = TAR_STATE_PAD;
+                break;
+            }
+            take = reader->remaining < len - off ? (size_t)reader->remaining : len - off;
+            reader->remaining -= take;
+            *body = data + off;
+            *body_len = take;
+            *used = off + take;
+            return RMI_TAR_DATA;
+        case TAR_STATE_PAD:
+            take = reader->pad < len - off ? reader->pad : len - off;
+            reader->pad -= take;
+            off += take;
+            if (reader->pad == 0) {
+                reader->state = TAR_STATE_HEADER;
+            }
+            break;
+        default:
+            /* Whatever follows the end marker is ignored. */
+            *used = len;
+            return RMI_TAR_END;
+        }
+    }
+    /* An empty body is finished as soon as its header is parsed. */
+    if (reader->state == TAR_STATE_BODY && reader->remaining == 0) {
+        reader->state = reader->pad > 0 ? TAR_STATE_PAD : TAR_STATE_HEADER;
+    } else if (reader->state == TAR_STATE_PAD && reader->pad == 0) {
+        reader->state = TAR_STATE_HEADER;
+    }
+    *used = off;
+    return RMI_TAR_MORE;
+}
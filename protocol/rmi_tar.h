@@ -0,0 +1,90 @@
+#ifndef RMI_TAR_H
+#define RMI_TAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The tar subset directory transfers stream: ustar headers for directories,
+ * regular files and symlinks, with a pax extended header in front of any
+ * entry whose name or link target does not fit the fixed fields. Sizes past
+ * the 11 octal digits of the field use the base-256 form GNU tar reads. The
+ * reader also takes GNU long names and skips global pax headers, so
+ * archives from common tar implementations unpack too.
+ */
+#define RMI_TAR_BLOCK 512u
+#define RMI_TAR_PATH_MAX 4096u
+/* A pax header with a path and a link target, then the ustar header. */
+#define RMI_TAR_HEADER_MAX (RMI_TAR_BLOCK * 20u)
+
+#define RMI_TAR_TYPE_FILE '0'
+#define RMI_TAR_TYPE_HARDLINK '1'
+#define RMI_TAR_TYPE_SYMLINK '2'
+#define RMI_TAR_TYPE_DIR '5'
+
+struct rmi_tar_entry {
+    char type;
+    char path[RMI_TAR_PATH_MAX];
+    char link[RMI_TAR_PATH_MAX];
+    uint32_t mode;
+    uint64_t size;
+    int64_t mtime;
+};
+
+/*
+ * Writes the header blocks for `entry` to `out` and returns their length,
+ * a multiple of RMI_TAR_BLOCK, or 0 when they do not fit in `cap`.
+ */
+size_t rmi_tar_write_header(const struct rmi_tar_entry *entry, uint8_t *out, size_t cap);
+
+/* Zero bytes that follow a body of `size` bytes up to the next block. */
+size_t rmi_tar_padding(uint64_t size);
+
+enum rmi_tar_event {
+    RMI_TAR_MORE,
+    RMI_TAR_ENTRY,
+    RMI_TAR_DATA,
+    RMI_TAR_END,
+    RMI_TAR_ERROR
+};
+
+/* Push parser for an archive arriving in pieces of any size. */
+struct rmi_tar_reader {
+    int state;
+    uint8_t block[RMI_TAR_BLOCK];
+    size_t block_len;
+    uint64_t remaining;
+    size_t pad;
+    /* Body of a pax or GNU long-name header, applied to the next entry. */
+    char ext_type;
+    uint8_t ext[RMI_TAR_HEADER_MAX];
+    size_t ext_len;
+    char next_path[RMI_TAR_PATH_MAX];
+    char next_link[RMI_TAR_PATH_MAX];
+    uint64_t next_size;
+    int has_next_size;
+    struct rmi_tar_entry entry;
+};
+
+void rmi_tar_reader_init(struct rmi_tar_reader *reader);
+
+/*
+ * Consumes input up to the next event and stores how much in `*used`:
+ * RMI_TAR_MORE once all of it is taken, RMI_TAR_ENTRY when `entry` holds
+ * the next member, RMI_TAR_DATA for `*body_len` bytes of its body at
+ * `*body` (inside `data`), RMI_TAR_END at the end-of-archive block and
+ * RMI_TAR_ERROR for a damaged header. Entry bodies are reported whatever
+ * the type, so a caller skips what it does not handle.
+ */
+enum rmi_tar_event rmi_tar_read(struct rmi_tar_reader *reader, const uint8_t *data, size_t len,
+                                size_t *used, const uint8_t **body, size_t *body_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <poll.h>
 #include <errno.h>
 #include <stdio.h>
@@ -21,10 +23,25 @@
 #include <sys/stat.h>
 #include <limits.h>
 #include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fb.h>
 #include <linux/input.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "rmi_version.h"
 #include "rmi_protocol.h"
+#include "rmi_qoi.h"
+#include "rmi_lz.h"
+#include "rmi_delta.h"
+#include "rmi_tar.h"
 
 #define DEFAULT_IP            INADDR_LOOPBACK
 #define DEFAULT_PORT          1234
@@ -35,6 +52,37 @@
 #define RMI_LOG_PATH          "/data/local/tmp/rmi.log"
 #define AID_SHELL             2000
 #define RMI_LIST_MAX_BYTES    (1024u * 1024u)
+#define RMI_LIST_LINE_MAX     (NAME_MAX + 64)
+#define RMI_DENTS_BUFFER_SIZE (64u * 1024u)
+#define RMI_MAX_CLIENTS       8
+#define RMI_MAX_EVENTS        16
+#define RMI_CMD_MAX_BYTES     1024
+#define RMI_IO_BUFFER_SIZE    (64u * 1024u)
+#define RMI_FLUSH_BUDGET      (1024u * 1024u)
+#define RMI_XFER_BUFFER_SIZE  (256u * 1024u)
+#define RMI_XFER_ALIGN        4096u
+#define RMI_SPLICE_PIPE_SIZE  (1024u * 1024u)
+#define RMI_STREAM_CHUNK      (64u * 1024u)
+#define RMI_FB_DEFAULT_PATH   "/dev/graphics/fb0"
+#define RMI_SCREENSTREAM_TILE 32u
+#define RMI_INPUT_PATH_FMT    "/dev/input/event%u"
+#define RMI_INPUT_MAX_NODES   32u
+#define RMI_INPUT_MAX_DEVICES 8u
+#define RMI_HELPER_SHELL      "/system/bin/sh"
+#define RMI_HELPER_MARKER     "__RMI_DONE__"
+#define RMI_HELPER_START_MS   5000
+#define RMI_HELPER_TIMEOUT_MS 15000
+#define RMI_OUT_HIGH_WATER    (256u * 1024u)
+#define RMI_WORKER_THREADS    2
+#define RMI_MAX_JOBS          64
+#define RMI_V2_MAX_STREAMS    4
+#define RMI_LZ_MAX_MISSES     8
+#define RMI_TREE_MAX_DEPTH    32
+#define RMI_TREE_V1_PIECE     (1u << 30)
+#define RMI_DELTA_STEP        (4u * RMI_V2_CHUNK_MAX)
+#define RMI_DELTA_STASH_MAX   (2u * RMI_V2_STREAM_WINDOW)
+#define RMI_COPY_CHUNK        (8u * 1024u * 1024u)
+#define RMI_COPY_BUFFER_SIZE  (1024u * 1024u)
 
 #define CHECKSYSCALL(r, name) \
     if((r)==-1){fprintf(stderr,"Syscall error: %s at line %d " \
@@ -42,12 +90,472 @@
 
 static char **rmi_argv;
 
+/*
+ * When UPLOAD data is flushed to storage: `none` leaves it to the kernel,
+ * `sync` fsyncs before answering OK, `deferred` answers first and fsyncs
+ * on the worker pool. Set with `upload_fsync=` in the config file.
+ */
+enum rmi_fsync_policy {
+    RMI_FSYNC_NONE = 0,
+    RMI_FSYNC_SYNC = 1,
+    RMI_FSYNC_DEFERRED = 2,
+};
+
+static enum rmi_fsync_policy rmi_upload_fsync = RMI_FSYNC_NONE;
+
+/* Framebuffer capture source; `fb_mode=` describes a raw file stand-in. */
+static char rmi_fb_path[PATH_MAX] = RMI_FB_DEFAULT_PATH;
+static char rmi_fb_mode[64];
+
+/*
+ * Event devices that report EV_KEY, probed at startup. Each key maps to the
+ * device that declares it; the fds stay open until a write fails.
+ */
+struct rmi_input_dev {
+    int fd;
+    unsigned int node;
+    unsigned int key_count;
+    uint8_t keys[KEY_MAX / 8 + 1];
+};
+
+static pthread_mutex_t rmi_input_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rmi_input_dev rmi_input_devs[RMI_INPUT_MAX_DEVICES];
+static unsigned int rmi_input_count;
+static int8_t rmi_input_key_dev[KEY_MAX + 1];
+
+/*
+ * Long-lived `sh` in the shell context that runs PRESS_INPUT and OPEN
+ * commands, so a call no longer forks the runcon/env chain. Every command
+ * is followed by a marker line carrying its exit status. The helper is
+ * restarted on next use after it dies or stops answering.
+ */
+struct rmi_helper {
+    pid_t pid;
+    int cmd_fd;
+    int reply_fd;
+    unsigned int seq;
+    unsigned int starts;
+    size_t reply_len;
+    char reply[256];
+};
+
+static pthread_mutex_t rmi_helper_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rmi_helper rmi_helper = { .pid = -1, .cmd_fd = -1, .reply_fd = -1 };
+
 enum rmi_client_result {
     RMI_CONTINUE = 0,
     RMI_SHUTDOWN = 1,
     RMI_RESTART = 2,
 };
 
+enum rmi_job_kind {
+    RMI_JOB_SCREENCAP = 0,
+    RMI_JOB_PRESS_INPUT = 1,
+    RMI_JOB_OPEN = 2,
+    RMI_JOB_DELETE = 3,
+    RMI_JOB_FSYNC = 4,
+    RMI_JOB_SCREENCAP_RAW = 5,
+    RMI_JOB_STREAM_FRAME = 6,
+    RMI_JOB_INPUT_BATCH = 7,
+    RMI_JOB_BLOCKSUMS = 8,
+    RMI_JOB_COPY = 9,
+    RMI_JOB_MOVE = 10,
+};
+
+enum rmi_job_state {
+    RMI_JOB_QUEUED = 0,
+    RMI_JOB_RUNNING = 1,
+    RMI_JOB_DONE = 2,
+    RMI_JOB_FAILED = 3,
+};
+
+struct rmi_conn;
+
+/*
+ * A blocking command run on the worker pool. Workers only touch `state`
+ * and the progress fields (under the pool lock) and the result fields;
+ * everything else belongs to the event loop.
+ */
+struct rmi_job {
+    struct rmi_job *next;
+    struct rmi_job *all_next;
+    uint32_t id;
+    enum rmi_job_kind kind;
+    enum rmi_job_state state;
+    /* PRESS_INPUT keycode, or the BLOCKSUMS block size. */
+    int keycode;
+    char arg[PATH_MAX];
+    /* COPY and MOVE destination. */
+    char dest[PATH_MAX];
+    int rc;
+    uint8_t *data;
+    size_t len;
+    struct rmi_conn *waiter;
+    uint32_t reply_id;
+    uint8_t reply_op;
+    bool detached;
+    struct rmi_screenstream *stream;
+    /* DELETE, COPY and MOVE progress for JOB_STATUS, and the JOB_CANCEL request. */
+    uint64_t progress_entries;
+    uint64_t progress_bytes;
+    bool cancel;
+};
+
+/*
+ * Jobs run in queue order, except that at most one file job (see
+ * job_is_bulk) runs at a time: the other workers stay free for screen
+ * captures and input, which a long DELETE or COPY would otherwise hold up.
+ */
+struct rmi_pool {
+    pthread_t threads[RMI_WORKER_THREADS];
+    unsigned int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct rmi_job *queue_head;
+    struct rmi_job *queue_tail;
+    bool bulk_running;
+    struct rmi_job *done;
+    int event_fd;
+    bool stop;
+};
+
+struct rmi_frame {
+    struct rmi_frame *next;
+    uint8_t header[RMI_FRAME_HEADER_SIZE + RMI_V2_HEADER_SIZE];
+    size_t header_len;
+    uint8_t *data;
+    size_t len;
+    size_t sent;
+};
+
+enum rmi_conn_state {
+    RMI_CONN_COMMAND = 0,
+    RMI_CONN_UPLOAD_HEADER = 1,
+    RMI_CONN_UPLOAD_BODY = 2,
+    RMI_CONN_INPUT_BATCH = 3,
+    RMI_CONN_TREE_HEADER = 4,
+    RMI_CONN_TREE_BODY = 5,
+};
+
+/*
+ * SCREENSTREAM state. The tile hashes and scratch buffer belong to the
+ * in-flight frame job while one runs; the event loop only touches the
+ * schedule fields.
+ */
+struct rmi_screenstream {
+    bool active;
+    bool restart;
+    uint32_t interval_ms;
+    uint64_t next_ms;
+    struct rmi_job *job;
+    uint32_t seq;
+    uint32_t width;
+    uint32_t height;
+    uint64_t *hashes;
+    size_t tile_count;
+    uint8_t *scratch;
+    size_t scratch_cap;
+};
+
+/* Fixed part of the records getdents64() fills in. */
+struct rmi_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* A directory read with getdents64(), RMI_DENTS_BUFFER_SIZE at a time. */
+struct rmi_dir_reader {
+    int fd;
+    uint8_t *buf;
+    size_t len;
+    size_t off;
+};
+
+enum rmi_list_format {
+    RMI_LIST_NONE,
+    RMI_LIST_TEXT,
+    RMI_LIST_BINARY
+};
+
+/* One directory entry; `fields` says which RMI_LIST2_FIELD_* are filled in. */
+struct rmi_list_entry {
+    const char *name;
+    uint8_t type;
+    uint8_t fields;
+    uint32_t mode;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t ino;
+};
+
+/*
+ * A directory being emptied by remove_tree(): `name` is its name in the
+ * directory below it on the stack, and `resume` where that one's listing
+ * carries on once it is gone.
+ */
+struct rmi_remove_dir {
+    int fd;
+    off_t resume;
+    char name[NAME_MAX + 1];
+};
+
+/* How a COPY moves file bodies; it falls back a step when one is refused. */
+enum rmi_copy_method {
+    RMI_COPY_RANGE,
+    RMI_COPY_SENDFILE,
+    RMI_COPY_BUFFERED
+};
+
+/* A directory being copied; `resume` as for struct rmi_remove_dir. */
+struct rmi_copy_dir {
+    int src_fd;
+    int dst_fd;
+    off_t resume;
+    mode_t mode;
+    struct timespec mtime;
+};
+
+/*
+ * A COPY in progress. `root_dev`/`root_ino` name the destination
+ * directory so a copy into the source's own subtree does not recurse
+ * into itself.
+ */
+struct rmi_copy {
+    struct rmi_pool *pool;
+    struct rmi_job *job;
+    enum rmi_copy_method method;
+    uint8_t *buf;
+    uint64_t entries;
+    uint64_t bytes;
+    dev_t root_dev;
+    ino_t root_ino;
+};
+
+/* A directory open on a DOWNLOAD_TREE walk; its entries' names start at `path_len`. */
+struct rmi_tree_dir {
+    DIR *dir;
+    size_t path_len;
+};
+
+/*
+ * DOWNLOAD_TREE: the directories being walked, innermost last, and what
+ * the archive still owes before the walk moves on: the rest of `hdr`, then
+ * `body` bytes of the open file `fd` from `off`, then `pad` zero bytes.
+ * `entry.path` holds the archive name of the current entry and doubles as
+ * the prefix its children are named under. `bytes` counts the archive.
+ */
+struct rmi_tree_walk {
+    struct rmi_tree_dir stack[RMI_TREE_MAX_DEPTH];
+    unsigned int depth;
+    struct rmi_tar_entry entry;
+    uint8_t hdr[RMI_TAR_HEADER_MAX];
+    size_t hdr_len;
+    size_t hdr_off;
+    int fd;
+    off_t off;
+    uint64_t body;
+    size_t pad;
+    bool ended;
+    uint64_t bytes;
+    uint64_t start_us;
+    char root[PATH_MAX];
+};
+
+/*
+ * UPLOAD_TREE: an archive unpacked under `root_fd` as it arrives. `dir_fd`
+ * stays open on the directory named `dir_path` while entries keep landing
+ * in it. `fd` is the file being written, `name` in `file_dir`, with `left`
+ * bytes of its body to come. Each entry adds a line to `summary`; past
+ * RMI_LIST_MAX_BYTES only the counts go on. `broken` marks an archive that
+ * cannot be trusted any more, the rest of which is only counted. Writing
+ * into a directory moves its mtime, so `dir_times` keeps the archive's
+ * directory mtimes until the archive ends.
+ */
+struct rmi_tree_dir_time {
+    char *path;
+    int64_t mtime;
+};
+
+struct rmi_tree_extract {
+    struct rmi_tar_reader reader;
+    int root_fd;
+    int dir_fd;
+    char dir_path[RMI_TAR_PATH_MAX];
+    int fd;
+    int file_dir;
+    char name[RMI_TAR_PATH_MAX];
+    char path[RMI_TAR_PATH_MAX];
+    uint64_t left;
+    uint32_t mode;
+    int64_t mtime;
+    bool ended;
+    bool broken;
+    uint32_t written;
+    uint32_t failed;
+    uint32_t skipped;
+    char *summary;
+    size_t summary_len;
+    size_t summary_cap;
+    bool summary_full;
+    struct rmi_tree_dir_time *dir_times;
+    size_t dir_times_len;
+    size_t dir_times_cap;
+    uint64_t bytes;
+    uint64_t start_us;
+    char root[PATH_MAX];
+};
+
+/*
+ * A v2 DOWNLOAD body, a DOWNLOAD_TREE archive when `tree` is set, or a
+ * paged v2 LIST or LIST2 when `list` is set,
+ * going out as DATA chunks on its request id. `credit` is how much more the client has
+ * said it can take. `compress` stays on until RMI_LZ_MAX_MISSES chunks in
+ * a row fail to shrink. A LIST stream counts directory entries in `index`
+ * and stops `limit` entries past `first` (0: no limit).
+ */
+struct rmi_bulk_stream {
+    uint32_t id;
+    int fd;
+    enum rmi_list_format list;
+    unsigned int fields;
+    struct rmi_dir_reader dir;
+    struct rmi_tree_walk *tree;
+    uint64_t index;
+    uint64_t first;
+    uint64_t limit;
+    off_t off;
+    uint64_t size;
+    uint64_t remaining;
+    uint32_t credit;
+    bool compress;
+    unsigned int misses;
+    uint64_t packed_bytes;
+    uint64_t start_us;
+    char path[PATH_MAX];
+};
+
+/* Per-connection framing state, buffers and heartbeat timer. */
+struct rmi_conn {
+    struct rmi_conn *next;
+    int fd;
+    uint32_t events;
+    bool dead;
+    bool closing;
+    bool authed;
+    int attempts;
+    uint64_t last_active_ms;
+    enum rmi_conn_state state;
+    struct rmi_job *wait_job;
+
+    /* v2 framing: frames queued now carry this request id and opcode. */
+    bool v2;
+    uint32_t reply_id;
+    uint8_t reply_op;
+    /* Set by COMPRESS; requests flagged COMPRESSED may get packed replies. */
+    bool compress;
+
+    uint8_t in[RMI_IO_BUFFER_SIZE];
+    size_t in_off;
+    size_t in_len;
+
+    struct rmi_frame *out_head;
+    struct rmi_frame *out_tail;
+    size_t out_bytes;
+
+    uint32_t batch_count;
+
+    int upload_fd;
+    bool upload_ok;
+    bool upload_tmp;
+    uint64_t upload_expected;
+    uint64_t upload_remaining;
+    int upload_pipe[2];
+    size_t upload_piped;
+    bool upload_splice;
+    uint64_t upload_start_us;
+    uint32_t upload_id;
+    bool upload_stream;
+    char upload_path[PATH_MAX];
+    char upload_write_path[PATH_MAX];
+    /*
+     * DELTA_UPLOAD: the body is rebuilt against `delta_base_fd`, the file
+     * being replaced. `delta_op` collects the body header, then each op
+     * header; `delta_literal` counts literal bytes still to come.
+     */
+    bool upload_delta;
+    int delta_base_fd;
+    uint64_t delta_base_size;
+    uint64_t delta_base_mtime;
+    mode_t delta_mode;
+    uint64_t delta_size;
+    uint64_t delta_written;
+    uint32_t delta_block;
+    uint64_t delta_hash_expected;
+    struct rmi_delta_hash delta_hash;
+    uint8_t delta_op[RMI_DELTA_HEADER_SIZE];
+    size_t delta_op_len;
+    bool delta_started;
+    uint64_t delta_literal;
+    /*
+     * A COPY op is copied RMI_DELTA_STEP bytes per loop pass from
+     * `delta_copy_off`; delta bytes that arrive meanwhile wait in
+     * `delta_stash`. A v2 upload holds back their WINDOW credit in
+     * `delta_grant` and its end in `delta_end` until both are done.
+     */
+    uint64_t delta_copy_off;
+    uint64_t delta_copy_left;
+    uint8_t *delta_stash;
+    size_t delta_stash_len;
+    size_t delta_stash_cap;
+    uint32_t delta_grant;
+    bool delta_end;
+
+    int file_fd;
+    off_t file_off;
+    uint64_t file_size;
+    uint64_t file_remaining;
+    uint64_t file_start_us;
+    bool file_copy;
+    char file_path[PATH_MAX];
+    /* v1 DOWNLOAD_TREE; file bodies go out through the file source above. */
+    struct rmi_tree_walk *tree;
+    /* UPLOAD_TREE; v1 frames are counted down in `upload_remaining`. */
+    struct rmi_tree_extract *extract;
+    uint8_t *xfer;
+    size_t xfer_off;
+    size_t xfer_len;
+
+    int cap_fd;
+    pid_t cap_pid;
+    bool cap_armed;
+    uint64_t cap_bytes;
+    uint64_t cap_start_us;
+    uint32_t cap_id;
+
+    struct rmi_bulk_stream bulk[RMI_V2_MAX_STREAMS];
+    unsigned int bulk_next;
+
+    struct rmi_screenstream *stream;
+};
+
+struct rmi_server {
+    int listen_fd;
+    int epoll_fd;
+    const char *user;
+    const char *pass;
+    struct rmi_conn *conns;
+    unsigned int conn_count;
+    enum rmi_client_result result;
+    struct rmi_conn *result_conn;
+    struct rmi_pool pool;
+    struct rmi_job *jobs;
+    unsigned int job_count;
+    uint32_t next_job_id;
+};
+
 static void
 redirect_rmi_logs(void)
 {
@@ -229,7 +737,7 @@ setup_socket(uint16_t port)
     struct sockaddr_in addr;
     int enable, s;
 
-    s = socket(AF_INET, SOCK_STREAM, 0);
+    s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     CHECKSYSCALL(s, "socket");
 
     enable = 1;
@@ -242,11 +750,47 @@ setup_socket(uint16_t port)
 
     CHECKSYSCALL(bind(s, (struct sockaddr *) &addr, sizeof(addr)), "bind");
 
-    CHECKSYSCALL(listen(s, 1), "listen");
+    CHECKSYSCALL(listen(s, RMI_MAX_CLIENTS), "listen");
 
     return s;
 }
 
+static uint64_t
+monotonic_us(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+    {
+        return 0;
+    }
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static uint64_t
+monotonic_ms(void)
+{
+    return monotonic_us() / 1000u;
+}
+
+static void
+log_transfer(const char *tag, const char *path, uint64_t bytes,
+             uint64_t start_us, const char *method)
+{
+    uint64_t elapsed_us;
+    double mbps;
+
+    elapsed_us = monotonic_us() - start_us;
+    if (elapsed_us == 0)
+    {
+        elapsed_us = 1;
+    }
+    mbps = ((double)bytes / (1024.0 * 1024.0)) / ((double)elapsed_us / 1000000.0);
+    fprintf(stderr, "RMI %s: %s %llu bytes in %llu ms (%.1f MB/s, %s)\n",
+            tag, path, (unsigned long long)bytes,
+            (unsigned long long)(elapsed_us / 1000u), mbps, method);
+}
+
 static int
 writeall(int fd, const void *buf, size_t count)
 {
@@ -277,1681 +821,9049 @@ writeall(int fd, const void *buf, size_t count)
     return 0;
 }
 
+static void
+set_reply_context(struct rmi_conn *conn, uint32_t id, uint8_t op)
+{
+    conn->reply_id = id;
+    conn->reply_op = op;
+}
+
+/*
+ * Outbound frames are queued per connection and written as the socket
+ * becomes writable, so a peer that stops reading only stalls itself.
+ * The header may announce more bytes than `len` when the rest of the
+ * payload is streamed from the connection's file source. On a v2
+ * connection the frame is stamped with the current reply context.
+ */
 static int
-read_exact(int fd, void *buf, size_t count)
+queue_frame_flags(struct rmi_conn *conn, uint32_t frame_len, uint8_t *data, size_t len,
+                  uint8_t flags)
 {
-    size_t done;
+    struct rmi_frame *frame;
 
-    done = 0;
-    while (done < count)
+    if (conn->v2 && frame_len > UINT32_MAX - RMI_V2_HEADER_SIZE)
     {
-        ssize_t n;
-
-        n = read(fd, (char *)buf + done, count - done);
-        if (n == 0)
-        {
-            return 0;
-        }
-        if (n == -1)
+        free(data);
+        return -1;
+    }
+    frame = (struct rmi_frame *)calloc(1, sizeof(*frame));
+    if (frame == NULL)
+    {
+        free(data);
+        return -1;
+    }
+    frame->header_len = RMI_FRAME_HEADER_SIZE;
+    if (conn->v2)
+    {
+        if (conn->reply_id != 0)
         {
-            if (errno == EINTR)
-            {
-                continue;
-            }
-            return -1;
+            flags |= RMI_V2_FLAG_REPLY;
         }
-        done += (size_t)n;
+        rmi_write_be32(frame->header, frame_len + RMI_V2_HEADER_SIZE);
+        rmi_v2_write_header(frame->header + RMI_FRAME_HEADER_SIZE,
+                            conn->reply_id, conn->reply_op, flags);
+        frame->header_len += RMI_V2_HEADER_SIZE;
     }
-
-    return 1;
+    else
+    {
+        rmi_write_be32(frame->header, frame_len);
+    }
+    frame->data = data;
+    frame->len = len;
+    if (conn->out_tail != NULL)
+    {
+        conn->out_tail->next = frame;
+    }
+    else
+    {
+        conn->out_head = frame;
+    }
+    conn->out_tail = frame;
+    conn->out_bytes += frame->header_len + len;
+    return 0;
 }
 
 static int
-read_frame_size(int fd, uint32_t *out_len)
+queue_frame(struct rmi_conn *conn, uint32_t frame_len, uint8_t *data, size_t len)
 {
-    uint8_t header[RMI_FRAME_HEADER_SIZE];
-    int rc;
+    return queue_frame_flags(conn, frame_len, data, len, 0);
+}
 
-    rc = read_exact(fd, header, sizeof(header));
-    if (rc <= 0)
-    {
-        return -1;
-    }
-    *out_len = rmi_read_be32(header);
-    return 0;
+static int
+send_frame_owned(struct rmi_conn *conn, uint8_t *data, uint32_t len)
+{
+    return queue_frame(conn, len, data, len);
 }
 
 static int
-drain_bytes(int fd, uint32_t len)
+send_frame(struct rmi_conn *conn, const void *buf, uint32_t len)
 {
-    char buf[4096];
-    uint32_t remaining;
+    uint8_t *copy;
 
-    remaining = len;
-    while (remaining > 0)
+    copy = NULL;
+    if (len > 0)
     {
-        size_t chunk;
-        int rc;
-
-        chunk = remaining > sizeof(buf) ? sizeof(buf) : remaining;
-        rc = read_exact(fd, buf, chunk);
-        if (rc <= 0)
+        copy = (uint8_t *)malloc(len);
+        if (copy == NULL)
         {
             return -1;
         }
-        remaining -= (uint32_t)chunk;
+        memcpy(copy, buf, len);
     }
-    return 0;
+    return send_frame_owned(conn, copy, len);
 }
 
 static int
-recv_frame_to_file(int fd, const char *path, uint32_t expected_len)
+send_text(struct rmi_conn *conn, const char *text)
 {
-    uint32_t len;
-    uint32_t remaining;
-    int out_fd;
-    const char *write_path;
-    char tmp_path[PATH_MAX];
-    bool use_tmp;
+    uint8_t *copy;
+    size_t len;
 
-    if (read_frame_size(fd, &len) == -1)
+    len = strlen(text);
+    if (len > UINT32_MAX)
     {
         return -1;
     }
-    if (len != expected_len)
+    copy = (uint8_t *)malloc(len > 0 ? len : 1);
+    if (copy == NULL)
     {
-        drain_bytes(fd, len);
         return -1;
     }
+    memcpy(copy, text, len);
+    return queue_frame_flags(conn, (uint32_t)len, copy, len,
+                             strncmp(text, RMI_RESP_ERR_PREFIX,
+                                     strlen(RMI_RESP_ERR_PREFIX)) == 0
+                             ? RMI_V2_FLAG_ERROR : 0);
+}
 
-    write_path = path;
-    use_tmp = false;
-    if (is_self_binary_path(path))
+static void
+free_frames(struct rmi_conn *conn)
+{
+    while (conn->out_head != NULL)
     {
-        if (snprintf(tmp_path, sizeof(tmp_path), "%s.new", path) >= (int)sizeof(tmp_path))
-        {
-            drain_bytes(fd, len);
-            return -1;
-        }
-        write_path = tmp_path;
-        use_tmp = true;
-    }
+        struct rmi_frame *frame;
 
-    out_fd = open(write_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-    if (out_fd == -1)
-    {
-        drain_bytes(fd, len);
-        return -1;
+        frame = conn->out_head;
+        conn->out_head = frame->next;
+        free(frame->data);
+        free(frame);
     }
+    conn->out_tail = NULL;
+    conn->out_bytes = 0;
+}
 
-    remaining = len;
-    while (remaining > 0)
+/* Returns 1 when the queue is empty, 0 when the socket would block. */
+static int
+flush_frames(struct rmi_conn *conn)
+{
+    while (conn->out_head != NULL)
     {
-        char buf[4096];
-        uint32_t chunk;
-        int rc;
+        struct rmi_frame *frame;
+        struct iovec iov[2];
+        size_t total;
+        int iovcnt;
+        ssize_t n;
 
-        chunk = remaining > sizeof(buf) ? sizeof(buf) : remaining;
-        rc = read_exact(fd, buf, chunk);
-        if (rc <= 0)
+        frame = conn->out_head;
+        total = frame->header_len + frame->len;
+        iovcnt = 0;
+        if (frame->sent < frame->header_len)
         {
-            close(out_fd);
-            return -1;
+            iov[iovcnt].iov_base = frame->header + frame->sent;
+            iov[iovcnt].iov_len = frame->header_len - frame->sent;
+            iovcnt++;
+            if (frame->len > 0)
+            {
+                iov[iovcnt].iov_base = frame->data;
+                iov[iovcnt].iov_len = frame->len;
+                iovcnt++;
+            }
         }
-        if (writeall(out_fd, buf, chunk) == -1)
+        else
         {
-            close(out_fd);
-            return -1;
-        }
-        remaining -= chunk;
-    }
+            size_t off;
 
-    close(out_fd);
-    if (use_tmp)
-    {
-        if (chmod(write_path, 0777) == -1)
-        {
-            unlink(write_path);
-            return -1;
+            off = frame->sent - frame->header_len;
+            iov[iovcnt].iov_base = frame->data + off;
+            iov[iovcnt].iov_len = frame->len - off;
+            iovcnt++;
         }
-        if (rename(write_path, path) == -1)
+
+        n = writev(conn->fd, iov, iovcnt);
+        if (n == -1)
         {
-            unlink(write_path);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
             return -1;
         }
-        return 0;
-    }
-    if (is_self_binary_path(path))
-    {
-        if (chmod(path, 0777) == -1)
+        frame->sent += (size_t)n;
+        conn->out_bytes -= (size_t)n;
+        if (frame->sent == total)
         {
-            return -1;
+            conn->out_head = frame->next;
+            if (conn->out_head == NULL)
+            {
+                conn->out_tail = NULL;
+            }
+            free(frame->data);
+            free(frame);
         }
     }
-    return 0;
+    return 1;
 }
 
-static int
-send_frame(int fd, const void *buf, uint32_t len)
+static void
+consume_input(struct rmi_conn *conn, size_t len)
 {
-    uint8_t header[RMI_FRAME_HEADER_SIZE];
-
-    rmi_write_be32(header, len);
-    if (writeall(fd, header, sizeof(header)) == -1)
+    conn->in_off += len;
+    if (conn->in_off == conn->in_len)
     {
-        return -1;
-    }
-    if (len == 0)
-    {
-        return 0;
+        conn->in_off = 0;
+        conn->in_len = 0;
     }
-    return writeall(fd, buf, len);
 }
 
-static int
-send_text(int fd, const char *text)
+static size_t
+input_available(const struct rmi_conn *conn)
 {
-    size_t len;
-
-    len = strlen(text);
-    if (len > UINT32_MAX)
-    {
-        return -1;
-    }
-    return send_frame(fd, text, (uint32_t)len);
+    return conn->in_len - conn->in_off;
 }
 
-static ssize_t
-read_command(int fd, char *buf, size_t size)
+/* Returns 1 when bytes were read, 0 when none are pending, -1 on EOF/error. */
+static int
+read_input(struct rmi_conn *conn)
 {
-    uint8_t header[RMI_FRAME_HEADER_SIZE];
-    uint32_t len;
-    int rc;
+    ssize_t n;
 
-    rc = read_exact(fd, header, sizeof(header));
-    if (rc <= 0)
+    if (conn->in_off > 0)
     {
-        return rc;
+        memmove(conn->in, conn->in + conn->in_off, conn->in_len - conn->in_off);
+        conn->in_len -= conn->in_off;
+        conn->in_off = 0;
     }
-
-    len = rmi_read_be32(header);
-    if (len == 0)
+    if (conn->in_len == sizeof(conn->in))
     {
         return 0;
     }
-    if (len >= size)
+    while (1)
     {
-        size_t remaining;
-
-        remaining = len;
-        while (remaining > 0)
+        n = read(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+        if (n == -1 && errno == EINTR)
         {
-            char tmp[256];
-            size_t chunk;
-            int rd;
-
-            chunk = remaining > sizeof(tmp) ? sizeof(tmp) : remaining;
-            rd = read_exact(fd, tmp, chunk);
-            if (rd <= 0)
-            {
-                return rd;
-            }
-            remaining -= chunk;
+            continue;
+        }
+        break;
+    }
+    if (n == 0)
+    {
+        return -1;
+    }
+    if (n == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
         }
         return -1;
     }
+    conn->in_len += (size_t)n;
+    conn->last_active_ms = monotonic_ms();
+    return 1;
+}
 
-    rc = read_exact(fd, buf, len);
-    if (rc <= 0)
+static void
+close_delta_base(struct rmi_conn *conn)
+{
+    if (conn->delta_base_fd != -1)
     {
-        return rc;
+        close(conn->delta_base_fd);
+        conn->delta_base_fd = -1;
     }
-    buf[len] = '\0';
-    return (ssize_t)len;
 }
 
+/* Opens the file a DELTA_UPLOAD is rebuilt from and notes its identity. */
 static int
-buffer_append(char **buf, size_t *len, size_t *cap, const char *text, size_t text_len)
+open_delta_base(struct rmi_conn *conn)
 {
-    size_t needed;
-    size_t new_cap;
-    char *tmp;
+    struct stat st;
 
-    if (buf == NULL || len == NULL || cap == NULL || text == NULL)
+    conn->delta_base_fd = open(conn->upload_path, O_RDONLY | O_CLOEXEC);
+    if (conn->delta_base_fd == -1)
     {
         return -1;
     }
-    needed = *len + text_len + 1;
-    if (needed > RMI_LIST_MAX_BYTES)
+    if (fstat(conn->delta_base_fd, &st) == -1 || !S_ISREG(st.st_mode))
     {
+        close_delta_base(conn);
         return -1;
     }
-    if (needed > *cap)
+    conn->delta_base_size = (uint64_t)st.st_size;
+    conn->delta_base_mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ull +
+                             (uint64_t)st.st_mtim.tv_nsec;
+    conn->delta_mode = st.st_mode & 07777;
+    return 0;
+}
+
+/*
+ * The self binary and delta uploads are written to a unique temporary next
+ * to the target and renamed over it once complete: the running binary must
+ * stay intact, and a delta reads the old file while the new one is built.
+ */
+static int
+open_upload_target(struct rmi_conn *conn)
+{
+    const char *path;
+    uint64_t size;
+
+    path = conn->upload_path;
+    snprintf(conn->upload_write_path, sizeof(conn->upload_write_path), "%s", path);
+    conn->upload_tmp = false;
+    if (is_self_binary_path(path) || conn->upload_delta)
     {
-        new_cap = *cap == 0 ? 1024 : *cap;
-        while (new_cap < needed)
+        if (snprintf(conn->upload_write_path, sizeof(conn->upload_write_path),
+                     "%s.XXXXXX", path) >= (int)sizeof(conn->upload_write_path))
         {
-            new_cap *= 2;
-            if (new_cap > RMI_LIST_MAX_BYTES)
-            {
-                new_cap = RMI_LIST_MAX_BYTES;
-                if (new_cap < needed)
-                {
-                    return -1;
-                }
-                break;
-            }
+            return -1;
         }
-        tmp = (char *)realloc(*buf, new_cap);
-        if (tmp == NULL)
+        conn->upload_tmp = true;
+    }
+    if (conn->upload_delta && open_delta_base(conn) == -1)
+    {
+        return -1;
+    }
+
+    if (conn->upload_tmp)
+    {
+        conn->upload_fd = mkostemp(conn->upload_write_path, O_CLOEXEC);
+    }
+    else
+    {
+        conn->upload_fd = open(conn->upload_write_path,
+                               O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    }
+    if (conn->upload_fd == -1)
+    {
+        close_delta_base(conn);
+        return -1;
+    }
+    /*
+     * Reserve the declared size up front so the file is laid out in one
+     * extent and a full disk fails before any data is streamed. KEEP_SIZE
+     * leaves a failed transfer truncated where it stopped.
+     */
+    size = conn->upload_delta ? conn->delta_size : conn->upload_expected;
+    if (size > 0 &&
+        fallocate(conn->upload_fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == -1 &&
+        errno == ENOSPC)
+    {
+        close(conn->upload_fd);
+        conn->upload_fd = -1;
+        close_delta_base(conn);
+        if (conn->upload_tmp)
         {
-            return -1;
+            unlink(conn->upload_write_path);
         }
-        *buf = tmp;
-        *cap = new_cap;
+        return -1;
     }
-    memcpy(*buf + *len, text, text_len);
-    *len += text_len;
-    (*buf)[*len] = '\0';
     return 0;
 }
 
 static int
-append_list_line(char **buf, size_t *len, size_t *cap, const char *line)
+write_delta_output(struct rmi_conn *conn, const uint8_t *data, size_t len)
 {
-    return buffer_append(buf, len, cap, line, strlen(line));
+    if (writeall(conn->upload_fd, data, len) == -1)
+    {
+        return -1;
+    }
+    rmi_delta_hash_update(&conn->delta_hash, data, len);
+    conn->delta_written += len;
+    return 0;
 }
 
+/*
+ * Appends up to RMI_DELTA_STEP bytes of the pending COPY span of the base
+ * file to the output.
+ */
 static int
-join_path(const char *dir, const char *name, char *out, size_t out_len)
+copy_delta_step(struct rmi_conn *conn)
 {
-    size_t dir_len;
+    uint8_t buf[RMI_V2_CHUNK_MAX];
+    size_t budget;
 
-    if (dir == NULL || name == NULL || out == NULL || out_len == 0)
+    budget = RMI_DELTA_STEP;
+    while (conn->delta_copy_left > 0 && budget > 0)
     {
-        return -1;
+        size_t chunk;
+        ssize_t n;
+
+        chunk = conn->delta_copy_left < sizeof(buf) ? (size_t)conn->delta_copy_left
+                                                    : sizeof(buf);
+        n = pread(conn->delta_base_fd, buf, chunk, (off_t)conn->delta_copy_off);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0 || write_delta_output(conn, buf, (size_t)n) == -1)
+        {
+            return -1;
+        }
+        conn->delta_copy_off += (uint64_t)n;
+        conn->delta_copy_left -= (uint64_t)n;
+        budget = budget > (size_t)n ? budget - (size_t)n : 0;
     }
-    dir_len = strlen(dir);
-    if (dir_len == 0)
+    return 0;
+}
+
+/* Bytes `delta_op` must hold before it can be run; 0 for an unknown op. */
+static size_t
+delta_op_size(const struct rmi_conn *conn)
+{
+    if (!conn->delta_started)
     {
-        return -1;
+        return RMI_DELTA_HEADER_SIZE;
     }
-    if (dir_len > 1 && dir[dir_len - 1] == '/')
+    if (conn->delta_op_len == 0)
     {
-        return snprintf(out, out_len, "%s%s", dir, name) < (int)out_len ? 0 : -1;
+        return 1;
     }
-    if (strcmp(dir, "/") == 0)
+    switch (conn->delta_op[0])
     {
-        return snprintf(out, out_len, "/%s", name) < (int)out_len ? 0 : -1;
+    case RMI_DELTA_OP_COPY:
+        return RMI_DELTA_COPY_SIZE;
+    case RMI_DELTA_OP_LITERAL:
+        return RMI_DELTA_LITERAL_SIZE;
     }
-    return snprintf(out, out_len, "%s/%s", dir, name) < (int)out_len ? 0 : -1;
+    return 0;
 }
 
+/*
+ * Runs the header or op collected in `delta_op`. The header must name the
+ * base file as it is now; ops may not reach past the base or the declared
+ * size. A COPY op only records its span; copy_delta_step() copies it.
+ */
 static int
-send_file_list(int fd, const char *path)
+run_delta_op(struct rmi_conn *conn)
 {
-    DIR *dir;
-    struct dirent *entry;
-    char *buf;
-    size_t len;
-    size_t cap;
-    int rc;
+    const uint8_t *op;
+    uint64_t off;
+    uint64_t len;
 
-    if (path == NULL || *path == '\0')
+    op = conn->delta_op;
+    if (!conn->delta_started)
+    {
+        conn->delta_block = rmi_read_be32(op);
+        if (conn->delta_block < RMI_DELTA_BLOCK_MIN ||
+            conn->delta_block > RMI_DELTA_BLOCK_MAX ||
+            rmi_read_be64(op + 4) != conn->delta_base_size ||
+            rmi_read_be64(op + 12) != conn->delta_base_mtime)
+        {
+            return -1;
+        }
+        conn->delta_hash_expected = rmi_read_be64(op + 20);
+        conn->delta_started = true;
+        return 0;
+    }
+    if (op[0] == RMI_DELTA_OP_LITERAL)
+    {
+        conn->delta_literal = rmi_read_be32(op + 1);
+        return conn->delta_literal <= conn->delta_size - conn->delta_written ? 0 : -1;
+    }
+    off = (uint64_t)rmi_read_be32(op + 1) * conn->delta_block;
+    len = (uint64_t)rmi_read_be32(op + 5) * conn->delta_block;
+    if (len == 0 || off >= conn->delta_base_size)
     {
         return -1;
     }
-    dir = opendir(path);
-    if (dir == NULL)
+    if (len > conn->delta_base_size - off)
+    {
+        len = conn->delta_base_size - off;
+    }
+    if (len > conn->delta_size - conn->delta_written)
     {
         return -1;
     }
-    buf = NULL;
-    len = 0;
-    cap = 0;
+    conn->delta_copy_off = off;
+    conn->delta_copy_left = len;
+    return 0;
+}
 
-    while ((entry = readdir(dir)) != NULL)
+/*
+ * Feeds DELTA_UPLOAD body bytes up to the next COPY op and stores how many
+ * were taken in `*used`; -1 on a malformed delta or a write error.
+ */
+static int
+apply_delta(struct rmi_conn *conn, const uint8_t *data, size_t len, size_t *used)
+{
+    *used = 0;
+    while (1)
     {
-        char full_path[PATH_MAX];
-        struct stat st;
-        char line[PATH_MAX + 64];
-        int line_len;
+        size_t need;
+        size_t take;
 
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        if (conn->delta_copy_left > 0)
         {
-            continue;
+            return 0;
         }
-        if (join_path(path, entry->d_name, full_path, sizeof(full_path)) == -1)
+        need = delta_op_size(conn);
+        if (need == 0)
         {
-            continue;
+            return -1;
         }
-        if (lstat(full_path, &st) == -1)
+        if (conn->delta_op_len == need)
         {
+            if (run_delta_op(conn) == -1)
+            {
+                return -1;
+            }
+            conn->delta_op_len = 0;
             continue;
         }
-
-        if (S_ISDIR(st.st_mode))
-        {
-            line_len = snprintf(line, sizeof(line), "D\t%s\n", entry->d_name);
-        }
-        else
+        if (len == 0)
         {
-            line_len = snprintf(line, sizeof(line), "F\t%s\t%lld\n",
-                                entry->d_name,
-                                (long long)st.st_size);
+            return 0;
         }
-        if (line_len < 0 || (size_t)line_len >= sizeof(line))
+        if (conn->delta_literal > 0)
         {
-            continue;
+            take = len < conn->delta_literal ? len : (size_t)conn->delta_literal;
+            if (write_delta_output(conn, data, take) == -1)
+            {
+                return -1;
+            }
+            conn->delta_literal -= take;
         }
-        if (append_list_line(&buf, &len, &cap, line) == -1)
+        else
         {
-            free(buf);
-            closedir(dir);
-            return -1;
+            take = need - conn->delta_op_len;
+            if (take > len)
+            {
+                take = len;
+            }
+            memcpy(conn->delta_op + conn->delta_op_len, data, take);
+            conn->delta_op_len += take;
         }
+        data += take;
+        len -= take;
+        *used += take;
     }
+}
 
-    closedir(dir);
-    if (buf == NULL)
-    {
-        return send_frame(fd, "", 0);
-    }
-    rc = send_frame(fd, buf, (uint32_t)len);
-    free(buf);
-    return rc;
+static bool
+delta_busy(const struct rmi_conn *conn)
+{
+    return conn->delta_copy_left > 0 || conn->delta_stash_len > 0;
 }
 
+/*
+ * Applies delta bytes as far as the next COPY op and keeps the rest in
+ * the stash until the copy is done.
+ */
 static int
-send_file_payload(int fd, int file_fd, uint32_t size)
+feed_delta(struct rmi_conn *conn, const uint8_t *data, size_t len)
 {
-    uint8_t header[RMI_FRAME_HEADER_SIZE];
-    uint32_t remaining;
+    size_t used;
 
-    rmi_write_be32(header, size);
-    if (writeall(fd, header, sizeof(header)) == -1)
+    used = 0;
+    if (!delta_busy(conn) && apply_delta(conn, data, len, &used) == -1)
+    {
+        return -1;
+    }
+    if (used == len)
+    {
+        return 0;
+    }
+    if (conn->delta_stash_len + (len - used) > RMI_DELTA_STASH_MAX)
     {
         return -1;
     }
-    remaining = size;
-    while (remaining > 0)
+    if (conn->delta_stash_len + (len - used) > conn->delta_stash_cap)
     {
-        char buf[4096];
-        ssize_t rd;
-        uint32_t chunk;
+        uint8_t *next;
 
-        chunk = remaining > sizeof(buf) ? sizeof(buf) : remaining;
-        rd = read(file_fd, buf, chunk);
-        if (rd <= 0)
+        next = (uint8_t *)realloc(conn->delta_stash, RMI_DELTA_STASH_MAX);
+        if (next == NULL)
         {
             return -1;
         }
-        if (writeall(fd, buf, (size_t)rd) == -1)
-        {
-            return -1;
-        }
-        remaining -= (uint32_t)rd;
+        conn->delta_stash = next;
+        conn->delta_stash_cap = RMI_DELTA_STASH_MAX;
     }
+    memcpy(conn->delta_stash + conn->delta_stash_len, data + used, len - used);
+    conn->delta_stash_len += len - used;
     return 0;
 }
 
+/*
+ * Copies the next step of a pending COPY op, then applies stashed bytes
+ * up to the COPY op after that. Returns -1 on failure.
+ */
 static int
-handle_download(int client_fd, const char *path)
+step_delta(struct rmi_conn *conn)
 {
-    int file_fd;
-    struct stat st;
+    size_t used;
 
-    if (path == NULL || *path == '\0')
-    {
-        return -1;
-    }
-    file_fd = open(path, O_RDONLY);
-    if (file_fd == -1)
+    if (copy_delta_step(conn) == -1)
     {
         return -1;
     }
-    if (fstat(file_fd, &st) == -1)
+    if (conn->delta_copy_left > 0 || conn->delta_stash_len == 0)
     {
-        close(file_fd);
-        return -1;
+        return 0;
     }
-    if (!S_ISREG(st.st_mode))
+    if (apply_delta(conn, conn->delta_stash, conn->delta_stash_len, &used) == -1)
     {
-        close(file_fd);
         return -1;
     }
-    if (st.st_size < 0 || st.st_size > UINT32_MAX)
+    memmove(conn->delta_stash, conn->delta_stash + used, conn->delta_stash_len - used);
+    conn->delta_stash_len -= used;
+    return 0;
+}
+
+static void
+clear_delta_backlog(struct rmi_conn *conn)
+{
+    conn->delta_copy_left = 0;
+    conn->delta_stash_len = 0;
+}
+
+/*
+ * Checks a rebuilt file against the size and hash the client declared and
+ * gives it the mode of the file it replaces.
+ */
+static int
+finish_delta(struct rmi_conn *conn)
+{
+    if (!conn->delta_started || conn->delta_op_len != 0 || conn->delta_literal != 0 ||
+        conn->delta_written != conn->delta_size ||
+        rmi_delta_hash_final(&conn->delta_hash) != conn->delta_hash_expected)
     {
-        close(file_fd);
         return -1;
     }
-    if (send_text(client_fd, RMI_RESP_OK) == -1)
+    return fchmod(conn->upload_fd, conn->delta_mode);
+}
+
+/* Writes upload body bytes to the target, or applies them as a delta. */
+static int
+upload_write(struct rmi_conn *conn, const uint8_t *data, size_t len)
+{
+    if (conn->upload_delta)
     {
-        close(file_fd);
-        return -1;
+        return feed_delta(conn, data, len);
     }
-    if (send_file_payload(client_fd, file_fd, (uint32_t)st.st_size) == -1)
+    return writeall(conn->upload_fd, data, len);
+}
+
+/* Makes the next upload a plain one, or a delta building `size` bytes. */
+static void
+set_upload_delta(struct rmi_conn *conn, bool delta, uint64_t size)
+{
+    conn->upload_delta = delta;
+    conn->delta_size = size;
+    conn->delta_written = 0;
+    conn->delta_op_len = 0;
+    conn->delta_started = false;
+    conn->delta_literal = 0;
+    conn->delta_grant = 0;
+    conn->delta_end = false;
+    clear_delta_backlog(conn);
+    rmi_delta_hash_init(&conn->delta_hash);
+}
+
+static void
+close_upload_pipe(struct rmi_conn *conn)
+{
+    if (conn->upload_pipe[0] != -1)
     {
-        close(file_fd);
-        return -1;
+        close(conn->upload_pipe[0]);
+        close(conn->upload_pipe[1]);
+        conn->upload_pipe[0] = -1;
+        conn->upload_pipe[1] = -1;
     }
-    close(file_fd);
-    return 0;
+    conn->upload_piped = 0;
 }
 
 static int
-remove_tree(const char *path)
+finish_upload(struct rmi_conn *conn)
 {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat st;
+    const char *path;
+    const char *write_path;
 
-    if (path == NULL || *path == '\0')
+    path = conn->upload_path;
+    write_path = conn->upload_write_path;
+    close_upload_pipe(conn);
+    if (delta_busy(conn))
     {
-        return -1;
+        clear_delta_backlog(conn);
+        conn->upload_ok = false;
     }
-    if (strcmp(path, "/") == 0)
+    if (conn->upload_fd != -1)
     {
-        return -1;
+        if (conn->upload_ok && conn->upload_delta && finish_delta(conn) == -1)
+        {
+            conn->upload_ok = false;
+        }
+        if (conn->upload_ok && rmi_upload_fsync == RMI_FSYNC_SYNC &&
+            fsync(conn->upload_fd) == -1)
+        {
+            conn->upload_ok = false;
+        }
+        close(conn->upload_fd);
+        conn->upload_fd = -1;
     }
-    if (lstat(path, &st) == -1)
+    close_delta_base(conn);
+    if (!conn->upload_ok)
     {
+        if (conn->upload_tmp)
+        {
+            unlink(write_path);
+        }
         return -1;
     }
-    if (S_ISDIR(st.st_mode))
+    if (is_self_binary_path(path))
     {
-        dir = opendir(path);
-        if (dir == NULL)
+        if (chmod(write_path, 0777) == -1)
         {
+            if (conn->upload_tmp)
+            {
+                unlink(write_path);
+            }
             return -1;
         }
-        while ((entry = readdir(dir)) != NULL)
+    }
+    if (conn->upload_tmp)
+    {
+        if (rename(write_path, path) == -1)
         {
-            char child_path[PATH_MAX];
-
-            if (strcmp(entry->d_name, ".") == 0 ||
-                strcmp(entry->d_name, "..") == 0)
-            {
-                continue;
-            }
-            if (join_path(path, entry->d_name, child_path, sizeof(child_path)) == -1)
-            {
-                closedir(dir);
-                return -1;
-            }
-            if (remove_tree(child_path) == -1)
-            {
-                closedir(dir);
-                return -1;
-            }
+            unlink(write_path);
+            return -1;
         }
-        closedir(dir);
-        return rmdir(path);
     }
+    return 0;
+}
+
+/*
+ * Expects the UPLOAD body as the next frame. With `delta` the body is a
+ * DELTA_UPLOAD delta rebuilding a `size`-byte file.
+ */
+static void
+start_upload(struct rmi_conn *conn, const char *path, uint32_t expected_len,
+             bool delta, uint64_t size)
+{
+    snprintf(conn->upload_path, sizeof(conn->upload_path), "%s", path);
+    set_upload_delta(conn, delta, size);
+    conn->upload_expected = expected_len;
+    conn->upload_remaining = 0;
+    conn->upload_ok = false;
+    conn->upload_fd = -1;
+    conn->upload_splice = !delta;
+    conn->upload_start_us = monotonic_us();
+    conn->state = RMI_CONN_UPLOAD_HEADER;
+}
 
-    return unlink(path);
+/*
+ * Whether the rest of the UPLOAD body can move socket -> pipe -> file
+ * with splice() instead of going through the input buffer.
+ */
+static bool
+upload_can_splice(const struct rmi_conn *conn)
+{
+    return conn->state == RMI_CONN_UPLOAD_BODY &&
+           conn->upload_ok &&
+           conn->upload_splice &&
+           conn->upload_remaining > 0 &&
+           input_available(conn) == 0;
 }
 
-static int
-check_restart_permissions(void)
+static void
+disable_upload_splice(struct rmi_conn *conn, int err)
 {
-    char path[PATH_MAX];
-    struct stat st;
-    unsigned int mode;
+    fprintf(stderr, "RMI upload: splice unavailable (%d), using copy loop\n", err);
+    conn->upload_splice = false;
+    close_upload_pipe(conn);
+}
 
-    snprintf(path, sizeof(path), "%s", "/data/local/tmp/rmi");
-    if (stat(path, &st) == -1)
-    {
-        fprintf(stderr, "RMI restart: stat failed for %s: %d\n", path, errno);
-        return -1;
-    }
-    if (!S_ISREG(st.st_mode))
+static int
+open_upload_pipe(struct rmi_conn *conn)
+{
+    if (conn->upload_pipe[0] != -1)
     {
-        fprintf(stderr, "RMI restart: %s is not a regular file.\n", path);
-        return -1;
+        return 0;
     }
-    mode = (unsigned int)(st.st_mode & 0777);
-    if (mode != 0777)
+    if (pipe2(conn->upload_pipe, O_CLOEXEC) == -1)
     {
-        fprintf(stderr, "RMI restart: %s has mode %o, expected 777.\n", path, mode);
+        conn->upload_pipe[0] = -1;
+        conn->upload_pipe[1] = -1;
         return -1;
     }
+    /* Best effort: a bigger pipe means fewer splice() round trips. */
+    fcntl(conn->upload_pipe[1], F_SETPIPE_SZ, (int)RMI_SPLICE_PIPE_SIZE);
     return 0;
 }
 
-static void
-trim_space(char *s)
+/* Moves everything parked in the pipe into the target file. */
+static int
+drain_upload_pipe(struct rmi_conn *conn)
 {
-    size_t len;
-    char *start;
-
-    start = s;
-    while (*start == ' ' || *start == '\t' || *start == '\r' || *start == '\n')
-    {
-        start++;
-    }
-    if (start != s)
+    while (conn->upload_piped > 0)
     {
-        memmove(s, start, strlen(start) + 1);
-    }
+        ssize_t n;
 
-    len = strlen(s);
-    while (len > 0)
-    {
-        char c = s[len - 1];
-        if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+        n = splice(conn->upload_pipe[0], NULL, conn->upload_fd, NULL,
+                   conn->upload_piped, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR)
         {
-            break;
+            continue;
         }
-        s[len - 1] = '\0';
-        len--;
+        if (n <= 0)
+        {
+            return -1;
+        }
+        conn->upload_piped -= (size_t)n;
     }
+    return 0;
 }
 
+/*
+ * Splices UPLOAD body bytes straight from the socket into the target file.
+ * Returns 1 on progress, 0 when the socket has nothing more for now (or
+ * splice() is unsupported and the copy loop takes over), -1 when the peer
+ * went away.
+ */
 static int
-copy_field(char *dst, size_t dst_len, const char *src)
+splice_upload_body(struct rmi_conn *conn)
 {
-    size_t len;
+    size_t budget;
+    bool progressed;
 
-    len = strlen(src);
-    if (len == 0 || len >= dst_len)
+    if (open_upload_pipe(conn) == -1)
     {
-        return -1;
+        disable_upload_splice(conn, errno);
+        return 0;
     }
-    snprintf(dst, dst_len, "%s", src);
-    return 0;
-}
+    budget = RMI_FLUSH_BUDGET;
+    progressed = false;
+    while (conn->upload_remaining > 0 && budget > 0)
+    {
+        size_t chunk;
+        ssize_t n;
+
+        chunk = RMI_SPLICE_PIPE_SIZE;
+        if (conn->upload_remaining < chunk)
+        {
+            chunk = (size_t)conn->upload_remaining;
+        }
+        n = splice(conn->fd, NULL, conn->upload_pipe[1], NULL, chunk,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+            {
+                disable_upload_splice(conn, errno);
+                break;
+            }
+            return -1;
+        }
+        if (n == 0)
+        {
+            return -1;
+        }
+        conn->upload_piped += (size_t)n;
+        conn->upload_remaining -= (uint64_t)n;
+        budget = budget > (size_t)n ? budget - (size_t)n : 0;
+        progressed = true;
+        if (drain_upload_pipe(conn) == -1)
+        {
+            /* Closing the pipe discards what it holds; keep draining the socket. */
+            conn->upload_ok = false;
+            close_upload_pipe(conn);
+            break;
+        }
+    }
+    if (progressed)
+    {
+        conn->last_active_ms = monotonic_ms();
+    }
+    return progressed ? 1 : 0;
+}
+
+static struct rmi_job *submit_job(struct rmi_server *srv, enum rmi_job_kind kind,
+                                  int keycode, const char *arg);
+
+/* Closes the upload target and answers the UPLOAD or DELTA_UPLOAD request. */
+static void
+complete_upload(struct rmi_server *srv, struct rmi_conn *conn)
+{
+    set_reply_context(conn, conn->upload_id,
+                      conn->upload_delta ? RMI_OP_DELTA_UPLOAD : RMI_OP_UPLOAD);
+    if (finish_upload(conn) == 0)
+    {
+        log_transfer("upload", conn->upload_path,
+                     conn->upload_delta ? conn->delta_size : conn->upload_expected,
+                     conn->upload_start_us,
+                     conn->upload_delta ? "delta" : conn->upload_splice ? "splice" : "copy");
+        if (rmi_upload_fsync == RMI_FSYNC_DEFERRED &&
+            submit_job(srv, RMI_JOB_FSYNC, 0, conn->upload_path) == NULL)
+        {
+            fprintf(stderr, "RMI upload: deferred fsync not queued for %s\n",
+                    conn->upload_path);
+        }
+        send_text(conn, RMI_RESP_OK);
+    }
+    else
+    {
+        send_text(conn, conn->upload_delta ? "ERR delta_upload" : "ERR upload");
+    }
+}
+
+/*
+ * Consumes the UPLOAD payload frame as it arrives: whatever is already in
+ * the input buffer is written out, the rest is spliced from the socket.
+ * A size mismatch or an unwritable target still drains the frame so the
+ * stream stays in sync, then answers `ERR upload`. A delta waits here
+ * while service_deltas() works through a COPY op.
+ * Returns 1 once the upload is answered, 0 while more bytes are needed,
+ * -1 when the connection failed mid-body.
+ */
+static int
+recv_frame_to_file(struct rmi_server *srv, struct rmi_conn *conn)
+{
+    size_t chunk;
+
+    if (conn->state == RMI_CONN_UPLOAD_HEADER)
+    {
+        uint32_t len;
+
+        if (input_available(conn) < RMI_FRAME_HEADER_SIZE)
+        {
+            return 0;
+        }
+        len = rmi_read_be32(conn->in + conn->in_off);
+        consume_input(conn, RMI_FRAME_HEADER_SIZE);
+        conn->upload_remaining = len;
+        conn->upload_ok = (len == conn->upload_expected) &&
+                          open_upload_target(conn) == 0;
+        conn->state = RMI_CONN_UPLOAD_BODY;
+    }
+    if (conn->upload_ok && delta_busy(conn))
+    {
+        return 0;
+    }
+
+    chunk = input_available(conn);
+    if (chunk > conn->upload_remaining)
+    {
+        chunk = (size_t)conn->upload_remaining;
+    }
+    if (chunk > 0 && conn->upload_ok)
+    {
+        if (upload_write(conn, conn->in + conn->in_off, chunk) == -1)
+        {
+            conn->upload_ok = false;
+        }
+    }
+    consume_input(conn, chunk);
+    conn->upload_remaining -= chunk;
+    if (upload_can_splice(conn) && splice_upload_body(conn) == -1)
+    {
+        return -1;
+    }
+    if (conn->upload_remaining > 0 || (conn->upload_ok && delta_busy(conn)))
+    {
+        return 0;
+    }
+
+    conn->state = RMI_CONN_COMMAND;
+    complete_upload(srv, conn);
+    return 1;
+}
+
+/*
+ * v2 UPLOAD: the body arrives as DATA chunks on the request id while other
+ * requests keep flowing. One upload per connection at a time. A
+ * DELTA_UPLOAD sends its `size`-byte delta the same way, with `delta_size`
+ * the size of the file it rebuilds.
+ */
+static void
+start_upload_stream(struct rmi_conn *conn, uint32_t id, const char *path, uint64_t size,
+                    bool delta, uint64_t delta_size)
+{
+    if (conn->upload_stream || path[0] == '\0')
+    {
+        send_text(conn, delta ? "ERR delta_upload" : "ERR upload");
+        return;
+    }
+    snprintf(conn->upload_path, sizeof(conn->upload_path), "%s", path);
+    set_upload_delta(conn, delta, delta_size);
+    conn->upload_expected = size;
+    conn->upload_remaining = size;
+    conn->upload_splice = false;
+    conn->upload_start_us = monotonic_us();
+    conn->upload_ok = open_upload_target(conn) == 0;
+    if (!conn->upload_ok)
+    {
+        finish_upload(conn);
+        send_text(conn, delta ? "ERR delta_upload" : "ERR upload");
+        return;
+    }
+    conn->upload_id = id;
+    conn->upload_stream = true;
+}
+
+static void tree_extract_feed(struct rmi_tree_extract *x, const uint8_t *data, size_t len);
+static void complete_tree_upload(struct rmi_server *srv, struct rmi_conn *conn);
+
+/*
+ * Writes one DATA chunk of the active v2 upload, or unpacks it for an
+ * UPLOAD_TREE, and hands the space back
+ * to the client, counting packed chunks at their size on the wire. Chunks
+ * for other ids belong to uploads that were refused and are dropped. While
+ * a delta works through a COPY op, the credit and the end of the upload
+ * wait for service_deltas().
+ */
+static void
+recv_upload_chunk(struct rmi_server *srv, struct rmi_conn *conn, uint32_t id,
+                  uint8_t flags, const uint8_t *data, uint32_t len)
+{
+    uint8_t raw[RMI_V2_CHUNK_MAX];
+    uint8_t *grant;
+    uint32_t wire;
+    size_t raw_len;
+
+    if (!conn->upload_stream || id != conn->upload_id)
+    {
+        return;
+    }
+    wire = len;
+    if (flags & RMI_V2_FLAG_COMPRESSED)
+    {
+        if (!conn->compress ||
+            rmi_lz_unpack(data, len, raw, sizeof(raw), &raw_len) == -1)
+        {
+            conn->upload_ok = false;
+            raw_len = 0;
+        }
+        data = raw;
+        len = (uint32_t)raw_len;
+    }
+    if (conn->extract != NULL)
+    {
+        if (!conn->upload_ok)
+        {
+            conn->extract->broken = true;
+        }
+        tree_extract_feed(conn->extract, data, len);
+    }
+    else
+    {
+        if (len > conn->upload_remaining)
+        {
+            conn->upload_ok = false;
+            len = (uint32_t)conn->upload_remaining;
+        }
+        if (len > 0 && conn->upload_ok && upload_write(conn, data, len) == -1)
+        {
+            conn->upload_ok = false;
+        }
+        conn->upload_remaining -= len;
+        if (conn->upload_ok && delta_busy(conn))
+        {
+            conn->delta_grant += wire;
+            conn->delta_end = (flags & RMI_V2_FLAG_END) != 0;
+            return;
+        }
+    }
+    if (flags & RMI_V2_FLAG_END)
+    {
+        conn->upload_stream = false;
+        if (conn->extract != NULL)
+        {
+            complete_tree_upload(srv, conn);
+            return;
+        }
+        if (conn->upload_remaining != 0)
+        {
+            conn->upload_ok = false;
+        }
+        complete_upload(srv, conn);
+        return;
+    }
+    grant = (uint8_t *)malloc(4);
+    if (grant == NULL)
+    {
+        return;
+    }
+    rmi_write_be32(grant, wire);
+    set_reply_context(conn, id, RMI_OP_WINDOW);
+    send_frame_owned(conn, grant, 4);
+}
+
+/*
+ * Takes one step on a DELTA_UPLOAD that is copying from its base file.
+ * Once it has caught up, a v2 upload gets the credit it held back, or its
+ * answer if the end already came in; a v1 upload carries on reading its
+ * frame when service_conn() runs next.
+ */
+static void
+pump_delta(struct rmi_server *srv, struct rmi_conn *conn)
+{
+    uint8_t *grant;
+
+    if (step_delta(conn) == -1)
+    {
+        clear_delta_backlog(conn);
+        conn->upload_ok = false;
+    }
+    if (delta_busy(conn) || !conn->upload_stream)
+    {
+        return;
+    }
+    if (conn->delta_end)
+    {
+        conn->upload_stream = false;
+        if (conn->upload_remaining != 0)
+        {
+            conn->upload_ok = false;
+        }
+        complete_upload(srv, conn);
+        return;
+    }
+    if (conn->delta_grant == 0 || (grant = (uint8_t *)malloc(4)) == NULL)
+    {
+        return;
+    }
+    rmi_write_be32(grant, conn->delta_grant);
+    conn->delta_grant = 0;
+    set_reply_context(conn, conn->upload_id, RMI_OP_WINDOW);
+    send_frame_owned(conn, grant, 4);
+}
+
+static int
+buffer_append(char **buf, size_t *len, size_t *cap, const char *text, size_t text_len)
+{
+    size_t needed;
+    size_t new_cap;
+    char *tmp;
+
+    if (buf == NULL || len == NULL || cap == NULL || text == NULL)
+    {
+        return -1;
+    }
+    needed = *len + text_len + 1;
+    if (needed > RMI_LIST_MAX_BYTES)
+    {
+        return -1;
+    }
+    if (needed > *cap)
+    {
+        new_cap = *cap == 0 ? 1024 : *cap;
+        while (new_cap < needed)
+        {
+            new_cap *= 2;
+            if (new_cap > RMI_LIST_MAX_BYTES)
+            {
+                new_cap = RMI_LIST_MAX_BYTES;
+                if (new_cap < needed)
+                {
+                    return -1;
+                }
+                break;
+            }
+        }
+        tmp = (char *)realloc(*buf, new_cap);
+        if (tmp == NULL)
+        {
+            return -1;
+        }
+        *buf = tmp;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, text, text_len);
+    *len += text_len;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+static int
+append_list_line(char **buf, size_t *len, size_t *cap, const char *line)
+{
+    return buffer_append(buf, len, cap, line, strlen(line));
+}
+
+/*
+ * Queues `data` as one frame, packed when `compress` is set and packing
+ * pays off. Takes ownership of `data`.
+ */
+static int
+send_frame_packed(struct rmi_conn *conn, uint8_t *data, uint32_t len, bool compress)
+{
+    uint8_t *packed;
+    size_t packed_len;
+
+    if (!compress)
+    {
+        return send_frame_owned(conn, data, len);
+    }
+    packed = (uint8_t *)malloc(rmi_lz_pack_bound(len));
+    if (packed == NULL)
+    {
+        return send_frame_owned(conn, data, len);
+    }
+    packed_len = rmi_lz_pack(data, len, packed, rmi_lz_pack_bound(len));
+    if (packed_len == 0)
+    {
+        free(packed);
+        return send_frame_owned(conn, data, len);
+    }
+    free(data);
+    return queue_frame_flags(conn, (uint32_t)packed_len, packed, packed_len,
+                             RMI_V2_FLAG_COMPRESSED);
+}
+
+static bool
+is_dot_entry(const char *name)
+{
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+static int
+dir_reader_open(struct rmi_dir_reader *dr, const char *path)
+{
+    dr->len = 0;
+    dr->off = 0;
+    dr->buf = NULL;
+    dr->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dr->fd == -1)
+    {
+        return -1;
+    }
+    dr->buf = (uint8_t *)malloc(RMI_DENTS_BUFFER_SIZE);
+    if (dr->buf == NULL)
+    {
+        close(dr->fd);
+        dr->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+dir_reader_close(struct rmi_dir_reader *dr)
+{
+    if (dr->fd != -1)
+    {
+        close(dr->fd);
+        dr->fd = -1;
+    }
+    free(dr->buf);
+    dr->buf = NULL;
+}
+
+/*
+ * Returns the next entry other than `.` and `..`, or NULL at the end of
+ * the directory (errno 0) or on error.
+ */
+static const struct rmi_dirent64 *
+dir_reader_next(struct rmi_dir_reader *dr)
+{
+    while (1)
+    {
+        const struct rmi_dirent64 *d;
+        long n;
+
+        if (dr->off >= dr->len)
+        {
+            do
+            {
+                n = syscall(SYS_getdents64, dr->fd, dr->buf, RMI_DENTS_BUFFER_SIZE);
+            }
+            while (n == -1 && errno == EINTR);
+            if (n <= 0)
+            {
+                if (n == 0)
+                {
+                    errno = 0;
+                }
+                return NULL;
+            }
+            dr->len = (size_t)n;
+            dr->off = 0;
+        }
+        d = (const struct rmi_dirent64 *)(dr->buf + dr->off);
+        dr->off += d->d_reclen;
+        if (!is_dot_entry(d->d_name))
+        {
+            return d;
+        }
+    }
+}
+
+static uint8_t
+list_type_from_mode(mode_t mode)
+{
+    if (S_ISREG(mode))
+    {
+        return RMI_LIST2_TYPE_FILE;
+    }
+    if (S_ISDIR(mode))
+    {
+        return RMI_LIST2_TYPE_DIR;
+    }
+    if (S_ISLNK(mode))
+    {
+        return RMI_LIST2_TYPE_LINK;
+    }
+    return RMI_LIST2_TYPE_OTHER;
+}
+
+static uint8_t
+list_type_from_dtype(unsigned char d_type)
+{
+    switch (d_type)
+    {
+    case DT_REG:
+        return RMI_LIST2_TYPE_FILE;
+    case DT_DIR:
+        return RMI_LIST2_TYPE_DIR;
+    case DT_LNK:
+        return RMI_LIST2_TYPE_LINK;
+    default:
+        return RMI_LIST2_TYPE_OTHER;
+    }
+}
+
+/*
+ * Fills `entry` for `d` with the `want` fields. fstatat() is only called
+ * for what d_type cannot answer: an unknown type, the mode or mtime, or
+ * the size of anything but a directory (always sent as 0). Returns -1 when
+ * the entry is gone.
+ */
+static int
+stat_list_entry(int dir_fd, const struct rmi_dirent64 *d, unsigned int want,
+                struct rmi_list_entry *entry)
+{
+    struct stat st;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->name = d->d_name;
+    entry->type = list_type_from_dtype(d->d_type);
+    entry->fields = (uint8_t)(want & RMI_LIST2_FIELDS_ALL);
+    if (want & RMI_LIST2_FIELD_INODE)
+    {
+        entry->ino = d->d_ino;
+    }
+    if (d->d_type != DT_UNKNOWN &&
+        !(want & (RMI_LIST2_FIELD_MODE | RMI_LIST2_FIELD_MTIME)) &&
+        (!(want & RMI_LIST2_FIELD_SIZE) || entry->type == RMI_LIST2_TYPE_DIR))
+    {
+        return 0;
+    }
+    if (fstatat(dir_fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+        return -1;
+    }
+    entry->type = list_type_from_mode(st.st_mode);
+    if (want & RMI_LIST2_FIELD_MODE)
+    {
+        entry->mode = (uint32_t)st.st_mode;
+    }
+    if ((want & RMI_LIST2_FIELD_SIZE) && entry->type != RMI_LIST2_TYPE_DIR)
+    {
+        entry->size = st.st_size > 0 ? (uint64_t)st.st_size : 0;
+    }
+    if (want & RMI_LIST2_FIELD_MTIME)
+    {
+        entry->mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ull +
+                          (uint64_t)st.st_mtim.tv_nsec;
+    }
+    return 0;
+}
+
+/*
+ * Formats `entry` as a LIST line or a LIST2 record into `out`. Returns the
+ * length, or -1 when it does not fit.
+ */
+static int
+format_list_entry(enum rmi_list_format format, const struct rmi_list_entry *entry,
+                  uint8_t *out, size_t size)
+{
+    size_t name_len;
+    int len;
+
+    if (format == RMI_LIST_TEXT)
+    {
+        if (entry->type == RMI_LIST2_TYPE_DIR)
+        {
+            len = snprintf((char *)out, size, "D\t%s\n", entry->name);
+        }
+        else
+        {
+            len = snprintf((char *)out, size, "F\t%s\t%llu\n", entry->name,
+                           (unsigned long long)entry->size);
+        }
+        return len < 0 || (size_t)len >= size ? -1 : len;
+    }
+
+    name_len = strlen(entry->name);
+    if (size < RMI_LIST2_RECORD_HEADER_SIZE + name_len)
+    {
+        return -1;
+    }
+    rmi_write_be16(out, (uint16_t)(RMI_LIST2_RECORD_HEADER_SIZE + name_len));
+    out[2] = entry->type;
+    out[3] = entry->fields;
+    rmi_write_be32(out + 4, entry->mode);
+    rmi_write_be64(out + 8, entry->size);
+    rmi_write_be64(out + 16, entry->mtime_ns);
+    rmi_write_be64(out + 24, entry->ino);
+    memcpy(out + RMI_LIST2_RECORD_HEADER_SIZE, entry->name, name_len);
+    return (int)(RMI_LIST2_RECORD_HEADER_SIZE + name_len);
+}
+
+/* Formats the end of a page that has more entries from `next` on. */
+static int
+format_list_next(enum rmi_list_format format, uint64_t next, uint8_t *out, size_t size)
+{
+    struct rmi_list_entry entry;
+
+    if (format == RMI_LIST_TEXT)
+    {
+        return snprintf((char *)out, size, "N\t%llu\n", (unsigned long long)next);
+    }
+    memset(&entry, 0, sizeof(entry));
+    entry.name = "";
+    entry.type = RMI_LIST2_TYPE_NEXT;
+    entry.size = next;
+    return format_list_entry(format, &entry, out, size);
+}
+
+/*
+ * Sends the listing of `path` as one frame. Entries are counted from 0 in
+ * directory order, skipping `.` and `..`; `offset` skips that many and a
+ * non-zero `limit` stops after that many, ending the page with a marker
+ * that holds the next offset when entries remain.
+ */
+static int
+send_file_list(struct rmi_conn *conn, const char *path, enum rmi_list_format format,
+               unsigned int fields, uint64_t offset, uint64_t limit, bool compress)
+{
+    struct rmi_dir_reader dir;
+    const struct rmi_dirent64 *d;
+    char *buf;
+    size_t len;
+    size_t cap;
+    uint64_t index;
+    bool more;
+
+    if (path == NULL || *path == '\0')
+    {
+        return -1;
+    }
+    if (dir_reader_open(&dir, path) == -1)
+    {
+        return -1;
+    }
+    buf = NULL;
+    len = 0;
+    cap = 0;
+    index = 0;
+    more = false;
+
+    while ((d = dir_reader_next(&dir)) != NULL)
+    {
+        struct rmi_list_entry entry;
+        uint8_t line[RMI_LIST_LINE_MAX];
+        uint64_t pos;
+        int line_len;
+
+        pos = index++;
+        if (pos < offset)
+        {
+            continue;
+        }
+        if (limit > 0 && pos - offset >= limit)
+        {
+            line_len = format_list_next(format, pos, line, sizeof(line));
+            more = true;
+        }
+        else if (stat_list_entry(dir.fd, d, fields, &entry) == -1)
+        {
+            continue;
+        }
+        else
+        {
+            line_len = format_list_entry(format, &entry, line, sizeof(line));
+        }
+        if (line_len < 0)
+        {
+            continue;
+        }
+        if (buffer_append(&buf, &len, &cap, (const char *)line, (size_t)line_len) == -1)
+        {
+            free(buf);
+            dir_reader_close(&dir);
+            return -1;
+        }
+        if (more)
+        {
+            break;
+        }
+    }
+
+    dir_reader_close(&dir);
+    return send_frame_packed(conn, (uint8_t *)buf, (uint32_t)len, compress);
+}
+
+static void
+close_file_source(struct rmi_conn *conn)
+{
+    if (conn->file_fd != -1)
+    {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    conn->file_remaining = 0;
+    conn->xfer_len = 0;
+    conn->xfer_off = 0;
+}
+
+static int
+ensure_xfer_buffer(struct rmi_conn *conn)
+{
+    void *buf;
+
+    if (conn->xfer != NULL)
+    {
+        return 0;
+    }
+    if (posix_memalign(&buf, RMI_XFER_ALIGN, RMI_XFER_BUFFER_SIZE) != 0)
+    {
+        return -1;
+    }
+    conn->xfer = (uint8_t *)buf;
+    return 0;
+}
+
+/*
+ * Copy-loop fallback for kernels or file systems without sendfile() into
+ * a socket. Reads at the tracked offset so it can take over mid-file.
+ */
+static int
+send_file_chunk_copy(struct rmi_conn *conn, size_t *budget)
+{
+    ssize_t n;
+
+    if (conn->xfer_off == conn->xfer_len)
+    {
+        size_t chunk;
+
+        if (*budget == 0)
+        {
+            return 0;
+        }
+        if (ensure_xfer_buffer(conn) == -1)
+        {
+            return -1;
+        }
+        chunk = RMI_XFER_BUFFER_SIZE;
+        if (conn->file_remaining < chunk)
+        {
+            chunk = (size_t)conn->file_remaining;
+        }
+        do
+        {
+            n = pread(conn->file_fd, conn->xfer, chunk, conn->file_off);
+        }
+        while (n == -1 && errno == EINTR);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        conn->xfer_len = (size_t)n;
+        conn->xfer_off = 0;
+        conn->file_off += n;
+        conn->file_remaining -= (uint64_t)n;
+        *budget = *budget > (size_t)n ? *budget - (size_t)n : 0;
+    }
+
+    n = write(conn->fd, conn->xfer + conn->xfer_off, conn->xfer_len - conn->xfer_off);
+    if (n == -1)
+    {
+        if (errno == EINTR)
+        {
+            return 1;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        return -1;
+    }
+    conn->xfer_off += (size_t)n;
+    return 1;
+}
+
+static int
+send_file_chunk_sendfile(struct rmi_conn *conn, size_t *budget)
+{
+    size_t chunk;
+    ssize_t n;
+
+    if (*budget == 0)
+    {
+        return 0;
+    }
+    chunk = *budget;
+    if (conn->file_remaining < chunk)
+    {
+        chunk = (size_t)conn->file_remaining;
+    }
+    n = sendfile(conn->fd, conn->file_fd, &conn->file_off, chunk);
+    if (n == -1)
+    {
+        if (errno == EINTR)
+        {
+            return 1;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+        {
+            fprintf(stderr, "RMI download: sendfile unavailable (%d), using copy loop\n",
+                    errno);
+            conn->file_copy = true;
+            return 1;
+        }
+        return -1;
+    }
+    if (n == 0)
+    {
+        return -1;
+    }
+    conn->file_remaining -= (uint64_t)n;
+    *budget = *budget > (size_t)n ? *budget - (size_t)n : 0;
+    return 1;
+}
+
+/*
+ * Streams the body of a DOWNLOAD frame from the connection's file source,
+ * with sendfile() when the kernel supports it and a large aligned copy
+ * buffer otherwise. Returns 1 when the file is fully sent, 0 when the
+ * socket would block or the per-wakeup budget is spent, -1 on error (the
+ * frame can no longer be completed, so the caller drops the connection).
+ */
+static int
+send_file_payload(struct rmi_conn *conn)
+{
+    size_t budget;
+
+    budget = RMI_FLUSH_BUDGET;
+    while (conn->file_fd != -1)
+    {
+        int rc;
+
+        if (conn->file_remaining == 0 && conn->xfer_off == conn->xfer_len)
+        {
+            /* A DOWNLOAD_TREE body is logged with the whole archive. */
+            if (conn->tree == NULL)
+            {
+                log_transfer("download", conn->file_path, conn->file_size,
+                             conn->file_start_us, conn->file_copy ? "copy" : "sendfile");
+            }
+            close_file_source(conn);
+            return 1;
+        }
+        if (conn->file_copy || conn->xfer_off != conn->xfer_len)
+        {
+            rc = send_file_chunk_copy(conn, &budget);
+        }
+        else
+        {
+            rc = send_file_chunk_sendfile(conn, &budget);
+        }
+        if (rc <= 0)
+        {
+            if (rc == -1)
+            {
+                fprintf(stderr, "RMI download: %s failed after %llu of %llu bytes: %d\n",
+                        conn->file_path,
+                        (unsigned long long)(conn->file_size - conn->file_remaining),
+                        (unsigned long long)conn->file_size, errno);
+            }
+            return rc;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Opens a regular file for DOWNLOAD and resolves the byte range to send;
+ * a zero `*length` means through the end of the file. Returns the fd or -1.
+ */
+static int
+open_download(const char *path, uint64_t offset, uint64_t *length, struct stat *st)
+{
+    int file_fd;
+    uint64_t size;
+
+    if (path == NULL || *path == '\0')
+    {
+        return -1;
+    }
+    file_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (file_fd == -1)
+    {
+        return -1;
+    }
+    if (fstat(file_fd, st) == -1)
+    {
+        close(file_fd);
+        return -1;
+    }
+    if (!S_ISREG(st->st_mode))
+    {
+        close(file_fd);
+        return -1;
+    }
+    if (st->st_size < 0 || (uint64_t)st->st_size < offset)
+    {
+        close(file_fd);
+        return -1;
+    }
+    size = (uint64_t)st->st_size;
+    if (*length == 0 || *length > size - offset)
+    {
+        *length = size - offset;
+    }
+    posix_fadvise(file_fd, (off_t)offset, 0, POSIX_FADV_SEQUENTIAL);
+    return file_fd;
+}
+
+/*
+ * `OK <length> <size> <mtime>`: the range being sent, then the file's size
+ * and modification time in nanoseconds so a client can tell whether a
+ * partial copy still matches before resuming it.
+ */
+static int
+send_download_ok(struct rmi_conn *conn, uint64_t length, const struct stat *st)
+{
+    char msg[96];
+
+    snprintf(msg, sizeof(msg), "%s %llu %llu %llu", RMI_RESP_OK,
+             (unsigned long long)length,
+             (unsigned long long)st->st_size,
+             (unsigned long long)st->st_mtim.tv_sec * 1000000000ull +
+                 (unsigned long long)st->st_mtim.tv_nsec);
+    return send_text(conn, msg);
+}
+
+static int
+handle_download(struct rmi_conn *conn, const char *path, uint64_t offset,
+                uint64_t length, bool ranged)
+{
+    int file_fd;
+    struct stat st;
+
+    file_fd = open_download(path, offset, &length, &st);
+    if (file_fd == -1)
+    {
+        return -1;
+    }
+    /* A v1 file frame carries a 32-bit length; larger files need v2. */
+    if (length > UINT32_MAX)
+    {
+        close(file_fd);
+        return -1;
+    }
+    if ((ranged ? send_download_ok(conn, length, &st) : send_text(conn, RMI_RESP_OK)) == -1 ||
+        queue_frame(conn, (uint32_t)length, NULL, 0) == -1)
+    {
+        close(file_fd);
+        return -1;
+    }
+    snprintf(conn->file_path, sizeof(conn->file_path), "%s", path);
+    conn->file_fd = file_fd;
+    conn->file_off = (off_t)offset;
+    conn->file_size = length;
+    conn->file_remaining = conn->file_size;
+    conn->file_copy = false;
+    conn->file_start_us = monotonic_us();
+    conn->xfer_len = 0;
+    conn->xfer_off = 0;
+    return 0;
+}
+
+static void
+tree_walk_free(struct rmi_tree_walk *walk)
+{
+    if (walk == NULL)
+    {
+        return;
+    }
+    if (walk->fd != -1)
+    {
+        close(walk->fd);
+    }
+    while (walk->depth > 0)
+    {
+        closedir(walk->stack[--walk->depth].dir);
+    }
+    free(walk);
+}
+
+static int
+tree_walk_push(struct rmi_tree_walk *walk, int dir_fd, const char *name, size_t path_len)
+{
+    DIR *dir;
+    int fd;
+
+    if (walk->depth == RMI_TREE_MAX_DEPTH)
+    {
+        fprintf(stderr, "RMI download_tree: %s nested too deep, skipping its contents\n",
+                walk->entry.path);
+        return -1;
+    }
+    fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    dir = fdopendir(fd);
+    if (dir == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    walk->stack[walk->depth].dir = dir;
+    walk->stack[walk->depth].path_len = path_len;
+    walk->depth++;
+    return 0;
+}
+
+/*
+ * Opens `path` for DOWNLOAD_TREE. Entries are named from the directory's
+ * own name down, as `tar -C <parent> -c <name>` would, and the first header
+ * is the directory itself.
+ */
+static struct rmi_tree_walk *
+tree_walk_open(const char *path)
+{
+    struct rmi_tree_walk *walk;
+    struct stat st;
+    const char *base;
+    size_t len;
+    DIR *dir;
+    int fd;
+
+    if (path == NULL || *path == '\0')
+    {
+        return NULL;
+    }
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    dir = fdopendir(fd);
+    if (dir == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    walk = (struct rmi_tree_walk *)calloc(1, sizeof(*walk));
+    if (walk == NULL || fstat(fd, &st) == -1)
+    {
+        free(walk);
+        closedir(dir);
+        return NULL;
+    }
+    walk->fd = -1;
+    walk->stack[0].dir = dir;
+    walk->depth = 1;
+    walk->start_us = monotonic_us();
+    snprintf(walk->root, sizeof(walk->root), "%s", path);
+
+    len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+    {
+        len--;
+    }
+    base = path + len;
+    while (base > path && base[-1] != '/')
+    {
+        base--;
+    }
+    len -= (size_t)(base - path);
+    if (len > 0)
+    {
+        memcpy(walk->entry.path, base, len);
+        walk->entry.path[len] = '/';
+        walk->entry.path[len + 1] = '\0';
+        walk->stack[0].path_len = len + 1;
+        walk->entry.type = RMI_TAR_TYPE_DIR;
+        walk->entry.mode = st.st_mode & 07777;
+        walk->entry.mtime = st.st_mtim.tv_sec;
+        walk->hdr_len = rmi_tar_write_header(&walk->entry, walk->hdr, sizeof(walk->hdr));
+    }
+    return walk;
+}
+
+/*
+ * Moves the walk to the next directory, regular file or symlink and puts
+ * its header in `hdr`; a file is left open with its body owed. Entries
+ * that cannot be read are logged and left out. Returns false at the end.
+ */
+static bool
+tree_walk_next(struct rmi_tree_walk *walk)
+{
+    struct rmi_tar_entry *entry;
+
+    entry = &walk->entry;
+    while (walk->depth > 0)
+    {
+        struct rmi_tree_dir *top;
+        struct dirent *de;
+        struct stat st;
+        size_t name_len;
+        ssize_t n;
+        int dir_fd;
+        int fd;
+
+        top = &walk->stack[walk->depth - 1];
+        errno = 0;
+        de = readdir(top->dir);
+        if (de == NULL)
+        {
+            if (errno != 0)
+            {
+                fprintf(stderr, "RMI download_tree: reading %.*s failed: %d\n",
+                        (int)top->path_len, entry->path, errno);
+            }
+            closedir(top->dir);
+            walk->depth--;
+            continue;
+        }
+        if (is_dot_entry(de->d_name))
+        {
+            continue;
+        }
+        name_len = strlen(de->d_name);
+        dir_fd = dirfd(top->dir);
+        if (top->path_len + name_len + 2 > sizeof(entry->path) ||
+            fstatat(dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+            continue;
+        }
+        memcpy(entry->path + top->path_len, de->d_name, name_len + 1);
+        entry->link[0] = '\0';
+        entry->mode = st.st_mode & 07777;
+        entry->mtime = st.st_mtim.tv_sec;
+        entry->size = 0;
+        fd = -1;
+        if (S_ISDIR(st.st_mode))
+        {
+            entry->type = RMI_TAR_TYPE_DIR;
+            entry->path[top->path_len + name_len] = '/';
+            entry->path[top->path_len + name_len + 1] = '\0';
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            fd = openat(dir_fd, de->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+            {
+                fprintf(stderr, "RMI download_tree: skipping %s: %d\n", entry->path, errno);
+                if (fd != -1)
+                {
+                    close(fd);
+                }
+                continue;
+            }
+            entry->type = RMI_TAR_TYPE_FILE;
+            entry->size = (uint64_t)st.st_size;
+        }
+        else if (S_ISLNK(st.st_mode))
+        {
+            n = readlinkat(dir_fd, de->d_name, entry->link, sizeof(entry->link) - 1);
+            if (n <= 0)
+            {
+                continue;
+            }
+            entry->link[n] = '\0';
+            entry->type = RMI_TAR_TYPE_SYMLINK;
+        }
+        else
+        {
+            continue;
+        }
+        walk->hdr_len = rmi_tar_write_header(entry, walk->hdr, sizeof(walk->hdr));
+        walk->hdr_off = 0;
+        if (walk->hdr_len == 0)
+        {
+            if (fd != -1)
+            {
+                close(fd);
+            }
+            continue;
+        }
+        if (fd != -1)
+        {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            walk->fd = fd;
+            walk->off = 0;
+            walk->body = entry->size;
+            walk->pad = rmi_tar_padding(entry->size);
+        }
+        else if (entry->type == RMI_TAR_TYPE_DIR)
+        {
+            /* A directory that cannot be opened still goes out, empty. */
+            tree_walk_push(walk, dir_fd, de->d_name, top->path_len + name_len + 1);
+        }
+        return true;
+    }
+    return false;
+}
+
+static bool
+tree_walk_done(const struct rmi_tree_walk *walk)
+{
+    return walk->ended && walk->pad == 0 && walk->hdr_off == walk->hdr_len;
+}
+
+/*
+ * Fills `out` with the next stretch of the archive. With `stop_at_body`
+ * it stops in front of a file body, which the caller sends straight from
+ * `fd`. A file that shrinks while it is read is padded out with zeros to
+ * the size its header gave.
+ */
+static size_t
+tree_walk_fill(struct rmi_tree_walk *walk, uint8_t *out, size_t cap, bool stop_at_body)
+{
+    size_t len;
+    size_t take;
+    ssize_t n;
+
+    len = 0;
+    while (len < cap)
+    {
+        if (walk->hdr_off < walk->hdr_len)
+        {
+            take = walk->hdr_len - walk->hdr_off;
+            take = take < cap - len ? take : cap - len;
+            memcpy(out + len, walk->hdr + walk->hdr_off, take);
+            walk->hdr_off += take;
+            len += take;
+            continue;
+        }
+        if (walk->body > 0)
+        {
+            if (stop_at_body && walk->fd != -1)
+            {
+                break;
+            }
+            take = walk->body < cap - len ? (size_t)walk->body : cap - len;
+            if (walk->fd == -1)
+            {
+                memset(out + len, 0, take);
+                n = (ssize_t)take;
+            }
+            else
+            {
+                do
+                {
+                    n = pread(walk->fd, out + len, take, walk->off);
+                }
+                while (n == -1 && errno == EINTR);
+                if (n <= 0)
+                {
+                    fprintf(stderr, "RMI download_tree: %s ended %llu bytes short: %d\n",
+                            walk->entry.path, (unsigned long long)walk->body, errno);
+                    close(walk->fd);
+                    walk->fd = -1;
+                    continue;
+                }
+            }
+            walk->off += n;
+            walk->body -= (uint64_t)n;
+            len += (size_t)n;
+            continue;
+        }
+        if (walk->fd != -1)
+        {
+            close(walk->fd);
+            walk->fd = -1;
+        }
+        if (walk->pad > 0)
+        {
+            take = walk->pad < cap - len ? walk->pad : cap - len;
+            memset(out + len, 0, take);
+            walk->pad -= take;
+            len += take;
+            continue;
+        }
+        if (walk->ended)
+        {
+            break;
+        }
+        if (!tree_walk_next(walk))
+        {
+            /* Two zero blocks close the archive. */
+            walk->ended = true;
+            walk->pad = 2 * RMI_TAR_BLOCK;
+        }
+    }
+    walk->bytes += len;
+    return len;
+}
+
+/*
+ * Queues the next stretch of a v1 DOWNLOAD_TREE once everything before it
+ * has gone out: headers and padding as one frame, then a file body as
+ * frames of its own that send_file_payload() fills straight from the file.
+ * An empty frame ends the archive. Returns -1 when the archive cannot be
+ * finished and the connection has to go.
+ */
+static int
+pump_tree(struct rmi_conn *conn)
+{
+    struct rmi_tree_walk *walk;
+    uint8_t *buf;
+    size_t len;
+
+    walk = conn->tree;
+    if (conn->out_head != NULL || conn->file_fd != -1)
+    {
+        return 0;
+    }
+    buf = (uint8_t *)malloc(RMI_STREAM_CHUNK);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+    len = tree_walk_fill(walk, buf, RMI_STREAM_CHUNK, true);
+    if (len == 0)
+    {
+        free(buf);
+    }
+    else if (send_frame_owned(conn, buf, (uint32_t)len) == -1)
+    {
+        return -1;
+    }
+    if (walk->hdr_off == walk->hdr_len && walk->body > 0 && walk->fd != -1)
+    {
+        uint64_t piece;
+        int fd;
+
+        /* v1 frame lengths are 32-bit; bigger files go out in pieces. */
+        piece = walk->body < RMI_TREE_V1_PIECE ? walk->body : RMI_TREE_V1_PIECE;
+        fd = piece < walk->body ? dup(walk->fd) : walk->fd;
+        if (fd == -1 || queue_frame(conn, (uint32_t)piece, NULL, 0) == -1)
+        {
+            return -1;
+        }
+        snprintf(conn->file_path, sizeof(conn->file_path), "%s", walk->entry.path);
+        conn->file_fd = fd;
+        conn->file_off = walk->off;
+        conn->file_size = piece;
+        conn->file_remaining = piece;
+        conn->file_start_us = monotonic_us();
+        conn->xfer_len = 0;
+        conn->xfer_off = 0;
+        if (fd == walk->fd)
+        {
+            walk->fd = -1;
+        }
+        walk->off += (off_t)piece;
+        walk->body -= piece;
+        walk->bytes += piece;
+        return 1;
+    }
+    if (tree_walk_done(walk))
+    {
+        if (queue_frame(conn, 0, NULL, 0) == -1)
+        {
+            return -1;
+        }
+        log_transfer("download_tree", walk->root, walk->bytes, walk->start_us,
+                     conn->file_copy ? "copy" : "sendfile");
+        tree_walk_free(walk);
+        conn->tree = NULL;
+    }
+    return 1;
+}
+
+static int
+handle_download_tree(struct rmi_conn *conn, const char *path)
+{
+    conn->tree = tree_walk_open(path);
+    if (conn->tree == NULL)
+    {
+        return -1;
+    }
+    if (send_text(conn, RMI_RESP_OK) == -1)
+    {
+        tree_walk_free(conn->tree);
+        conn->tree = NULL;
+        return -1;
+    }
+    conn->file_copy = false;
+    return 0;
+}
+
+static void
+tree_extract_free(struct rmi_tree_extract *x)
+{
+    size_t i;
+
+    if (x == NULL)
+    {
+        return;
+    }
+    if (x->fd != -1)
+    {
+        /* The upload stopped inside this file's body. */
+        close(x->fd);
+        unlinkat(x->file_dir, x->name, 0);
+    }
+    if (x->dir_fd != -1)
+    {
+        close(x->dir_fd);
+    }
+    if (x->root_fd != -1)
+    {
+        close(x->root_fd);
+    }
+    for (i = 0; i < x->dir_times_len; i++)
+    {
+        free(x->dir_times[i].path);
+    }
+    free(x->dir_times);
+    free(x->summary);
+    free(x);
+}
+
+/*
+ * Starts unpacking an UPLOAD_TREE archive into `path`, which is created if
+ * it is missing. A target that cannot be opened leaves the archive broken
+ * from the start, so the upload is still read to its end and refused.
+ */
+static struct rmi_tree_extract *
+tree_extract_open(const char *path)
+{
+    struct rmi_tree_extract *x;
+
+    x = (struct rmi_tree_extract *)calloc(1, sizeof(*x));
+    if (x == NULL)
+    {
+        return NULL;
+    }
+    rmi_tar_reader_init(&x->reader);
+    x->dir_fd = -1;
+    x->fd = -1;
+    x->start_us = monotonic_us();
+    snprintf(x->root, sizeof(x->root), "%s", path);
+    x->root_fd = -1;
+    if (path[0] != '\0' && (mkdir(path, 0755) == 0 || errno == EEXIST))
+    {
+        x->root_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    x->broken = x->root_fd == -1;
+    return x;
+}
+
+/* Adds "<status> <path>" to the UPLOAD_TREE summary. */
+static void
+tree_extract_note(struct rmi_tree_extract *x, const char *status)
+{
+    char line[RMI_TAR_PATH_MAX + 16];
+    int n;
+
+    if (strcmp(status, "ok") == 0)
+    {
+        x->written++;
+    }
+    else if (strcmp(status, "failed") == 0)
+    {
+        x->failed++;
+    }
+    else
+    {
+        x->skipped++;
+    }
+    if (x->summary_full)
+    {
+        return;
+    }
+    n = snprintf(line, sizeof(line), "%s %s\n", status, x->path);
+    if (n < 0 || (size_t)n >= sizeof(line) ||
+        buffer_append(&x->summary, &x->summary_len, &x->summary_cap, line, (size_t)n) == -1)
+    {
+        x->summary_full = true;
+    }
+}
+
+/*
+ * Finds the directory the entry `x->path` goes into and points `*name` at
+ * its last component. Directories on the way are created as needed and
+ * never reached through a symlink. Absolute names and ".." are refused.
+ * Archives list a directory's entries together, so the last directory is
+ * kept open and most entries skip the walk.
+ */
+static int
+tree_extract_parent(struct rmi_tree_extract *x, const char **name)
+{
+    char dir[RMI_TAR_PATH_MAX];
+    const char *slash;
+    char *part;
+    char *save;
+    int fd;
+
+    if (x->path[0] == '/' || x->path[0] == '\0')
+    {
+        return -1;
+    }
+    snprintf(dir, sizeof(dir), "%s", x->path);
+    for (part = strtok_r(dir, "/", &save); part != NULL; part = strtok_r(NULL, "/", &save))
+    {
+        if (strcmp(part, "..") == 0)
+        {
+            return -1;
+        }
+    }
+    slash = strrchr(x->path, '/');
+    if (slash == NULL)
+    {
+        *name = x->path;
+        return x->root_fd;
+    }
+    *name = slash + 1;
+    if (x->dir_fd != -1 && strlen(x->dir_path) == (size_t)(slash - x->path) &&
+        strncmp(x->dir_path, x->path, (size_t)(slash - x->path)) == 0)
+    {
+        return x->dir_fd;
+    }
+    if (x->dir_fd != -1)
+    {
+        close(x->dir_fd);
+        x->dir_fd = -1;
+    }
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - x->path), x->path);
+    snprintf(x->dir_path, sizeof(x->dir_path), "%s", dir);
+    fd = x->root_fd;
+    for (part = strtok_r(dir, "/", &save); part != NULL; part = strtok_r(NULL, "/", &save))
+    {
+        int next;
+
+        if (strcmp(part, ".") == 0)
+        {
+            continue;
+        }
+        next = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next == -1 && errno == ENOENT && mkdirat(fd, part, 0755) == 0)
+        {
+            next = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (fd != x->root_fd)
+        {
+            close(fd);
+        }
+        if (next == -1)
+        {
+            return -1;
+        }
+        fd = next;
+    }
+    if (fd != x->root_fd)
+    {
+        x->dir_fd = fd;
+    }
+    return fd;
+}
+
+static void
+tree_extract_end_file(struct rmi_tree_extract *x, bool ok)
+{
+    struct timespec times[2];
+
+    if (ok && rmi_upload_fsync == RMI_FSYNC_SYNC && fsync(x->fd) == -1)
+    {
+        ok = false;
+    }
+    if (ok)
+    {
+        /* Best effort, as for the owner the server runs as. */
+        fchmod(x->fd, (mode_t)(x->mode & 07777));
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = (time_t)x->mtime;
+        times[1].tv_nsec = 0;
+        futimens(x->fd, times);
+    }
+    if (close(x->fd) == -1)
+    {
+        ok = false;
+    }
+    x->fd = -1;
+    if (!ok)
+    {
+        unlinkat(x->file_dir, x->name, 0);
+    }
+    tree_extract_note(x, ok ? "ok" : "failed");
+}
+
+/*
+ * Creates the file for a header and reserves its size, so it is laid out
+ * in one go and a full disk fails it before its body arrives.
+ */
+static void
+tree_extract_file(struct rmi_tree_extract *x, int dir_fd, const char *name)
+{
+    const struct rmi_tar_entry *entry;
+
+    entry = &x->reader.entry;
+    x->fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (x->fd == -1 && errno == ELOOP)
+    {
+        /* A symlink in the way is replaced, as tar does. */
+        unlinkat(dir_fd, name, 0);
+        x->fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                       0644);
+    }
+    if (x->fd == -1)
+    {
+        tree_extract_note(x, "failed");
+        return;
+    }
+    x->file_dir = dir_fd;
+    snprintf(x->name, sizeof(x->name), "%s", name);
+    x->left = entry->size;
+    x->mode = entry->mode;
+    x->mtime = entry->mtime;
+    if (entry->size > 0 &&
+        fallocate(x->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)entry->size) == -1 &&
+        errno == ENOSPC)
+    {
+        tree_extract_end_file(x, false);
+        return;
+    }
+    if (x->left == 0)
+    {
+        tree_extract_end_file(x, true);
+    }
+}
+
+/* Remembers the mtime of the directory `x->path`; best effort. */
+static void
+tree_extract_keep_dir_time(struct rmi_tree_extract *x, int64_t mtime)
+{
+    struct rmi_tree_dir_time *slot;
+
+    if (x->dir_times_len == x->dir_times_cap)
+    {
+        size_t next_cap;
+        struct rmi_tree_dir_time *next;
+
+        next_cap = x->dir_times_cap == 0 ? 16 : x->dir_times_cap * 2;
+        next = (struct rmi_tree_dir_time *)realloc(x->dir_times, next_cap * sizeof(*next));
+        if (next == NULL)
+        {
+            return;
+        }
+        x->dir_times = next;
+        x->dir_times_cap = next_cap;
+    }
+    slot = &x->dir_times[x->dir_times_len];
+    slot->path = strdup(x->path);
+    if (slot->path == NULL)
+    {
+        return;
+    }
+    slot->mtime = mtime;
+    x->dir_times_len++;
+}
+
+/*
+ * Sets the directory mtimes from the archive. A directory comes before its
+ * entries, so going backwards sets each one after everything inside it.
+ */
+static void
+tree_extract_dir_times(struct rmi_tree_extract *x)
+{
+    struct timespec times[2];
+    const char *name;
+    size_t i;
+    int dir_fd;
+
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_nsec = 0;
+    for (i = x->dir_times_len; i > 0; i--)
+    {
+        snprintf(x->path, sizeof(x->path), "%s", x->dir_times[i - 1].path);
+        dir_fd = tree_extract_parent(x, &name);
+        if (dir_fd == -1)
+        {
+            continue;
+        }
+        times[1].tv_sec = (time_t)x->dir_times[i - 1].mtime;
+        utimensat(dir_fd, name, times, AT_SYMLINK_NOFOLLOW);
+    }
+}
+
+static void
+tree_extract_entry(struct rmi_tree_extract *x)
+{
+    const struct rmi_tar_entry *entry;
+    const char *name;
+    struct stat st;
+    size_t len;
+    int dir_fd;
+    int rc;
+
+    entry = &x->reader.entry;
+    snprintf(x->path, sizeof(x->path), "%s", entry->path);
+    len = strlen(x->path);
+    while (len > 1 && x->path[len - 1] == '/')
+    {
+        x->path[--len] = '\0';
+    }
+    if (entry->type != RMI_TAR_TYPE_FILE && entry->type != RMI_TAR_TYPE_DIR &&
+        entry->type != RMI_TAR_TYPE_SYMLINK)
+    {
+        tree_extract_note(x, "skipped");
+        return;
+    }
+    dir_fd = tree_extract_parent(x, &name);
+    if (dir_fd == -1)
+    {
+        tree_extract_note(x, "failed");
+        return;
+    }
+    if (entry->type == RMI_TAR_TYPE_FILE)
+    {
+        tree_extract_file(x, dir_fd, name);
+        return;
+    }
+    if (entry->type == RMI_TAR_TYPE_DIR)
+    {
+        /* Kept writable for the owner so the entries inside can follow. */
+        rc = mkdirat(dir_fd, name, (mode_t)((entry->mode & 07777) | 0700));
+        if (rc == -1 && errno == EEXIST &&
+            fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+        {
+            rc = 0;
+        }
+        if (rc == 0)
+        {
+            tree_extract_keep_dir_time(x, entry->mtime);
+        }
+    }
+    else
+    {
+        unlinkat(dir_fd, name, 0);
+        rc = symlinkat(entry->link, dir_fd, name);
+    }
+    tree_extract_note(x, rc == 0 ? "ok" : "failed");
+}
+
+static void
+tree_extract_body(struct rmi_tree_extract *x, const uint8_t *body, size_t len)
+{
+    if (x->fd == -1)
+    {
+        /* A body nobody wants: a failed file or an entry type we skip. */
+        return;
+    }
+    if (writeall(x->fd, body, len) == -1)
+    {
+        tree_extract_end_file(x, false);
+        return;
+    }
+    x->left -= len;
+    if (x->left == 0)
+    {
+        tree_extract_end_file(x, true);
+    }
+}
+
+/* Unpacks the next piece of an UPLOAD_TREE archive, whatever its size. */
+static void
+tree_extract_feed(struct rmi_tree_extract *x, const uint8_t *data, size_t len)
+{
+    x->bytes += len;
+    while (len > 0 && !x->broken && !x->ended)
+    {
+        const uint8_t *body;
+        size_t body_len;
+        size_t used;
+
+        switch (rmi_tar_read(&x->reader, data, len, &used, &body, &body_len))
+        {
+        case RMI_TAR_ENTRY:
+            tree_extract_entry(x);
+            break;
+        case RMI_TAR_DATA:
+            tree_extract_body(x, body, body_len);
+            break;
+        case RMI_TAR_END:
+            x->ended = true;
+            tree_extract_dir_times(x);
+            break;
+        case RMI_TAR_ERROR:
+            x->broken = true;
+            break;
+        case RMI_TAR_MORE:
+            break;
+        }
+        data += used;
+        len -= used;
+    }
+}
+
+/*
+ * Answers UPLOAD_TREE once the archive is in: "OK <written> <failed>
+ * <skipped>", then a "<status> <path>" line per entry. An archive that was
+ * cut short or damaged gets `ERR upload_tree`; whatever it unpacked stays.
+ */
+static void
+complete_tree_upload(struct rmi_server *srv, struct rmi_conn *conn)
+{
+    struct rmi_tree_extract *x;
+    char head[64];
+    uint8_t *reply;
+    size_t head_len;
+
+    x = conn->extract;
+    conn->extract = NULL;
+    set_reply_context(conn, conn->upload_id, RMI_OP_UPLOAD_TREE);
+    if (x == NULL || x->broken || !x->ended)
+    {
+        fprintf(stderr, "RMI upload_tree: %s: %s\n", x != NULL ? x->root : "?",
+                x == NULL || x->root_fd == -1 ? "target unusable" :
+                x->broken ? "damaged archive" : "archive ended early");
+        tree_extract_free(x);
+        send_text(conn, "ERR upload_tree");
+        return;
+    }
+    head_len = (size_t)snprintf(head, sizeof(head), "OK %u %u %u\n",
+                                x->written, x->failed, x->skipped);
+    reply = (uint8_t *)malloc(head_len + x->summary_len);
+    if (reply != NULL)
+    {
+        memcpy(reply, head, head_len);
+        if (x->summary_len > 0)
+        {
+            memcpy(reply + head_len, x->summary, x->summary_len);
+        }
+        send_frame_owned(conn, reply, (uint32_t)(head_len + x->summary_len));
+    }
+    else
+    {
+        send_text(conn, "ERR upload_tree");
+    }
+    log_transfer("upload_tree", x->root, x->bytes, x->start_us, "tar");
+    if (rmi_upload_fsync == RMI_FSYNC_DEFERRED &&
+        submit_job(srv, RMI_JOB_FSYNC, 0, x->root) == NULL)
+    {
+        fprintf(stderr, "RMI upload_tree: deferred fsync not queued for %s\n", x->root);
+    }
+    tree_extract_free(x);
+}
+
+/*
+ * v1 UPLOAD_TREE: the archive follows as frames of any size, up to an
+ * empty one. Frame bytes are unpacked as they arrive; nothing waits for a
+ * whole frame. A refused target still reads the frames so the stream
+ * stays in sync. Returns 1 once the upload is answered, 0 while more bytes
+ * are needed.
+ */
+static int
+recv_tree_frames(struct rmi_server *srv, struct rmi_conn *conn)
+{
+    size_t chunk;
+
+    while (1)
+    {
+        if (conn->state == RMI_CONN_TREE_HEADER)
+        {
+            if (input_available(conn) < RMI_FRAME_HEADER_SIZE)
+            {
+                return 0;
+            }
+            conn->upload_remaining = rmi_read_be32(conn->in + conn->in_off);
+            consume_input(conn, RMI_FRAME_HEADER_SIZE);
+            if (conn->upload_remaining == 0)
+            {
+                conn->state = RMI_CONN_COMMAND;
+                complete_tree_upload(srv, conn);
+                return 1;
+            }
+            conn->state = RMI_CONN_TREE_BODY;
+        }
+        chunk = input_available(conn);
+        if (chunk == 0)
+        {
+            return 0;
+        }
+        if (chunk > conn->upload_remaining)
+        {
+            chunk = (size_t)conn->upload_remaining;
+        }
+        if (conn->extract != NULL)
+        {
+            tree_extract_feed(conn->extract, conn->in + conn->in_off, chunk);
+        }
+        consume_input(conn, chunk);
+        conn->upload_remaining -= chunk;
+        if (conn->upload_remaining == 0)
+        {
+            conn->state = RMI_CONN_TREE_HEADER;
+        }
+    }
+}
+
+/* v2 UPLOAD_TREE: DATA chunks as for UPLOAD, counting as the connection's upload. */
+static void
+start_tree_upload_stream(struct rmi_conn *conn, uint32_t id, const char *path)
+{
+    if (conn->upload_stream)
+    {
+        send_text(conn, "ERR upload_tree");
+        return;
+    }
+    conn->extract = tree_extract_open(path);
+    if (conn->extract == NULL || conn->extract->broken)
+    {
+        tree_extract_free(conn->extract);
+        conn->extract = NULL;
+        send_text(conn, "ERR upload_tree");
+        return;
+    }
+    conn->upload_ok = true;
+    conn->upload_id = id;
+    conn->upload_stream = true;
+}
+
+static void
+close_bulk_stream(struct rmi_bulk_stream *bs)
+{
+    if (bs->tree != NULL)
+    {
+        tree_walk_free(bs->tree);
+        bs->tree = NULL;
+    }
+    else if (bs->list != RMI_LIST_NONE)
+    {
+        dir_reader_close(&bs->dir);
+        bs->list = RMI_LIST_NONE;
+    }
+    else if (bs->fd != -1)
+    {
+        close(bs->fd);
+    }
+    bs->fd = -1;
+    bs->id = 0;
+}
+
+static struct rmi_bulk_stream *
+free_bulk_stream(struct rmi_conn *conn)
+{
+    unsigned int i;
+
+    for (i = 0; i < RMI_V2_MAX_STREAMS; i++)
+    {
+        if (conn->bulk[i].fd == -1)
+        {
+            return &conn->bulk[i];
+        }
+    }
+    return NULL;
+}
+
+static struct rmi_bulk_stream *
+find_bulk_stream(struct rmi_conn *conn, uint32_t id)
+{
+    unsigned int i;
+
+    for (i = 0; i < RMI_V2_MAX_STREAMS; i++)
+    {
+        if (conn->bulk[i].fd != -1 && conn->bulk[i].id == id)
+        {
+            return &conn->bulk[i];
+        }
+    }
+    return NULL;
+}
+
+/* Whether the file starts like a PNG, JPEG or DNG, which do not pack. */
+static bool
+file_precompressed(int fd)
+{
+    uint8_t magic[8];
+    ssize_t n;
+
+    do
+    {
+        n = pread(fd, magic, sizeof(magic), 0);
+    }
+    while (n == -1 && errno == EINTR);
+    return n > 0 && rmi_lz_precompressed(magic, (size_t)n);
+}
+
+/*
+ * v2 DOWNLOAD: answers `OK <size>` and opens a stream whose body
+ * pump_bulk_streams() sends as DATA chunks on the request id.
+ */
+static int
+start_download_stream(struct rmi_conn *conn, uint32_t id, const char *path,
+                      uint64_t offset, uint64_t length, bool compress)
+{
+    struct rmi_bulk_stream *bs;
+    struct stat st;
+
+    bs = free_bulk_stream(conn);
+    if (bs == NULL)
+    {
+        return -1;
+    }
+    bs->fd = open_download(path, offset, &length, &st);
+    if (bs->fd == -1)
+    {
+        return -1;
+    }
+    if (send_download_ok(conn, length, &st) == -1)
+    {
+        close_bulk_stream(bs);
+        return -1;
+    }
+    snprintf(bs->path, sizeof(bs->path), "%s", path);
+    bs->id = id;
+    bs->off = (off_t)offset;
+    bs->size = length;
+    bs->remaining = length;
+    bs->credit = RMI_V2_STREAM_WINDOW;
+    bs->start_us = monotonic_us();
+    bs->compress = compress && !file_precompressed(bs->fd);
+    bs->misses = 0;
+    bs->packed_bytes = 0;
+    return 0;
+}
+
+/*
+ * v2 LIST or LIST2 with a cursor: answers `OK` and opens a stream whose
+ * entries pump_bulk_streams() sends as DATA chunks of whole lines or
+ * records on the request id, so a large directory shows up while it is
+ * still being read.
+ */
+static int
+start_list_stream(struct rmi_conn *conn, uint32_t id, const char *path,
+                  enum rmi_list_format format, unsigned int fields,
+                  uint64_t offset, uint64_t limit, bool compress)
+{
+    struct rmi_bulk_stream *bs;
+
+    bs = free_bulk_stream(conn);
+    if (bs == NULL || *path == '\0')
+    {
+        return -1;
+    }
+    if (dir_reader_open(&bs->dir, path) == -1)
+    {
+        return -1;
+    }
+    bs->list = format;
+    bs->fd = bs->dir.fd;
+    if (send_text(conn, RMI_RESP_OK) == -1)
+    {
+        close_bulk_stream(bs);
+        return -1;
+    }
+    snprintf(bs->path, sizeof(bs->path), "%s", path);
+    bs->id = id;
+    bs->fields = fields;
+    bs->index = 0;
+    bs->first = offset;
+    bs->limit = limit;
+    bs->size = 0;
+    bs->remaining = 0;
+    bs->credit = RMI_V2_STREAM_WINDOW;
+    bs->start_us = monotonic_us();
+    bs->compress = compress;
+    bs->misses = 0;
+    bs->packed_bytes = 0;
+    return 0;
+}
+
+/*
+ * v2 DOWNLOAD_TREE: answers `OK` and opens a stream whose archive
+ * pump_bulk_streams() sends as DATA chunks on the request id.
+ */
+static int
+start_tree_stream(struct rmi_conn *conn, uint32_t id, const char *path, bool compress)
+{
+    struct rmi_bulk_stream *bs;
+
+    bs = free_bulk_stream(conn);
+    if (bs == NULL)
+    {
+        return -1;
+    }
+    bs->tree = tree_walk_open(path);
+    if (bs->tree == NULL)
+    {
+        return -1;
+    }
+    bs->fd = dirfd(bs->tree->stack[0].dir);
+    if (send_text(conn, RMI_RESP_OK) == -1)
+    {
+        close_bulk_stream(bs);
+        return -1;
+    }
+    snprintf(bs->path, sizeof(bs->path), "%s", path);
+    bs->id = id;
+    bs->size = 0;
+    bs->remaining = 0;
+    bs->credit = RMI_V2_STREAM_WINDOW;
+    bs->start_us = monotonic_us();
+    bs->compress = compress;
+    bs->misses = 0;
+    bs->packed_bytes = 0;
+    return 0;
+}
+
+static void
+grant_bulk_credit(struct rmi_conn *conn, uint32_t id, const uint8_t *data, uint32_t len)
+{
+    struct rmi_bulk_stream *bs;
+    uint32_t add;
+
+    bs = find_bulk_stream(conn, id);
+    if (bs == NULL || len != 4)
+    {
+        return;
+    }
+    add = rmi_read_be32(data);
+    bs->credit = add > UINT32_MAX - bs->credit ? UINT32_MAX : bs->credit + add;
+}
+
+/*
+ * Whether a stream may send a chunk now. A LIST chunk is cut from whole
+ * lines, so it waits until the window has room for the longest one.
+ */
+static bool
+bulk_stream_can_send(const struct rmi_bulk_stream *bs)
+{
+    if (bs->fd == -1)
+    {
+        return false;
+    }
+    if (bs->tree != NULL)
+    {
+        return bs->credit > 0;
+    }
+    if (bs->list != RMI_LIST_NONE)
+    {
+        return bs->credit >= RMI_LIST_LINE_MAX;
+    }
+    return bs->credit > 0 || bs->remaining == 0;
+}
+
+/* Whether a bulk stream has something it may send right now. */
+static bool
+bulk_stream_ready(const struct rmi_conn *conn)
+{
+    unsigned int i;
+
+    for (i = 0; i < RMI_V2_MAX_STREAMS; i++)
+    {
+        if (bulk_stream_can_send(&conn->bulk[i]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Replaces `*chunk` with its packed form when that is smaller and returns
+ * the length to send. A stream whose chunks keep failing to shrink stops
+ * trying.
+ */
+static size_t
+pack_bulk_chunk(struct rmi_bulk_stream *bs, uint8_t **chunk, size_t len)
+{
+    uint8_t *packed;
+    size_t packed_len;
+
+    packed = (uint8_t *)malloc(rmi_lz_pack_bound(len));
+    if (packed == NULL)
+    {
+        return len;
+    }
+    packed_len = rmi_lz_pack(*chunk, len, packed, rmi_lz_pack_bound(len));
+    if (packed_len == 0)
+    {
+        free(packed);
+        if (++bs->misses >= RMI_LZ_MAX_MISSES)
+        {
+            bs->compress = false;
+        }
+        return len;
+    }
+    free(*chunk);
+    *chunk = packed;
+    bs->misses = 0;
+    bs->packed_bytes += packed_len;
+    return packed_len;
+}
+
+/*
+ * Fills `chunk` with whole lines or records from a LIST stream, stopping
+ * while there is still room for the longest one. Sets END in `*flags` once the
+ * directory or the requested page is done.
+ */
+static size_t
+read_list_chunk(struct rmi_bulk_stream *bs, uint8_t *chunk, size_t cap, uint8_t *flags)
+{
+    size_t len;
+
+    len = 0;
+    while (cap - len >= RMI_LIST_LINE_MAX)
+    {
+        const struct rmi_dirent64 *d;
+        struct rmi_list_entry entry;
+        uint64_t pos;
+        int line_len;
+
+        d = dir_reader_next(&bs->dir);
+        if (d == NULL)
+        {
+            if (errno != 0)
+            {
+                fprintf(stderr, "RMI list: %s failed after %llu entries: %d\n",
+                        bs->path, (unsigned long long)bs->index, errno);
+                *flags = RMI_V2_FLAG_END | RMI_V2_FLAG_ERROR;
+                return 0;
+            }
+            *flags = RMI_V2_FLAG_END;
+            return len;
+        }
+        pos = bs->index++;
+        if (pos < bs->first)
+        {
+            continue;
+        }
+        if (bs->limit > 0 && pos - bs->first >= bs->limit)
+        {
+            line_len = format_list_next(bs->list, pos, chunk + len, cap - len);
+            *flags = RMI_V2_FLAG_END;
+            return line_len > 0 ? len + (size_t)line_len : len;
+        }
+        if (stat_list_entry(bs->dir.fd, d, bs->fields, &entry) == -1)
+        {
+            continue;
+        }
+        line_len = format_list_entry(bs->list, &entry, chunk + len, cap - len);
+        if (line_len > 0)
+        {
+            len += (size_t)line_len;
+        }
+    }
+    return len;
+}
+
+/*
+ * Queues the next DATA chunk of a download, tree or LIST stream, taking the
+ * streams in turn. Chunks are only cut once everything else queued on the
+ * connection has gone out, so replies to interactive requests never wait behind more
+ * than one chunk here, and the client's window bounds what can sit in the
+ * socket buffers. Returns true when a chunk was queued.
+ */
+static bool
+pump_bulk_streams(struct rmi_conn *conn)
+{
+    unsigned int i;
+
+    if (conn->out_head != NULL)
+    {
+        return false;
+    }
+    for (i = 0; i < RMI_V2_MAX_STREAMS; i++)
+    {
+        struct rmi_bulk_stream *bs;
+        uint8_t *chunk;
+        size_t len;
+        size_t wire;
+        ssize_t n;
+        uint8_t flags;
+
+        bs = &conn->bulk[(conn->bulk_next + i) % RMI_V2_MAX_STREAMS];
+        if (!bulk_stream_can_send(bs))
+        {
+            continue;
+        }
+        conn->bulk_next = (conn->bulk_next + i + 1) % RMI_V2_MAX_STREAMS;
+        len = RMI_V2_CHUNK_MAX;
+        if (len > bs->credit)
+        {
+            len = bs->credit;
+        }
+        if (bs->list == RMI_LIST_NONE && bs->tree == NULL && len > bs->remaining)
+        {
+            len = (size_t)bs->remaining;
+        }
+        chunk = (uint8_t *)malloc(len > 0 ? len : 1);
+        if (chunk == NULL)
+        {
+            return false;
+        }
+        flags = 0;
+        if (bs->tree != NULL)
+        {
+            n = (ssize_t)tree_walk_fill(bs->tree, chunk, len, false);
+            if (tree_walk_done(bs->tree))
+            {
+                flags = RMI_V2_FLAG_END;
+            }
+        }
+        else if (bs->list != RMI_LIST_NONE)
+        {
+            n = (ssize_t)read_list_chunk(bs, chunk, len, &flags);
+        }
+        else
+        {
+            do
+            {
+                n = len > 0 ? pread(bs->fd, chunk, len, bs->off) : 0;
+            }
+            while (n == -1 && errno == EINTR);
+            if (n < 0 || (n == 0 && len > 0))
+            {
+                fprintf(stderr, "RMI download: %s failed after %llu of %llu bytes: %d\n",
+                        bs->path, (unsigned long long)(bs->size - bs->remaining),
+                        (unsigned long long)bs->size, errno);
+                n = 0;
+                flags = RMI_V2_FLAG_END | RMI_V2_FLAG_ERROR;
+            }
+            bs->off += n;
+            bs->remaining -= (uint64_t)n;
+            if (bs->remaining == 0)
+            {
+                flags |= RMI_V2_FLAG_END;
+            }
+        }
+        wire = (size_t)n;
+        if (bs->compress && n > 0)
+        {
+            wire = pack_bulk_chunk(bs, &chunk, (size_t)n);
+            if (wire < (size_t)n)
+            {
+                flags |= RMI_V2_FLAG_COMPRESSED;
+            }
+        }
+        /* Credit counts the bytes on the wire, packed or not. */
+        bs->credit -= (uint32_t)wire;
+        set_reply_context(conn, bs->id, RMI_OP_DATA);
+        queue_frame_flags(conn, (uint32_t)wire, chunk, wire, flags);
+        if (flags & RMI_V2_FLAG_END)
+        {
+            if (bs->list == RMI_LIST_NONE && !(flags & RMI_V2_FLAG_ERROR))
+            {
+                log_transfer(bs->tree != NULL ? "download_tree" : "download", bs->path,
+                             bs->tree != NULL ? bs->tree->bytes : bs->size, bs->start_us,
+                             bs->packed_bytes > 0 ? "stream, lz" : "stream");
+            }
+            close_bulk_stream(bs);
+        }
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Publishes a DELETE, COPY or MOVE job's progress for JOB_STATUS and
+ * returns true once JOB_CANCEL asked it to stop, or the pool is shutting
+ * down. Without a job there is nothing to report or cancel.
+ */
+static bool
+job_progress(struct rmi_pool *pool, struct rmi_job *job, uint64_t entries, uint64_t bytes)
+{
+    bool cancel;
+
+    if (job == NULL)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&pool->lock);
+    job->progress_entries = entries;
+    job->progress_bytes = bytes;
+    cancel = job->cancel || pool->stop;
+    pthread_mutex_unlock(&pool->lock);
+    return cancel;
+}
+
+/* Space removing `st` gives back: a file's blocks once its last link goes. */
+static uint64_t
+freed_bytes(const struct stat *st)
+{
+    if (S_ISDIR(st->st_mode) || st->st_nlink <= 1)
+    {
+        return (uint64_t)st->st_blocks * 512u;
+    }
+    return 0;
+}
+
+static int
+remove_dir_push(struct rmi_remove_dir **stack, size_t *depth, size_t *cap,
+                int dir_fd, const char *name)
+{
+    struct rmi_remove_dir *top;
+    int fd;
+
+    if (*depth == *cap)
+    {
+        size_t next_cap;
+        struct rmi_remove_dir *next;
+
+        next_cap = *cap == 0 ? 16 : *cap * 2;
+        next = (struct rmi_remove_dir *)realloc(*stack, next_cap * sizeof(*next));
+        if (next == NULL)
+        {
+            return -1;
+        }
+        *stack = next;
+        *cap = next_cap;
+    }
+    if (strlen(name) >= sizeof(top->name))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    top = &(*stack)[*depth];
+    top->fd = fd;
+    top->resume = 0;
+    strcpy(top->name, name);
+    (*depth)++;
+    return 0;
+}
+
+/*
+ * DELETE: removes `path` and everything under it. The walk keeps one
+ * open directory per level on an explicit stack and names entries relative
+ * to it, so depth costs neither C stack nor path rebuilding, and nothing
+ * is ever reached through a symlink. All levels share one getdents64()
+ * buffer: descending drops what is left of the parent's batch and the
+ * parent picks up at the next entry's offset once the child is gone.
+ * Progress is published to `job` after every entry; a cancelled or failed
+ * removal leaves whatever was not removed yet in place.
+ */
+static int
+remove_tree(struct rmi_pool *pool, struct rmi_job *job, const char *path)
+{
+    struct rmi_remove_dir *stack;
+    struct rmi_dir_reader dr;
+    struct stat st;
+    size_t depth;
+    size_t cap;
+    uint64_t entries;
+    uint64_t bytes;
+    int rc;
+
+    if (*path == '\0' || strcmp(path, "/") == 0)
+    {
+        return -1;
+    }
+    if (job_progress(pool, job, 0, 0) || lstat(path, &st) == -1)
+    {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        if (unlink(path) == -1)
+        {
+            return -1;
+        }
+        job_progress(pool, job, 1, freed_bytes(&st));
+        return 0;
+    }
+
+    stack = NULL;
+    depth = 0;
+    cap = 0;
+    if (remove_dir_push(&stack, &depth, &cap, AT_FDCWD, path) == -1)
+    {
+        free(stack);
+        return -1;
+    }
+    dr.buf = (uint8_t *)malloc(RMI_DENTS_BUFFER_SIZE);
+    dr.fd = stack[0].fd;
+    dr.len = 0;
+    dr.off = 0;
+    entries = 0;
+    bytes = 0;
+    rc = dr.buf == NULL ? -1 : 0;
+    while (rc == 0 && depth > 0)
+    {
+        const struct rmi_dirent64 *d;
+        struct rmi_remove_dir *top;
+        bool is_dir;
+
+        top = &stack[depth - 1];
+        d = dir_reader_next(&dr);
+        if (d == NULL)
+        {
+            if (errno != 0 || fstat(top->fd, &st) == -1)
+            {
+                rc = -1;
+                break;
+            }
+            close(top->fd);
+            depth--;
+            if (depth == 0)
+            {
+                rc = rmdir(path);
+            }
+            else
+            {
+                rc = unlinkat(stack[depth - 1].fd, top->name, AT_REMOVEDIR);
+                dr.fd = stack[depth - 1].fd;
+                dr.len = 0;
+                dr.off = 0;
+                if (rc == 0 && lseek(dr.fd, stack[depth - 1].resume, SEEK_SET) == (off_t)-1)
+                {
+                    rc = -1;
+                }
+            }
+            if (rc == 0)
+            {
+                entries++;
+                bytes += freed_bytes(&st);
+                if (job_progress(pool, job, entries, bytes))
+                {
+                    rc = -1;
+                }
+            }
+            continue;
+        }
+
+        is_dir = d->d_type == DT_DIR;
+        if (!is_dir)
+        {
+            if (fstatat(top->fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            {
+                if (errno == ENOENT)
+                {
+                    continue;
+                }
+                rc = -1;
+                break;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        if (is_dir)
+        {
+            top->resume = (off_t)d->d_off;
+            if (remove_dir_push(&stack, &depth, &cap, top->fd, d->d_name) == -1)
+            {
+                rc = -1;
+                break;
+            }
+            dr.fd = stack[depth - 1].fd;
+            dr.len = 0;
+            dr.off = 0;
+            continue;
+        }
+        if (unlinkat(top->fd, d->d_name, 0) == -1)
+        {
+            if (errno == ENOENT)
+            {
+                continue;
+            }
+            rc = -1;
+            break;
+        }
+        entries++;
+        bytes += freed_bytes(&st);
+        if (job_progress(pool, job, entries, bytes))
+        {
+            rc = -1;
+        }
+    }
+    while (depth > 0)
+    {
+        close(stack[--depth].fd);
+    }
+    free(stack);
+    free(dr.buf);
+    return rc;
+}
+
+/* Errors that mean a copy method is not available for these files. */
+static bool
+copy_method_refused(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+           err == EPERM;
+}
+
+/*
+ * Copies the rest of `in` to `out` from their current offsets. The kernel
+ * copies without a trip through user space where it can: copy_file_range()
+ * first, which may also share extents on file systems that support it,
+ * then sendfile(), then plain reads and writes through one large buffer.
+ * A refused method is not tried again for the rest of the COPY.
+ */
+static int
+copy_file_data(struct rmi_copy *c, int in, int out)
+{
+    while (1)
+    {
+        ssize_t n;
+
+        if (c->method == RMI_COPY_RANGE)
+        {
+#ifdef SYS_copy_file_range
+            n = syscall(SYS_copy_file_range, in, NULL, out, NULL, (size_t)RMI_COPY_CHUNK, 0u);
+#else
+            n = -1;
+            errno = ENOSYS;
+#endif
+            if (n == -1 && copy_method_refused(errno))
+            {
+                c->method = RMI_COPY_SENDFILE;
+                continue;
+            }
+        }
+        else if (c->method == RMI_COPY_SENDFILE)
+        {
+            n = sendfile(out, in, NULL, RMI_COPY_CHUNK);
+            if (n == -1 && copy_method_refused(errno))
+            {
+                c->method = RMI_COPY_BUFFERED;
+                continue;
+            }
+        }
+        else
+        {
+            if (c->buf == NULL)
+            {
+                c->buf = (uint8_t *)malloc(RMI_COPY_BUFFER_SIZE);
+                if (c->buf == NULL)
+                {
+                    return -1;
+                }
+            }
+            n = read(in, c->buf, RMI_COPY_BUFFER_SIZE);
+            if (n > 0 && writeall(out, c->buf, (size_t)n) == -1)
+            {
+                return -1;
+            }
+        }
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return n == 0 ? 0 : -1;
+        }
+        c->bytes += (uint64_t)n;
+        if (job_progress(c->pool, c->job, c->entries, c->bytes))
+        {
+            return -1;
+        }
+    }
+}
+
+/* Gives the copy open at `fd` its source's mode and modification time. */
+static void
+copy_attributes(int fd, mode_t mode, const struct timespec *mtime)
+{
+    struct timespec times[2];
+
+    /* Best effort, as for the owner the server runs as. */
+    fchmod(fd, mode & 07777);
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = *mtime;
+    futimens(fd, times);
+}
+
+/*
+ * Copies the file or symlink `name` in `src_dir` to `dst_name` in
+ * `dst_dir`, which must not exist yet. Other file types are skipped inside
+ * a directory, but fail as the top-level source (`src_dir` is AT_FDCWD),
+ * where a skip would pass for a copy. A file that fails half way is
+ * removed again.
+ */
+static int
+copy_leaf(struct rmi_copy *c, int src_dir, const char *name, int dst_dir,
+          const char *dst_name, const struct stat *st)
+{
+    int in;
+    int out;
+    int rc;
+
+    if (S_ISLNK(st->st_mode))
+    {
+        struct timespec times[2];
+        char target[PATH_MAX];
+        ssize_t n;
+
+        n = readlinkat(src_dir, name, target, sizeof(target));
+        if (n == -1 || (size_t)n >= sizeof(target))
+        {
+            return -1;
+        }
+        target[n] = '\0';
+        if (symlinkat(target, dst_dir, dst_name) == -1)
+        {
+            return -1;
+        }
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1] = st->st_mtim;
+        utimensat(dst_dir, dst_name, times, AT_SYMLINK_NOFOLLOW);
+    }
+    else if (S_ISREG(st->st_mode))
+    {
+        in = openat(src_dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (in == -1)
+        {
+            return -1;
+        }
+        out = openat(dst_dir, dst_name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                     0600);
+        if (out == -1)
+        {
+            close(in);
+            return -1;
+        }
+        rc = copy_file_data(c, in, out);
+        if (rc == 0)
+        {
+            copy_attributes(out, st->st_mode, &st->st_mtim);
+        }
+        close(in);
+        if (close(out) == -1)
+        {
+            rc = -1;
+        }
+        if (rc == -1)
+        {
+            unlinkat(dst_dir, dst_name, 0);
+            return -1;
+        }
+    }
+    else if (src_dir == AT_FDCWD)
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    else
+    {
+        return 0;
+    }
+    c->entries++;
+    return job_progress(c->pool, c->job, c->entries, c->bytes) ? -1 : 0;
+}
+
+/*
+ * Opens the source directory `name` in `src_dir` and creates its copy
+ * `dst_name` in `dst_dir` on top of the stack. The copy stays writable
+ * until copy_tree() gives it the source's mode on the way out.
+ */
+static int
+copy_dir_push(struct rmi_copy_dir **stack, size_t *depth, size_t *cap,
+              int src_dir, const char *name, int dst_dir, const char *dst_name,
+              const struct stat *st)
+{
+    struct rmi_copy_dir *top;
+
+    if (*depth == *cap)
+    {
+        size_t next_cap;
+        struct rmi_copy_dir *next;
+
+        next_cap = *cap == 0 ? 16 : *cap * 2;
+        next = (struct rmi_copy_dir *)realloc(*stack, next_cap * sizeof(*next));
+        if (next == NULL)
+        {
+            return -1;
+        }
+        *stack = next;
+        *cap = next_cap;
+    }
+    top = &(*stack)[*depth];
+    top->src_fd = openat(src_dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (top->src_fd == -1)
+    {
+        return -1;
+    }
+    if (mkdirat(dst_dir, dst_name, 0700) == -1 ||
+        (top->dst_fd = openat(dst_dir, dst_name,
+                              O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+    {
+        close(top->src_fd);
+        return -1;
+    }
+    top->resume = 0;
+    top->mode = st->st_mode;
+    top->mtime = st->st_mtim;
+    (*depth)++;
+    return 0;
+}
+
+/*
+ * COPY: copies `src` to `dst`, which must not exist yet; a directory is
+ * copied with everything under it. The walk is remove_tree()'s: one open
+ * directory per level on an explicit stack, fd-relative names and one
+ * shared getdents64() buffer. Files and symlinks keep their mode and
+ * modification time and directories get theirs once their contents are
+ * in. A cancelled or failed copy leaves what was copied so far.
+ */
+static int
+copy_tree(struct rmi_pool *pool, struct rmi_job *job, const char *src, const char *dst)
+{
+    struct rmi_copy_dir *stack;
+    struct rmi_dir_reader dr;
+    struct rmi_copy c;
+    struct stat st;
+    size_t depth;
+    size_t cap;
+    int rc;
+
+    if (*src == '\0' || *dst == '\0' || job_progress(pool, job, 0, 0) ||
+        lstat(src, &st) == -1)
+    {
+        return -1;
+    }
+    memset(&c, 0, sizeof(c));
+    c.pool = pool;
+    c.job = job;
+    c.method = RMI_COPY_RANGE;
+    if (!S_ISDIR(st.st_mode))
+    {
+        rc = copy_leaf(&c, AT_FDCWD, src, AT_FDCWD, dst, &st);
+        free(c.buf);
+        return rc;
+    }
+
+    stack = NULL;
+    depth = 0;
+    cap = 0;
+    if (copy_dir_push(&stack, &depth, &cap, AT_FDCWD, src, AT_FDCWD, dst, &st) == -1 ||
+        fstat(stack[0].dst_fd, &st) == -1)
+    {
+        while (depth > 0)
+        {
+            depth--;
+            close(stack[depth].src_fd);
+            close(stack[depth].dst_fd);
+        }
+        free(stack);
+        return -1;
+    }
+    c.root_dev = st.st_dev;
+    c.root_ino = st.st_ino;
+    dr.buf = (uint8_t *)malloc(RMI_DENTS_BUFFER_SIZE);
+    dr.fd = stack[0].src_fd;
+    dr.len = 0;
+    dr.off = 0;
+    rc = dr.buf == NULL ? -1 : 0;
+    while (rc == 0 && depth > 0)
+    {
+        const struct rmi_dirent64 *d;
+        struct rmi_copy_dir *top;
+
+        top = &stack[depth - 1];
+        d = dir_reader_next(&dr);
+        if (d == NULL)
+        {
+            if (errno != 0)
+            {
+                rc = -1;
+                break;
+            }
+            copy_attributes(top->dst_fd, top->mode, &top->mtime);
+            close(top->src_fd);
+            close(top->dst_fd);
+            depth--;
+            if (depth > 0)
+            {
+                dr.fd = stack[depth - 1].src_fd;
+                dr.len = 0;
+                dr.off = 0;
+                if (lseek(dr.fd, stack[depth - 1].resume, SEEK_SET) == (off_t)-1)
+                {
+                    rc = -1;
+                }
+            }
+            c.entries++;
+            if (rc == 0 && job_progress(pool, job, c.entries, c.bytes))
+            {
+                rc = -1;
+            }
+            continue;
+        }
+
+        if (fstatat(top->src_fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+            if (errno == ENOENT)
+            {
+                continue;
+            }
+            rc = -1;
+            break;
+        }
+        if (!S_ISDIR(st.st_mode))
+        {
+            rc = copy_leaf(&c, top->src_fd, d->d_name, top->dst_fd, d->d_name, &st);
+            continue;
+        }
+        if (st.st_dev == c.root_dev && st.st_ino == c.root_ino)
+        {
+            continue;
+        }
+        top->resume = (off_t)d->d_off;
+        if (copy_dir_push(&stack, &depth, &cap, top->src_fd, d->d_name,
+                          top->dst_fd, d->d_name, &st) == -1)
+        {
+            rc = -1;
+            break;
+        }
+        dr.fd = stack[depth - 1].src_fd;
+        dr.len = 0;
+        dr.off = 0;
+    }
+    while (depth > 0)
+    {
+        depth--;
+        close(stack[depth].src_fd);
+        close(stack[depth].dst_fd);
+    }
+    free(stack);
+    free(dr.buf);
+    free(c.buf);
+    return rc;
+}
+
+/*
+ * rename() that fails with EEXIST rather than replace `dst`. File systems
+ * without RENAME_NOREPLACE fall back to checking first.
+ */
+static int
+rename_noreplace(const char *src, const char *dst)
+{
+    struct stat st;
+
+#if defined(SYS_renameat2) && defined(RENAME_NOREPLACE)
+    if (syscall(SYS_renameat2, AT_FDCWD, src, AT_FDCWD, dst, RENAME_NOREPLACE) == 0)
+    {
+        return 0;
+    }
+    if (errno != EINVAL && errno != ENOSYS)
+    {
+        return -1;
+    }
+#endif
+    if (lstat(dst, &st) == 0)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+    return rename(src, dst);
+}
+
+/*
+ * MOVE: a rename() when `src` and `dst` share a file system. Across file
+ * systems the source is copied as for COPY and removed once the copy is
+ * complete; a cancel only stops the copy, so the source is never left
+ * half removed.
+ */
+static int
+move_path(struct rmi_pool *pool, struct rmi_job *job, const char *src, const char *dst)
+{
+    struct stat st;
+
+    if (*src == '\0' || *dst == '\0' || job_progress(pool, job, 0, 0))
+    {
+        return -1;
+    }
+    if (rename_noreplace(src, dst) == 0)
+    {
+        job_progress(pool, job, 1, 0);
+        return 0;
+    }
+    if (errno != EXDEV || lstat(dst, &st) == 0 || copy_tree(pool, job, src, dst) == -1)
+    {
+        return -1;
+    }
+    return remove_tree(pool, NULL, src);
+}
+
+/*
+ * Flushes a finished upload for the deferred fsync policy. An UPLOAD_TREE
+ * target is a directory; syncing its file system covers every file in it.
+ */
+static int
+sync_path(const char *path)
+{
+    struct stat st;
+    int fd;
+    int rc;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        rc = (int)syscall(SYS_syncfs, fd);
+    }
+    else
+    {
+        rc = fsync(fd);
+    }
+    if (rc == -1)
+    {
+        fprintf(stderr, "RMI upload: deferred fsync failed for %s: %d\n", path, errno);
+    }
+    close(fd);
+    return rc;
+}
+
+/* Fills `buf` from `off`, stopping early only at end of file. */
+static ssize_t
+pread_full(int fd, uint8_t *buf, size_t len, off_t off)
+{
+    size_t got;
+
+    got = 0;
+    while (got < len)
+    {
+        ssize_t n;
+
+        n = pread(fd, buf + got, len - got, off + (off_t)got);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        got += (size_t)n;
+    }
+    return (ssize_t)got;
+}
+
+/*
+ * Builds the BLOCKSUMS reply for `path`: the file's identity, then the weak
+ * and strong checksum of every `block_size` block.
+ */
+static int
+compute_block_sums(const char *path, uint32_t block_size, uint8_t **out, size_t *out_len)
+{
+    struct stat st;
+    uint8_t *reply;
+    uint8_t *block;
+    uint8_t *entry;
+    uint64_t count;
+    uint64_t i;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+        block_size < RMI_DELTA_BLOCK_MIN || block_size > RMI_DELTA_BLOCK_MAX)
+    {
+        close(fd);
+        return -1;
+    }
+    count = ((uint64_t)st.st_size + block_size - 1) / block_size;
+    if (count > RMI_DELTA_MAX_BLOCKS)
+    {
+        close(fd);
+        return -1;
+    }
+    reply = (uint8_t *)malloc(RMI_BLOCKSUMS_HEADER_SIZE + count * RMI_BLOCKSUMS_ENTRY_SIZE);
+    block = (uint8_t *)malloc(block_size);
+    if (reply == NULL || block == NULL)
+    {
+        free(reply);
+        free(block);
+        close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    rmi_write_be32(reply, block_size);
+    rmi_write_be32(reply + 4, (uint32_t)count);
+    rmi_write_be64(reply + 8, (uint64_t)st.st_size);
+    rmi_write_be64(reply + 16, (uint64_t)st.st_mtim.tv_sec * 1000000000ull +
+                                   (uint64_t)st.st_mtim.tv_nsec);
+    entry = reply + RMI_BLOCKSUMS_HEADER_SIZE;
+    for (i = 0; i < count; i++)
+    {
+        size_t len;
+        ssize_t n;
+
+        len = block_size;
+        if (i == count - 1 && (uint64_t)st.st_size % block_size != 0)
+        {
+            len = (size_t)((uint64_t)st.st_size % block_size);
+        }
+        n = pread_full(fd, block, len, (off_t)(i * block_size));
+        if (n != (ssize_t)len)
+        {
+            /* Shrank or failed while being read. */
+            free(reply);
+            free(block);
+            close(fd);
+            return -1;
+        }
+        rmi_write_be32(entry, rmi_delta_weak(block, len));
+        rmi_write_be64(entry + 4, rmi_delta_strong(block, len));
+        entry += RMI_BLOCKSUMS_ENTRY_SIZE;
+    }
+    free(block);
+    close(fd);
+    *out = reply;
+    *out_len = RMI_BLOCKSUMS_HEADER_SIZE + count * RMI_BLOCKSUMS_ENTRY_SIZE;
+    return 0;
+}
+
+static int
+check_restart_permissions(void)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    unsigned int mode;
+
+    snprintf(path, sizeof(path), "%s", "/data/local/tmp/rmi");
+    if (stat(path, &st) == -1)
+    {
+        fprintf(stderr, "RMI restart: stat failed for %s: %d\n", path, errno);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "RMI restart: %s is not a regular file.\n", path);
+        return -1;
+    }
+    mode = (unsigned int)(st.st_mode & 0777);
+    if (mode != 0777)
+    {
+        fprintf(stderr, "RMI restart: %s has mode %o, expected 777.\n", path, mode);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+trim_space(char *s)
+{
+    size_t len;
+    char *start;
+
+    start = s;
+    while (*start == ' ' || *start == '\t' || *start == '\r' || *start == '\n')
+    {
+        start++;
+    }
+    if (start != s)
+    {
+        memmove(s, start, strlen(start) + 1);
+    }
+
+    len = strlen(s);
+    while (len > 0)
+    {
+        char c = s[len - 1];
+        if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+        {
+            break;
+        }
+        s[len - 1] = '\0';
+        len--;
+    }
+}
+
+static int
+copy_field(char *dst, size_t dst_len, const char *src)
+{
+    size_t len;
+
+    len = strlen(src);
+    if (len == 0 || len >= dst_len)
+    {
+        return -1;
+    }
+    snprintf(dst, dst_len, "%s", src);
+    return 0;
+}
+
+static int
+write_default_rmi_config(void)
+{
+    FILE *fp;
+
+    fp = fopen(RMI_CONFIG_PATH, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Failed to create default RMI config: %s\n",
+                RMI_CONFIG_PATH);
+        return -1;
+    }
+    fprintf(fp, "username=%s\npassword=%s\n", RMI_DEFAULT_USER, RMI_DEFAULT_PASS);
+    fclose(fp);
+    chmod(RMI_CONFIG_PATH, 0666);
+    return 0;
+}
+
+static int
+load_rmi_config(char *user, size_t user_len, char *pass, size_t pass_len)
+{
+    FILE *fp;
+    char line[256];
+    char user_tmp[128];
+    char pass_tmp[128];
+
+    user_tmp[0] = '\0';
+    pass_tmp[0] = '\0';
+
+    fp = fopen(RMI_CONFIG_PATH, "r");
+    if (fp == NULL)
+    {
+        if (errno == ENOENT)
+        {
+            if (write_default_rmi_config() == 0)
+            {
+                if (copy_field(user, user_len, RMI_DEFAULT_USER) == -1 ||
+                    copy_field(pass, pass_len, RMI_DEFAULT_PASS) == -1)
+                {
+                    fprintf(stderr, "Default RMI config fields too long.\n");
+                    return -1;
+                }
+                fprintf(stderr, "Created default RMI config: %s\n", RMI_CONFIG_PATH);
+                return 0;
+            }
+        }
+        fprintf(stderr, "RMI config not found: %s\n", RMI_CONFIG_PATH);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        char *sep;
+
+        trim_space(line);
+        if (line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+
+        if (strncmp(line, "username=", 9) == 0)
+        {
+            char *val = line + 9;
+            trim_space(val);
+            if (copy_field(user_tmp, sizeof(user_tmp), val) == -1)
+            {
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+        if (strncmp(line, "upload_fsync=", 13) == 0)
+        {
+            char *val = line + 13;
+            trim_space(val);
+            if (strcmp(val, "sync") == 0)
+            {
+                rmi_upload_fsync = RMI_FSYNC_SYNC;
+            }
+            else if (strcmp(val, "deferred") == 0)
+            {
+                rmi_upload_fsync = RMI_FSYNC_DEFERRED;
+            }
+            else if (strcmp(val, "none") == 0)
+            {
+                rmi_upload_fsync = RMI_FSYNC_NONE;
+            }
+            else
+            {
+                fprintf(stderr, "RMI config: unknown upload_fsync '%s', using none.\n", val);
+                rmi_upload_fsync = RMI_FSYNC_NONE;
+            }
+            continue;
+        }
+        if (strncmp(line, "fb_path=", 8) == 0)
+        {
+            char *val = line + 8;
+            trim_space(val);
+            if (*val == '\0')
+            {
+                /* Empty disables in-process capture. */
+                rmi_fb_path[0] = '\0';
+                continue;
+            }
+            if (copy_field(rmi_fb_path, sizeof(rmi_fb_path), val) == -1)
+            {
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+        if (strncmp(line, "fb_mode=", 8) == 0)
+        {
+            char *val = line + 8;
+            trim_space(val);
+            if (copy_field(rmi_fb_mode, sizeof(rmi_fb_mode), val) == -1)
+            {
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+        if (strncmp(line, "password=", 9) == 0)
+        {
+            char *val = line + 9;
+            trim_space(val);
+            if (copy_field(pass_tmp, sizeof(pass_tmp), val) == -1)
+            {
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+
+        if (user_tmp[0] == '\0' && pass_tmp[0] == '\0')
+        {
+            sep = strchr(line, ':');
+            if (sep == NULL)
+            {
+                sep = strpbrk(line, " \t");
+            }
+            if (sep != NULL)
+            {
+                *sep = '\0';
+                sep++;
+                trim_space(line);
+                trim_space(sep);
+                if (copy_field(user_tmp, sizeof(user_tmp), line) == -1 ||
+                    copy_field(pass_tmp, sizeof(pass_tmp), sep) == -1)
+                {
+                    fclose(fp);
+                    return -1;
+                }
+                continue;
+            }
+
+            if (copy_field(user_tmp, sizeof(user_tmp), line) == -1)
+            {
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+
+        if (pass_tmp[0] == '\0')
+        {
+            if (copy_field(pass_tmp, sizeof(pass_tmp), line) == -1)
+            {
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+    }
+
+    fclose(fp);
+
+    if (user_tmp[0] == '\0' || pass_tmp[0] == '\0')
+    {
+        fprintf(stderr, "RMI config missing username/password.\n");
+        return -1;
+    }
+    if (copy_field(user, user_len, user_tmp) == -1 ||
+        copy_field(pass, pass_len, pass_tmp) == -1)
+    {
+        fprintf(stderr, "RMI config fields too long.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Starts `screencap` (PNG with `png`, raw otherwise) and returns its stdout. */
+static int
+spawn_screencap(pid_t *out_pid, bool png)
+{
+    int pipefd[2];
+    pid_t pid;
+
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+    {
+        fprintf(stderr, "Syscall error: pipe at line %d with code %d.\n",
+                __LINE__, errno);
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == -1)
+    {
+        fprintf(stderr, "Syscall error: fork at line %d with code %d.\n",
+                __LINE__, errno);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        if (dup2(pipefd[1], STDOUT_FILENO) == -1)
+        {
+            _exit(127);
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (png)
+        {
+            execl("/system/bin/screencap", "screencap", "-p", (char *)NULL);
+        }
+        else
+        {
+            execl("/system/bin/screencap", "screencap", (char *)NULL);
+        }
+        _exit(127);
+    }
+
+    close(pipefd[1]);
+    *out_pid = pid;
+    return pipefd[0];
+}
+
+/*
+ * In-process framebuffer capture. The device (or a raw file stand-in when
+ * `fb_path=`/`fb_mode=` are set in the config) is mapped once and kept
+ * open; each capture converts the visible buffer into a reused RGB888
+ * scratch buffer. Guarded by a lock because both workers may capture.
+ */
+enum rmi_fb_format {
+    RMI_FB_RGB565 = 0,
+    RMI_FB_RGBX8888 = 1,
+    RMI_FB_BGRX8888 = 2,
+    RMI_FB_RGB888 = 3,
+};
+
+enum rmi_fb_state {
+    RMI_FB_UNPROBED = 0,
+    RMI_FB_READY = 1,
+    RMI_FB_UNAVAILABLE = 2,
+};
+
+struct rmi_fb {
+    pthread_mutex_t lock;
+    enum rmi_fb_state state;
+    int fd;
+    bool is_device;
+    uint8_t *map;
+    size_t map_len;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    enum rmi_fb_format format;
+    uint8_t *pixels;
+    size_t pixels_cap;
+    uint32_t frame_width;
+    uint32_t frame_height;
+    uint8_t *exec_buf;
+    size_t exec_cap;
+};
+
+static struct rmi_fb rmi_fb = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .state = RMI_FB_UNPROBED,
+    .fd = -1,
+};
+
+static uint32_t
+fb_bytes_per_pixel(enum rmi_fb_format format)
+{
+    switch (format)
+    {
+    case RMI_FB_RGB565:
+        return 2u;
+    case RMI_FB_RGB888:
+        return 3u;
+    case RMI_FB_RGBX8888:
+    case RMI_FB_BGRX8888:
+        break;
+    }
+    return 4u;
+}
+
+static int
+parse_fb_format(const char *name, enum rmi_fb_format *format)
+{
+    if (strcmp(name, "rgb565") == 0)
+    {
+        *format = RMI_FB_RGB565;
+    }
+    else if (strcmp(name, "rgbx8888") == 0)
+    {
+        *format = RMI_FB_RGBX8888;
+    }
+    else if (strcmp(name, "bgrx8888") == 0)
+    {
+        *format = RMI_FB_BGRX8888;
+    }
+    else if (strcmp(name, "rgb888") == 0)
+    {
+        *format = RMI_FB_RGB888;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Parses `<width>x<height>:<format>` from the fb_mode= config key. */
+static int
+parse_fb_mode(const char *mode, uint32_t *width, uint32_t *height,
+              enum rmi_fb_format *format)
+{
+    unsigned int w;
+    unsigned int h;
+    char name[16];
+
+    if (sscanf(mode, "%ux%u:%15s", &w, &h, name) != 3 || w == 0 || h == 0 ||
+        w > 8192 || h > 8192)
+    {
+        return -1;
+    }
+    if (parse_fb_format(name, format) == -1)
+    {
+        return -1;
+    }
+    *width = w;
+    *height = h;
+    return 0;
+}
+
+static int
+fb_format_from_var(const struct fb_var_screeninfo *var, enum rmi_fb_format *format)
+{
+    if (var->bits_per_pixel == 16 && var->red.offset == 11 &&
+        var->green.offset == 5 && var->blue.offset == 0)
+    {
+        *format = RMI_FB_RGB565;
+        return 0;
+    }
+    if (var->bits_per_pixel == 32 && var->green.offset == 8)
+    {
+        if (var->red.offset == 0 && var->blue.offset == 16)
+        {
+            *format = RMI_FB_RGBX8888;
+            return 0;
+        }
+        if (var->red.offset == 16 && var->blue.offset == 0)
+        {
+            *format = RMI_FB_BGRX8888;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int
+fb_open(struct rmi_fb *fb)
+{
+    struct fb_var_screeninfo var;
+    struct fb_fix_screeninfo fix;
+    struct stat st;
+    size_t needed;
+
+    fb->fd = open(rmi_fb_path, O_RDONLY | O_CLOEXEC);
+    if (fb->fd == -1)
+    {
+        return -1;
+    }
+    if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &var) == 0 &&
+        ioctl(fb->fd, FBIOGET_FSCREENINFO, &fix) == 0)
+    {
+        if (fb_format_from_var(&var, &fb->format) == -1)
+        {
+            fprintf(stderr, "RMI fb: unsupported pixel layout (%u bpp)\n",
+                    var.bits_per_pixel);
+            return -1;
+        }
+        fb->is_device = true;
+        fb->width = var.xres;
+        fb->height = var.yres;
+        fb->stride = fix.line_length;
+        fb->map_len = fix.smem_len;
+    }
+    else
+    {
+        /* A plain file holding one raw frame, described by fb_mode=. */
+        if (rmi_fb_mode[0] == '\0' ||
+            parse_fb_mode(rmi_fb_mode, &fb->width, &fb->height, &fb->format) == -1 ||
+            fstat(fb->fd, &st) == -1)
+        {
+            return -1;
+        }
+        fb->is_device = false;
+        fb->stride = fb->width * fb_bytes_per_pixel(fb->format);
+        fb->map_len = (size_t)st.st_size;
+    }
+
+    needed = (size_t)fb->stride * fb->height;
+    if (fb->width == 0 || fb->height == 0 ||
+        fb->stride < fb->width * fb_bytes_per_pixel(fb->format) ||
+        fb->map_len < needed)
+    {
+        return -1;
+    }
+    fb->map = (uint8_t *)mmap(NULL, fb->map_len, PROT_READ, MAP_SHARED, fb->fd, 0);
+    if (fb->map == MAP_FAILED)
+    {
+        fb->map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+fb_close(struct rmi_fb *fb)
+{
+    if (fb->map != NULL)
+    {
+        munmap(fb->map, fb->map_len);
+        fb->map = NULL;
+    }
+    if (fb->fd != -1)
+    {
+        close(fb->fd);
+        fb->fd = -1;
+    }
+}
+
+/*
+ * Row converters to packed RGB888. The NEON paths handle 16 (32-bit) or
+ * 8 (RGB565) pixels per step; the scalar loops finish the tail and serve
+ * other targets.
+ */
+static void
+fb_convert_row_x8888(uint8_t *dst, const uint8_t *src, uint32_t width, bool bgr)
+{
+    uint32_t x;
+    int r;
+    int b;
+
+    x = 0;
+#if defined(__ARM_NEON)
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16x4_t in;
+        uint8x16x3_t out;
+
+        in = vld4q_u8(src + (size_t)x * 4u);
+        out.val[0] = bgr ? in.val[2] : in.val[0];
+        out.val[1] = in.val[1];
+        out.val[2] = bgr ? in.val[0] : in.val[2];
+        vst3q_u8(dst + (size_t)x * 3u, out);
+    }
+#endif
+    r = bgr ? 2 : 0;
+    b = bgr ? 0 : 2;
+    for (; x < width; x++)
+    {
+        const uint8_t *p;
+        uint8_t *q;
+
+        p = src + (size_t)x * 4u;
+        q = dst + (size_t)x * 3u;
+        q[0] = p[r];
+        q[1] = p[1];
+        q[2] = p[b];
+    }
+}
+
+static void
+fb_convert_row_rgb565(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    uint32_t x;
+
+    x = 0;
+#if defined(__ARM_NEON)
+    for (; x + 8 <= width; x += 8)
+    {
+        uint16x8_t px;
+        uint8x8_t r;
+        uint8x8_t g;
+        uint8x8_t b;
+        uint8x8x3_t out;
+
+        px = vld1q_u16((const uint16_t *)(const void *)(src + (size_t)x * 2u));
+        r = vand_u8(vshrn_n_u16(px, 8), vdup_n_u8(0xf8));
+        g = vand_u8(vshrn_n_u16(px, 3), vdup_n_u8(0xfc));
+        b = vmovn_u16(vshlq_n_u16(px, 3));
+        out.val[0] = vorr_u8(r, vshr_n_u8(r, 5));
+        out.val[1] = vorr_u8(g, vshr_n_u8(g, 6));
+        out.val[2] = vorr_u8(b, vshr_n_u8(b, 5));
+        vst3_u8(dst + (size_t)x * 3u, out);
+    }
+#endif
+    for (; x < width; x++)
+    {
+        uint16_t v;
+        uint8_t r;
+        uint8_t g;
+        uint8_t b;
+        uint8_t *q;
+
+        v = (uint16_t)(src[(size_t)x * 2u] | (src[(size_t)x * 2u + 1u] << 8));
+        r = (uint8_t)((v >> 8) & 0xf8);
+        g = (uint8_t)((v >> 3) & 0xfc);
+        b = (uint8_t)(v << 3);
+        q = dst + (size_t)x * 3u;
+        q[0] = (uint8_t)(r | (r >> 5));
+        q[1] = (uint8_t)(g | (g >> 6));
+        q[2] = (uint8_t)(b | (b >> 5));
+    }
+}
+
+/* Converts a whole frame into fb->pixels as packed RGB888. */
+static int
+fb_convert_frame(struct rmi_fb *fb,
+                 const uint8_t *src,
+                 uint32_t width,
+                 uint32_t height,
+                 uint32_t stride,
+                 enum rmi_fb_format format)
+{
+    size_t needed;
+    uint32_t y;
+
+    needed = (size_t)width * height * 3u;
+    if (needed > fb->pixels_cap)
+    {
+        uint8_t *tmp;
+
+        tmp = (uint8_t *)realloc(fb->pixels, needed);
+        if (tmp == NULL)
+        {
+            return -1;
+        }
+        fb->pixels = tmp;
+        fb->pixels_cap = needed;
+    }
+    fb->frame_width = width;
+    fb->frame_height = height;
+
+    for (y = 0; y < height; y++)
+    {
+        const uint8_t *row;
+        uint8_t *dst;
+
+        row = src + (size_t)y * stride;
+        dst = fb->pixels + (size_t)y * width * 3u;
+        switch (format)
+        {
+        case RMI_FB_RGB565:
+            fb_convert_row_rgb565(dst, row, width);
+            break;
+        case RMI_FB_RGB888:
+            memcpy(dst, row, (size_t)width * 3u);
+            break;
+        case RMI_FB_RGBX8888:
+        case RMI_FB_BGRX8888:
+            fb_convert_row_x8888(dst, row, width, format == RMI_FB_BGRX8888);
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copies the currently displayed frame into fb->pixels as packed RGB888.
+ * Caller holds fb->lock.
+ */
+static int
+fb_grab(struct rmi_fb *fb)
+{
+    size_t offset;
+
+    if (fb->state == RMI_FB_UNPROBED)
+    {
+        if (rmi_fb_path[0] != '\0' && fb_open(fb) == 0)
+        {
+            fb->state = RMI_FB_READY;
+            fprintf(stderr, "RMI fb: capturing %ux%u from %s\n",
+                    (unsigned int)fb->width, (unsigned int)fb->height, rmi_fb_path);
+        }
+        else
+        {
+            fb_close(fb);
+            fb->state = RMI_FB_UNAVAILABLE;
+            fprintf(stderr, "RMI fb: %s unavailable, using screencap\n", rmi_fb_path);
+        }
+    }
+    if (fb->state != RMI_FB_READY)
+    {
+        return -1;
+    }
+
+    offset = 0;
+    if (fb->is_device)
+    {
+        struct fb_var_screeninfo var;
+
+        /* Page-flipping drivers scan out from yoffset. */
+        if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &var) == 0)
+        {
+            offset = (size_t)var.yoffset * fb->stride +
+                     (size_t)var.xoffset * fb_bytes_per_pixel(fb->format);
+        }
+        if (offset + (size_t)fb->stride * fb->height > fb->map_len)
+        {
+            offset = 0;
+        }
+    }
+
+    return fb_convert_frame(fb, fb->map + offset, fb->width, fb->height,
+                            fb->stride, fb->format);
+}
+
+static uint32_t
+read_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Fallback for raw captures: runs `screencap` without -p and converts its
+ * output (a 12- or 16-byte header of width, height and format, then tight
+ * rows) into fb->pixels. The read buffer is kept for the next capture.
+ * Caller holds fb->lock.
+ */
+static int
+exec_grab_raw(struct rmi_fb *fb)
+{
+    enum rmi_fb_format format;
+    uint32_t width;
+    uint32_t height;
+    size_t pixel_bytes;
+    size_t header;
+    size_t len;
+    pid_t pid;
+    ssize_t n;
+    int status;
+    int fd;
+
+    fd = spawn_screencap(&pid, false);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    len = 0;
+    n = -1;
+    while (1)
+    {
+        if (len == fb->exec_cap)
+        {
+            size_t next;
+            uint8_t *tmp;
+
+            next = fb->exec_cap == 0 ? RMI_XFER_BUFFER_SIZE : fb->exec_cap * 2;
+            tmp = (uint8_t *)realloc(fb->exec_buf, next);
+            if (tmp == NULL)
+            {
+                break;
+            }
+            fb->exec_buf = tmp;
+            fb->exec_cap = next;
+        }
+        n = read(fd, fb->exec_buf + len, fb->exec_cap - len);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        len += (size_t)n;
+    }
+    close(fd);
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0 || n != 0 || len < 12)
+    {
+        return -1;
+    }
+
+    width = read_le32(fb->exec_buf);
+    height = read_le32(fb->exec_buf + 4);
+    switch (read_le32(fb->exec_buf + 8))
+    {
+    case 1: /* RGBA_8888 */
+    case 2: /* RGBX_8888 */
+        format = RMI_FB_RGBX8888;
+        break;
+    case 3:
+        format = RMI_FB_RGB888;
+        break;
+    case 4:
+        format = RMI_FB_RGB565;
+        break;
+    default:
+        return -1;
+    }
+    if (width == 0 || height == 0 || width > 8192 || height > 8192)
+    {
+        return -1;
+    }
+    pixel_bytes = (size_t)width * height * fb_bytes_per_pixel(format);
+    if (len < pixel_bytes)
+    {
+        return -1;
+    }
+    header = len - pixel_bytes;
+    if (header != 12 && header != 16)
+    {
+        return -1;
+    }
+    return fb_convert_frame(fb, fb->exec_buf + header, width, height,
+                            width * fb_bytes_per_pixel(format), format);
+}
+
+static uint32_t
+png_crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+    static uint32_t table[256];
+    size_t i;
+
+    /* Only called with rmi_fb.lock held, so the lazy init is not racy. */
+    if (table[1] == 0)
+    {
+        uint32_t n;
+
+        for (n = 0; n < 256; n++)
+        {
+            uint32_t c;
+            int k;
+
+            c = n;
+            for (k = 0; k < 8; k++)
+            {
+                c = (c & 1u) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+    }
+    crc = ~crc;
+    for (i = 0; i < len; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0xffu] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint8_t *
+png_put_be32(uint8_t *p, uint32_t value)
+{
+    rmi_write_be32(p, value);
+    return p + 4;
+}
+
+/* Writes a chunk whose `len` data bytes are already in place after the header. */
+static uint8_t *
+png_finish_chunk(uint8_t *chunk, const char *type, uint32_t len)
+{
+    png_put_be32(chunk, len);
+    memcpy(chunk + 4, type, 4);
+    return png_put_be32(chunk + 8 + len, png_crc32(0, chunk + 4, 4u + len));
+}
+
+/*
+ * Deflate for the framebuffer PNG in the spirit of zlib level 1: a single
+ * fixed-Huffman block of greedy LZ77 matches, found through a hash of the
+ * next four bytes that only remembers where each match starts. Screens are
+ * mostly flat colour, which the PNG Up filter turns into long zero runs.
+ */
+#define PNG_HASH_BITS  15
+#define PNG_WINDOW     32768u
+#define PNG_MIN_MATCH  4u
+#define PNG_MAX_MATCH  258u
+
+static const uint16_t png_len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t png_len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t png_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t png_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+/* Deflate output, least significant bit first. */
+struct png_bits {
+    uint8_t *p;
+    uint64_t buf;
+    unsigned int count;
+};
+
+static void
+png_bits_put(struct png_bits *b, uint32_t value, unsigned int n)
+{
+    b->buf |= (uint64_t)value << b->count;
+    b->count += n;
+    while (b->count >= 8)
+    {
+        *b->p++ = (uint8_t)b->buf;
+        b->buf >>= 8;
+        b->count -= 8;
+    }
+}
+
+/* Huffman codes go out most significant bit first. */
+static void
+png_bits_code(struct png_bits *b, uint32_t code, unsigned int n)
+{
+    uint32_t reversed;
+    unsigned int i;
+
+    reversed = 0;
+    for (i = 0; i < n; i++)
+    {
+        reversed = (reversed << 1) | ((code >> i) & 1u);
+    }
+    png_bits_put(b, reversed, n);
+}
+
+/* Writes literal/length symbol `sym` with the fixed Huffman code. */
+static void
+png_put_symbol(struct png_bits *b, unsigned int sym)
+{
+    if (sym < 144)
+    {
+        png_bits_code(b, 0x30u + sym, 8);
+    }
+    else if (sym < 256)
+    {
+        png_bits_code(b, 0x190u + (sym - 144u), 9);
+    }
+    else if (sym < 280)
+    {
+        png_bits_code(b, sym - 256u, 7);
+    }
+    else
+    {
+        png_bits_code(b, 0xc0u + (sym - 280u), 8);
+    }
+}
+
+static void
+png_put_match(struct png_bits *b, unsigned int len, unsigned int dist)
+{
+    unsigned int code;
+
+    code = 28;
+    while (png_len_base[code] > len)
+    {
+        code--;
+    }
+    png_put_symbol(b, 257u + code);
+    png_bits_put(b, len - png_len_base[code], png_len_extra[code]);
+    code = 29;
+    while (png_dist_base[code] > dist)
+    {
+        code--;
+    }
+    png_bits_code(b, code, 5);
+    png_bits_put(b, dist - png_dist_base[code], png_dist_extra[code]);
+}
+
+/*
+ * Compresses `len` bytes into `out` as a zlib stream and returns its end.
+ * `out` must hold len + len / 8 + 16 bytes: a literal never takes more
+ * than nine bits and a match less than its literals would.
+ */
+static uint8_t *
+png_deflate(const uint8_t *data, size_t len, uint8_t *out, uint32_t *head)
+{
+    struct png_bits b;
+    uint32_t adler_a;
+    uint32_t adler_b;
+    size_t i;
+
+    memset(head, 0, sizeof(*head) << PNG_HASH_BITS);
+    out[0] = 0x78;
+    out[1] = 0x01;
+    b.p = out + 2;
+    b.buf = 0;
+    b.count = 0;
+    png_bits_put(&b, 3, 3);  /* last block, fixed Huffman */
+    i = 0;
+    while (i + PNG_MIN_MATCH <= len)
+    {
+        uint32_t v;
+        uint32_t h;
+        size_t cand;
+
+        memcpy(&v, data + i, sizeof(v));
+        h = (v * 2654435761u) >> (32 - PNG_HASH_BITS);
+        cand = head[h];
+        head[h] = (uint32_t)i + 1u;
+        if (cand != 0 && i - (cand - 1) <= PNG_WINDOW &&
+            memcmp(data + cand - 1, data + i, PNG_MIN_MATCH) == 0)
+        {
+            size_t max;
+            size_t n;
+
+            cand--;
+            max = len - i < PNG_MAX_MATCH ? len - i : PNG_MAX_MATCH;
+            n = PNG_MIN_MATCH;
+            while (n < max && data[cand + n] == data[i + n])
+            {
+                n++;
+            }
+            png_put_match(&b, (unsigned int)n, (unsigned int)(i - cand));
+            i += n;
+            continue;
+        }
+        png_put_symbol(&b, data[i]);
+        i++;
+    }
+    for (; i < len; i++)
+    {
+        png_put_symbol(&b, data[i]);
+    }
+    png_put_symbol(&b, 256);
+    png_bits_put(&b, 0, 7);  /* flush to a byte boundary */
+
+    adler_a = 1;
+    adler_b = 0;
+    while (len > 0)
+    {
+        /* 5552 is the most bytes adler32 can sum before b overflows. */
+        size_t n;
+
+        n = len > 5552u ? 5552u : len;
+        for (i = 0; i < n; i++)
+        {
+            adler_a += data[i];
+            adler_b += adler_a;
+        }
+        adler_a %= 65521u;
+        adler_b %= 65521u;
+        data += n;
+        len -= n;
+    }
+    return png_put_be32(b.p, (adler_b << 16) | adler_a);
+}
+
+/*
+ * Wraps fb->pixels in an RGB PNG, Up-filtered and deflated by
+ * png_deflate(): quick to encode, and small enough to send over Wi-Fi.
+ */
+static int
+fb_encode_png(const struct rmi_fb *fb, uint8_t **out, size_t *out_len)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    size_t row_len;
+    size_t raw_len;
+    size_t idat_max;
+    size_t total;
+    uint32_t *head;
+    uint8_t *filtered;
+    uint8_t *buf;
+    uint8_t *p;
+    uint8_t *idat;
+    uint8_t *tmp;
+    uint32_t y;
+
+    row_len = (size_t)fb->frame_width * 3u;
+    raw_len = (row_len + 1u) * fb->frame_height;
+    idat_max = raw_len + raw_len / 8u + 16u;
+    total = sizeof(signature) + (12u + 13u) + (12u + idat_max) + 12u;
+    if (idat_max > INT32_MAX || total > UINT32_MAX)
+    {
+        return -1;
+    }
+    buf = (uint8_t *)malloc(total);
+    filtered = (uint8_t *)malloc(raw_len);
+    head = (uint32_t *)malloc(sizeof(*head) << PNG_HASH_BITS);
+    if (buf == NULL || filtered == NULL || head == NULL)
+    {
+        free(buf);
+        free(filtered);
+        free(head);
+        return -1;
+    }
+
+    for (y = 0; y < fb->frame_height; y++)
+    {
+        const uint8_t *row;
+        const uint8_t *above;
+        uint8_t *dst;
+        size_t x;
+
+        row = fb->pixels + (size_t)y * row_len;
+        dst = filtered + (size_t)y * (row_len + 1u);
+        dst[0] = 2;  /* Up */
+        if (y == 0)
+        {
+            memcpy(dst + 1, row, row_len);
+            continue;
+        }
+        above = row - row_len;
+        for (x = 0; x < row_len; x++)
+        {
+            dst[1 + x] = (uint8_t)(row[x] - above[x]);
+        }
+    }
+
+    p = buf;
+    memcpy(p, signature, sizeof(signature));
+    p += sizeof(signature);
+
+    png_put_be32(p + 8, fb->frame_width);
+    png_put_be32(p + 12, fb->frame_height);
+    p[16] = 8;  /* bit depth */
+    p[17] = 2;  /* truecolour RGB */
+    p[18] = 0;
+    p[19] = 0;
+    p[20] = 0;
+    p = png_finish_chunk(p, "IHDR", 13);
+
+    idat = p;
+    p = png_deflate(filtered, raw_len, idat + 8, head);
+    p = png_finish_chunk(idat, "IDAT", (uint32_t)(p - (idat + 8)));
+    free(filtered);
+    free(head);
+
+    p = png_finish_chunk(p, "IEND", 0);
+
+    *out_len = (size_t)(p - buf);
+    tmp = (uint8_t *)realloc(buf, *out_len);
+    *out = tmp != NULL ? tmp : buf;
+    return 0;
+}
+
+/* Captures the framebuffer as a PNG; -1 means use the screencap binary. */
+static int
+fb_capture_png(uint8_t **out, size_t *out_len)
+{
+    int rc;
+
+    pthread_mutex_lock(&rmi_fb.lock);
+    rc = fb_grab(&rmi_fb);
+    if (rc == 0)
+    {
+        rc = fb_encode_png(&rmi_fb, out, out_len);
+    }
+    pthread_mutex_unlock(&rmi_fb.lock);
+    return rc;
+}
+
+/*
+ * SCREENCAP_RAW payload: an RMI_RAW_HEADER_SIZE header followed by the
+ * frame as a QOI op stream. Uses the framebuffer when it is available and
+ * raw `screencap` output otherwise; neither path encodes a PNG.
+ */
+static int
+capture_screencap_raw(uint8_t **out, size_t *out_len)
+{
+    struct rmi_fb *fb;
+    uint8_t *buf;
+    size_t cap;
+    size_t n;
+    int rc;
+
+    fb = &rmi_fb;
+    buf = NULL;
+    n = 0;
+    pthread_mutex_lock(&fb->lock);
+    rc = fb_grab(fb);
+    if (rc == -1)
+    {
+        rc = exec_grab_raw(fb);
+    }
+    if (rc == 0)
+    {
+        cap = RMI_RAW_HEADER_SIZE + rmi_qoi_max_size(fb->frame_width, fb->frame_height);
+        buf = (uint8_t *)malloc(cap);
+        if (buf != NULL)
+        {
+            n = rmi_qoi_encode(fb->pixels, fb->frame_width, fb->frame_height,
+                               fb->frame_width * 3u, 3,
+                               buf + RMI_RAW_HEADER_SIZE, cap - RMI_RAW_HEADER_SIZE);
+        }
+        if (buf != NULL && n > 0)
+        {
+            rmi_write_be32(buf, fb->frame_width);
+            rmi_write_be32(buf + 4, fb->frame_height);
+            rmi_write_be32(buf + 8, fb->frame_width * 3u);
+            buf[12] = RMI_RAW_FORMAT_RGB888;
+            buf[13] = RMI_RAW_CODEC_QOI;
+            buf[14] = 0;
+            buf[15] = 0;
+        }
+        else
+        {
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&fb->lock);
+    if (rc == -1)
+    {
+        free(buf);
+        return -1;
+    }
+
+    n += RMI_RAW_HEADER_SIZE;
+    if (n > UINT32_MAX)
+    {
+        free(buf);
+        return -1;
+    }
+    /* Give back the worst-case slack; the frame can sit in the queue a while. */
+    *out = (uint8_t *)realloc(buf, n);
+    if (*out == NULL)
+    {
+        *out = buf;
+    }
+    *out_len = n;
+    return 0;
+}
+
+static uint64_t
+hash_tile(const uint8_t *pixels, size_t stride, uint32_t width, uint32_t height)
+{
+    uint64_t h;
+    size_t row_len;
+    uint32_t y;
+
+    h = 0xcbf29ce484222325ull;
+    row_len = (size_t)width * 3u;
+    for (y = 0; y < height; y++)
+    {
+        const uint8_t *row;
+        size_t i;
+
+        row = pixels + (size_t)y * stride;
+        for (i = 0; i + 8 <= row_len; i += 8)
+        {
+            uint64_t word;
+
+            memcpy(&word, row + i, sizeof(word));
+            h = (h ^ word) * 0x100000001b3ull;
+            h ^= h >> 29;
+        }
+        for (; i < row_len; i++)
+        {
+            h = (h ^ row[i]) * 0x100000001b3ull;
+        }
+    }
+    return h;
+}
+
+/*
+ * Builds one SCREENSTREAM frame: the current screen is split into
+ * RMI_SCREENSTREAM_TILE squares and only tiles whose hash changed since
+ * the previous frame are encoded. The first frame, and any frame after a
+ * geometry change, is a keyframe carrying every tile.
+ */
+static int
+capture_stream_frame(struct rmi_screenstream *ss, uint8_t **out, size_t *out_len)
+{
+    struct rmi_fb *fb;
+    uint32_t cols;
+    uint32_t rows;
+    uint32_t tiles;
+    uint32_t tx;
+    uint32_t ty;
+    size_t stride;
+    size_t need;
+    uint8_t *p;
+    bool keyframe;
+    int rc;
+
+    fb = &rmi_fb;
+    pthread_mutex_lock(&fb->lock);
+    rc = fb_grab(fb);
+    if (rc == -1)
+    {
+        rc = exec_grab_raw(fb);
+    }
+    if (rc == -1)
+    {
+        pthread_mutex_unlock(&fb->lock);
+        return -1;
+    }
+
+    cols = (fb->frame_width + RMI_SCREENSTREAM_TILE - 1) / RMI_SCREENSTREAM_TILE;
+    rows = (fb->frame_height + RMI_SCREENSTREAM_TILE - 1) / RMI_SCREENSTREAM_TILE;
+    keyframe = ss->hashes == NULL || ss->width != fb->frame_width ||
+               ss->height != fb->frame_height;
+    if (keyframe && (size_t)cols * rows != ss->tile_count)
+    {
+        uint64_t *tmp;
+
+        tmp = (uint64_t *)realloc(ss->hashes, (size_t)cols * rows * sizeof(*tmp));
+        if (tmp == NULL)
+        {
+            pthread_mutex_unlock(&fb->lock);
+            return -1;
+        }
+        ss->hashes = tmp;
+        ss->tile_count = (size_t)cols * rows;
+    }
+    ss->width = fb->frame_width;
+    ss->height = fb->frame_height;
+
+    need = RMI_STREAM_HEADER_SIZE + ss->tile_count * RMI_STREAM_TILE_HEADER_SIZE +
+           rmi_qoi_max_size(fb->frame_width, fb->frame_height);
+    if (need > ss->scratch_cap)
+    {
+        free(ss->scratch);
+        ss->scratch = (uint8_t *)malloc(need);
+        ss->scratch_cap = ss->scratch != NULL ? need : 0;
+        if (ss->scratch == NULL)
+        {
+            pthread_mutex_unlock(&fb->lock);
+            return -1;
+        }
+    }
+
+    stride = (size_t)fb->frame_width * 3u;
+    p = ss->scratch + RMI_STREAM_HEADER_SIZE;
+    tiles = 0;
+    for (ty = 0; ty < rows; ty++)
+    {
+        for (tx = 0; tx < cols; tx++)
+        {
+            const uint8_t *src;
+            uint32_t x;
+            uint32_t y;
+            uint32_t w;
+            uint32_t h;
+            uint64_t hash;
+            size_t index;
+            size_t n;
+
+            x = tx * RMI_SCREENSTREAM_TILE;
+            y = ty * RMI_SCREENSTREAM_TILE;
+            w = fb->frame_width - x < RMI_SCREENSTREAM_TILE ?
+                fb->frame_width - x : RMI_SCREENSTREAM_TILE;
+            h = fb->frame_height - y < RMI_SCREENSTREAM_TILE ?
+                fb->frame_height - y : RMI_SCREENSTREAM_TILE;
+            src = fb->pixels + (size_t)y * stride + (size_t)x * 3u;
+            index = (size_t)ty * cols + tx;
+            hash = hash_tile(src, stride, w, h);
+            if (!keyframe && ss->hashes[index] == hash)
+            {
+                continue;
+            }
+            ss->hashes[index] = hash;
+
+            n = rmi_qoi_encode(src, w, h, stride, 3,
+                               p + RMI_STREAM_TILE_HEADER_SIZE,
+                               (size_t)(ss->scratch + ss->scratch_cap - p) -
+                               RMI_STREAM_TILE_HEADER_SIZE);
+            if (n == 0)
+            {
+                /* Force the tile out again on the next frame. */
+                ss->hashes[index] = ~hash;
+                continue;
+            }
+            rmi_write_be16(p, (uint16_t)x);
+            rmi_write_be16(p + 2, (uint16_t)y);
+            rmi_write_be16(p + 4, (uint16_t)w);
+            rmi_write_be16(p + 6, (uint16_t)h);
+            rmi_write_be32(p + 8, (uint32_t)n);
+            p += RMI_STREAM_TILE_HEADER_SIZE + n;
+            tiles++;
+        }
+    }
+    pthread_mutex_unlock(&fb->lock);
+
+    ss->seq++;
+    memcpy(ss->scratch, RMI_STREAM_MAGIC, 4);
+    rmi_write_be32(ss->scratch + 4, ss->seq);
+    rmi_write_be32(ss->scratch + 8, ss->width);
+    rmi_write_be32(ss->scratch + 12, ss->height);
+    rmi_write_be16(ss->scratch + 16, RMI_SCREENSTREAM_TILE);
+    ss->scratch[18] = keyframe ? RMI_STREAM_FLAG_KEYFRAME : 0;
+    ss->scratch[19] = RMI_RAW_FORMAT_RGB888;
+    rmi_write_be32(ss->scratch + 20, tiles);
+
+    /* Copy out so the worst-case scratch buffer is reused, not queued. */
+    *out_len = (size_t)(p - ss->scratch);
+    *out = (uint8_t *)malloc(*out_len);
+    if (*out == NULL)
+    {
+        return -1;
+    }
+    memcpy(*out, ss->scratch, *out_len);
+    return 0;
+}
+
+static int
+capture_screencap(uint8_t **out, size_t *out_len)
+{
+    int pipefd[2];
+    char buf[4096];
+    char *data;
+    size_t size;
+    size_t cap;
+    pid_t pid;
+    ssize_t n;
+    int status;
+
+    if (fb_capture_png(out, out_len) == 0)
+    {
+        return 0;
+    }
+
+    data = NULL;
+    size = 0;
+    cap = 0;
+
+    pipefd[0] = spawn_screencap(&pid, true);
+    if (pipefd[0] == -1)
+    {
+        return -1;
+    }
+    while ((n = read(pipefd[0], buf, sizeof(buf))) > 0)
+    {
+        size_t needed;
+
+        needed = size + (size_t)n;
+        if (needed > UINT32_MAX)
+        {
+            free(data);
+            close(pipefd[0]);
+            waitpid(pid, &status, 0);
+            return -1;
+        }
+        if (needed > cap)
+        {
+            size_t next;
+            char *tmp;
+
+            next = cap == 0 ? 8192 : cap * 2;
+            while (next < needed)
+            {
+                next *= 2;
+            }
+            tmp = realloc(data, next);
+            if (tmp == NULL)
+            {
+                free(data);
+                close(pipefd[0]);
+                waitpid(pid, &status, 0);
+                return -1;
+            }
+            data = tmp;
+            cap = next;
+        }
+        memcpy(data + size, buf, (size_t)n);
+        size = needed;
+    }
+    if (n == -1)
+    {
+        free(data);
+        close(pipefd[0]);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+    close(pipefd[0]);
+    waitpid(pid, &status, 0);
+
+    *out = (uint8_t *)data;
+    *out_len = size;
+    return 0;
+}
+
+/*
+ * SCREENCAP_STREAM: the screencap pipe is watched by the event loop under
+ * the connection's own epoll cookie, and whatever it produces is forwarded
+ * in RMI_STREAM_CHUNK frames. Reading pauses while the outbound queue is
+ * above RMI_OUT_HIGH_WATER so a slow client only backs up the pipe.
+ */
+static void
+arm_capture(struct rmi_server *srv, struct rmi_conn *conn, bool armed)
+{
+    struct epoll_event ev;
+
+    if (conn->cap_armed == armed)
+    {
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(srv->epoll_fd, armed ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                  conn->cap_fd, &ev) == -1)
+    {
+        fprintf(stderr, "Syscall error: epoll_ctl at line %d with code %d.\n",
+                __LINE__, errno);
+        return;
+    }
+    conn->cap_armed = armed;
+}
+
+static void
+stop_capture(struct rmi_server *srv, struct rmi_conn *conn, bool kill_child)
+{
+    int status;
+    bool ok;
+
+    arm_capture(srv, conn, false);
+    close(conn->cap_fd);
+    conn->cap_fd = -1;
+    if (kill_child)
+    {
+        kill(conn->cap_pid, SIGKILL);
+    }
+    ok = waitpid(conn->cap_pid, &status, 0) == conn->cap_pid &&
+         WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+         conn->cap_bytes > 0;
+    conn->cap_pid = -1;
+    if (kill_child)
+    {
+        return;
+    }
+    if (ok)
+    {
+        log_transfer("screencap", "stream", conn->cap_bytes, conn->cap_start_us, "pipe");
+    }
+    set_reply_context(conn, conn->cap_id, RMI_OP_SCREENCAP_STREAM);
+    send_frame_owned(conn, NULL, 0);
+    send_text(conn, ok ? RMI_RESP_OK : "ERR screencap");
+}
+
+static void
+start_capture_stream(struct rmi_server *srv, struct rmi_conn *conn)
+{
+    int flags;
+
+    conn->cap_fd = spawn_screencap(&conn->cap_pid, true);
+    if (conn->cap_fd == -1)
+    {
+        send_text(conn, "ERR screencap");
+        return;
+    }
+    flags = fcntl(conn->cap_fd, F_GETFL);
+    if (flags != -1)
+    {
+        fcntl(conn->cap_fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    conn->cap_armed = false;
+    conn->cap_bytes = 0;
+    conn->cap_start_us = monotonic_us();
+    arm_capture(srv, conn, true);
+}
+
+/* Forwards pending screencap output; returns true when frames were queued. */
+static bool
+pump_capture(struct rmi_server *srv, struct rmi_conn *conn)
+{
+    bool progressed;
+
+    progressed = false;
+    while (conn->cap_fd != -1 && conn->out_bytes < RMI_OUT_HIGH_WATER)
+    {
+        uint8_t *chunk;
+        ssize_t n;
+
+        chunk = (uint8_t *)malloc(RMI_STREAM_CHUNK);
+        if (chunk == NULL)
+        {
+            break;
+        }
+        n = read(conn->cap_fd, chunk, RMI_STREAM_CHUNK);
+        if (n > 0)
+        {
+            conn->cap_bytes += (uint64_t)n;
+            set_reply_context(conn, conn->cap_id, RMI_OP_SCREENCAP_STREAM);
+            send_frame_owned(conn, chunk, (uint32_t)n);
+            progressed = true;
+            continue;
+        }
+        free(chunk);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            arm_capture(srv, conn, true);
+            return progressed;
+        }
+        stop_capture(srv, conn, false);
+        return true;
+    }
+    if (conn->cap_fd != -1)
+    {
+        /* Resumed from service_conn() once the queue drains. */
+        arm_capture(srv, conn, false);
+    }
+    return progressed;
+}
+
+static bool
+input_test_bit(const uint8_t *bits, unsigned int bit)
+{
+    return (bits[bit / 8] >> (bit % 8)) & 1u;
+}
+
+/* Opens event node `node` and reads its key bitmap; -1 if it has no keys. */
+static int
+input_probe(struct rmi_input_dev *dev, unsigned int node)
+{
+    uint8_t ev_bits[EV_MAX / 8 + 1];
+    char path[64];
+    char name[128];
+    unsigned int key;
+
+    snprintf(path, sizeof(path), RMI_INPUT_PATH_FMT, node);
+    dev->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (dev->fd == -1)
+    {
+        return -1;
+    }
+    memset(ev_bits, 0, sizeof(ev_bits));
+    memset(dev->keys, 0, sizeof(dev->keys));
+    dev->key_count = 0;
+    if (ioctl(dev->fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) != -1 &&
+        input_test_bit(ev_bits, EV_KEY) &&
+        ioctl(dev->fd, EVIOCGBIT(EV_KEY, sizeof(dev->keys)), dev->keys) != -1)
+    {
+        for (key = 0; key <= KEY_MAX; key++)
+        {
+            dev->key_count += input_test_bit(dev->keys, key);
+        }
+    }
+    if (dev->key_count == 0)
+    {
+        close(dev->fd);
+        dev->fd = -1;
+        return -1;
+    }
+
+    dev->node = node;
+    if (ioctl(dev->fd, EVIOCGNAME(sizeof(name)), name) < 0)
+    {
+        snprintf(name, sizeof(name), "unknown");
+    }
+    name[sizeof(name) - 1] = '\0';
+    fprintf(stderr, "RMI input: %s \"%s\" (%u keys)\n", path, name, dev->key_count);
+    return 0;
+}
+
+static void
+input_close_all(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < rmi_input_count; i++)
+    {
+        close(rmi_input_devs[i].fd);
+        rmi_input_devs[i].fd = -1;
+    }
+    rmi_input_count = 0;
+    memset(rmi_input_key_dev, -1, sizeof(rmi_input_key_dev));
+}
+
+/*
+ * (Re)builds the device table. When several devices declare a key, the one
+ * declaring the fewest keys wins: a dedicated button device is a better
+ * target than a keyboard or a virtual device that claims everything.
+ */
+static void
+input_discover(void)
+{
+    unsigned int node;
+    unsigned int key;
+
+    input_close_all();
+    for (node = 0; node < RMI_INPUT_MAX_NODES && rmi_input_count < RMI_INPUT_MAX_DEVICES; node++)
+    {
+        if (input_probe(&rmi_input_devs[rmi_input_count], node) == 0)
+        {
+            rmi_input_count++;
+        }
+    }
+    if (rmi_input_count == 0)
+    {
+        fprintf(stderr, "RMI input: no key-capable event devices\n");
+        return;
+    }
+    for (key = 0; key <= KEY_MAX; key++)
+    {
+        unsigned int i;
+
+        for (i = 0; i < rmi_input_count; i++)
+        {
+            int8_t best;
+
+            if (!input_test_bit(rmi_input_devs[i].keys, key))
+            {
+                continue;
+            }
+            best = rmi_input_key_dev[key];
+            if (best == -1 ||
+                rmi_input_devs[i].key_count < rmi_input_devs[best].key_count)
+            {
+                rmi_input_key_dev[key] = (int8_t)i;
+            }
+        }
+    }
+}
+
+/* Returns the event node that should receive `keycode`, or -1. */
+static int
+input_key_node(int keycode)
+{
+    int node;
+
+    node = -1;
+    pthread_mutex_lock(&rmi_input_lock);
+    if (rmi_input_count == 0)
+    {
+        input_discover();
+    }
+    if (rmi_input_key_dev[keycode] != -1)
+    {
+        node = (int)rmi_input_devs[rmi_input_key_dev[keycode]].node;
+    }
+    pthread_mutex_unlock(&rmi_input_lock);
+    return node;
+}
+
+static struct rmi_input_dev *
+input_find_node(unsigned int node)
+{
+    unsigned int i;
+
+    for (i = 0; i < rmi_input_count; i++)
+    {
+        if (rmi_input_devs[i].node == node)
+        {
+            return &rmi_input_devs[i];
+        }
+    }
+    return NULL;
+}
+
+/* Writes `count` events to event node `node` in one write(). */
+static int
+input_write_events(unsigned int node, const struct input_event *events, size_t count)
+{
+    struct rmi_input_dev *dev;
+    int rc;
+
+    pthread_mutex_lock(&rmi_input_lock);
+    dev = input_find_node(node);
+    if (dev != NULL && writeall(dev->fd, events, count * sizeof(*events)) == 0)
+    {
+        pthread_mutex_unlock(&rmi_input_lock);
+        return 0;
+    }
+
+    /* The node may have gone away or been renumbered; probe again once. */
+    fprintf(stderr, "RMI input: write to event%u failed: %d, rescanning\n", node, errno);
+    input_discover();
+    dev = input_find_node(node);
+    rc = dev != NULL ? writeall(dev->fd, events, count * sizeof(*events)) : -1;
+    pthread_mutex_unlock(&rmi_input_lock);
+    return rc;
+}
+
+static int
+send_keyevent(int keycode)
+{
+    struct input_event events[4];
+    struct timeval now;
+    int node;
+
+    if (keycode < 0 || keycode > KEY_MAX)
+    {
+        return -1;
+    }
+    node = input_key_node(keycode);
+    if (node == -1)
+    {
+        fprintf(stderr, "RMI keyevent: no input device reports keycode %d\n", keycode);
+        return -1;
+    }
+
+    if (gettimeofday(&now, NULL) == -1)
+    {
+        return -1;
+    }
+
+    events[0].time = now;
+    events[0].type = EV_KEY;
+    events[0].code = (unsigned short)keycode;
+    events[0].value = 1;
+
+    events[1].time = now;
+    events[1].type = EV_SYN;
+    events[1].code = SYN_REPORT;
+    events[1].value = 0;
+
+    events[2].time = now;
+    events[2].type = EV_KEY;
+    events[2].code = (unsigned short)keycode;
+    events[2].value = 0;
+
+    events[3].time = now;
+    events[3].type = EV_SYN;
+    events[3].code = SYN_REPORT;
+    events[3].value = 0;
+
+    if (input_write_events((unsigned int)node, events, 4) == 0)
+    {
+        return 0;
+    }
+    /* A rescan may have moved the key to another node. */
+    node = input_key_node(keycode);
+    if (node == -1)
+    {
+        return -1;
+    }
+    return input_write_events((unsigned int)node, events, 4);
+}
+
+static void
+sleep_until(const struct timespec *deadline)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR)
+    {
+    }
+}
+
+/*
+ * Plays INPUT_BATCH records. Each record's delay is slept (against an
+ * absolute deadline, so write latency does not accumulate) before it is
+ * queued; queued events go out in one write() per EV_SYN group, or earlier
+ * when a delay interrupts the group or the target device changes (the
+ * part for the previous device then gets its own SYN_REPORT).
+ * The whole batch is validated before anything is written.
+ */
+static int
+play_input_batch(const uint8_t *data, size_t len)
+{
+    struct input_event group[RMI_INPUT_BATCH_MAX + 1];
+    struct timespec deadline;
+    uint64_t total_us;
+    size_t queued;
+    size_t count;
+    size_t i;
+    int group_node;
+    int node;
+
+    count = len / RMI_INPUT_RECORD_SIZE;
+    total_us = 0;
+    node = -1;
+    for (i = 0; i < count; i++)
+    {
+        const uint8_t *rec;
+        unsigned int type;
+        unsigned int code;
+
+        rec = data + i * RMI_INPUT_RECORD_SIZE;
+        type = rmi_read_be16(rec + 2);
+        code = rmi_read_be16(rec + 4);
+        total_us += rmi_read_be32(rec + 12);
+        if (type > EV_MAX || total_us > RMI_INPUT_BATCH_MAX_US)
+        {
+            return -1;
+        }
+        if (rec[0] != RMI_INPUT_DEVICE_AUTO)
+        {
+            pthread_mutex_lock(&rmi_input_lock);
+            node = input_find_node(rec[0]) != NULL ? rec[0] : -1;
+            pthread_mutex_unlock(&rmi_input_lock);
+        }
+        else if (type == EV_KEY)
+        {
+            node = code <= KEY_MAX ? input_key_node((int)code) : -1;
+        }
+        if (node == -1)
+        {
+            fprintf(stderr, "RMI input_batch: no device for record %zu (type %u code %u)\n",
+                    i, type, code);
+            return -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    queued = 0;
+    group_node = -1;
+    for (i = 0; i < count; i++)
+    {
+        const uint8_t *rec;
+        uint32_t delay_us;
+        unsigned int type;
+        unsigned int code;
+
+        rec = data + i * RMI_INPUT_RECORD_SIZE;
+        type = rmi_read_be16(rec + 2);
+        code = rmi_read_be16(rec + 4);
+        delay_us = rmi_read_be32(rec + 12);
+        if (rec[0] != RMI_INPUT_DEVICE_AUTO)
+        {
+            node = rec[0];
+        }
+        else if (type == EV_KEY)
+        {
+            node = input_key_node((int)code);
+        }
+        else
+        {
+            node = group_node;
+        }
+        if (node == -1)
+        {
+            return -1;
+        }
+
+        if (queued > 0 && node != group_node)
+        {
+            /* Each device of a chord needs its own SYN_REPORT. */
+            memset(&group[queued], 0, sizeof(group[queued]));
+            group[queued].type = EV_SYN;
+            group[queued].code = SYN_REPORT;
+            queued++;
+        }
+        if (queued > 0 && (delay_us > 0 || node != group_node))
+        {
+            if (input_write_events((unsigned int)group_node, group, queued) == -1)
+            {
+                return -1;
+            }
+            queued = 0;
+        }
+        if (delay_us > 0)
+        {
+            deadline.tv_sec += delay_us / 1000000u;
+            deadline.tv_nsec += (long)(delay_us % 1000000u) * 1000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            sleep_until(&deadline);
+        }
+
+        memset(&group[queued], 0, sizeof(group[queued]));
+        group[queued].type = (unsigned short)type;
+        group[queued].code = (unsigned short)code;
+        group[queued].value = (int32_t)rmi_read_be32(rec + 8);
+        queued++;
+        group_node = node;
+        if (type == EV_SYN)
+        {
+            if (input_write_events((unsigned int)group_node, group, queued) == -1)
+            {
+                return -1;
+            }
+            queued = 0;
+        }
+    }
+    if (queued > 0)
+    {
+        return input_write_events((unsigned int)group_node, group, queued);
+    }
+    return 0;
+}
+
+static void
+helper_stop(void)
+{
+    if (rmi_helper.pid == -1)
+    {
+        return;
+    }
+    close(rmi_helper.cmd_fd);
+    close(rmi_helper.reply_fd);
+    kill(rmi_helper.pid, SIGKILL);
+    waitpid(rmi_helper.pid, NULL, 0);
+    rmi_helper.pid = -1;
+    rmi_helper.cmd_fd = -1;
+    rmi_helper.reply_fd = -1;
+    rmi_helper.reply_len = 0;
+}
+
+/*
+ * Reads helper output until the marker line for `seq`. Lines that are not
+ * the expected marker are dropped. Returns 0 with the command's exit status,
+ * -1 on EOF, error or timeout.
+ */
+static int
+helper_wait_marker(unsigned int seq, int timeout_ms, int *status)
+{
+    uint64_t deadline;
+
+    deadline = monotonic_ms() + (uint64_t)timeout_ms;
+    while (1)
+    {
+        struct pollfd pfd;
+        uint64_t now;
+        char *nl;
+        ssize_t n;
+
+        while ((nl = memchr(rmi_helper.reply, '\n', rmi_helper.reply_len)) != NULL)
+        {
+            size_t line_len;
+            unsigned int got_seq;
+            int got_status;
+            bool matched;
+
+            *nl = '\0';
+            line_len = (size_t)(nl - rmi_helper.reply) + 1;
+            matched = sscanf(rmi_helper.reply, RMI_HELPER_MARKER " %u %d",
+                             &got_seq, &got_status) == 2 && got_seq == seq;
+            memmove(rmi_helper.reply, rmi_helper.reply + line_len,
+                    rmi_helper.reply_len - line_len);
+            rmi_helper.reply_len -= line_len;
+            if (matched)
+            {
+                *status = got_status;
+                return 0;
+            }
+        }
+        if (rmi_helper.reply_len == sizeof(rmi_helper.reply))
+        {
+            rmi_helper.reply_len = 0;
+        }
+
+        now = monotonic_ms();
+        if (now >= deadline)
+        {
+            return -1;
+        }
+        pfd.fd = rmi_helper.reply_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        n = poll(&pfd, 1, (int)(deadline - now));
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        n = read(rmi_helper.reply_fd, rmi_helper.reply + rmi_helper.reply_len,
+                 sizeof(rmi_helper.reply) - rmi_helper.reply_len);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        rmi_helper.reply_len += (size_t)n;
+    }
+}
+
+/*
+ * Writes one command line to the helper and waits for its marker.
+ * Returns 0 with the exit status, -1 when the command could not be sent
+ * (nothing ran) and -2 when the helper stopped answering mid-command.
+ */
+static int
+helper_exchange(const char *command, int timeout_ms, int *status)
+{
+    char line[RMI_CMD_MAX_BYTES * 4 + 128];
+    unsigned int seq;
+    int len;
+
+    seq = ++rmi_helper.seq;
+    len = snprintf(line, sizeof(line),
+                   "%s </dev/null >&2; echo \"" RMI_HELPER_MARKER " %u $?\"\n",
+                   command, seq);
+    if (len < 0 || (size_t)len >= sizeof(line))
+    {
+        return -1;
+    }
+    if (writeall(rmi_helper.cmd_fd, line, (size_t)len) == -1)
+    {
+        return -1;
+    }
+    if (helper_wait_marker(seq, timeout_ms, status) == -1)
+    {
+        return -2;
+    }
+    return 0;
+}
+
+static int
+helper_start(void)
+{
+    int cmd_pipe[2];
+    int reply_pipe[2];
+    int runcon_ok;
+    int status;
+    pid_t pid;
+
+    if (pipe2(cmd_pipe, O_CLOEXEC) == -1)
+    {
+        return -1;
+    }
+    if (pipe2(reply_pipe, O_CLOEXEC) == -1)
+    {
+        close(cmd_pipe[0]);
+        close(cmd_pipe[1]);
+        return -1;
+    }
+    runcon_ok = (access("/system/bin/runcon", X_OK) == 0);
+
+    pid = fork();
+    if (pid == -1)
+    {
+        fprintf(stderr, "Syscall error: fork at line %d with code %d.\n",
+                __LINE__, errno);
+        close(cmd_pipe[0]);
+        close(cmd_pipe[1]);
+        close(reply_pipe[0]);
+        close(reply_pipe[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        if (dup2(cmd_pipe[0], STDIN_FILENO) == -1 ||
+            dup2(reply_pipe[1], STDOUT_FILENO) == -1)
+        {
+            _exit(127);
+        }
+        set_shell_env();
+        if (runcon_ok)
+        {
+            execl("/system/bin/runcon", "runcon", "u:r:shell:s0",
+                  RMI_HELPER_SHELL, (char *)NULL);
+            fprintf(stderr, "RMI helper: exec /system/bin/runcon failed: %d\n",
+                    errno);
+        }
+        drop_to_shell_user();
+        execl(RMI_HELPER_SHELL, "sh", (char *)NULL);
+        fprintf(stderr, "RMI helper: exec %s failed: %d\n", RMI_HELPER_SHELL, errno);
+        _exit(127);
+    }
+
+    close(cmd_pipe[0]);
+    close(reply_pipe[1]);
+    rmi_helper.pid = pid;
+    rmi_helper.cmd_fd = cmd_pipe[1];
+    rmi_helper.reply_fd = reply_pipe[0];
+    rmi_helper.reply_len = 0;
+    if (helper_exchange("true", RMI_HELPER_START_MS, &status) != 0 || status != 0)
+    {
+        fprintf(stderr, "RMI helper: pid %d did not answer\n", (int)pid);
+        helper_stop();
+        return -1;
+    }
+    rmi_helper.starts++;
+    fprintf(stderr, "RMI helper: started pid %d\n", (int)pid);
+    return 0;
+}
+
+/*
+ * Runs `command` in the warm helper, starting or restarting it as needed.
+ * Returns 0 when the command ran (`*status` holds its exit status, -1 if
+ * the helper died or timed out mid-command) and -1 when no helper could
+ * take it, in which case the caller falls back to a one-off exec chain.
+ */
+static int
+helper_run(const char *command, int *status)
+{
+    int attempt;
+    int rc;
+
+    pthread_mutex_lock(&rmi_helper_lock);
+    rc = -1;
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        if (rmi_helper.pid == -1 && helper_start() == -1)
+        {
+            break;
+        }
+        rc = helper_exchange(command, RMI_HELPER_TIMEOUT_MS, status);
+        if (rc == 0)
+        {
+            break;
+        }
+        fprintf(stderr, "RMI helper: pid %d lost, restarting\n", (int)rmi_helper.pid);
+        helper_stop();
+        if (rc == -2)
+        {
+            /* The command may have run; do not repeat it. */
+            *status = -1;
+            rc = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rmi_helper_lock);
+    return rc;
+}
+
+/* Single-quotes `src` for the helper shell. Returns -1 if it does not fit. */
+static int
+shell_quote(char *dst, size_t cap, const char *src)
+{
+    size_t len;
+
+    len = 0;
+    if (cap < 3)
+    {
+        return -1;
+    }
+    dst[len++] = '\'';
+    for (; *src != '\0'; src++)
+    {
+        if (*src == '\'')
+        {
+            if (len + 4 >= cap)
+            {
+                return -1;
+            }
+            memcpy(dst + len, "'\\''", 4);
+            len += 4;
+            continue;
+        }
+        if (len + 1 >= cap)
+        {
+            return -1;
+        }
+        dst[len++] = *src;
+    }
+    if (len + 2 > cap)
+    {
+        return -1;
+    }
+    dst[len++] = '\'';
+    dst[len] = '\0';
+    return 0;
+}
+
+/*
+ * Ways of running PRESS_INPUT and OPEN. Each chain lists the commands that
+ * can do the job, and each command may run in the helper, under runcon, or
+ * after dropping to the shell uid. Binaries are probed once at startup and
+ * the first pair that runs is remembered, so later calls go straight to it.
+ * The chain is walked again only when that pair can no longer run (exec
+ * failure, exit 126/127, signal); a command that ran and reported failure
+ * keeps its place.
+ */
+#define RMI_EXEC_ARG       "%s"
+#define RMI_EXEC_MAX_ARGS  12
+#define RMI_EXEC_MAX_CMDS  8
+#define RMI_EXEC_CLASSPATH "/system/framework/input.jar"
+
+enum rmi_exec_via {
+    RMI_VIA_HELPER = 0,
+    RMI_VIA_RUNCON = 1,
+    RMI_VIA_SHELL_UID = 2,
+    RMI_VIA_COUNT = 3,
+};
+
+enum rmi_exec_result {
+    RMI_EXEC_OK = 0,
+    RMI_EXEC_FAILED = 1,
+    RMI_EXEC_UNUSABLE = 2,
+};
+
+struct rmi_exec_cmd {
+    const char *name;
+    const char *script;
+    bool classpath;
+    const char *argv[RMI_EXEC_MAX_ARGS];
+};
+
+struct rmi_exec_chain {
+    const char *name;
+    const struct rmi_exec_cmd *cmds;
+    size_t count;
+    bool available[RMI_EXEC_MAX_CMDS];
+    int via;
+    int cmd;
+};
+
+static const char *const rmi_exec_via_names[RMI_VIA_COUNT] = {
+    "helper", "runcon", "shell_uid",
+};
+
+static const struct rmi_exec_cmd rmi_press_cmds[] = {
+    { "input", "/system/bin/input", false,
+      { "/system/bin/sh", "/system/bin/input", "keyevent", RMI_EXEC_ARG, NULL } },
+    { "app_process", NULL, true,
+      { "/system/bin/app_process", "/system/bin", "com.android.commands.input.Input",
+        "keyevent", RMI_EXEC_ARG, NULL } },
+    { "app_process64", NULL, true,
+      { "/system/bin/app_process64", "/system/bin", "com.android.commands.input.Input",
+        "keyevent", RMI_EXEC_ARG, NULL } },
+    { "app_process32", NULL, true,
+      { "/system/bin/app_process32", "/system/bin", "com.android.commands.input.Input",
+        "keyevent", RMI_EXEC_ARG, NULL } },
+    { "cmd", NULL, false,
+      { "/system/bin/cmd", "input", "keyevent", RMI_EXEC_ARG, NULL } },
+    { "toybox", NULL, false,
+      { "/system/bin/toybox", "input", "keyevent", RMI_EXEC_ARG, NULL } },
+    { "toolbox", NULL, false,
+      { "/system/bin/toolbox", "input", "keyevent", RMI_EXEC_ARG, NULL } },
+};
+
+static const struct rmi_exec_cmd rmi_open_component_cmds[] = {
+    { "am", "/system/bin/am", false,
+      { "/system/bin/sh", "/system/bin/am", "start", "-n", RMI_EXEC_ARG, NULL } },
+    { "cmd", NULL, false,
+      { "/system/bin/cmd", "activity", "start", "-n", RMI_EXEC_ARG, NULL } },
+};
+
+static const struct rmi_exec_cmd rmi_open_package_cmds[] = {
+    { "monkey", "/system/bin/monkey", false,
+      { "/system/bin/sh", "/system/bin/monkey", "-p", RMI_EXEC_ARG,
+        "-c", "android.intent.category.LAUNCHER", "1", NULL } },
+    { "am", "/system/bin/am", false,
+      { "/system/bin/sh", "/system/bin/am", "start",
+        "-a", "android.intent.action.MAIN",
+        "-c", "android.intent.category.LAUNCHER", "-p", RMI_EXEC_ARG, NULL } },
+    { "cmd", NULL, false,
+      { "/system/bin/cmd", "activity", "start",
+        "-a", "android.intent.action.MAIN",
+        "-c", "android.intent.category.LAUNCHER", "-p", RMI_EXEC_ARG, NULL } },
+};
+
+static pthread_mutex_t rmi_exec_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool rmi_runcon_ok;
+static struct rmi_exec_chain rmi_press_chain = {
+    "press_input", rmi_press_cmds,
+    sizeof(rmi_press_cmds) / sizeof(rmi_press_cmds[0]), { false }, -1, -1,
+};
+static struct rmi_exec_chain rmi_open_component_chain = {
+    "open_component", rmi_open_component_cmds,
+    sizeof(rmi_open_component_cmds) / sizeof(rmi_open_component_cmds[0]), { false }, -1, -1,
+};
+static struct rmi_exec_chain rmi_open_package_chain = {
+    "open_package", rmi_open_package_cmds,
+    sizeof(rmi_open_package_cmds) / sizeof(rmi_open_package_cmds[0]), { false }, -1, -1,
+};
+
+/* Re-checks which commands exist and forgets the remembered choice. */
+static void
+exec_probe_chain(struct rmi_exec_chain *chain)
+{
+    size_t i;
+
+    pthread_mutex_lock(&rmi_exec_lock);
+    rmi_runcon_ok = (access("/system/bin/runcon", X_OK) == 0);
+    for (i = 0; i < chain->count; i++)
+    {
+        const struct rmi_exec_cmd *cmd;
+
+        cmd = &chain->cmds[i];
+        chain->available[i] = access(cmd->argv[0], X_OK) == 0 &&
+                              (cmd->script == NULL || access(cmd->script, R_OK) == 0);
+    }
+    chain->via = -1;
+    chain->cmd = -1;
+    pthread_mutex_unlock(&rmi_exec_lock);
+}
+
+static void
+exec_probe_all(void)
+{
+    exec_probe_chain(&rmi_press_chain);
+    exec_probe_chain(&rmi_open_component_chain);
+    exec_probe_chain(&rmi_open_package_chain);
+    pthread_mutex_lock(&rmi_helper_lock);
+    if (rmi_helper.pid == -1)
+    {
+        helper_start();
+    }
+    pthread_mutex_unlock(&rmi_helper_lock);
+}
+
+static bool
+helper_available(void)
+{
+    bool ok;
+
+    pthread_mutex_lock(&rmi_helper_lock);
+    if (rmi_helper.pid == -1)
+    {
+        helper_start();
+    }
+    ok = (rmi_helper.pid != -1);
+    pthread_mutex_unlock(&rmi_helper_lock);
+    return ok;
+}
+
+static enum rmi_exec_result
+exec_in_helper(const struct rmi_exec_cmd *cmd, const char **argv)
+{
+    char line[RMI_CMD_MAX_BYTES * 4 + 256];
+    size_t len;
+    size_t i;
+    int status;
+
+    len = 0;
+    line[0] = '\0';
+    if (cmd->classpath)
+    {
+        len = (size_t)snprintf(line, sizeof(line), "CLASSPATH=%s ", RMI_EXEC_CLASSPATH);
+    }
+    for (i = 0; argv[i] != NULL; i++)
+    {
+        if (i > 0)
+        {
+            if (len + 1 >= sizeof(line))
+            {
+                return RMI_EXEC_FAILED;
+            }
+            line[len++] = ' ';
+        }
+        if (shell_quote(line + len, sizeof(line) - len, argv[i]) == -1)
+        {
+            return RMI_EXEC_FAILED;
+        }
+        len += strlen(line + len);
+    }
+
+    if (helper_run(line, &status) == -1)
+    {
+        return RMI_EXEC_UNUSABLE;
+    }
+    if (status == 0)
+    {
+        return RMI_EXEC_OK;
+    }
+    fprintf(stderr, "RMI exec: helper %s status %d\n", cmd->name, status);
+    return status >= 126 ? RMI_EXEC_UNUSABLE : RMI_EXEC_FAILED;
+}
+
+static enum rmi_exec_result
+exec_forked(const struct rmi_exec_cmd *cmd, enum rmi_exec_via via, const char **argv)
+{
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid == -1)
+    {
+        fprintf(stderr, "Syscall error: fork at line %d with code %d.\n",
+                __LINE__, errno);
+        return RMI_EXEC_FAILED;
+    }
+
+    if (pid == 0)
+    {
+        set_shell_env();
+        if (cmd->classpath && setenv("CLASSPATH", RMI_EXEC_CLASSPATH, 1) == -1)
+        {
+            _exit(127);
+        }
+        if (via == RMI_VIA_SHELL_UID)
+        {
+            drop_to_shell_user();
+        }
+        log_identity(rmi_exec_via_names[via]);
+        execv(argv[0], (char *const *)argv);
+        fprintf(stderr, "RMI exec: exec %s failed: %d\n", argv[0], errno);
+        _exit(127);
+    }
+
+    if (waitpid(pid, &status, 0) == -1)
+    {
+        return RMI_EXEC_FAILED;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        return RMI_EXEC_OK;
+    }
+    if (WIFEXITED(status))
+    {
+        fprintf(stderr, "RMI exec: %s via %s exit status %d\n",
+                cmd->name, rmi_exec_via_names[via], WEXITSTATUS(status));
+        return WEXITSTATUS(status) >= 126 ? RMI_EXEC_UNUSABLE : RMI_EXEC_FAILED;
+    }
+    fprintf(stderr, "RMI exec: %s via %s signaled %d\n",
+            cmd->name, rmi_exec_via_names[via],
+            WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    return RMI_EXEC_UNUSABLE;
+}
+
+static enum rmi_exec_result
+exec_attempt(const struct rmi_exec_cmd *cmd, enum rmi_exec_via via, const char *arg)
+{
+    const char *argv[RMI_EXEC_MAX_ARGS + 2];
+    size_t argc;
+    size_t i;
+
+    argc = 0;
+    if (via == RMI_VIA_RUNCON)
+    {
+        argv[argc++] = "/system/bin/runcon";
+        argv[argc++] = "u:r:shell:s0";
+    }
+    for (i = 0; cmd->argv[i] != NULL; i++)
+    {
+        argv[argc++] = strcmp(cmd->argv[i], RMI_EXEC_ARG) == 0 ? arg : cmd->argv[i];
+    }
+    argv[argc] = NULL;
+
+    if (via == RMI_VIA_HELPER)
+    {
+        return exec_in_helper(cmd, argv);
+    }
+    return exec_forked(cmd, via, argv);
+}
+
+/*
+ * Runs the chain's remembered strategy, or finds one. Returns 0 when the
+ * command succeeded, -1 when it failed or nothing on this firmware can run it.
+ */
+static int
+exec_chain_run(struct rmi_exec_chain *chain, const char *arg)
+{
+    bool available[RMI_EXEC_MAX_CMDS];
+    enum rmi_exec_result res;
+    int via;
+    int index;
+    int v;
+    size_t i;
+
+    pthread_mutex_lock(&rmi_exec_lock);
+    via = chain->via;
+    index = chain->cmd;
+    pthread_mutex_unlock(&rmi_exec_lock);
+
+    if (index != -1)
+    {
+        res = exec_attempt(&chain->cmds[index], (enum rmi_exec_via)via, arg);
+        if (res != RMI_EXEC_UNUSABLE)
+        {
+            return res == RMI_EXEC_OK ? 0 : -1;
+        }
+        fprintf(stderr, "RMI %s: %s via %s stopped working, re-probing\n",
+                chain->name, chain->cmds[index].name, rmi_exec_via_names[via]);
+    }
+
+    exec_probe_chain(chain);
+    pthread_mutex_lock(&rmi_exec_lock);
+    memcpy(available, chain->available, sizeof(available));
+    pthread_mutex_unlock(&rmi_exec_lock);
+
+    for (v = 0; v < RMI_VIA_COUNT; v++)
+    {
+        if (v == RMI_VIA_HELPER && !helper_available())
+        {
+            continue;
+        }
+        if (v == RMI_VIA_RUNCON && !rmi_runcon_ok)
+        {
+            continue;
+        }
+        for (i = 0; i < chain->count; i++)
+        {
+            if (!available[i] || (v == via && (int)i == index))
+            {
+                continue;
+            }
+            res = exec_attempt(&chain->cmds[i], (enum rmi_exec_via)v, arg);
+            if (res == RMI_EXEC_UNUSABLE)
+            {
+                continue;
+            }
+            pthread_mutex_lock(&rmi_exec_lock);
+            chain->via = v;
+            chain->cmd = (int)i;
+            pthread_mutex_unlock(&rmi_exec_lock);
+            fprintf(stderr, "RMI %s: using %s via %s\n",
+                    chain->name, chain->cmds[i].name, rmi_exec_via_names[v]);
+            return res == RMI_EXEC_OK ? 0 : -1;
+        }
+    }
+    fprintf(stderr, "RMI %s: no working strategy\n", chain->name);
+    return -1;
+}
+
+static int
+send_keyevent_input(int keycode)
+{
+    char key_str[16];
+
+    if (keycode < 0)
+    {
+        return -1;
+    }
+    if (snprintf(key_str, sizeof(key_str), "%d", keycode) >= (int)sizeof(key_str))
+    {
+        return -1;
+    }
+
+    fprintf(stderr, "RMI press_input: keycode %d\n", keycode);
+    return exec_chain_run(&rmi_press_chain, key_str);
+}
+
+static int
+open_app(const char *target)
+{
+    const char *prefix;
+
+    if (target == NULL || target[0] == '\0')
+    {
+        return -1;
+    }
+
+    prefix = "package:";
+    if (strncmp(target, prefix, strlen(prefix)) == 0)
+    {
+        target += strlen(prefix);
+        while (*target == ' ' || *target == '\t')
+        {
+            target++;
+        }
+        if (target[0] == '\0')
+        {
+            return -1;
+        }
+    }
+
+    fprintf(stderr, "RMI open: %s\n", target);
+    if (strchr(target, '/') != NULL)
+    {
+        return exec_chain_run(&rmi_open_component_chain, target);
+    }
+    return exec_chain_run(&rmi_open_package_chain, target);
+}
+
+static int
+append_chain_info(char **buf, size_t *len, size_t *cap, const struct rmi_exec_chain *chain)
+{
+    char line[256];
+    size_t used;
+    size_t i;
+
+    if (chain->cmd == -1)
+    {
+        snprintf(line, sizeof(line), "%s=unprobed\n", chain->name);
+    }
+    else
+    {
+        snprintf(line, sizeof(line), "%s=%s/%s\n", chain->name,
+                 rmi_exec_via_names[chain->via], chain->cmds[chain->cmd].name);
+    }
+    if (append_list_line(buf, len, cap, line) == -1)
+    {
+        return -1;
+    }
+    used = (size_t)snprintf(line, sizeof(line), "%s_available=", chain->name);
+    for (i = 0; i < chain->count; i++)
+    {
+        if (chain->available[i])
+        {
+            used += (size_t)snprintf(line + used, sizeof(line) - used, "%s%s",
+                                     line[used - 1] == '=' ? "" : ",",
+                                     chain->cmds[i].name);
+        }
+    }
+    snprintf(line + used, sizeof(line) - used, "\n");
+    return append_list_line(buf, len, cap, line);
+}
+
+/* Answers RUNTIME_INFO with `key=value` lines describing the chosen paths. */
+static int
+send_runtime_info(struct rmi_conn *conn)
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+    char line[128];
+    const char *screencap;
+    pid_t helper_pid;
+    unsigned int helper_starts;
+    unsigned int input_devices;
+    int rc;
+
+    pthread_mutex_lock(&rmi_helper_lock);
+    helper_pid = rmi_helper.pid;
+    helper_starts = rmi_helper.starts;
+    pthread_mutex_unlock(&rmi_helper_lock);
+    pthread_mutex_lock(&rmi_input_lock);
+    input_devices = rmi_input_count;
+    pthread_mutex_unlock(&rmi_input_lock);
+    pthread_mutex_lock(&rmi_fb.lock);
+    switch (rmi_fb.state)
+    {
+    case RMI_FB_READY:
+        screencap = "framebuffer";
+        break;
+    case RMI_FB_UNAVAILABLE:
+        screencap = "exec";
+        break;
+    default:
+        screencap = "unprobed";
+        break;
+    }
+    pthread_mutex_unlock(&rmi_fb.lock);
+
+    buf = NULL;
+    len = 0;
+    cap = 0;
+    snprintf(line, sizeof(line), "helper=%s\nhelper_pid=%d\nhelper_starts=%u\n",
+             helper_pid != -1 ? "running" : "stopped", (int)helper_pid, helper_starts);
+    if (append_list_line(&buf, &len, &cap, line) == -1)
+    {
+        free(buf);
+        return -1;
+    }
+    pthread_mutex_lock(&rmi_exec_lock);
+    snprintf(line, sizeof(line), "runcon=%d\n", rmi_runcon_ok ? 1 : 0);
+    rc = append_list_line(&buf, &len, &cap, line);
+    if (rc == 0)
+    {
+        rc = append_chain_info(&buf, &len, &cap, &rmi_press_chain);
+    }
+    if (rc == 0)
+    {
+        rc = append_chain_info(&buf, &len, &cap, &rmi_open_component_chain);
+    }
+    if (rc == 0)
+    {
+        rc = append_chain_info(&buf, &len, &cap, &rmi_open_package_chain);
+    }
+    pthread_mutex_unlock(&rmi_exec_lock);
+    snprintf(line, sizeof(line), "input_devices=%u\nscreencap=%s\n",
+             input_devices, screencap);
+    if (rc == -1 || append_list_line(&buf, &len, &cap, line) == -1)
+    {
+        free(buf);
+        return -1;
+    }
+    return send_frame_owned(conn, (uint8_t *)buf, (uint32_t)len);
+}
+
+static void
+run_job(struct rmi_pool *pool, struct rmi_job *job)
+{
+    switch (job->kind)
+    {
+    case RMI_JOB_SCREENCAP:
+        job->rc = capture_screencap(&job->data, &job->len);
+        break;
+    case RMI_JOB_SCREENCAP_RAW:
+        job->rc = capture_screencap_raw(&job->data, &job->len);
+        break;
+    case RMI_JOB_PRESS_INPUT:
+        job->rc = send_keyevent_input(job->keycode);
+        break;
+    case RMI_JOB_OPEN:
+        job->rc = open_app(job->arg);
+        break;
+    case RMI_JOB_DELETE:
+        job->rc = remove_tree(pool, job, job->arg);
+        break;
+    case RMI_JOB_COPY:
+        job->rc = copy_tree(pool, job, job->arg, job->dest);
+        break;
+    case RMI_JOB_MOVE:
+        job->rc = move_path(pool, job, job->arg, job->dest);
+        break;
+    case RMI_JOB_FSYNC:
+        job->rc = sync_path(job->arg);
+        break;
+    case RMI_JOB_STREAM_FRAME:
+        job->rc = capture_stream_frame(job->stream, &job->data, &job->len);
+        break;
+    case RMI_JOB_INPUT_BATCH:
+        job->rc = play_input_batch(job->data, job->len);
+        break;
+    case RMI_JOB_BLOCKSUMS:
+        job->rc = compute_block_sums(job->arg, (uint32_t)job->keycode,
+                                     &job->data, &job->len);
+        break;
+    default:
+        job->rc = -1;
+        break;
+    }
+}
+
+/* File jobs that can take minutes, as opposed to interactive ones. */
+static bool
+job_is_bulk(enum rmi_job_kind kind)
+{
+    switch (kind)
+    {
+    case RMI_JOB_DELETE:
+    case RMI_JOB_FSYNC:
+    case RMI_JOB_BLOCKSUMS:
+    case RMI_JOB_COPY:
+    case RMI_JOB_MOVE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Unlinks the first queued job a worker may start: any interactive job,
+ * or a file job while no other one runs. Called with the pool lock held.
+ */
+static struct rmi_job *
+take_job(struct rmi_pool *pool)
+{
+    struct rmi_job **link;
+    struct rmi_job *prev;
+    struct rmi_job *job;
+
+    prev = NULL;
+    for (link = &pool->queue_head; *link != NULL; link = &(*link)->next)
+    {
+        job = *link;
+        if (job_is_bulk(job->kind) && pool->bulk_running)
+        {
+            prev = job;
+            continue;
+        }
+        *link = job->next;
+        if (pool->queue_tail == job)
+        {
+            pool->queue_tail = prev;
+        }
+        job->next = NULL;
+        if (job_is_bulk(job->kind))
+        {
+            pool->bulk_running = true;
+        }
+        return job;
+    }
+    return NULL;
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct rmi_pool *pool;
+
+    pool = (struct rmi_pool *)arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        struct rmi_job *job;
+        uint64_t one;
+
+        job = NULL;
+        while (!pool->stop && (job = take_job(pool)) == NULL)
+        {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->stop)
+        {
+            break;
+        }
+        job->state = RMI_JOB_RUNNING;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_job(pool, job);
+
+        pthread_mutex_lock(&pool->lock);
+        if (job_is_bulk(job->kind))
+        {
+            /* A file job left queued behind this one may start now. */
+            pool->bulk_running = false;
+            pthread_cond_broadcast(&pool->cond);
+        }
+        job->next = pool->done;
+        pool->done = job;
+        one = 1;
+        if (write(pool->event_fd, &one, sizeof(one)) == -1)
+        {
+            fprintf(stderr, "RMI worker: eventfd write failed: %d\n", errno);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int
+start_pool(struct rmi_pool *pool)
+{
+    unsigned int i;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->event_fd == -1)
+    {
+        return -1;
+    }
+    for (i = 0; i < RMI_WORKER_THREADS; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0)
+        {
+            fprintf(stderr, "RMI: pthread_create failed for worker %u\n", i);
+            break;
+        }
+        pool->thread_count++;
+    }
+    return pool->thread_count > 0 ? 0 : -1;
+}
+
+/* Queued jobs are dropped; running ones are allowed to finish. */
+static void
+stop_pool(struct rmi_pool *pool)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->thread_count; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool->thread_count = 0;
+    if (pool->event_fd != -1)
+    {
+        close(pool->event_fd);
+        pool->event_fd = -1;
+    }
+}
+
+static struct rmi_job *
+find_job(struct rmi_server *srv, uint32_t id)
+{
+    struct rmi_job *job;
+
+    for (job = srv->jobs; job != NULL; job = job->all_next)
+    {
+        if (job->id == id)
+        {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static void
+free_job(struct rmi_server *srv, struct rmi_job *job)
+{
+    struct rmi_job **link;
+
+    for (link = &srv->jobs; *link != NULL; link = &(*link)->all_next)
+    {
+        if (*link == job)
+        {
+            *link = job->all_next;
+            srv->job_count--;
+            break;
+        }
+    }
+    free(job->data);
+    free(job);
+}
+
+static bool
+job_finished(const struct rmi_job *job)
+{
+    return job->state == RMI_JOB_DONE || job->state == RMI_JOB_FAILED;
+}
+
+/* Drops the oldest finished detached job nobody has collected yet. */
+static bool
+prune_jobs(struct rmi_server *srv)
+{
+    struct rmi_job *job;
+    struct rmi_job *oldest;
+
+    oldest = NULL;
+    for (job = srv->jobs; job != NULL; job = job->all_next)
+    {
+        if (job->detached && job->waiter == NULL && job_finished(job))
+        {
+            oldest = job;
+        }
+    }
+    if (oldest == NULL)
+    {
+        return false;
+    }
+    free_job(srv, oldest);
+    return true;
+}
+
+static struct rmi_job *
+new_job(struct rmi_server *srv, enum rmi_job_kind kind, int keycode, const char *arg)
+{
+    struct rmi_job *job;
+
+    if (srv->pool.thread_count == 0)
+    {
+        return NULL;
+    }
+    if (srv->job_count >= RMI_MAX_JOBS && !prune_jobs(srv))
+    {
+        return NULL;
+    }
+    job = (struct rmi_job *)calloc(1, sizeof(*job));
+    if (job == NULL)
+    {
+        return NULL;
+    }
+    if (arg != NULL &&
+        snprintf(job->arg, sizeof(job->arg), "%s", arg) >= (int)sizeof(job->arg))
+    {
+        free(job);
+        return NULL;
+    }
+    srv->next_job_id++;
+    if (srv->next_job_id == 0)
+    {
+        srv->next_job_id = 1;
+    }
+    job->id = srv->next_job_id;
+    job->kind = kind;
+    job->keycode = keycode;
+    job->state = RMI_JOB_QUEUED;
+    job->all_next = srv->jobs;
+    srv->jobs = job;
+    srv->job_count++;
+    return job;
+}
+
+static void
+enqueue_job(struct rmi_pool *pool, struct rmi_job *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queue_tail != NULL)
+    {
+        pool->queue_tail->next = job;
+    }
+    else
+    {
+        pool->queue_head = job;
+    }
+    pool->queue_tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static struct rmi_job *
+submit_job(struct rmi_server *srv, enum rmi_job_kind kind, int keycode, const char *arg)
+{
+    struct rmi_job *job;
+
+    job = new_job(srv, kind, keycode, arg);
+    if (job != NULL)
+    {
+        enqueue_job(&srv->pool, job);
+    }
+    return job;
+}
+
+static const char *
+job_error_text(enum rmi_job_kind kind)
+{
+    switch (kind)
+    {
+    case RMI_JOB_SCREENCAP:
+    case RMI_JOB_SCREENCAP_RAW:
+    case RMI_JOB_STREAM_FRAME:
+        return "ERR screencap";
+    case RMI_JOB_PRESS_INPUT:
+        return "ERR press";
+    case RMI_JOB_INPUT_BATCH:
+        return "ERR input_batch";
+    case RMI_JOB_OPEN:
+        return "ERR open";
+    case RMI_JOB_DELETE:
+        return "ERR delete";
+    case RMI_JOB_FSYNC:
+        return "ERR upload";
+    case RMI_JOB_BLOCKSUMS:
+        return "ERR blocksums";
+    case RMI_JOB_COPY:
+        return "ERR copy";
+    case RMI_JOB_MOVE:
+        return "ERR move";
+    }
+    return "ERR job";
+}
+
+/* Jobs that report progress to JOB_STATUS and stop on JOB_CANCEL. */
+static bool
+job_has_progress(enum rmi_job_kind kind)
+{
+    return kind == RMI_JOB_DELETE || kind == RMI_JOB_COPY || kind == RMI_JOB_MOVE;
+}
+
+static const char *
+job_state_text(const struct rmi_job *job)
+{
+    switch (job->state)
+    {
+    case RMI_JOB_QUEUED:
+        return "QUEUED";
+    case RMI_JOB_RUNNING:
+        return "RUNNING";
+    case RMI_JOB_DONE:
+        return "DONE";
+    case RMI_JOB_FAILED:
+        return "FAILED";
+    }
+    return "UNKNOWN";
+}
+
+/* Sends the response the command would have produced if run inline. */
+static void
+send_job_result(struct rmi_conn *conn, struct rmi_job *job)
+{
+    if (job->rc != 0 && job->cancel)
+    {
+        send_text(conn, "ERR cancelled");
+        return;
+    }
+    if (job->rc != 0)
+    {
+        send_text(conn, job_error_text(job->kind));
+        return;
+    }
+    if (job->kind == RMI_JOB_SCREENCAP || job->kind == RMI_JOB_SCREENCAP_RAW ||
+        job->kind == RMI_JOB_BLOCKSUMS)
+    {
+        if (send_frame_owned(conn, job->data, (uint32_t)job->len) == -1)
+        {
+            send_text(conn, job_error_text(job->kind));
+        }
+        job->data = NULL;
+        job->len = 0;
+        return;
+    }
+    send_text(conn, RMI_RESP_OK);
+}
+
+static void service_conn(struct rmi_server *srv, struct rmi_conn *conn);
+
+static struct rmi_conn *
+deliver_job(struct rmi_server *srv, struct rmi_job *job)
+{
+    struct rmi_conn *conn;
+
+    conn = job->waiter;
+    job->waiter = NULL;
+    if (conn->wait_job == job)
+    {
+        conn->wait_job = NULL;
+    }
+    set_reply_context(conn, job->reply_id, job->reply_op);
+    send_job_result(conn, job);
+    free_job(srv, job);
+    return conn;
+}
+
+static void
+free_screenstream(struct rmi_screenstream *ss)
+{
+    if (ss == NULL)
+    {
+        return;
+    }
+    free(ss->hashes);
+    free(ss->scratch);
+    free(ss);
+}
+
+/* Frames from a stream that was stopped or closed meanwhile are dropped. */
+static struct rmi_conn *
+finish_stream_frame(struct rmi_server *srv, struct rmi_job *job)
+{
+    struct rmi_screenstream *ss;
+    struct rmi_conn *conn;
+
+    conn = job->waiter;
+    ss = job->stream;
+    if (conn == NULL)
+    {
+        free_screenstream(ss);
+        free_job(srv, job);
+        return NULL;
+    }
+    ss->job = NULL;
+    set_reply_context(conn, 0, RMI_OP_SCREENSTREAM);
+    /* Frames built before a stop are stale; a restart opens with a keyframe. */
+    if (ss->active && !ss->restart && job->rc == 0 &&
+        (conn->file_fd != -1 || conn->tree != NULL || conn->cap_fd != -1))
+    {
+        /* Cannot interleave with a streamed body; resend everything later. */
+        ss->restart = true;
+    }
+    else if (ss->active && !ss->restart && job->rc == 0)
+    {
+        send_frame_owned(conn, job->data, (uint32_t)job->len);
+        job->data = NULL;
+    }
+    else if (ss->active && !ss->restart)
+    {
+        uint8_t end[RMI_STREAM_HEADER_SIZE];
+
+        fprintf(stderr, "RMI screenstream: capture failed, stopping\n");
+        memset(end, 0, sizeof(end));
+        memcpy(end, RMI_STREAM_MAGIC, 4);
+        end[18] = RMI_STREAM_FLAG_END;
+        send_frame(conn, end, sizeof(end));
+        ss->active = false;
+    }
+    free_job(srv, job);
+    return conn;
+}
+
+static void
+complete_jobs(struct rmi_server *srv)
+{
+    struct rmi_pool *pool;
+    struct rmi_job *done;
+    struct rmi_job *job;
+    uint64_t count;
+
+    pool = &srv->pool;
+    while (read(pool->event_fd, &count, sizeof(count)) == -1 && errno == EINTR)
+    {
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    done = pool->done;
+    pool->done = NULL;
+    for (job = done; job != NULL; job = job->next)
+    {
+        job->state = job->rc == 0 ? RMI_JOB_DONE : RMI_JOB_FAILED;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    while (done != NULL)
+    {
+        job = done;
+        done = job->next;
+        job->next = NULL;
+        if (job->kind == RMI_JOB_STREAM_FRAME)
+        {
+            struct rmi_conn *conn;
+
+            conn = finish_stream_frame(srv, job);
+            if (conn != NULL)
+            {
+                service_conn(srv, conn);
+            }
+        }
+        else if (job->waiter != NULL)
+        {
+            service_conn(srv, deliver_job(srv, job));
+        }
+        else if (!job->detached)
+        {
+            free_job(srv, job);
+        }
+    }
+}
+
+/*
+ * Makes `conn` the job's waiter. A v1 connection stops reading commands
+ * until the result is sent, which keeps its replies in order; a v2
+ * connection keeps going and gets the result tagged with the request id.
+ */
+static void
+attach_job(struct rmi_conn *conn, struct rmi_job *job)
+{
+    job->waiter = conn;
+    job->reply_id = conn->reply_id;
+    job->reply_op = conn->reply_op;
+    if (!conn->v2)
+    {
+        conn->wait_job = job;
+    }
+}
+
+/*
+ * Runs a blocking command on the worker pool; the result goes to `conn`
+ * once it is done. With `detached` the client gets `JOB <id>` back
+ * immediately instead. `dest` is the second path of COPY and MOVE.
+ */
+static void
+start_job(struct rmi_server *srv,
+          struct rmi_conn *conn,
+          enum rmi_job_kind kind,
+          int keycode,
+          const char *arg,
+          const char *dest,
+          bool detached)
+{
+    struct rmi_job *job;
+    char msg[64];
+
+    job = new_job(srv, kind, keycode, arg);
+    if (job != NULL && dest != NULL &&
+        snprintf(job->dest, sizeof(job->dest), "%s", dest) >= (int)sizeof(job->dest))
+    {
+        free_job(srv, job);
+        job = NULL;
+    }
+    if (job == NULL)
+    {
+        send_text(conn, job_error_text(kind));
+        return;
+    }
+    enqueue_job(&srv->pool, job);
+    job->detached = detached;
+    if (!detached)
+    {
+        attach_job(conn, job);
+        return;
+    }
+    snprintf(msg, sizeof(msg), "%s%u", RMI_RESP_JOB_PREFIX, (unsigned int)job->id);
+    send_text(conn, msg);
+}
+
+/* Copies `len` bytes of records into an INPUT_BATCH job for `conn`. */
+static void
+start_input_batch(struct rmi_server *srv, struct rmi_conn *conn,
+                  const uint8_t *records, uint32_t len)
+{
+    struct rmi_job *job;
+    uint8_t *data;
+
+    if (len == 0 || len % RMI_INPUT_RECORD_SIZE != 0 ||
+        len / RMI_INPUT_RECORD_SIZE > RMI_INPUT_BATCH_MAX ||
+        (data = (uint8_t *)malloc(len)) == NULL)
+    {
+        send_text(conn, job_error_text(RMI_JOB_INPUT_BATCH));
+        return;
+    }
+    memcpy(data, records, len);
+    job = new_job(srv, RMI_JOB_INPUT_BATCH, 0, NULL);
+    if (job == NULL)
+    {
+        free(data);
+        send_text(conn, job_error_text(RMI_JOB_INPUT_BATCH));
+        return;
+    }
+    job->data = data;
+    job->len = len;
+    attach_job(conn, job);
+    enqueue_job(&srv->pool, job);
+}
 
+/*
+ * INPUT_BATCH <count> is followed by one frame of <count> records. The
+ * frame is collected from the input buffer and played on the worker pool;
+ * the connection waits for the result like any other blocking command.
+ * Returns 1 once the frame is consumed, 0 while more bytes are needed and
+ * -1 when it can never fit in the input buffer.
+ */
 static int
-write_default_rmi_config(void)
+recv_input_batch(struct rmi_server *srv, struct rmi_conn *conn)
+{
+    uint32_t len;
+
+    if (input_available(conn) < RMI_FRAME_HEADER_SIZE)
+    {
+        return 0;
+    }
+    len = rmi_read_be32(conn->in + conn->in_off);
+    if (len > sizeof(conn->in) - RMI_FRAME_HEADER_SIZE)
+    {
+        return -1;
+    }
+    if (input_available(conn) < RMI_FRAME_HEADER_SIZE + len)
+    {
+        return 0;
+    }
+    conn->state = RMI_CONN_COMMAND;
+    if (conn->batch_count == 0 || len != conn->batch_count * RMI_INPUT_RECORD_SIZE)
+    {
+        consume_input(conn, RMI_FRAME_HEADER_SIZE + len);
+        send_text(conn, job_error_text(RMI_JOB_INPUT_BATCH));
+        return 1;
+    }
+    start_input_batch(srv, conn, conn->in + conn->in_off + RMI_FRAME_HEADER_SIZE, len);
+    consume_input(conn, RMI_FRAME_HEADER_SIZE + len);
+    return 1;
+}
+
+static void
+handle_input_batch(struct rmi_conn *conn, char *cmd)
+{
+    char *save;
+    char *tok;
+    char *count_str;
+    char *end;
+    unsigned long count;
+
+    tok = strtok_r(cmd, " \t", &save);
+    count_str = strtok_r(NULL, " \t", &save);
+    if (tok != NULL && count_str != NULL)
+    {
+        errno = 0;
+        count = strtoul(count_str, &end, 10);
+        if (errno == 0 && end != count_str && *end == '\0' &&
+            count > 0 && count <= RMI_INPUT_BATCH_MAX)
+        {
+            conn->batch_count = (uint32_t)count;
+            conn->state = RMI_CONN_INPUT_BATCH;
+            return;
+        }
+    }
+    /* The record frame still follows; consume it and answer then. */
+    conn->batch_count = 0;
+    conn->state = RMI_CONN_INPUT_BATCH;
+}
+
+/*
+ * Parses SCREENCAP, SCREENCAP_RAW, PRESS_INPUT, OPEN, DELETE, COPY and MOVE
+ * into a job request. Returns 1 for a valid request, 0 when the command is
+ * not a job command and -1 when it is one but its arguments are invalid.
+ */
+static int
+parse_job_command(char *cmd, enum rmi_job_kind *kind, int *keycode, const char **arg,
+                  const char **dest)
+{
+    char *save;
+    char *tok;
+    char *value;
+
+    *keycode = 0;
+    *arg = NULL;
+    *dest = NULL;
+    if (strcmp(cmd, RMI_CMD_SCREENCAP) == 0)
+    {
+        *kind = RMI_JOB_SCREENCAP;
+        return 1;
+    }
+    if (strcmp(cmd, RMI_CMD_SCREENCAP_RAW) == 0)
+    {
+        *kind = RMI_JOB_SCREENCAP_RAW;
+        return 1;
+    }
+    if (strncmp(cmd, RMI_CMD_PRESS_INPUT, strlen(RMI_CMD_PRESS_INPUT)) == 0)
+    {
+        *kind = RMI_JOB_PRESS_INPUT;
+    }
+    else if (strncmp(cmd, RMI_CMD_OPEN, strlen(RMI_CMD_OPEN)) == 0)
+    {
+        *kind = RMI_JOB_OPEN;
+    }
+    else if (strncmp(cmd, RMI_CMD_DELETE, strlen(RMI_CMD_DELETE)) == 0)
+    {
+        *kind = RMI_JOB_DELETE;
+    }
+    else if (strncmp(cmd, RMI_CMD_COPY, strlen(RMI_CMD_COPY)) == 0)
+    {
+        *kind = RMI_JOB_COPY;
+    }
+    else if (strncmp(cmd, RMI_CMD_MOVE, strlen(RMI_CMD_MOVE)) == 0)
+    {
+        *kind = RMI_JOB_MOVE;
+    }
+    else
+    {
+        return 0;
+    }
+
+    tok = strtok_r(cmd, " \t", &save);
+    value = strtok_r(NULL, " \t", &save);
+    if (tok == NULL || value == NULL)
+    {
+        return -1;
+    }
+    if (*kind == RMI_JOB_PRESS_INPUT)
+    {
+        char *end;
+        long code;
+
+        errno = 0;
+        code = strtol(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0' ||
+            code < INT_MIN || code > INT_MAX)
+        {
+            return -1;
+        }
+        *keycode = (int)code;
+        return 1;
+    }
+    if (*kind == RMI_JOB_COPY || *kind == RMI_JOB_MOVE)
+    {
+        *dest = strtok_r(NULL, " \t", &save);
+        if (*dest == NULL)
+        {
+            return -1;
+        }
+    }
+    *arg = value;
+    return 1;
+}
+
+static int
+parse_job_id(const char *cmd, const char *name, uint32_t *id)
+{
+    const char *value;
+    char *end;
+    unsigned long parsed;
+
+    value = cmd + strlen(name);
+    if (*value != ' ')
+    {
+        return -1;
+    }
+    value++;
+    errno = 0;
+    parsed = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || parsed == 0 ||
+        parsed > UINT32_MAX)
+    {
+        return -1;
+    }
+    *id = (uint32_t)parsed;
+    return 0;
+}
+
+static int
+parse_u64(const char *text, uint64_t *out)
+{
+    char *end;
+    unsigned long long parsed;
+
+    if (*text == '-')
+    {
+        return -1;
+    }
+    errno = 0;
+    parsed = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0')
+    {
+        return -1;
+    }
+    *out = (uint64_t)parsed;
+    return 0;
+}
+
+static void
+handle_job_status(struct rmi_server *srv, struct rmi_conn *conn, uint32_t id)
+{
+    struct rmi_job *job;
+    char msg[64];
+
+    if (id == 0 || (job = find_job(srv, id)) == NULL)
+    {
+        send_text(conn, "ERR job");
+        return;
+    }
+    pthread_mutex_lock(&srv->pool.lock);
+    if (job_has_progress(job->kind))
+    {
+        snprintf(msg, sizeof(msg), "%s%u %s %llu %llu", RMI_RESP_JOB_PREFIX,
+                 (unsigned int)job->id, job_state_text(job),
+                 (unsigned long long)job->progress_entries,
+                 (unsigned long long)job->progress_bytes);
+    }
+    else
+    {
+        snprintf(msg, sizeof(msg), "%s%u %s", RMI_RESP_JOB_PREFIX,
+                 (unsigned int)job->id, job_state_text(job));
+    }
+    pthread_mutex_unlock(&srv->pool.lock);
+    send_text(conn, msg);
+}
+
+/*
+ * Asks a DELETE, COPY or MOVE job to stop. A queued one never starts; a
+ * running one stops after the entry or chunk it is on and answers
+ * `ERR cancelled`.
+ */
+static void
+handle_job_cancel(struct rmi_server *srv, struct rmi_conn *conn, uint32_t id)
+{
+    struct rmi_job *job;
+    bool finished;
+
+    if (id == 0 || (job = find_job(srv, id)) == NULL || !job_has_progress(job->kind))
+    {
+        send_text(conn, "ERR job");
+        return;
+    }
+    pthread_mutex_lock(&srv->pool.lock);
+    finished = job_finished(job);
+    if (!finished)
+    {
+        job->cancel = true;
+    }
+    pthread_mutex_unlock(&srv->pool.lock);
+    send_text(conn, finished ? "ERR job" : RMI_RESP_OK);
+}
+
+static void
+handle_job_wait(struct rmi_server *srv, struct rmi_conn *conn, uint32_t id)
 {
-    FILE *fp;
+    struct rmi_job *job;
 
-    fp = fopen(RMI_CONFIG_PATH, "w");
-    if (fp == NULL)
+    if (id == 0 || (job = find_job(srv, id)) == NULL || !job->detached ||
+        job->waiter != NULL)
     {
-        fprintf(stderr, "Failed to create default RMI config: %s\n",
-                RMI_CONFIG_PATH);
-        return -1;
+        send_text(conn, "ERR job");
+        return;
+    }
+    attach_job(conn, job);
+    if (job_finished(job))
+    {
+        deliver_job(srv, job);
     }
-    fprintf(fp, "username=%s\npassword=%s\n", RMI_DEFAULT_USER, RMI_DEFAULT_PASS);
-    fclose(fp);
-    chmod(RMI_CONFIG_PATH, 0666);
-    return 0;
 }
 
-static int
-load_rmi_config(char *user, size_t user_len, char *pass, size_t pass_len)
+/*
+ * SCREENSTREAM <fps> starts (or retunes) a frame stream on this
+ * connection; SCREENSTREAM 0 stops it. Frames are produced by
+ * service_streams() and interleave with ordinary replies.
+ */
+static void
+set_screenstream(struct rmi_conn *conn, unsigned long fps)
 {
-    FILE *fp;
-    char line[256];
-    char user_tmp[128];
-    char pass_tmp[128];
+    struct rmi_screenstream *ss;
 
-    user_tmp[0] = '\0';
-    pass_tmp[0] = '\0';
+    if (fps > RMI_STREAM_MAX_FPS)
+    {
+        send_text(conn, "ERR screenstream");
+        return;
+    }
+    if (fps == 0)
+    {
+        if (conn->stream != NULL)
+        {
+            conn->stream->active = false;
+        }
+        send_text(conn, RMI_RESP_OK);
+        return;
+    }
 
-    fp = fopen(RMI_CONFIG_PATH, "r");
-    if (fp == NULL)
+    ss = conn->stream;
+    if (ss == NULL)
     {
-        if (errno == ENOENT)
+        ss = (struct rmi_screenstream *)calloc(1, sizeof(*ss));
+        if (ss == NULL)
         {
-            if (write_default_rmi_config() == 0)
-            {
-                if (copy_field(user, user_len, RMI_DEFAULT_USER) == -1 ||
-                    copy_field(pass, pass_len, RMI_DEFAULT_PASS) == -1)
-                {
-                    fprintf(stderr, "Default RMI config fields too long.\n");
-                    return -1;
-                }
-                fprintf(stderr, "Created default RMI config: %s\n", RMI_CONFIG_PATH);
-                return 0;
-            }
+            send_text(conn, "ERR screenstream");
+            return;
         }
-        fprintf(stderr, "RMI config not found: %s\n", RMI_CONFIG_PATH);
-        return -1;
+        conn->stream = ss;
+    }
+    if (!ss->active)
+    {
+        ss->restart = true;
+        ss->next_ms = monotonic_ms();
     }
+    ss->active = true;
+    ss->interval_ms = (uint32_t)(1000u / fps);
+    send_text(conn, RMI_RESP_OK);
+}
 
-    while (fgets(line, sizeof(line), fp) != NULL)
+static void
+handle_screenstream(struct rmi_conn *conn, const char *cmd)
+{
+    const char *arg;
+    char *end;
+    unsigned long fps;
+
+    arg = cmd + strlen(RMI_CMD_SCREENSTREAM);
+    while (*arg == ' ' || *arg == '\t')
     {
-        char *sep;
+        arg++;
+    }
+    errno = 0;
+    fps = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0')
+    {
+        send_text(conn, "ERR screenstream");
+        return;
+    }
+    set_screenstream(conn, fps);
+}
 
-        trim_space(line);
-        if (line[0] == '\0' || line[0] == '#')
+static void
+release_screenstream(struct rmi_conn *conn)
+{
+    if (conn->stream == NULL)
+    {
+        return;
+    }
+    if (conn->stream->job != NULL)
+    {
+        /* The worker still owns the state; finish_stream_frame frees it. */
+        conn->stream->job->waiter = NULL;
+    }
+    else
+    {
+        free_screenstream(conn->stream);
+    }
+    conn->stream = NULL;
+}
+
+/*
+ * Submits a frame job for every stream that is due, keeping at most one
+ * in flight per connection and none while the client is behind on the
+ * previous frames. Returns the epoll timeout until the next one is due.
+ */
+static int
+service_streams(struct rmi_server *srv)
+{
+    struct rmi_conn *conn;
+    uint64_t now;
+    int timeout;
+
+    now = monotonic_ms();
+    timeout = -1;
+    for (conn = srv->conns; conn != NULL; conn = conn->next)
+    {
+        struct rmi_screenstream *ss;
+        int wait;
+
+        ss = conn->stream;
+        if (conn->dead || ss == NULL || !ss->active || ss->job != NULL)
         {
             continue;
         }
-
-        if (strncmp(line, "username=", 9) == 0)
+        if (conn->out_bytes > RMI_OUT_HIGH_WATER ||
+            conn->file_fd != -1 || conn->tree != NULL || conn->cap_fd != -1)
         {
-            char *val = line + 9;
-            trim_space(val);
-            if (copy_field(user_tmp, sizeof(user_tmp), val) == -1)
-            {
-                fclose(fp);
-                return -1;
-            }
+            /* The loop wakes again once the queue or the body drains. */
             continue;
         }
-        if (strncmp(line, "password=", 9) == 0)
+        if (now < ss->next_ms)
         {
-            char *val = line + 9;
-            trim_space(val);
-            if (copy_field(pass_tmp, sizeof(pass_tmp), val) == -1)
-            {
-                fclose(fp);
-                return -1;
-            }
-            continue;
+            wait = (int)(ss->next_ms - now);
         }
-
-        if (user_tmp[0] == '\0' && pass_tmp[0] == '\0')
+        else
         {
-            sep = strchr(line, ':');
-            if (sep == NULL)
+            if (ss->restart)
             {
-                sep = strpbrk(line, " \t");
+                ss->width = 0;
+                ss->height = 0;
+                ss->restart = false;
             }
-            if (sep != NULL)
+            ss->job = new_job(srv, RMI_JOB_STREAM_FRAME, 0, NULL);
+            if (ss->job != NULL)
             {
-                *sep = '\0';
-                sep++;
-                trim_space(line);
-                trim_space(sep);
-                if (copy_field(user_tmp, sizeof(user_tmp), line) == -1 ||
-                    copy_field(pass_tmp, sizeof(pass_tmp), sep) == -1)
-                {
-                    fclose(fp);
-                    return -1;
-                }
-                continue;
+                ss->job->stream = ss;
+                ss->job->waiter = conn;
+                enqueue_job(&srv->pool, ss->job);
             }
-
-            if (copy_field(user_tmp, sizeof(user_tmp), line) == -1)
+            ss->next_ms += ss->interval_ms;
+            if (ss->next_ms <= now)
             {
-                fclose(fp);
-                return -1;
+                ss->next_ms = now + ss->interval_ms;
             }
-            continue;
+            wait = (int)(ss->next_ms - now);
         }
-
-        if (pass_tmp[0] == '\0')
+        if (timeout == -1 || wait < timeout)
         {
-            if (copy_field(pass_tmp, sizeof(pass_tmp), line) == -1)
-            {
-                fclose(fp);
-                return -1;
-            }
-            continue;
+            timeout = wait;
         }
     }
+    return timeout;
+}
+
+static void
+send_version(struct rmi_conn *conn)
+{
+    char msg[64];
+
+    if (snprintf(msg, sizeof(msg), "%s%u",
+                 RMI_RESP_VERSION_PREFIX,
+                 (unsigned int)RMI_VERSION) >= (int)sizeof(msg))
+    {
+        send_text(conn, "ERR version");
+        return;
+    }
+    send_text(conn, msg);
+}
 
-    fclose(fp);
+/*
+ * PROTOCOL <n> selects the framing for the rest of the connection. The
+ * reply still goes out in v1 framing; everything after it uses the new one.
+ */
+static void
+handle_protocol(struct rmi_conn *conn, const char *cmd)
+{
+    const char *arg;
 
-    if (user_tmp[0] == '\0' || pass_tmp[0] == '\0')
+    arg = cmd + strlen(RMI_CMD_PROTOCOL);
+    if (strcmp(arg, " 1") == 0)
     {
-        fprintf(stderr, "RMI config missing username/password.\n");
-        return -1;
+        send_text(conn, RMI_RESP_PROTOCOL_PREFIX "1");
+        return;
     }
-    if (copy_field(user, user_len, user_tmp) == -1 ||
-        copy_field(pass, pass_len, pass_tmp) == -1)
+    if (strcmp(arg, " 2") == 0)
     {
-        fprintf(stderr, "RMI config fields too long.\n");
-        return -1;
+        send_text(conn, RMI_RESP_PROTOCOL_PREFIX "2");
+        conn->v2 = true;
+        return;
     }
-    return 0;
+    send_text(conn, "ERR protocol");
 }
 
-static int
-send_screencap(int client_fd)
+static enum rmi_client_result
+handle_rmi_client(struct rmi_server *srv, struct rmi_conn *conn, char *cmd)
 {
-    int pipefd[2];
-    char buf[4096];
-    char *data;
-    size_t size;
-    size_t cap;
-    pid_t pid;
-    ssize_t n;
-    int status;
-
-    data = NULL;
-    size = 0;
-    cap = 0;
+    enum rmi_job_kind kind;
+    const char *arg;
+    const char *dest;
+    int keycode;
+    int rc;
 
-    if (pipe(pipefd) == -1)
+    if (!conn->authed)
     {
-        fprintf(stderr, "Syscall error: pipe at line %d with code %d.\n",
-                __LINE__, errno);
-        return -1;
+        char *save;
+        char *tok;
+        char *u;
+        char *p;
+
+        tok = strtok_r(cmd, " \t", &save);
+        if (tok != NULL && strcmp(tok, RMI_CMD_AUTH) == 0)
+        {
+            u = strtok_r(NULL, " \t", &save);
+            p = strtok_r(NULL, " \t", &save);
+            if (u != NULL && p != NULL &&
+                strcmp(u, srv->user) == 0 && strcmp(p, srv->pass) == 0)
+            {
+                send_text(conn, RMI_RESP_OK);
+                conn->authed = true;
+                return RMI_CONTINUE;
+            }
+        }
+
+        conn->attempts++;
+        if (conn->attempts >= 3)
+        {
+            send_text(conn, "ERR auth failed");
+            conn->closing = true;
+            return RMI_CONTINUE;
+        }
+
+        send_text(conn, "ERR auth required");
+        return RMI_CONTINUE;
     }
 
-    pid = fork();
-    if (pid == -1)
+    if (strcmp(cmd, RMI_CMD_QUIT) == 0)
     {
-        fprintf(stderr, "Syscall error: fork at line %d with code %d.\n",
-                __LINE__, errno);
-        close(pipefd[0]);
-        close(pipefd[1]);
-        return -1;
+        send_text(conn, RMI_RESP_OK);
+        return RMI_SHUTDOWN;
     }
 
-    if (pid == 0)
+    if (strcmp(cmd, RMI_CMD_RESTART) == 0)
     {
-        if (dup2(pipefd[1], STDOUT_FILENO) == -1)
+        if (check_restart_permissions() == -1)
         {
-            _exit(127);
+            send_text(conn, "ERR restart");
+            return RMI_CONTINUE;
         }
-        close(pipefd[0]);
-        close(pipefd[1]);
-        execl("/system/bin/screencap", "screencap", "-p", (char *)NULL);
-        _exit(127);
+        send_text(conn, RMI_RESP_OK);
+        return RMI_RESTART;
     }
 
-    close(pipefd[1]);
-    while ((n = read(pipefd[0], buf, sizeof(buf))) > 0)
+    if (strcmp(cmd, RMI_CMD_VERSION) == 0)
     {
-        size_t needed;
+        send_version(conn);
+        return RMI_CONTINUE;
+    }
 
-        needed = size + (size_t)n;
-        if (needed > UINT32_MAX)
+    if (strncmp(cmd, RMI_CMD_PROTOCOL, strlen(RMI_CMD_PROTOCOL)) == 0)
+    {
+        handle_protocol(conn, cmd);
+        return RMI_CONTINUE;
+    }
+
+    if (strcmp(cmd, RMI_CMD_RUNTIME_INFO) == 0)
+    {
+        if (send_runtime_info(conn) == -1)
         {
-            free(data);
-            close(pipefd[0]);
-            waitpid(pid, &status, 0);
-            return -1;
+            send_text(conn, "ERR runtime_info");
         }
-        if (needed > cap)
-        {
-            size_t next;
-            char *tmp;
+        return RMI_CONTINUE;
+    }
 
-            next = cap == 0 ? 8192 : cap * 2;
-            while (next < needed)
+    if (strcmp(cmd, RMI_CMD_HEARTBEAT) == 0)
+    {
+        send_text(conn, RMI_RESP_OK);
+        return RMI_CONTINUE;
+    }
+
+    if (strncmp(cmd, RMI_CMD_JOB_START, strlen(RMI_CMD_JOB_START)) == 0)
+    {
+        char *inner;
+
+        inner = cmd + strlen(RMI_CMD_JOB_START);
+        if (*inner == ' ')
+        {
+            inner++;
+            rc = parse_job_command(inner, &kind, &keycode, &arg, &dest);
+            if (rc == 1)
             {
-                next *= 2;
+                start_job(srv, conn, kind, keycode, arg, dest, true);
+                return RMI_CONTINUE;
             }
-            tmp = realloc(data, next);
-            if (tmp == NULL)
+            if (rc == -1)
             {
-                free(data);
-                close(pipefd[0]);
-                waitpid(pid, &status, 0);
-                return -1;
+                send_text(conn, job_error_text(kind));
+                return RMI_CONTINUE;
             }
-            data = tmp;
-            cap = next;
         }
-        memcpy(data + size, buf, (size_t)n);
-        size = needed;
+        send_text(conn, "ERR job");
+        return RMI_CONTINUE;
     }
-    if (n == -1)
+
+    if (strncmp(cmd, RMI_CMD_JOB_STATUS, strlen(RMI_CMD_JOB_STATUS)) == 0)
     {
-        free(data);
-        close(pipefd[0]);
-        waitpid(pid, &status, 0);
-        return -1;
+        uint32_t id;
+
+        handle_job_status(srv, conn,
+                          parse_job_id(cmd, RMI_CMD_JOB_STATUS, &id) == 0 ? id : 0);
+        return RMI_CONTINUE;
     }
-    close(pipefd[0]);
-    waitpid(pid, &status, 0);
 
-    if (send_frame(client_fd, data, (uint32_t)size) == -1)
+    if (strncmp(cmd, RMI_CMD_JOB_WAIT, strlen(RMI_CMD_JOB_WAIT)) == 0)
+    {
+        uint32_t id;
+
+        handle_job_wait(srv, conn,
+                        parse_job_id(cmd, RMI_CMD_JOB_WAIT, &id) == 0 ? id : 0);
+        return RMI_CONTINUE;
+    }
+
+    if (strncmp(cmd, RMI_CMD_JOB_CANCEL, strlen(RMI_CMD_JOB_CANCEL)) == 0)
+    {
+        uint32_t id;
+
+        handle_job_cancel(srv, conn,
+                          parse_job_id(cmd, RMI_CMD_JOB_CANCEL, &id) == 0 ? id : 0);
+        return RMI_CONTINUE;
+    }
+
+    if (strcmp(cmd, RMI_CMD_SCREENCAP_STREAM) == 0)
+    {
+        start_capture_stream(srv, conn);
+        return RMI_CONTINUE;
+    }
+
+    if (strncmp(cmd, RMI_CMD_SCREENSTREAM, strlen(RMI_CMD_SCREENSTREAM)) == 0)
+    {
+        handle_screenstream(conn, cmd);
+        return RMI_CONTINUE;
+    }
+
+    rc = parse_job_command(cmd, &kind, &keycode, &arg, &dest);
+    if (rc == 1)
+    {
+        start_job(srv, conn, kind, keycode, arg, dest, false);
+        return RMI_CONTINUE;
+    }
+    if (rc == -1)
     {
-        free(data);
-        return -1;
+        send_text(conn, job_error_text(kind));
+        return RMI_CONTINUE;
     }
 
-    free(data);
-    return 0;
-}
-
-static int
-send_keyevent(int keycode)
-{
-    struct input_event events[4];
-    struct timeval now;
-    int fd;
-    const char *path;
+    /* UPLOAD_TREE <path>, ahead of UPLOAD; the archive frames follow. */
+    if (strncmp(cmd, RMI_CMD_UPLOAD_TREE, strlen(RMI_CMD_UPLOAD_TREE)) == 0)
+    {
+        char *save;
+        char *tok;
+        char *path;
+
+        tok = strtok_r(cmd, " \t", &save);
+        path = strtok_r(NULL, " \t", &save);
+        conn->extract = tree_extract_open(tok != NULL && path != NULL ? path : "");
+        conn->state = RMI_CONN_TREE_HEADER;
+        return RMI_CONTINUE;
+    }
 
-    if (keycode < 0 || keycode > KEY_MAX)
+    if (strncmp(cmd, RMI_CMD_UPLOAD, strlen(RMI_CMD_UPLOAD)) == 0)
     {
-        return -1;
+        char *save;
+        char *tok;
+        char *path;
+        char *size_str;
+        char *end;
+        unsigned long size;
+
+        tok = strtok_r(cmd, " \t", &save);
+        path = strtok_r(NULL, " \t", &save);
+        size_str = strtok_r(NULL, " \t", &save);
+        if (tok != NULL && path != NULL && size_str != NULL)
+        {
+            errno = 0;
+            size = strtoul(size_str, &end, 10);
+            if (errno == 0 && end != size_str && *end == '\0' &&
+                size <= UINT32_MAX && strlen(path) < PATH_MAX)
+            {
+                start_upload(conn, path, (uint32_t)size, false, 0);
+                return RMI_CONTINUE;
+            }
+        }
+        send_text(conn, "ERR upload");
+        return RMI_CONTINUE;
     }
 
-    path = "/dev/input/event2";
-    fd = open(path, O_RDWR | O_CLOEXEC);
-    if (fd == -1)
+    /* DELTA_UPLOAD <path> <size> <delta length>; the delta follows as one frame. */
+    if (strncmp(cmd, RMI_CMD_DELTA_UPLOAD, strlen(RMI_CMD_DELTA_UPLOAD)) == 0)
     {
-        return -1;
+        char *save;
+        char *tok;
+        char *path;
+        char *size_str;
+        char *len_str;
+        uint64_t size;
+        uint64_t length;
+
+        tok = strtok_r(cmd, " \t", &save);
+        path = strtok_r(NULL, " \t", &save);
+        size_str = strtok_r(NULL, " \t", &save);
+        len_str = strtok_r(NULL, " \t", &save);
+        if (tok != NULL && path != NULL && len_str != NULL &&
+            parse_u64(size_str, &size) == 0 && size <= INT64_MAX &&
+            parse_u64(len_str, &length) == 0 && length <= UINT32_MAX &&
+            strlen(path) < PATH_MAX)
+        {
+            start_upload(conn, path, (uint32_t)length, true, size);
+            return RMI_CONTINUE;
+        }
+        send_text(conn, "ERR delta_upload");
+        return RMI_CONTINUE;
     }
 
-    fprintf(stderr, "RMI keyevent: using %s for keycode %d\n", path, keycode);
+    if (strncmp(cmd, RMI_CMD_BLOCKSUMS, strlen(RMI_CMD_BLOCKSUMS)) == 0)
+    {
+        char *save;
+        char *tok;
+        char *path;
+        char *block_str;
+        uint64_t block;
+
+        tok = strtok_r(cmd, " \t", &save);
+        path = strtok_r(NULL, " \t", &save);
+        block_str = strtok_r(NULL, " \t", &save);
+        if (tok != NULL && path != NULL && block_str != NULL &&
+            parse_u64(block_str, &block) == 0 &&
+            block >= RMI_DELTA_BLOCK_MIN && block <= RMI_DELTA_BLOCK_MAX)
+        {
+            start_job(srv, conn, RMI_JOB_BLOCKSUMS, (int)block, path, NULL, false);
+            return RMI_CONTINUE;
+        }
+        send_text(conn, job_error_text(RMI_JOB_BLOCKSUMS));
+        return RMI_CONTINUE;
+    }
 
-    if (gettimeofday(&now, NULL) == -1)
+    /* Also takes LIST2, which adds an optional field mask. */
+    if (strncmp(cmd, RMI_CMD_LIST, strlen(RMI_CMD_LIST)) == 0)
     {
-        close(fd);
-        return -1;
+        char *save;
+        char *tok;
+        char *path;
+        char *off_str;
+        char *limit_str;
+        char *fields_str;
+        uint64_t offset;
+        uint64_t limit;
+        uint64_t fields;
+        enum rmi_list_format format;
+
+        tok = strtok_r(cmd, " \t", &save);
+        path = strtok_r(NULL, " \t", &save);
+        off_str = strtok_r(NULL, " \t", &save);
+        limit_str = strtok_r(NULL, " \t", &save);
+        fields_str = strtok_r(NULL, " \t", &save);
+        offset = 0;
+        limit = 0;
+        format = RMI_LIST_TEXT;
+        fields = RMI_LIST2_FIELD_SIZE;
+        if (tok != NULL && strcmp(tok, RMI_CMD_LIST2) == 0)
+        {
+            format = RMI_LIST_BINARY;
+            fields = RMI_LIST2_FIELDS_ALL;
+        }
+        if (tok != NULL && path != NULL &&
+            (off_str == NULL ||
+             (limit_str != NULL && parse_u64(off_str, &offset) == 0 &&
+              parse_u64(limit_str, &limit) == 0)) &&
+            (fields_str == NULL ||
+             (format == RMI_LIST_BINARY && parse_u64(fields_str, &fields) == 0)))
+        {
+            if (send_file_list(conn, path, format, (unsigned int)fields, offset, limit,
+                               false) == 0)
+            {
+                return RMI_CONTINUE;
+            }
+        }
+        send_text(conn, "ERR list");
+        return RMI_CONTINUE;
     }
 
-    events[0].time = now;
-    events[0].type = EV_KEY;
-    events[0].code = (unsigned short)keycode;
-    events[0].value = 1;
+    /* Ahead of DOWNLOAD, which it would otherwise match as a prefix. */
+    if (strncmp(cmd, RMI_CMD_DOWNLOAD_TREE, strlen(RMI_CMD_DOWNLOAD_TREE)) == 0)
+    {
+        char *save;
+        char *tok;
+        char *path;
 
-    events[1].time = now;
-    events[1].type = EV_SYN;
-    events[1].code = SYN_REPORT;
-    events[1].value = 0;
+        tok = strtok_r(cmd, " \t", &save);
+        path = strtok_r(NULL, " \t", &save);
+        if (tok != NULL && path != NULL && handle_download_tree(conn, path) == 0)
+        {
+            return RMI_CONTINUE;
+        }
+        send_text(conn, "ERR download_tree");
+        return RMI_CONTINUE;
+    }
 
-    events[2].time = now;
-    events[2].type = EV_KEY;
-    events[2].code = (unsigned short)keycode;
-    events[2].value = 0;
+    if (strncmp(cmd, RMI_CMD_DOWNLOAD, strlen(RMI_CMD_DOWNLOAD)) == 0)
+    {
+        char *save;
+        char *tok;
+        char *path;
+        char *off_str;
+        char *len_str;
+        uint64_t offset;
+        uint64_t length;
+
+        tok = strtok_r(cmd, " \t", &save);
+        path = strtok_r(NULL, " \t", &save);
+        off_str = strtok_r(NULL, " \t", &save);
+        len_str = strtok_r(NULL, " \t", &save);
+        offset = 0;
+        length = 0;
+        if (tok != NULL && path != NULL &&
+            (off_str == NULL ||
+             (len_str != NULL && parse_u64(off_str, &offset) == 0 &&
+              parse_u64(len_str, &length) == 0)))
+        {
+            if (handle_download(conn, path, offset, length, off_str != NULL) == 0)
+            {
+                return RMI_CONTINUE;
+            }
+        }
+        send_text(conn, "ERR download");
+        return RMI_CONTINUE;
+    }
 
-    events[3].time = now;
-    events[3].type = EV_SYN;
-    events[3].code = SYN_REPORT;
-    events[3].value = 0;
+    if (strncmp(cmd, RMI_CMD_INPUT_BATCH, strlen(RMI_CMD_INPUT_BATCH)) == 0)
+    {
+        handle_input_batch(conn, cmd);
+        return RMI_CONTINUE;
+    }
 
-    if (writeall(fd, events, sizeof(events)) == -1)
+    if (strncmp(cmd, RMI_CMD_PRESS, strlen(RMI_CMD_PRESS)) == 0)
     {
-        close(fd);
-        return -1;
+        char *save;
+        char *tok;
+        char *code_str;
+        char *end;
+        long code;
+
+        tok = strtok_r(cmd, " \t", &save);
+        code_str = strtok_r(NULL, " \t", &save);
+        if (tok != NULL && code_str != NULL)
+        {
+            errno = 0;
+            code = strtol(code_str, &end, 10);
+            if (errno == 0 && end != code_str && *end == '\0')
+            {
+                if (send_keyevent((int)code) == 0)
+                {
+                    send_text(conn, RMI_RESP_OK);
+                    return RMI_CONTINUE;
+                }
+                send_text(conn, "ERR press");
+                return RMI_CONTINUE;
+            }
+        }
+        send_text(conn, "ERR press");
+        return RMI_CONTINUE;
     }
 
-    close(fd);
-    return 0;
+    send_text(conn, "ERR unknown command");
+    return RMI_CONTINUE;
 }
 
+/* Copies a v2 string argument; embedded NULs and overlong values fail. */
 static int
-send_keyevent_input(int keycode)
+v2_arg_string(const struct rmi_v2_arg *arg, char *out, size_t cap)
 {
-    pid_t pid;
-    int status;
-    char key_str[16];
-    int sh_ok;
-    int runcon_ok;
-    int app_process_ok;
-    int app_process64_ok;
-    int app_process32_ok;
-    int cmd_ok;
-    int toolbox_ok;
-    int toybox_ok;
-
-    if (keycode < 0)
+    if (arg->len == 0 || arg->len >= cap || memchr(arg->data, '\0', arg->len) != NULL)
     {
         return -1;
     }
-    if (snprintf(key_str, sizeof(key_str), "%d", keycode) >= (int)sizeof(key_str))
+    memcpy(out, arg->data, arg->len);
+    out[arg->len] = '\0';
+    return 0;
+}
+
+static int
+v2_arg_u32(const struct rmi_v2_arg *arg, uint32_t *out)
+{
+    if (arg->len != 4)
     {
         return -1;
     }
+    *out = rmi_read_be32(arg->data);
+    return 0;
+}
 
-    fprintf(stderr, "RMI press_input: keycode %d\n", keycode);
-
-    sh_ok = (access("/system/bin/sh", X_OK) == 0);
-    runcon_ok = (access("/system/bin/runcon", X_OK) == 0);
-    app_process_ok = (access("/system/bin/app_process", X_OK) == 0);
-    app_process64_ok = (access("/system/bin/app_process64", X_OK) == 0);
-    app_process32_ok = (access("/system/bin/app_process32", X_OK) == 0);
-    cmd_ok = (access("/system/bin/cmd", X_OK) == 0);
-    toolbox_ok = (access("/system/bin/toolbox", X_OK) == 0);
-    toybox_ok = (access("/system/bin/toybox", X_OK) == 0);
-
-    pid = fork();
-    if (pid == -1)
+static int
+v2_arg_u64(const struct rmi_v2_arg *arg, uint64_t *out)
+{
+    if (arg->len != 8)
     {
-        fprintf(stderr, "Syscall error: fork at line %d with code %d.\n",
-                __LINE__, errno);
         return -1;
     }
+    *out = rmi_read_be64(arg->data);
+    return 0;
+}
 
-    if (pid == 0)
+/*
+ * Maps a v2 opcode onto the same handlers the v1 commands use. Replies are
+ * tagged with `id`, and worker-pool jobs do not hold up the connection, so
+ * a client can keep many requests in flight and match them up by id.
+ */
+static enum rmi_client_result
+handle_v2_request(struct rmi_server *srv, struct rmi_conn *conn, uint32_t id,
+                  uint8_t op, uint8_t flags, const struct rmi_v2_arg *args,
+                  size_t count)
+{
+    char path[PATH_MAX];
+    char dest[PATH_MAX];
+    uint32_t value;
+    uint64_t offset;
+    uint64_t size;
+    bool detached;
+    bool compress;
+    enum rmi_list_format format;
+
+    set_reply_context(conn, id, op);
+    detached = (flags & RMI_V2_FLAG_DETACH) != 0;
+    compress = conn->compress && (flags & RMI_V2_FLAG_COMPRESSED) != 0;
+    switch (op)
     {
-        set_shell_env();
-        log_identity("before runcon");
-        if (runcon_ok)
+    case RMI_OP_HEARTBEAT:
+        send_text(conn, RMI_RESP_OK);
+        return RMI_CONTINUE;
+    case RMI_OP_QUIT:
+        send_text(conn, RMI_RESP_OK);
+        return RMI_SHUTDOWN;
+    case RMI_OP_RESTART:
+        if (check_restart_permissions() == -1)
         {
-            fprintf(stderr, "RMI press_input: exec /system/bin/runcon shell\n");
-            execl("/system/bin/runcon", "runcon", "u:r:shell:s0",
-                  "/system/bin/sh", "/system/bin/input", "keyevent",
-                  key_str, (char *)NULL);
-            fprintf(stderr, "RMI press_input: exec /system/bin/runcon failed: %d\n",
-                    errno);
+            send_text(conn, "ERR restart");
+            return RMI_CONTINUE;
         }
-        drop_to_shell_user();
-        log_identity("after drop");
-        if (sh_ok)
+        send_text(conn, RMI_RESP_OK);
+        return RMI_RESTART;
+    case RMI_OP_VERSION:
+        send_version(conn);
+        return RMI_CONTINUE;
+    case RMI_OP_RUNTIME_INFO:
+        if (send_runtime_info(conn) == -1)
         {
-            fprintf(stderr, "RMI press_input: exec /system/bin/sh /system/bin/input\n");
-            execl("/system/bin/sh", "sh", "/system/bin/input", "keyevent",
-                  key_str, (char *)NULL);
-            fprintf(stderr, "RMI press_input: exec sh /system/bin/input failed: %d\n",
-                    errno);
+            send_text(conn, "ERR runtime_info");
         }
-        if (app_process_ok)
+        return RMI_CONTINUE;
+    case RMI_OP_COMPRESS:
+        /* The only codec so far; later ones would be picked from the list. */
+        if (count != 1 || v2_arg_string(&args[0], path, sizeof(path)) == -1 ||
+            strcmp(path, RMI_LZ_CODEC) != 0)
         {
-            if (setenv("CLASSPATH", "/system/framework/input.jar", 1) == 0)
-            {
-                fprintf(stderr, "RMI press_input: exec /system/bin/app_process\n");
-                execl("/system/bin/app_process", "app_process", "/system/bin",
-                      "com.android.commands.input.Input", "keyevent", key_str,
-                      (char *)NULL);
-                fprintf(stderr, "RMI press_input: exec /system/bin/app_process failed: %d\n",
-                        errno);
-            }
-            else
-            {
-                fprintf(stderr, "RMI press_input: setenv CLASSPATH failed: %d\n",
-                        errno);
-            }
+            send_text(conn, "ERR compress");
+            return RMI_CONTINUE;
         }
-        if (app_process64_ok)
+        conn->compress = true;
+        send_text(conn, RMI_RESP_OK " " RMI_LZ_CODEC);
+        return RMI_CONTINUE;
+    case RMI_OP_COMMAND:
+        /* A v1 command line; ones that expect a follow-up frame are refused. */
+        if (count != 1 || v2_arg_string(&args[0], path, RMI_CMD_MAX_BYTES) == -1 ||
+            strncmp(path, RMI_CMD_UPLOAD, strlen(RMI_CMD_UPLOAD)) == 0 ||
+            strncmp(path, RMI_CMD_DELTA_UPLOAD, strlen(RMI_CMD_DELTA_UPLOAD)) == 0 ||
+            strncmp(path, RMI_CMD_DOWNLOAD_TREE, strlen(RMI_CMD_DOWNLOAD_TREE)) == 0 ||
+            strncmp(path, RMI_CMD_SCREENCAP_STREAM, strlen(RMI_CMD_SCREENCAP_STREAM)) == 0 ||
+            strncmp(path, RMI_CMD_INPUT_BATCH, strlen(RMI_CMD_INPUT_BATCH)) == 0 ||
+            strncmp(path, RMI_CMD_PROTOCOL, strlen(RMI_CMD_PROTOCOL)) == 0)
         {
-            if (setenv("CLASSPATH", "/system/framework/input.jar", 1) == 0)
-            {
-                fprintf(stderr, "RMI press_input: exec /system/bin/app_process64\n");
-                execl("/system/bin/app_process64", "app_process64", "/system/bin",
-                      "com.android.commands.input.Input", "keyevent", key_str,
-                      (char *)NULL);
-                fprintf(stderr, "RMI press_input: exec /system/bin/app_process64 failed: %d\n",
-                        errno);
-            }
-            else
-            {
-                fprintf(stderr, "RMI press_input: setenv CLASSPATH failed: %d\n",
-                        errno);
-            }
+            send_text(conn, "ERR unknown command");
+            return RMI_CONTINUE;
         }
-        if (app_process32_ok)
+        return handle_rmi_client(srv, conn, path);
+    case RMI_OP_PRESS:
+        if (count != 1 || v2_arg_u32(&args[0], &value) == -1 ||
+            send_keyevent((int32_t)value) == -1)
         {
-            if (setenv("CLASSPATH", "/system/framework/input.jar", 1) == 0)
-            {
-                fprintf(stderr, "RMI press_input: exec /system/bin/app_process32\n");
-                execl("/system/bin/app_process32", "app_process32", "/system/bin",
-                      "com.android.commands.input.Input", "keyevent", key_str,
-                      (char *)NULL);
-                fprintf(stderr, "RMI press_input: exec /system/bin/app_process32 failed: %d\n",
-                        errno);
-            }
-            else
-            {
-                fprintf(stderr, "RMI press_input: setenv CLASSPATH failed: %d\n",
-                        errno);
-            }
+            send_text(conn, "ERR press");
+            return RMI_CONTINUE;
         }
-        if (cmd_ok)
+        send_text(conn, RMI_RESP_OK);
+        return RMI_CONTINUE;
+    case RMI_OP_PRESS_INPUT:
+        if (count != 1 || v2_arg_u32(&args[0], &value) == -1)
         {
-            fprintf(stderr, "RMI press_input: exec /system/bin/cmd\n");
-            execl("/system/bin/cmd", "cmd", "input", "keyevent", key_str,
-                  (char *)NULL);
-            fprintf(stderr, "RMI press_input: exec /system/bin/cmd failed: %d\n",
-                    errno);
+            send_text(conn, job_error_text(RMI_JOB_PRESS_INPUT));
+            return RMI_CONTINUE;
         }
-        if (toybox_ok)
+        start_job(srv, conn, RMI_JOB_PRESS_INPUT, (int32_t)value, NULL, NULL, detached);
+        return RMI_CONTINUE;
+    case RMI_OP_INPUT_BATCH:
+        if (count != 1)
         {
-            fprintf(stderr, "RMI press_input: exec /system/bin/toybox\n");
-            execl("/system/bin/toybox", "toybox", "input", "keyevent", key_str,
-                  (char *)NULL);
-            fprintf(stderr, "RMI press_input: exec /system/bin/toybox failed: %d\n",
-                    errno);
+            send_text(conn, job_error_text(RMI_JOB_INPUT_BATCH));
+            return RMI_CONTINUE;
         }
-        if (toolbox_ok)
+        start_input_batch(srv, conn, args[0].data, args[0].len);
+        return RMI_CONTINUE;
+    case RMI_OP_OPEN:
+    case RMI_OP_DELETE:
+        if (count != 1 || v2_arg_string(&args[0], path, sizeof(path)) == -1)
         {
-            fprintf(stderr, "RMI press_input: exec /system/bin/toolbox\n");
-            execl("/system/bin/toolbox", "toolbox", "input", "keyevent", key_str,
-                  (char *)NULL);
-            fprintf(stderr, "RMI press_input: exec /system/bin/toolbox failed: %d\n",
-                    errno);
+            send_text(conn, job_error_text(op == RMI_OP_OPEN ? RMI_JOB_OPEN : RMI_JOB_DELETE));
+            return RMI_CONTINUE;
         }
-        _exit(127);
+        start_job(srv, conn, op == RMI_OP_OPEN ? RMI_JOB_OPEN : RMI_JOB_DELETE,
+                  0, path, NULL, detached);
+        return RMI_CONTINUE;
+    case RMI_OP_COPY:
+    case RMI_OP_MOVE:
+        if (count != 2 || v2_arg_string(&args[0], path, sizeof(path)) == -1 ||
+            v2_arg_string(&args[1], dest, sizeof(dest)) == -1)
+        {
+            send_text(conn, job_error_text(op == RMI_OP_COPY ? RMI_JOB_COPY : RMI_JOB_MOVE));
+            return RMI_CONTINUE;
+        }
+        start_job(srv, conn, op == RMI_OP_COPY ? RMI_JOB_COPY : RMI_JOB_MOVE,
+                  0, path, dest, detached);
+        return RMI_CONTINUE;
+    case RMI_OP_SCREENCAP:
+    case RMI_OP_SCREENCAP_RAW:
+        start_job(srv, conn, op == RMI_OP_SCREENCAP ? RMI_JOB_SCREENCAP : RMI_JOB_SCREENCAP_RAW,
+                  0, NULL, NULL, detached);
+        return RMI_CONTINUE;
+    case RMI_OP_SCREENCAP_STREAM:
+        conn->cap_id = id;
+        start_capture_stream(srv, conn);
+        return RMI_CONTINUE;
+    case RMI_OP_SCREENSTREAM:
+        if (count != 1 || v2_arg_u32(&args[0], &value) == -1)
+        {
+            send_text(conn, "ERR screenstream");
+            return RMI_CONTINUE;
+        }
+        set_screenstream(conn, value);
+        return RMI_CONTINUE;
+    case RMI_OP_JOB_STATUS:
+    case RMI_OP_JOB_WAIT:
+    case RMI_OP_JOB_CANCEL:
+        if (count != 1 || v2_arg_u32(&args[0], &value) == -1)
+        {
+            value = 0;
+        }
+        if (op == RMI_OP_JOB_STATUS)
+        {
+            handle_job_status(srv, conn, value);
+        }
+        else if (op == RMI_OP_JOB_WAIT)
+        {
+            handle_job_wait(srv, conn, value);
+        }
+        else
+        {
+            handle_job_cancel(srv, conn, value);
+        }
+        return RMI_CONTINUE;
+    case RMI_OP_UPLOAD:
+        if (count != 2 || v2_arg_string(&args[0], path, sizeof(path)) == -1 ||
+            v2_arg_u64(&args[1], &size) == -1 || size > INT64_MAX)
+        {
+            send_text(conn, "ERR upload");
+            return RMI_CONTINUE;
+        }
+        start_upload_stream(conn, id, path, size, false, 0);
+        return RMI_CONTINUE;
+    case RMI_OP_DELTA_UPLOAD:
+        /* Path, size of the rebuilt file, length of the delta streamed after. */
+        if (count != 3 || v2_arg_string(&args[0], path, sizeof(path)) == -1 ||
+            v2_arg_u64(&args[1], &size) == -1 || size > INT64_MAX ||
+            v2_arg_u64(&args[2], &offset) == -1)
+        {
+            send_text(conn, "ERR delta_upload");
+            return RMI_CONTINUE;
+        }
+        start_upload_stream(conn, id, path, offset, true, size);
+        return RMI_CONTINUE;
+    case RMI_OP_UPLOAD_TREE:
+        if (count != 1 || v2_arg_string(&args[0], path, sizeof(path)) == -1)
+        {
+            send_text(conn, "ERR upload_tree");
+            return RMI_CONTINUE;
+        }
+        start_tree_upload_stream(conn, id, path);
+        return RMI_CONTINUE;
+    case RMI_OP_BLOCKSUMS:
+        if (count != 2 || v2_arg_string(&args[0], path, sizeof(path)) == -1 ||
+            v2_arg_u32(&args[1], &value) == -1 ||
+            value < RMI_DELTA_BLOCK_MIN || value > RMI_DELTA_BLOCK_MAX)
+        {
+            send_text(conn, job_error_text(RMI_JOB_BLOCKSUMS));
+            return RMI_CONTINUE;
+        }
+        start_job(srv, conn, RMI_JOB_BLOCKSUMS, (int)value, path, NULL, detached);
+        return RMI_CONTINUE;
+    case RMI_OP_LIST:
+    case RMI_OP_LIST2:
+        /*
+         * Offset and limit stream the listing; the bare path still gets
+         * it as one reply for older clients. LIST2 may add a field mask.
+         */
+        format = op == RMI_OP_LIST2 ? RMI_LIST_BINARY : RMI_LIST_TEXT;
+        value = op == RMI_OP_LIST2 ? RMI_LIST2_FIELDS_ALL : RMI_LIST2_FIELD_SIZE;
+        if ((count != 1 && count != 3 && !(count == 4 && op == RMI_OP_LIST2)) ||
+            v2_arg_string(&args[0], path, sizeof(path)) == -1 ||
+            (count >= 3 && (v2_arg_u64(&args[1], &offset) == -1 ||
+                            v2_arg_u64(&args[2], &size) == -1)) ||
+            (count == 4 && v2_arg_u32(&args[3], &value) == -1) ||
+            (count == 1 && send_file_list(conn, path, format, value, 0, 0, compress) == -1) ||
+            (count > 1 && start_list_stream(conn, id, path, format, value, offset, size,
+                                            compress) == -1))
+        {
+            send_text(conn, "ERR list");
+        }
+        return RMI_CONTINUE;
+    case RMI_OP_DOWNLOAD:
+        /* Optional offset and length select a range, as in v1. */
+        offset = 0;
+        size = 0;
+        if ((count != 1 && count != 3) ||
+            v2_arg_string(&args[0], path, sizeof(path)) == -1 ||
+            (count == 3 && (v2_arg_u64(&args[1], &offset) == -1 ||
+                            v2_arg_u64(&args[2], &size) == -1)) ||
+            start_download_stream(conn, id, path, offset, size, compress) == -1)
+        {
+            send_text(conn, "ERR download");
+        }
+        return RMI_CONTINUE;
+    case RMI_OP_DOWNLOAD_TREE:
+        if (count != 1 || v2_arg_string(&args[0], path, sizeof(path)) == -1 ||
+            start_tree_stream(conn, id, path, compress) == -1)
+        {
+            send_text(conn, "ERR download_tree");
+        }
+        return RMI_CONTINUE;
+    default:
+        send_text(conn, "ERR unknown command");
+        return RMI_CONTINUE;
     }
+}
 
-    if (waitpid(pid, &status, 0) == -1)
+/*
+ * Runs one complete v2 request from the input buffer. Returns 1 when one
+ * was handled, 0 when more bytes are needed, -1 on a framing error.
+ */
+static int
+process_v2_request(struct rmi_server *srv, struct rmi_conn *conn)
+{
+    struct rmi_v2_arg args[RMI_V2_MAX_ARGS];
+    enum rmi_client_result result;
+    const uint8_t *frame;
+    uint32_t len;
+    uint32_t id;
+    uint8_t op;
+    size_t count;
+
+    if (input_available(conn) < RMI_FRAME_HEADER_SIZE)
+    {
+        return 0;
+    }
+    frame = conn->in + conn->in_off;
+    len = rmi_read_be32(frame);
+    if (len < RMI_V2_HEADER_SIZE || len > sizeof(conn->in) - RMI_FRAME_HEADER_SIZE)
     {
         return -1;
     }
-    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    if (input_available(conn) < RMI_FRAME_HEADER_SIZE + len)
     {
-        if (WIFEXITED(status))
+        return 0;
+    }
+    frame += RMI_FRAME_HEADER_SIZE;
+    id = rmi_read_be32(frame);
+    op = frame[4];
+    if (op == RMI_OP_DATA || op == RMI_OP_WINDOW)
+    {
+        if (op == RMI_OP_DATA)
         {
-            fprintf(stderr, "RMI press_input: exit status %d\n",
-                    WEXITSTATUS(status));
+            recv_upload_chunk(srv, conn, id, frame[5], frame + RMI_V2_HEADER_SIZE,
+                              len - RMI_V2_HEADER_SIZE);
         }
-        else if (WIFSIGNALED(status))
+        else
         {
-            fprintf(stderr, "RMI press_input: signaled %d\n",
-                    WTERMSIG(status));
+            grant_bulk_credit(conn, id, frame + RMI_V2_HEADER_SIZE, len - RMI_V2_HEADER_SIZE);
         }
-        return -1;
+        consume_input(conn, RMI_FRAME_HEADER_SIZE + len);
+        return 1;
+    }
+    if (rmi_v2_parse_args(frame + RMI_V2_HEADER_SIZE, len - RMI_V2_HEADER_SIZE,
+                          args, RMI_V2_MAX_ARGS, &count) == -1)
+    {
+        set_reply_context(conn, id, op);
+        send_text(conn, "ERR unknown command");
+        consume_input(conn, RMI_FRAME_HEADER_SIZE + len);
+        return 1;
+    }
+    result = handle_v2_request(srv, conn, id, op, frame[5], args, count);
+    consume_input(conn, RMI_FRAME_HEADER_SIZE + len);
+    if (result != RMI_CONTINUE)
+    {
+        srv->result = result;
+        srv->result_conn = conn;
     }
+    return 1;
+}
 
-    return 0;
+static bool
+conn_busy(const struct rmi_conn *conn)
+{
+    return conn->closing ||
+           conn->wait_job != NULL ||
+           conn->file_fd != -1 ||
+           conn->tree != NULL ||
+           conn->cap_fd != -1 ||
+           conn->out_bytes > RMI_OUT_HIGH_WATER;
 }
 
-static int
-open_app(const char *target)
+static void
+close_conn(struct rmi_server *srv, struct rmi_conn *conn)
 {
-    pid_t pid;
-    int status;
-    int runcon_ok;
-    int sh_ok;
-    int am_ok;
-    int cmd_ok;
-    int monkey_ok;
-    bool is_component;
-    const char *prefix;
+    struct rmi_job *job;
+    unsigned int i;
 
-    if (target == NULL || target[0] == '\0')
+    if (conn->dead)
     {
-        return -1;
+        return;
     }
-
-    prefix = "package:";
-    if (strncmp(target, prefix, strlen(prefix)) == 0)
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->dead = true;
+    srv->conn_count--;
+    if (conn->upload_fd != -1)
     {
-        target += strlen(prefix);
-        while (*target == ' ' || *target == '\t')
-        {
-            target++;
-        }
-        if (target[0] == '\0')
+        conn->upload_ok = false;
+        finish_upload(conn);
+    }
+    close_upload_pipe(conn);
+    close_delta_base(conn);
+    free(conn->delta_stash);
+    conn->delta_stash = NULL;
+    close_file_source(conn);
+    tree_walk_free(conn->tree);
+    conn->tree = NULL;
+    tree_extract_free(conn->extract);
+    conn->extract = NULL;
+    for (i = 0; i < RMI_V2_MAX_STREAMS; i++)
+    {
+        close_bulk_stream(&conn->bulk[i]);
+    }
+    if (conn->cap_fd != -1)
+    {
+        stop_capture(srv, conn, true);
+    }
+    free_frames(conn);
+    for (job = srv->jobs; job != NULL; job = job->all_next)
+    {
+        if (job->waiter == conn)
         {
-            return -1;
+            job->waiter = NULL;
         }
     }
+    conn->wait_job = NULL;
+    release_screenstream(conn);
+    fprintf(stderr, "RMI: client disconnected (%u active)\n",
+            (unsigned int)srv->conn_count);
+}
 
-    is_component = (strchr(target, '/') != NULL);
-
-    runcon_ok = (access("/system/bin/runcon", X_OK) == 0);
-    sh_ok = (access("/system/bin/sh", X_OK) == 0);
-    am_ok = (access("/system/bin/am", X_OK) == 0);
-    cmd_ok = (access("/system/bin/cmd", X_OK) == 0);
-    monkey_ok = (access("/system/bin/monkey", X_OK) == 0);
+static void
+update_conn_events(struct rmi_server *srv, struct rmi_conn *conn)
+{
+    struct epoll_event ev;
+    uint32_t events;
 
-    pid = fork();
-    if (pid == -1)
+    if (conn->dead)
     {
-        fprintf(stderr, "Syscall error: fork at line %d with code %d.\n",
+        return;
+    }
+    events = 0;
+    if (conn->in_len < sizeof(conn->in) || conn->in_off > 0)
+    {
+        events |= EPOLLIN;
+    }
+    if (conn->out_head != NULL || conn->file_fd != -1 || conn->tree != NULL ||
+        bulk_stream_ready(conn))
+    {
+        events |= EPOLLOUT;
+    }
+    if (events == conn->events)
+    {
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1)
+    {
+        fprintf(stderr, "Syscall error: epoll_ctl at line %d with code %d.\n",
                 __LINE__, errno);
-        return -1;
+        close_conn(srv, conn);
+        return;
     }
+    conn->events = events;
+}
 
-    if (pid == 0)
+/* Runs every complete command in the input buffer; returns true on progress. */
+static bool
+process_input(struct rmi_server *srv, struct rmi_conn *conn)
+{
+    bool progressed;
+
+    progressed = false;
+    while (!conn->dead && srv->result == RMI_CONTINUE)
     {
-        set_shell_env();
-        log_identity("before runcon");
-        if (runcon_ok)
+        char cmd[RMI_CMD_MAX_BYTES];
+        enum rmi_client_result result;
+        uint32_t len;
+
+        if (conn->state != RMI_CONN_COMMAND)
         {
-            if (monkey_ok && !is_component)
-            {
-                if (sh_ok)
-                {
-                    fprintf(stderr, "RMI open: exec /system/bin/runcon sh monkey\n");
-                    execl("/system/bin/runcon", "runcon", "u:r:shell:s0",
-                          "/system/bin/sh", "/system/bin/monkey", "-p", target,
-                          "-c", "android.intent.category.LAUNCHER", "1",
-                          (char *)NULL);
-                    fprintf(stderr, "RMI open: exec /system/bin/runcon sh monkey failed: %d\n",
-                            errno);
-                }
-                fprintf(stderr, "RMI open: exec /system/bin/runcon monkey\n");
-                execl("/system/bin/runcon", "runcon", "u:r:shell:s0",
-                      "/system/bin/monkey", "-p", target,
-                      "-c", "android.intent.category.LAUNCHER", "1",
-                      (char *)NULL);
-                fprintf(stderr, "RMI open: exec /system/bin/runcon monkey failed: %d\n",
-                        errno);
-            }
-            if (sh_ok && am_ok)
-            {
-                fprintf(stderr, "RMI open: exec /system/bin/runcon shell am\n");
-                if (is_component)
-                {
-                    execl("/system/bin/runcon", "runcon", "u:r:shell:s0",
-                          "/system/bin/sh", "/system/bin/am", "start",
-                          "-n", target, (char *)NULL);
-                }
-                else
-                {
-                    execl("/system/bin/runcon", "runcon", "u:r:shell:s0",
-                          "/system/bin/sh", "/system/bin/am", "start",
-                          "-a", "android.intent.action.MAIN",
-                          "-c", "android.intent.category.LAUNCHER",
-                          "-p", target, (char *)NULL);
-                }
-                fprintf(stderr, "RMI open: exec /system/bin/runcon am failed: %d\n",
-                        errno);
-            }
-            if (cmd_ok)
+            int rc;
+
+            if (conn->state == RMI_CONN_INPUT_BATCH)
             {
-                if (sh_ok)
-                {
-                    fprintf(stderr, "RMI open: exec /system/bin/runcon sh cmd\n");
-                    if (is_component)
-                    {
-                        execl("/system/bin/runcon", "runcon", "u:r:shell:s0",
-                              "/system/bin/sh", "/system/bin/cmd", "activity",
-                              "start", "-n", target, (char *)NULL);
-                    }
-                    else
-                    {
-                        execl("/system/bin/runcon", "runcon", "u:r:shell:s0",
-                              "/system/bin/sh", "/system/bin/cmd", "activity",
-                              "start", "-a", "android.intent.action.MAIN",
-                              "-c", "android.intent.category.LAUNCHER",
-                              "-p", target, (char *)NULL);
-                    }
-                    fprintf(stderr, "RMI open: exec /system/bin/runcon sh cmd failed: %d\n",
-                            errno);
-                }
-                fprintf(stderr, "RMI open: exec /system/bin/runcon cmd\n");
-                if (is_component)
-                {
-                    execl("/system/bin/runcon", "runcon", "u:r:shell:s0",
-                          "/system/bin/cmd", "activity", "start",
-                          "-n", target, (char *)NULL);
-                }
-                else
-                {
-                    execl("/system/bin/runcon", "runcon", "u:r:shell:s0",
-                          "/system/bin/cmd", "activity", "start",
-                          "-a", "android.intent.action.MAIN",
-                          "-c", "android.intent.category.LAUNCHER",
-                          "-p", target, (char *)NULL);
-                }
-                fprintf(stderr, "RMI open: exec /system/bin/runcon cmd failed: %d\n",
-                        errno);
+                rc = recv_input_batch(srv, conn);
             }
-        }
-
-        drop_to_shell_user();
-        log_identity("after drop");
-        if (sh_ok && am_ok)
-        {
-            fprintf(stderr, "RMI open: exec /system/bin/sh /system/bin/am\n");
-            if (is_component)
+            else if (conn->state == RMI_CONN_TREE_HEADER || conn->state == RMI_CONN_TREE_BODY)
             {
-                execl("/system/bin/sh", "sh", "/system/bin/am", "start",
-                      "-n", target, (char *)NULL);
+                rc = recv_tree_frames(srv, conn);
             }
             else
             {
-                execl("/system/bin/sh", "sh", "/system/bin/am", "start",
-                      "-a", "android.intent.action.MAIN",
-                      "-c", "android.intent.category.LAUNCHER",
-                      "-p", target, (char *)NULL);
+                rc = recv_frame_to_file(srv, conn);
             }
-            fprintf(stderr, "RMI open: exec sh /system/bin/am failed: %d\n",
-                    errno);
-        }
-        if (am_ok)
-        {
-            fprintf(stderr, "RMI open: exec /system/bin/am\n");
-            if (is_component)
+            if (rc == -1)
             {
-                execl("/system/bin/am", "am", "start",
-                      "-n", target, (char *)NULL);
+                close_conn(srv, conn);
+                break;
             }
-            else
+            if (rc == 0)
             {
-                execl("/system/bin/am", "am", "start",
-                      "-a", "android.intent.action.MAIN",
-                      "-c", "android.intent.category.LAUNCHER",
-                      "-p", target, (char *)NULL);
+                break;
             }
-            fprintf(stderr, "RMI open: exec /system/bin/am failed: %d\n",
-                    errno);
+            progressed = true;
+            continue;
         }
-        if (cmd_ok)
+        if (conn_busy(conn) || input_available(conn) < RMI_FRAME_HEADER_SIZE)
         {
-            if (sh_ok)
-            {
-                fprintf(stderr, "RMI open: exec /system/bin/sh /system/bin/cmd\n");
-                if (is_component)
-                {
-                    execl("/system/bin/sh", "sh", "/system/bin/cmd", "activity",
-                          "start", "-n", target, (char *)NULL);
-                }
-                else
-                {
-                    execl("/system/bin/sh", "sh", "/system/bin/cmd", "activity",
-                          "start", "-a", "android.intent.action.MAIN",
-                          "-c", "android.intent.category.LAUNCHER",
-                          "-p", target, (char *)NULL);
-                }
-                fprintf(stderr, "RMI open: exec sh /system/bin/cmd failed: %d\n",
-                        errno);
-            }
-            fprintf(stderr, "RMI open: exec /system/bin/cmd\n");
-            if (is_component)
+            break;
+        }
+        if (conn->v2)
+        {
+            int rc;
+
+            rc = process_v2_request(srv, conn);
+            if (rc == -1)
             {
-                execl("/system/bin/cmd", "cmd", "activity", "start",
-                      "-n", target, (char *)NULL);
+                close_conn(srv, conn);
+                break;
             }
-            else
+            if (rc == 0)
             {
-                execl("/system/bin/cmd", "cmd", "activity", "start",
-                      "-a", "android.intent.action.MAIN",
-                      "-c", "android.intent.category.LAUNCHER",
-                      "-p", target, (char *)NULL);
+                break;
             }
-            fprintf(stderr, "RMI open: exec /system/bin/cmd failed: %d\n",
-                    errno);
+            progressed = true;
+            continue;
         }
-        if (monkey_ok && !is_component)
+        len = rmi_read_be32(conn->in + conn->in_off);
+        if (len >= sizeof(cmd))
         {
-            if (sh_ok)
-            {
-                fprintf(stderr, "RMI open: exec /system/bin/sh /system/bin/monkey\n");
-                execl("/system/bin/sh", "sh", "/system/bin/monkey", "-p", target,
-                      "-c", "android.intent.category.LAUNCHER", "1",
-                      (char *)NULL);
-                fprintf(stderr, "RMI open: exec sh /system/bin/monkey failed: %d\n",
-                        errno);
-            }
-            fprintf(stderr, "RMI open: exec /system/bin/monkey\n");
-            execl("/system/bin/monkey", "monkey", "-p", target,
-                  "-c", "android.intent.category.LAUNCHER", "1",
-                  (char *)NULL);
-            fprintf(stderr, "RMI open: exec /system/bin/monkey failed: %d\n",
-                    errno);
+            close_conn(srv, conn);
+            break;
         }
-        _exit(127);
-    }
-
-    if (waitpid(pid, &status, 0) == -1)
-    {
-        return -1;
-    }
-    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-    {
-        if (WIFEXITED(status))
+        if (input_available(conn) < RMI_FRAME_HEADER_SIZE + len)
+        {
+            break;
+        }
+        memcpy(cmd, conn->in + conn->in_off + RMI_FRAME_HEADER_SIZE, len);
+        cmd[len] = '\0';
+        consume_input(conn, RMI_FRAME_HEADER_SIZE + len);
+        progressed = true;
+        if (cmd[0] == '\0')
         {
-            fprintf(stderr, "RMI open: exit status %d\n", WEXITSTATUS(status));
+            continue;
         }
-        else if (WIFSIGNALED(status))
+
+        result = handle_rmi_client(srv, conn, cmd);
+        if (result != RMI_CONTINUE)
         {
-            fprintf(stderr, "RMI open: signaled %d\n", WTERMSIG(status));
+            srv->result = result;
+            srv->result_conn = conn;
         }
-        return -1;
     }
-
-    return 0;
+    return progressed;
 }
 
-static int
-handle_rmi_client(int client_fd, const char *user, const char *pass)
+static void
+service_conn(struct rmi_server *srv, struct rmi_conn *conn)
 {
-    struct pollfd pfd;
-    char cmd[1024];
-    ssize_t n;
-    int attempts;
-    bool authed;
+    unsigned int bulk_chunks;
 
-    pfd.fd = client_fd;
-    pfd.events = POLLIN;
-    attempts = 0;
-    authed = false;
-
-    while (1)
+    bulk_chunks = 0;
+    while (!conn->dead)
     {
-        int pr;
+        bool progressed;
+        int rc;
 
-        pr = poll(&pfd, 1, RMI_HEARTBEAT_MS);
-        if (pr == 0)
+        progressed = process_input(srv, conn);
+        if (conn->dead)
         {
-            if (send_text(client_fd, RMI_CMD_HEARTBEAT) == -1)
-            {
-                return RMI_CONTINUE;
-            }
-            continue;
+            return;
         }
-        if (pr == -1)
+        if (conn->cap_fd != -1 && pump_capture(srv, conn))
         {
-            if (errno == EINTR)
-            {
-                continue;
-            }
-            fprintf(stderr, "Syscall error: poll at line %d with code %d.\n",
-                    __LINE__, errno);
-            return RMI_CONTINUE;
+            progressed = true;
         }
-        if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+        rc = flush_frames(conn);
+        if (rc == 1)
         {
-            return RMI_CONTINUE;
+            rc = send_file_payload(conn);
         }
-        if (!(pfd.revents & POLLIN))
+        if (rc == 1 && conn->tree != NULL &&
+            bulk_chunks < RMI_FLUSH_BUDGET / RMI_STREAM_CHUNK)
         {
-            continue;
+            rc = pump_tree(conn);
+            bulk_chunks++;
+            progressed = true;
         }
-
-        n = read_command(client_fd, cmd, sizeof(cmd));
-        if (n <= 0)
+        if (rc == 1 && bulk_chunks < RMI_FLUSH_BUDGET / RMI_V2_CHUNK_MAX &&
+            pump_bulk_streams(conn))
         {
-            return RMI_CONTINUE;
+            bulk_chunks++;
+            progressed = true;
         }
-        if (cmd[0] == '\0')
+        if (rc == -1)
         {
-            continue;
+            close_conn(srv, conn);
+            return;
         }
-
-        if (!authed)
+        if (rc == 0 || !progressed || srv->result != RMI_CONTINUE)
         {
-            char *save;
-            char *tok;
-            char *u;
-            char *p;
-
-            tok = strtok_r(cmd, " \t", &save);
-            if (tok != NULL && strcmp(tok, RMI_CMD_AUTH) == 0)
-            {
-                u = strtok_r(NULL, " \t", &save);
-                p = strtok_r(NULL, " \t", &save);
-                if (u != NULL && p != NULL &&
-                    strcmp(u, user) == 0 && strcmp(p, pass) == 0)
-                {
-                    if (send_text(client_fd, RMI_RESP_OK) == -1)
-                    {
-                        return RMI_CONTINUE;
-                    }
-                    authed = true;
-                    continue;
-                }
-            }
+            break;
+        }
+    }
+    if (conn->closing && conn->out_head == NULL && conn->file_fd == -1 && conn->tree == NULL)
+    {
+        close_conn(srv, conn);
+        return;
+    }
+    update_conn_events(srv, conn);
+}
 
-            attempts++;
-            if (attempts >= 3)
-            {
-                send_text(client_fd, "ERR auth failed");
-                return RMI_CONTINUE;
-            }
+/*
+ * Moves every DELTA_UPLOAD that is copying from its base file on by one
+ * step, so a COPY op spanning a large file is interleaved with the other
+ * connections instead of holding up the loop. Returns true while any of
+ * them has more to copy.
+ */
+static bool
+service_deltas(struct rmi_server *srv)
+{
+    struct rmi_conn *conn;
+    bool pending;
 
-            send_text(client_fd, "ERR auth required");
+    pending = false;
+    for (conn = srv->conns; conn != NULL; conn = conn->next)
+    {
+        if (conn->dead || !conn->upload_delta || !delta_busy(conn))
+        {
             continue;
         }
+        pump_delta(srv, conn);
+        service_conn(srv, conn);
+        if (!conn->dead && delta_busy(conn))
+        {
+            pending = true;
+        }
+    }
+    return pending;
+}
 
-        if (strcmp(cmd, RMI_CMD_QUIT) == 0)
+static void
+handle_conn_event(struct rmi_server *srv, struct rmi_conn *conn, uint32_t events)
+{
+    if (conn->dead)
+    {
+        return;
+    }
+    if (events & EPOLLERR)
+    {
+        close_conn(srv, conn);
+        return;
+    }
+    /* An UPLOAD body being spliced is read by service_conn() instead. */
+    if ((events & (EPOLLIN | EPOLLHUP)) && !upload_can_splice(conn))
+    {
+        if (read_input(conn) == -1)
         {
-            send_text(client_fd, RMI_RESP_OK);
-            return RMI_SHUTDOWN;
+            close_conn(srv, conn);
+            return;
         }
+    }
+    service_conn(srv, conn);
+}
+
+static void
+accept_clients(struct rmi_server *srv)
+{
+    while (1)
+    {
+        struct epoll_event ev;
+        struct rmi_conn *conn;
+        unsigned int i;
+        int c;
 
-        if (strcmp(cmd, RMI_CMD_RESTART) == 0)
+        c = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (c == -1)
         {
-            if (check_restart_permissions() == -1)
+            if (errno == EINTR)
             {
-                send_text(client_fd, "ERR restart");
                 continue;
             }
-            send_text(client_fd, RMI_RESP_OK);
-            return RMI_RESTART;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                fprintf(stderr, "Syscall error: accept at line %d with code %d.\n",
+                        __LINE__, errno);
+            }
+            return;
         }
-
-        if (strcmp(cmd, RMI_CMD_VERSION) == 0)
+        if (srv->conn_count >= RMI_MAX_CLIENTS)
         {
-            char msg[64];
+            static const uint8_t busy[] = { 0, 0, 0, 8, 'E', 'R', 'R', ' ', 'b', 'u', 's', 'y' };
 
-            if (snprintf(msg, sizeof(msg), "%s%u",
-                         RMI_RESP_VERSION_PREFIX,
-                         (unsigned int)RMI_VERSION) >= (int)sizeof(msg))
-            {
-                send_text(client_fd, "ERR version");
-            }
-            else
+            fprintf(stderr, "RMI: rejecting client, %u already connected\n",
+                    (unsigned int)srv->conn_count);
+            if (write(c, busy, sizeof(busy)) == -1)
             {
-                send_text(client_fd, msg);
+                /* Best effort; the peer sees the close either way. */
             }
+            close(c);
             continue;
         }
 
-        if (strcmp(cmd, RMI_CMD_HEARTBEAT) == 0)
+        conn = (struct rmi_conn *)calloc(1, sizeof(*conn));
+        if (conn == NULL)
         {
-            send_text(client_fd, RMI_RESP_OK);
+            close(c);
             continue;
         }
-
-        if (strncmp(cmd, RMI_CMD_PRESS_INPUT, strlen(RMI_CMD_PRESS_INPUT)) == 0)
+        conn->fd = c;
+        conn->upload_fd = -1;
+        conn->upload_pipe[0] = -1;
+        conn->upload_pipe[1] = -1;
+        conn->delta_base_fd = -1;
+        conn->file_fd = -1;
+        conn->cap_fd = -1;
+        conn->cap_pid = -1;
+        for (i = 0; i < RMI_V2_MAX_STREAMS; i++)
         {
-            char *save;
-            char *tok;
-            char *code_str;
-            char *end;
-            long code;
-
-            tok = strtok_r(cmd, " \t", &save);
-            code_str = strtok_r(NULL, " \t", &save);
-            if (tok != NULL && code_str != NULL)
-            {
-                errno = 0;
-                code = strtol(code_str, &end, 10);
-                if (errno == 0 && end != code_str && *end == '\0')
-                {
-                    if (send_keyevent_input((int)code) == 0)
-                    {
-                        send_text(client_fd, RMI_RESP_OK);
-                        continue;
-                    }
-                    send_text(client_fd, "ERR press");
-                    continue;
-                }
-            }
-            send_text(client_fd, "ERR press");
-            continue;
+            conn->bulk[i].fd = -1;
         }
+        conn->events = EPOLLIN;
+        conn->last_active_ms = monotonic_ms();
 
-        if (strncmp(cmd, RMI_CMD_UPLOAD, strlen(RMI_CMD_UPLOAD)) == 0)
+        memset(&ev, 0, sizeof(ev));
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, c, &ev) == -1)
         {
-            char *save;
-            char *tok;
-            char *path;
-            char *size_str;
-            char *end;
-            unsigned long size;
-
-            tok = strtok_r(cmd, " \t", &save);
-            path = strtok_r(NULL, " \t", &save);
-            size_str = strtok_r(NULL, " \t", &save);
-            if (tok != NULL && path != NULL && size_str != NULL)
-            {
-                errno = 0;
-                size = strtoul(size_str, &end, 10);
-                if (errno == 0 && end != size_str && *end == '\0' &&
-                    size <= UINT32_MAX)
-                {
-                    if (recv_frame_to_file(client_fd, path, (uint32_t)size) == 0)
-                    {
-                        send_text(client_fd, RMI_RESP_OK);
-                        continue;
-                    }
-                    send_text(client_fd, "ERR upload");
-                    continue;
-                }
-            }
-            send_text(client_fd, "ERR upload");
+            fprintf(stderr, "Syscall error: epoll_ctl at line %d with code %d.\n",
+                    __LINE__, errno);
+            close(c);
+            free(conn);
             continue;
         }
+        conn->next = srv->conns;
+        srv->conns = conn;
+        srv->conn_count++;
+        fprintf(stderr, "RMI: client connected (%u active)\n",
+                (unsigned int)srv->conn_count);
+    }
+}
 
-        if (strncmp(cmd, RMI_CMD_LIST, strlen(RMI_CMD_LIST)) == 0)
-        {
-            char *save;
-            char *tok;
-            char *path;
+/*
+ * Queues a HEARTBEAT on every connection that has been idle for
+ * RMI_HEARTBEAT_MS and returns the epoll timeout until the next one is due.
+ */
+static int
+service_heartbeats(struct rmi_server *srv)
+{
+    struct rmi_conn *conn;
+    uint64_t now;
+    int timeout;
 
-            tok = strtok_r(cmd, " \t", &save);
-            path = strtok_r(NULL, " \t", &save);
-            if (tok != NULL && path != NULL)
-            {
-                if (send_file_list(client_fd, path) == 0)
-                {
-                    continue;
-                }
-            }
-            send_text(client_fd, "ERR list");
-            continue;
-        }
+    now = monotonic_ms();
+    timeout = -1;
+    for (conn = srv->conns; conn != NULL; conn = conn->next)
+    {
+        uint64_t due;
+        int wait;
 
-        if (strncmp(cmd, RMI_CMD_DOWNLOAD, strlen(RMI_CMD_DOWNLOAD)) == 0)
+        if (conn->dead)
         {
-            char *save;
-            char *tok;
-            char *path;
-
-            tok = strtok_r(cmd, " \t", &save);
-            path = strtok_r(NULL, " \t", &save);
-            if (tok != NULL && path != NULL)
-            {
-                if (handle_download(client_fd, path) == 0)
-                {
-                    continue;
-                }
-            }
-            send_text(client_fd, "ERR download");
             continue;
         }
-
-        if (strncmp(cmd, RMI_CMD_DELETE, strlen(RMI_CMD_DELETE)) == 0)
+        if (conn->state != RMI_CONN_COMMAND || conn->out_head != NULL ||
+            conn->file_fd != -1 || conn->tree != NULL || conn->cap_fd != -1)
         {
-            char *save;
-            char *tok;
-            char *path;
-
-            tok = strtok_r(cmd, " \t", &save);
-            path = strtok_r(NULL, " \t", &save);
-            if (tok != NULL && path != NULL)
-            {
-                if (remove_tree(path) == 0)
-                {
-                    send_text(client_fd, RMI_RESP_OK);
-                    continue;
-                }
-            }
-            send_text(client_fd, "ERR delete");
-            continue;
+            wait = RMI_HEARTBEAT_MS;
         }
-
-        if (strncmp(cmd, RMI_CMD_PRESS, strlen(RMI_CMD_PRESS)) == 0)
+        else
         {
-            char *save;
-            char *tok;
-            char *code_str;
-            char *end;
-            long code;
-
-            tok = strtok_r(cmd, " \t", &save);
-            code_str = strtok_r(NULL, " \t", &save);
-            if (tok != NULL && code_str != NULL)
+            due = conn->last_active_ms + RMI_HEARTBEAT_MS;
+            if (now >= due)
             {
-                errno = 0;
-                code = strtol(code_str, &end, 10);
-                if (errno == 0 && end != code_str && *end == '\0')
-                {
-                    if (send_keyevent((int)code) == 0)
-                    {
-                        send_text(client_fd, RMI_RESP_OK);
-                        continue;
-                    }
-                    send_text(client_fd, "ERR press");
-                    continue;
-                }
+                set_reply_context(conn, 0, RMI_OP_HEARTBEAT);
+                send_text(conn, RMI_CMD_HEARTBEAT);
+                conn->last_active_ms = now;
+                service_conn(srv, conn);
+                wait = RMI_HEARTBEAT_MS;
             }
-            send_text(client_fd, "ERR press");
-            continue;
-        }
-
-        if (strncmp(cmd, RMI_CMD_OPEN, strlen(RMI_CMD_OPEN)) == 0)
-        {
-            char *save;
-            char *tok;
-            char *target;
-
-            tok = strtok_r(cmd, " \t", &save);
-            target = strtok_r(NULL, " \t", &save);
-            if (tok != NULL && target != NULL)
+            else
             {
-                if (open_app(target) == 0)
-                {
-                    send_text(client_fd, RMI_RESP_OK);
-                    continue;
-                }
+                wait = (int)(due - now);
             }
-            send_text(client_fd, "ERR open");
-            continue;
         }
+        if (timeout == -1 || wait < timeout)
+        {
+            timeout = wait;
+        }
+    }
+    return timeout;
+}
 
-        if (strcmp(cmd, RMI_CMD_SCREENCAP) == 0)
+static void
+reap_conns(struct rmi_server *srv)
+{
+    struct rmi_conn **link;
+
+    link = &srv->conns;
+    while (*link != NULL)
+    {
+        struct rmi_conn *conn;
+
+        conn = *link;
+        if (!conn->dead)
         {
-            if (send_screencap(client_fd) == -1)
-            {
-                send_text(client_fd, "ERR screencap");
-            }
+            link = &conn->next;
             continue;
         }
-
-        send_text(client_fd, "ERR unknown command");
+        *link = conn->next;
+        free(conn->xfer);
+        free(conn);
     }
+}
 
-    return RMI_CONTINUE;
+static void
+flush_blocking(struct rmi_conn *conn)
+{
+    int flags;
+
+    if (conn == NULL || conn->dead)
+    {
+        return;
+    }
+    flags = fcntl(conn->fd, F_GETFL);
+    if (flags != -1)
+    {
+        fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    flush_frames(conn);
 }
 
 static void
 rmi_server(uint16_t port)
 {
-    struct sockaddr_in addr;
-    socklen_t addr_len;
+    struct epoll_event events[RMI_MAX_EVENTS];
+    struct epoll_event ev;
+    struct rmi_server srv;
     char user[128];
     char pass[128];
-    int s;
 
     if (load_rmi_config(user, sizeof(user), pass, sizeof(pass)) == -1)
     {
         exit(EXIT_FAILURE);
     }
 
-    s = setup_socket(htons(port));
+    signal(SIGPIPE, SIG_IGN);
+    input_discover();
+    exec_probe_all();
+
+    memset(&srv, 0, sizeof(srv));
+    srv.user = user;
+    srv.pass = pass;
+    srv.result = RMI_CONTINUE;
+    srv.listen_fd = setup_socket(htons(port));
+    srv.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    CHECKSYSCALL(srv.epoll_fd, "epoll_create1");
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    CHECKSYSCALL(epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.listen_fd, &ev),
+                 "epoll_ctl");
+
+    if (start_pool(&srv.pool) == -1)
+    {
+        fprintf(stderr, "RMI: worker pool unavailable; blocking commands will fail.\n");
+    }
+    if (srv.pool.event_fd != -1)
+    {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &srv.pool;
+        CHECKSYSCALL(epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.pool.event_fd, &ev),
+                     "epoll_ctl");
+    }
 
     printf(">>> RMI command server listening on 0.0.0.0:%u\n\n", port);
 
-    while (1)
+    while (srv.result == RMI_CONTINUE)
     {
-        int c;
-
-        addr_len = sizeof(addr);
-        c = accept(s, (struct sockaddr *)&addr, &addr_len);
-        if (c == -1)
+        int stream_timeout;
+        int timeout;
+        int n;
+        int i;
+
+        timeout = service_heartbeats(&srv);
+        stream_timeout = service_streams(&srv);
+        if (stream_timeout != -1 && (timeout == -1 || stream_timeout < timeout))
+        {
+            timeout = stream_timeout;
+        }
+        if (service_deltas(&srv))
+        {
+            timeout = 0;
+        }
+        n = epoll_wait(srv.epoll_fd, events, RMI_MAX_EVENTS, timeout);
+        if (n == -1)
         {
             if (errno == EINTR)
             {
                 continue;
             }
-            fprintf(stderr, "Syscall error: accept at line %d with code %d.\n",
+            fprintf(stderr, "Syscall error: epoll_wait at line %d with code %d.\n",
                     __LINE__, errno);
             break;
         }
-
-        int result;
-
-        result = handle_rmi_client(c, user, pass);
-        close(c);
-        if (result == RMI_SHUTDOWN)
-        {
-            break;
-        }
-        if (result == RMI_RESTART)
+        for (i = 0; i < n && srv.result == RMI_CONTINUE; i++)
         {
-            close(s);
-            if (rmi_argv == NULL || rmi_argv[0] == NULL)
+            if (events[i].data.ptr == NULL)
             {
-                fprintf(stderr, "RMI restart failed: missing argv.\n");
-                exit(EXIT_FAILURE);
+                accept_clients(&srv);
+                continue;
             }
-            execv(rmi_argv[0], rmi_argv);
-            fprintf(stderr, "Syscall error: execv at line %d with code %d.\n",
-                    __LINE__, errno);
-            exit(EXIT_FAILURE);
+            if (events[i].data.ptr == &srv.pool)
+            {
+                complete_jobs(&srv);
+                continue;
+            }
+            handle_conn_event(&srv, (struct rmi_conn *)events[i].data.ptr,
+                              events[i].events);
+        }
+        if (srv.result != RMI_CONTINUE)
+        {
+            flush_blocking(srv.result_conn);
         }
+        reap_conns(&srv);
     }
 
-    close(s);
+    while (srv.conns != NULL)
+    {
+        close_conn(&srv, srv.conns);
+        reap_conns(&srv);
+    }
+    stop_pool(&srv.pool);
+    while (srv.jobs != NULL)
+    {
+        free_job(&srv, srv.jobs);
+    }
+    input_close_all();
+    pthread_mutex_lock(&rmi_helper_lock);
+    helper_stop();
+    pthread_mutex_unlock(&rmi_helper_lock);
+    close(srv.epoll_fd);
+    close(srv.listen_fd);
+
+    if (srv.result == RMI_RESTART)
+    {
+        if (rmi_argv == NULL || rmi_argv[0] == NULL)
+        {
+            fprintf(stderr, "RMI restart failed: missing argv.\n");
+            exit(EXIT_FAILURE);
+        }
+        execv(rmi_argv[0], rmi_argv);
+        fprintf(stderr, "Syscall error: execv at line %d with code %d.\n",
+                __LINE__, errno);
+        exit(EXIT_FAILURE);
+    }
 }
 
 int